@@ -1,13 +1,239 @@
 #include <sys/syslimits.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include "car_crypto.h"
+#include "car_chunk.h"
 #include "car.h"
 
+// Locate the extension section directory (if any) of an archive
+static ARSectionDirectory *ARArchiveLocateSections(ARArchive *archive)
+{
+    OSOffset dataModification;
+
+    switch (archive->subtype)
+    {
+        case kARSubtype2:           dataModification = ((CAHeaderS2 *)archive->address)->dataModification;          break;
+        case kARSubtypeBootX:       dataModification = sizeof(CAHeaderBootX);                                      break;
+        case kARSubtypeSystemImage: dataModification = ((CAHeaderSystemImage *)archive->address)->dataModification; break;
+        default: return kOSNullPointer;
+    }
+
+    OSOffset offset = dataModification + sizeof(CADataModification);
+
+    if (offset + sizeof(ARSectionDirectory) > archive->size)
+        return kOSNullPointer;
+
+    ARSectionDirectory *directory = archive->address + offset;
+
+    if (memcmp(directory->magic, kARSectionMagic, 4) || directory->sectionCount > kARSectionMaxCount)
+        return kOSNullPointer;
+
+    for (OSIndex i = 0; i < directory->sectionCount; i++)
+    {
+        ARSection *section = &directory->sections[i];
+
+        if (section->offset > archive->size || section->size > archive->size - section->offset)
+            return kOSNullPointer;
+    }
+
+    return directory;
+}
+
+static void *ARArchiveLocateToC(ARArchive *archive)
+{
+    switch (archive->subtype)
+    {
+        case kARSubtype1:           return archive->address + sizeof(CAHeaderS1);
+        case kARSubtype2:           return archive->address + ((CAHeaderS2 *)archive->address)->tocOffset;
+        case kARSubtypeSystemImage: return archive->address + ((CAHeaderSystemImage *)archive->address)->tocOffset;
+        case kARSubtypeBootX: {
+            OSOffset offset = sizeof(CAHeaderBootX) + sizeof(CADataModification);
+
+            if (archive->sections)
+                offset += sizeof(ARSectionDirectory);
+
+            return archive->address + offset;
+        }
+        default: return kOSNullPointer;
+    }
+}
+
+static UInt8 *ARArchiveLocateEntryTable(ARArchive *archive)
+{
+    switch (archive->subtype)
+    {
+        case kARSubtype1:           return archive->address + ((CAHeaderS1 *)archive->address)->entryTableOffset;
+        case kARSubtype2:           return archive->address + ((CAHeaderS2 *)archive->address)->entryTableOffset;
+        case kARSubtypeBootX:       return archive->address + ((CAHeaderBootX *)archive->address)->entryTableOffset;
+        case kARSubtypeSystemImage: return archive->address + ((CAHeaderSystemImage *)archive->address)->entryTableOffset;
+        default: return kOSNullPointer;
+    }
+}
+
+// The ToC runs up to the entry table (which may be block aligned), and
+// every entry but the first has a non-zero offset into the entry table.
+#define ARArchiveDefineCountEntries(name, Slot)                             \
+    static OSCount name(ARArchive *archive)                                 \
+    {                                                                       \
+        Slot *toc = archive->toc;                                           \
+        OSCount count = 0;                                                  \
+                                                                            \
+        while ((UInt8 *)(toc + 1) <= archive->entryTable - sizeof(UInt32))  \
+        {                                                                   \
+            if (count && !(*toc))                                           \
+                break;                                                      \
+                                                                            \
+            count++;                                                        \
+            toc++;                                                          \
+        }                                                                   \
+                                                                            \
+        return count;                                                       \
+    }
+
+ARArchiveDefineCountEntries(ARArchiveCountEntriesWide,   UInt64)
+ARArchiveDefineCountEntries(ARArchiveCountEntriesNarrow, UInt32)
+
+#undef ARArchiveDefineCountEntries
+
+static bool ARCompactReadNumber(const UInt8 **cursor, const UInt8 *end, UInt64 *value)
+{
+    *value = 0;
+
+    for (UInt32 shift = 0; shift < 64; shift += 7)
+    {
+        if (*cursor >= end)
+            return false;
+
+        UInt8 byte = *(*cursor)++;
+        *value |= (UInt64)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+// Rebuild the path of every entry in a compact entry table. Paths are
+// built from their parent's path, so they're decoded in two passes: one
+// to size every path and one to fill them in.
+static bool ARArchiveDecodeCompactEntries(ARArchive *archive)
+{
+    ARCompactTable *table = (ARCompactTable *)archive->toc;
+    OSSize tableSpace = (archive->entryTable - sizeof(UInt32)) - (UInt8 *)archive->toc;
+
+    if (tableSpace < sizeof(ARCompactTable) || !table->entryCount || table->entryCount > (tableSpace / 8) || ARCompactTableSize(table->entryCount) > tableSpace || table->poolSize > archive->entryTableSize)
+        return false;
+
+    OSCount count = table->entryCount;
+    const UInt8 *types = (UInt8 *)table + ARCompactTypesOffset(count);
+    const UInt32 *parents = (UInt32 *)((UInt8 *)table + ARCompactParentsOffset(count));
+    const UInt8 *poolEnd = archive->entryTable + table->poolSize;
+    const UInt8 *cursor = archive->entryTable;
+
+    OSSize *lengths = malloc(count * sizeof(OSSize));
+    OSSize pathsSize = 0;
+    OSSize previousLength = 0;
+    bool success = !!lengths;
+
+    for (OSIndex i = 0; success && i < count; i++)
+    {
+        UInt64 shared, added;
+
+        success = ARCompactReadNumber(&cursor, poolEnd, &shared) && ARCompactReadNumber(&cursor, poolEnd, &added);
+        success = success && shared <= previousLength && added <= (OSSize)(poolEnd - cursor);
+
+        if (!success)
+            break;
+
+        if (i) success = parents[i] < i && types[parents[i]] == kCAEntryTypeDirectory && (shared + added);
+        else   success = !(shared + added) && types[0] == kCAEntryTypeDirectory;
+
+        success = success && !memchr(cursor, '/', added) && !memchr(cursor, 0, added);
+        if (!success) break;
+
+        if (i) lengths[i] = (parents[i] ? lengths[parents[i]] + 1 : 1) + shared + added;
+        else   lengths[i] = 1;
+
+        previousLength = shared + added;
+        pathsSize += lengths[i] + 1;
+        cursor += added;
+    }
+
+    OSUTF8Char **paths = success ? malloc((count * sizeof(OSUTF8Char *)) + pathsSize) : kOSNullPointer;
+    OSUTF8Char *next = (OSUTF8Char *)(paths + count);
+    const OSUTF8Char *previousName = (OSUTF8Char *)"";
+    cursor = archive->entryTable;
+
+    for (OSIndex i = 0; paths && i < count; i++)
+    {
+        UInt64 shared, added;
+
+        ARCompactReadNumber(&cursor, poolEnd, &shared);
+        ARCompactReadNumber(&cursor, poolEnd, &added);
+
+        OSUTF8Char *path = paths[i] = next;
+        OSUTF8Char *name = path + 1;
+
+        // The root's children don't get a second '/'
+        if (i && parents[i])
+        {
+            OSSize parentLength = lengths[parents[i]];
+
+            memcpy(path, paths[parents[i]], parentLength);
+            name = path + parentLength + 1;
+        }
+
+        *(name - 1) = '/';
+        memmove(name, previousName, shared);
+        memcpy(name + shared, cursor, added);
+        name[shared + added] = 0;
+
+        previousName = name;
+        next += lengths[i] + 1;
+        cursor += added;
+    }
+
+    free(lengths);
+
+    if (!paths)
+        return false;
+
+    archive->paths = paths;
+    archive->entryCount = count;
+
+    return true;
+}
+
+// Count (or for compact entry tables, decode) the entries of an archive
+// whose ToC and entry table are readable.
+static bool ARArchiveLoadEntries(ARArchive *archive)
+{
+    if (archive->compact)
+        return ARArchiveDecodeCompactEntries(archive);
+
+    archive->entryCount = archive->narrow ? ARArchiveCountEntriesNarrow(archive) : ARArchiveCountEntriesWide(archive);
+    return true;
+}
+
+static UInt8 *ARArchiveLocateDataSection(ARArchive *archive)
+{
+    switch (archive->subtype)
+    {
+        case kARSubtype1:           return archive->address + ((CAHeaderS1 *)archive->address)->dataSectionOffset;
+        case kARSubtype2:           return archive->address + ((CAHeaderS2 *)archive->address)->dataSectionOffset;
+        case kARSubtypeBootX:       return archive->address + ((CAHeaderBootX *)archive->address)->dataSectionOffset;
+        case kARSubtypeSystemImage: return archive->address + ((CAHeaderSystemImage *)archive->address)->dataSectionOffset;
+        default: return kOSNullPointer;
+    }
+}
+
 ARArchive *ARArchiveOpen(const OSUTF8Char *path)
 {
     struct stat stats;
@@ -76,9 +302,199 @@ ARArchive *ARArchiveOpen(const OSUTF8Char *path)
     archive->subtype = subtype;
     archive->address = address;
 
+    archive->dataSection = ARArchiveLocateDataSection(archive);
+    archive->sections = ARArchiveLocateSections(archive);
+    archive->entryTable = ARArchiveLocateEntryTable(archive);
+    archive->toc = ARArchiveLocateToC(archive);
+    archive->tocOffset = (UInt8 *)archive->toc - (UInt8 *)archive->address;
+    archive->chunks = kOSNullPointer;
+    archive->cipher = kOSNullPointer;
+    archive->metadata = kOSNullPointer;
+    archive->entryTableSize = 0;
+    archive->entryCount = 0;
+    archive->paths = kOSNullPointer;
+
+    archive->compact = !!(ARHeaderFlags(address) & kARHeaderFlagCompactEntries);
+    archive->narrow = !!(ARHeaderFlags(address) & kARHeaderFlagNarrowOffsets);
+
+    UInt8 *end = archive->address + archive->size;
+    bool valid;
+
+    if (ARHeaderFlags(address) & kARHeaderFlagTrailingEntries) {
+        valid = (archive->dataSection >= (UInt8 *)archive->address && (UInt8 *)archive->toc >= archive->dataSection && (UInt8 *)archive->toc <= archive->entryTable && archive->entryTable <= end && !ARArchiveIsEncrypted(archive));
+        archive->entryTableSize = end - archive->entryTable;
+    } else {
+        valid = ((UInt8 *)archive->toc >= (UInt8 *)archive->address && (UInt8 *)archive->toc <= archive->entryTable && archive->entryTable <= archive->dataSection && archive->dataSection <= end);
+        archive->entryTableSize = archive->dataSection - archive->entryTable;
+    }
+
+    if (!valid)
+    {
+        fprintf(stderr, "Error: Archive '%s' has an invalid layout!\n", path);
+        ARArchiveClose(archive);
+
+        return kOSNullPointer;
+    }
+
+    // The entries of an encrypted archive can only be read once it is unlocked
+    if (!ARArchiveIsEncrypted(archive) && !ARArchiveLoadEntries(archive))
+    {
+        fprintf(stderr, "Error: Archive '%s' has an invalid entry table!\n", path);
+        ARArchiveClose(archive);
+
+        return kOSNullPointer;
+    }
+
+    ARSection *chunkIndex = ARArchiveFindSection(archive, kARSectionTypeChunkIndex);
+
+    if (chunkIndex)
+    {
+        OSSize storedSize = 0;
+
+        if ((void *)archive->dataSection <= archive->address + archive->size)
+            storedSize = (archive->address + archive->size) - (void *)archive->dataSection;
+
+        archive->chunks = ARChunkReaderCreate(archive->address + chunkIndex->offset, chunkIndex->size, archive->dataSection, storedSize);
+
+        if (!archive->chunks)
+        {
+            fprintf(stderr, "Error: Archive '%s' has an invalid chunk index!\n", path);
+            ARArchiveClose(archive);
+
+            return kOSNullPointer;
+        }
+    }
+
+    return archive;
+}
+
+// Open an archive and unlock it with the key in `keyFile` (if given)
+ARArchive *ARArchiveOpenWithKey(const OSUTF8Char *path, const OSUTF8Char *keyFile)
+{
+    UInt8 key[kARCipherMaxKeySize];
+    OSSize keySize;
+
+    ARArchive *archive = ARArchiveOpen(path);
+    if (!archive) return kOSNullPointer;
+
+    if (!keyFile)
+        return archive;
+
+    if (!ARArchiveIsEncrypted(archive))
+    {
+        fprintf(stderr, "Warning: Archive '%s' is not encrypted; ignoring key!\n", path);
+        return archive;
+    }
+
+    if (!ARCipherLoadKey(keyFile, key, &keySize))
+    {
+        ARArchiveClose(archive);
+        return kOSNullPointer;
+    }
+
+    bool unlocked = ARArchiveUnlock(archive, key, keySize);
+    memset(key, 0, sizeof(key));
+
+    if (!unlocked)
+    {
+        ARArchiveClose(archive);
+        return kOSNullPointer;
+    }
+
     return archive;
 }
 
+bool ARArchiveIsEncrypted(ARArchive *archive)
+{
+    return !!ARArchiveFindSection(archive, kARSectionTypeCipher);
+}
+
+// Check `key` against the archive's key check and decrypt the ToC and entry
+// table into a private copy. Data is decrypted as it is read.
+bool ARArchiveUnlock(ARArchive *archive, const UInt8 *key, OSSize keySize)
+{
+    ARSection *section = ARArchiveFindSection(archive, kARSectionTypeCipher);
+    UInt8 check[kARCipherBlockSize];
+
+    if (!section || section->size < sizeof(ARCipherInfo))
+    {
+        fprintf(stderr, "Error: Archive is not encrypted!\n");
+        return false;
+    }
+
+    if (archive->cipher)
+        return true;
+
+    ARCipherInfo *info = archive->address + section->offset;
+    OSOffset start = info->encryptedOffset;
+    OSOffset tocOffset = archive->tocOffset;
+    OSOffset dataSectionOffset = archive->dataSection - (UInt8 *)archive->address;
+
+    if (start > tocOffset || info->encryptedSize > archive->size - start || start + info->encryptedSize < dataSectionOffset)
+    {
+        fprintf(stderr, "Error: Archive has invalid encryption parameters!\n");
+        return false;
+    }
+
+    if (info->keySize != keySize)
+    {
+        fprintf(stderr, "Error: Archive requires a %u bit key!\n", info->keySize * 8);
+        return false;
+    }
+
+    ARCipher *cipher = ARCipherCreate(info->encryptionType, key, keySize, info->nonce);
+    if (!cipher) return false;
+
+    ARCipherKeyCheck(cipher, check);
+
+    if (memcmp(check, info->keyCheck, kARCipherBlockSize))
+    {
+        fprintf(stderr, "Error: Incorrect key for archive!\n");
+        ARCipherFree(cipher);
+
+        return false;
+    }
+
+    UInt8 *metadata = malloc(dataSectionOffset - start);
+
+    if (!metadata)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        ARCipherFree(cipher);
+
+        return false;
+    }
+
+    memcpy(metadata, archive->address + start, dataSectionOffset - start);
+    ARCipherApply(cipher, metadata, dataSectionOffset - start, start);
+
+    void *toc = archive->toc;
+    UInt8 *entryTable = archive->entryTable;
+
+    archive->toc = metadata + (tocOffset - start);
+    archive->entryTable = metadata + ((archive->entryTable - (UInt8 *)archive->address) - start);
+
+    if (!ARArchiveLoadEntries(archive))
+    {
+        fprintf(stderr, "Error: Archive has an invalid entry table!\n");
+        archive->entryTable = entryTable;
+        archive->toc = toc;
+
+        ARCipherFree(cipher);
+        free(metadata);
+
+        return false;
+    }
+
+    archive->metadata = metadata;
+    archive->cipher = cipher;
+
+    if (archive->chunks)
+        ARChunkReaderSetCipher(archive->chunks, cipher, dataSectionOffset);
+
+    return true;
+}
+
 ARSubtype ARDetectSubtype(const UInt8 *buffer)
 {
     CAHeaderS1 *header = (CAHeaderS1 *)buffer;
@@ -86,21 +502,134 @@ ARSubtype ARDetectSubtype(const UInt8 *buffer)
     if (memcmp(header->magic, kCAHeaderMagic, 4))
         return kARSubtypeInvalid;
 
-    if (!memcmp(header->version, kCAHeaderVersionS1, 4)) {
-        return kARSubtype1;
-    } else if (!memcmp(header->version, kCAHeaderVersionS2, 4)) {
-        return kARSubtype2;
-    } else if (!memcmp(header->version, kCAHeaderVersionBootX, 4)) {
-        return kARSubtypeBootX;
-    } else if (!memcmp(header->version, kCAHeaderVersionSystem, 4)) {
-        return kARSubtypeSystemImage;
+    UInt8 flags = ARHeaderFlags(header);
+    ARSubtype subtype;
+
+    if (flags & ~kARHeaderFlagMask)
+        return kARSubtypeInvalid;
+
+    if (!memcmp(header->version, kCAHeaderVersionS1, 3)) {
+        subtype = kARSubtype1;
+    } else if (!memcmp(header->version, kCAHeaderVersionS2, 3)) {
+        subtype = kARSubtype2;
+    } else if (!memcmp(header->version, kCAHeaderVersionBootX, 3)) {
+        subtype = kARSubtypeBootX;
+    } else if (!memcmp(header->version, kCAHeaderVersionSystem, 3)) {
+        subtype = kARSubtypeSystemImage;
     } else {
         return kARSubtypeInvalid;
     }
+
+    // Only Subtype 2 has compact entry tables, which have no ToC to narrow
+    if ((flags & kARHeaderFlagCompactEntries) && (subtype != kARSubtype2 || (flags & kARHeaderFlagNarrowOffsets)))
+        return kARSubtypeInvalid;
+
+    // Only Subtype 2 has a ToC offset to move
+    if ((flags & kARHeaderFlagTrailingEntries) && subtype != kARSubtype2)
+        return kARSubtypeInvalid;
+
+    return subtype;
+}
+
+OSSize ARArchiveHeaderSize(ARSubtype subtype)
+{
+    switch (subtype)
+    {
+        case kARSubtype1:           return sizeof(CAHeaderS1);
+        case kARSubtype2:           return sizeof(CAHeaderS2);
+        case kARSubtypeBootX:       return sizeof(CAHeaderBootX);
+        case kARSubtypeSystemImage: return sizeof(CAHeaderSystemImage);
+        default: return 0;
+    }
+}
+
+// Header checksums are computed with the header checksum field itself
+// zeroed, so the same routine serves both creation and verification.
+UInt32 ARArchiveHeaderChecksum(ARSubtype subtype, const void *address)
+{
+    UInt8 header[kARBlockSize];
+    UInt32 checksum = ARCRC32Init();
+
+    switch (subtype)
+    {
+        case kARSubtype1: {
+            memcpy(header, address, sizeof(CAHeaderS1));
+
+            return ARCRC32Process(header, sizeof(CAHeaderS1) - (2 * sizeof(UInt32)));
+        }
+        case kARSubtype2: {
+            memcpy(header, address, sizeof(CAHeaderS2));
+            ((CAHeaderS2 *)header)->headerChecksum = 0;
+
+            checksum = ARCRC32Update(checksum, header, sizeof(CAHeaderS2) - (3 * sizeof(UInt64)));
+            checksum = ARCRC32Update(checksum, header + (sizeof(CAHeaderS2) - (3 * sizeof(UInt64))), 2 * sizeof(UInt64));
+        } break;
+        case kARSubtypeBootX: {
+            memcpy(header, address, sizeof(CAHeaderBootX));
+            ((CAHeaderBootX *)header)->headerChecksum = 0;
+
+            checksum = ARCRC32Update(checksum, header, sizeof(CAHeaderBootX) - (3 * sizeof(UInt64)));
+            checksum = ARCRC32Update(checksum, header + (sizeof(CAHeaderBootX) - (3 * sizeof(UInt64))), 2 * sizeof(UInt64));
+        } break;
+        case kARSubtypeSystemImage: {
+            memcpy(header, address, kARBlockSize);
+            ((CAHeaderSystemImage *)header)->headerChecksum = 0;
+
+            // Offset into the header for the checksum (ignored during calculation)
+            UInt32 headerChecksumOffset = sizeof(CAHeaderSystemImage) - (3 * sizeof(UInt64));
+
+            checksum = ARCRC32Update(checksum, header, headerChecksumOffset);
+            checksum = ARCRC32Update(checksum, header + headerChecksumOffset, kARBlockSize - (headerChecksumOffset + sizeof(UInt32)));
+        } break;
+        default: return 0;
+    }
+
+    return ARCRC32Finalize(checksum);
+}
+
+// Digest of the header with the fields written after signing (the signature offset and checksums) zeroed
+void ARArchiveHeaderDigest(ARSubtype subtype, const void *address, UInt8 *digest)
+{
+    UInt8 header[kARBlockSize];
+    OSSize size = ARArchiveHeaderSize(subtype);
+
+    memcpy(header, address, size);
+
+    #define ARClearChecksums(t)                     \
+        ((t *)header)->dataChecksum = 0;            \
+        ((t *)header)->headerChecksum = 0
+
+    switch (subtype)
+    {
+        case kARSubtype1:           ARClearChecksums(CAHeaderS1);    break;
+        case kARSubtypeBootX:       ARClearChecksums(CAHeaderBootX); break;
+        case kARSubtype2: {
+            ARClearChecksums(CAHeaderS2);
+            ((CAHeaderS2 *)header)->archiveSignature = 0;
+        } break;
+        case kARSubtypeSystemImage: {
+            ARClearChecksums(CAHeaderSystemImage);
+            ((CAHeaderSystemImage *)header)->archiveSignature = 0;
+        } break;
+        default: break;
+    }
+
+    #undef ARClearChecksums
+
+    ARSHA256Process(header, size, digest);
 }
 
 bool ARArchiveClose(ARArchive *archive)
 {
+    if (archive->chunks)
+        ARChunkReaderFree(archive->chunks);
+
+    if (archive->cipher)
+        ARCipherFree(archive->cipher);
+
+    free(archive->metadata);
+    free(archive->paths);
+
     if (munmap(archive->address, archive->size))
     {
         fprintf(stderr, "Error: Could not unmap archive!\n");
@@ -113,6 +642,251 @@ bool ARArchiveClose(ARArchive *archive)
     return true;
 }
 
+// Entries are read by one routine per ToC width, specialized from this
+// template so neither has to check the width per field.
+#define ARArchiveDefineGetEntry(name, Slot, EntryS1, EntryS2, SystemDirectoryEntry, SystemFileEntry)     \
+    static bool name(ARArchive *archive, OSIndex index, ARArchiveEntry *entry)                          \
+    {                                                                                                   \
+        Slot slot = ((Slot *)archive->toc)[index];                                                      \
+        UInt8 *raw = archive->entryTable + slot;                                                        \
+                                                                                                        \
+        if (slot >= archive->entryTableSize)                                                            \
+        {                                                                                               \
+            fprintf(stderr, "Error: Entry %ld is outside of archive!\n", index);                        \
+            return false;                                                                               \
+        }                                                                                               \
+                                                                                                        \
+        entry->type = *raw;                                                                             \
+        entry->flags = 0;                                                                               \
+        entry->dataOffset = 0;                                                                          \
+        entry->dataSize = 0;                                                                            \
+                                                                                                        \
+        switch (archive->subtype)                                                                       \
+        {                                                                                               \
+            case kARSubtype1: {                                                                         \
+                EntryS1 *realEntry = (EntryS1 *)raw;                                                    \
+                                                                                                        \
+                entry->dataOffset = realEntry->dataOffset;                                              \
+                entry->dataSize = realEntry->dataSize;                                                  \
+                entry->path = realEntry->path;                                                          \
+            } break;                                                                                    \
+            case kARSubtype2:                                                                           \
+            case kARSubtypeBootX: {                                                                     \
+                EntryS2 *realEntry = (EntryS2 *)raw;                                                    \
+                entry->flags = realEntry->flags;                                                        \
+                                                                                                        \
+                /* Directories (and meta entries without data) omit the data fields */                  \
+                if (entry->type == kCAEntryTypeDirectory || (entry->type == kCAEntryTypeMeta && !(realEntry->flags & kCAEntryFlagMetaHasData))) { \
+                    entry->path = raw + offsetof(EntryS2, dataOffset);                                  \
+                } else {                                                                                \
+                    entry->dataOffset = realEntry->dataOffset;                                          \
+                    entry->dataSize = realEntry->dataSize;                                              \
+                    entry->path = realEntry->path;                                                      \
+                }                                                                                       \
+            } break;                                                                                    \
+            case kARSubtypeSystemImage: {                                                               \
+                if (entry->type == kCAEntryTypeDirectory) {                                             \
+                    entry->path = ((SystemDirectoryEntry *)raw)->path;                                  \
+                } else {                                                                                \
+                    SystemFileEntry *realEntry = (SystemFileEntry *)raw;                                \
+                                                                                                        \
+                    entry->dataOffset = realEntry->dataOffset;                                          \
+                    entry->dataSize = realEntry->dataSize;                                              \
+                    entry->path = realEntry->path;                                                      \
+                }                                                                                       \
+            } break;                                                                                    \
+            default: return false;                                                                      \
+        }                                                                                               \
+                                                                                                        \
+        return true;                                                                                    \
+    }
+
+ARArchiveDefineGetEntry(ARArchiveGetEntryWide,   UInt64, CAEntryS1,     CAEntryS2,     CASystemDirectoryEntry,       CASystemFileEntry)
+ARArchiveDefineGetEntry(ARArchiveGetEntryNarrow, UInt32, AREntryNarrow, AREntryNarrow, ARSystemDirectoryEntryNarrow, ARSystemFileEntryNarrow)
+
+#undef ARArchiveDefineGetEntry
+
+bool ARArchiveGetEntry(ARArchive *archive, OSIndex index, ARArchiveEntry *entry)
+{
+    if (index < 0 || index >= archive->entryCount)
+        return false;
+
+    if (archive->compact)
+    {
+        ARCompactTable *table = (ARCompactTable *)archive->toc;
+        UInt8 *base = (UInt8 *)table;
+        OSCount count = table->entryCount;
+
+        entry->type = base[ARCompactTypesOffset(count) + index];
+        entry->flags = base[ARCompactFlagsOffset(count) + index];
+        entry->dataOffset = ((UInt64 *)(base + ARCompactDataOffsetsOffset(count)))[index];
+        entry->dataSize = ((UInt64 *)(base + ARCompactDataSizesOffset(count)))[index];
+        entry->path = archive->paths[index];
+
+        return true;
+    }
+
+    if (archive->narrow) return ARArchiveGetEntryNarrow(archive, index, entry);
+    else return ARArchiveGetEntryWide(archive, index, entry);
+}
+
+// Order of paths in an archive with sorted entries. This is byte order,
+// except that '/' sorts before everything so a directory's contents come
+// directly after it (and before any sibling which shares its prefix).
+int ARArchiveComparePaths(const OSUTF8Char *a, const OSUTF8Char *b)
+{
+    while (*a && *a == *b)
+    {
+        a++;
+        b++;
+    }
+
+    if (*a == *b) return 0;
+    if (*a == '/') return *b ? -1 : 1;
+    if (*b == '/') return *a ? 1 : -1;
+
+    return (*a < *b) ? -1 : 1;
+}
+
+// Look up the entry with the given path. Returns its ToC index, or -1 if there is none.
+OSIndex ARArchiveFindEntry(ARArchive *archive, const OSUTF8Char *path, ARArchiveEntry *entry)
+{
+    if (archive->sections && (archive->sections->flags & kARSectionFlagSortedEntries))
+    {
+        OSIndex low = 0, high = archive->entryCount;
+
+        while (low < high)
+        {
+            OSIndex middle = low + ((high - low) / 2);
+
+            if (!ARArchiveGetEntry(archive, middle, entry))
+                return -1;
+
+            int order = ARArchiveComparePaths(entry->path, path);
+
+            if (!order) return middle;
+            if (order < 0) low = middle + 1;
+            else high = middle;
+        }
+
+        return -1;
+    }
+
+    for (OSIndex i = 0; i < archive->entryCount; i++)
+    {
+        if (!ARArchiveGetEntry(archive, i, entry))
+            return -1;
+
+        if (!strcmp((char *)entry->path, (char *)path))
+            return i;
+    }
+
+    return -1;
+}
+
+// Look up the stored checksum of the entry at ToC position `index`. Fails
+// quietly if the archive has no checksum table (or the index is beyond it).
+bool ARArchiveGetEntryChecksum(ARArchive *archive, OSIndex index, UInt32 *checksum)
+{
+    ARSection *section = ARArchiveFindSection(archive, kARSectionTypeEntryChecksums);
+
+    if (!section || section->size < sizeof(ARChecksumTable) || section->offset + section->size > archive->size)
+        return false;
+
+    ARChecksumTable *table = archive->address + section->offset;
+
+    if (table->checksumType != kARChecksumTypeCRC32C || index < 0 || index >= table->entryCount)
+        return false;
+
+    if (sizeof(ARChecksumTable) + ((index + 1) * sizeof(UInt32)) > section->size)
+        return false;
+
+    *checksum = table->checksums[index];
+    return true;
+}
+
+// Look up the extents of the sparse entry at ToC position `index`. Fails
+// quietly for entries which are stored in full.
+bool ARArchiveGetSparseExtents(ARArchive *archive, OSIndex index, UInt64 *fileSize, const ARSparseExtent **extents, OSCount *extentCount)
+{
+    ARSection *section = ARArchiveFindSection(archive, kARSectionTypeSparseMap);
+
+    if (!section || section->size < sizeof(ARSparseMap) || section->offset + section->size > archive->size)
+        return false;
+
+    ARSparseMap *map = archive->address + section->offset;
+    OSSize available = section->size - sizeof(ARSparseMap);
+
+    if (map->entryCount > available / sizeof(ARSparseEntry) || map->extentCount > (available - (map->entryCount * sizeof(ARSparseEntry))) / sizeof(ARSparseExtent))
+        return false;
+
+    OSIndex low = 0, high = map->entryCount;
+
+    while (low < high)
+    {
+        OSIndex middle = low + ((high - low) / 2);
+        ARSparseEntry *entry = &map->entries[middle];
+
+        if (entry->entryIndex < index) {
+            low = middle + 1;
+        } else if (entry->entryIndex > index) {
+            high = middle;
+        } else {
+            if (entry->firstExtent > map->extentCount || entry->extentCount > map->extentCount - entry->firstExtent)
+                return false;
+
+            *extents = (ARSparseExtent *)&map->entries[map->entryCount] + entry->firstExtent;
+            *extentCount = entry->extentCount;
+            *fileSize = entry->fileSize;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ARSection *ARArchiveFindSection(ARArchive *archive, ARSectionType type)
+{
+    if (!archive->sections)
+        return kOSNullPointer;
+
+    for (OSIndex i = 0; i < archive->sections->sectionCount; i++)
+    {
+        if (archive->sections->sections[i].type == type)
+            return &archive->sections->sections[i];
+    }
+
+    return kOSNullPointer;
+}
+
+// Read `size` bytes at `offset` into the (uncompressed) data section
+bool ARArchiveReadData(ARArchive *archive, UInt64 offset, OSSize size, void *buffer)
+{
+    if (!archive->cipher && ARArchiveIsEncrypted(archive))
+    {
+        fprintf(stderr, "Error: Archive is encrypted!\n");
+        return false;
+    }
+
+    if (archive->chunks)
+        return ARChunkReaderRead(archive->chunks, offset, size, buffer);
+
+    if (archive->dataSection + offset + size > (UInt8 *)archive->address + archive->size)
+    {
+        fprintf(stderr, "Error: Data range is outside of archive!\n");
+        return false;
+    }
+
+    memcpy(buffer, archive->dataSection + offset, size);
+
+    if (archive->cipher)
+        ARCipherApply(archive->cipher, buffer, size, (archive->dataSection - (UInt8 *)archive->address) + offset);
+
+    return true;
+}
+
+// Create every missing parent directory of `path`
 bool ARCreateDirectories(const OSUTF8Char *path)
 {
     OSUTF8Char *pointer = kOSNullPointer;
@@ -129,7 +903,7 @@ bool ARCreateDirectories(const OSUTF8Char *path)
         {
             (*pointer) = 0;
 
-            if (!ARCreateDirectory(copy))
+            if (!ARDirectoryExistsAtPath(copy) && !ARCreateDirectory(copy))
                 return false;
 
             (*pointer) = '/';
@@ -166,3 +940,18 @@ bool ARFileHasDataAtPath(const OSUTF8Char *path)
 
     return false;
 }
+
+// Write all of `buffer` to `fd`, retrying short writes
+bool ARWriteAll(int fd, const void *buffer, OSSize size)
+{
+    while (size)
+    {
+        ssize_t written = write(fd, buffer, size);
+        if (written <= 0) return false;
+
+        buffer += written;
+        size -= written;
+    }
+
+    return true;
+}
@@ -2,6 +2,10 @@
 #define __car__ 1
 
 #include <System/Archives/OSCAR.h>
+#include <openssl/evp.h>
+
+#define OSAlignUpward(p, s) (((p) + ((s) - 1)) & (~((s) - 1)))
+#define kARBlockSize        512
 
 typedef enum {
     kARSubtypeInvalid = -1,
@@ -11,21 +15,300 @@ typedef enum {
     kARSubtypeSystemImage
 } ARSubtype;
 
+// Extension sections. When present, the section directory sits directly
+// after the CADataModification structure of Subtype 2, BootX and System
+// Image archives and points at data the base format has no room for.
+
+#define kARSectionMagic         "CARX"
+#define kARSectionMaxCount      8
+
+typedef enum {
+    kARSectionTypeNone          = 0,
+    kARSectionTypeChunkIndex    = 1,
+    kARSectionTypeCipher        = 2,
+    kARSectionTypeMerkleTree    = 3,
+    kARSectionTypeSignature     = 4,
+    kARSectionTypeEntryChecksums = 5,
+    kARSectionTypeSparseMap     = 6
+} ARSectionType;
+
+typedef struct {
+    UInt32 type;
+    UInt32 flags;
+    UInt64 offset;
+    UInt64 size;
+} ARSection;
+
+typedef struct {
+    UInt8 magic[4];
+    UInt32 sectionCount;
+    UInt64 flags;
+    ARSection sections[kARSectionMaxCount];
+} ARSectionDirectory;
+
+// Entries are in canonical order: a depth first walk with siblings sorted
+// by name in byte order. Paths then sort with '/' below any other byte
+// (see ARArchiveComparePaths), so lookups can binary search the ToC.
+#define kARSectionFlagSortedEntries     (1 << 0)
+
+// The data section of a compressed archive is split into fixed-size chunks
+// which are compressed independently. Offsets are relative to the start of
+// the data section and there is one more offset than there are chunks, so
+// the stored size of chunk i is offsets[i + 1] - offsets[i]. A chunk whose
+// stored size equals its raw size was not compressible and is stored as-is.
+typedef struct {
+    UInt32 compressionType;
+    UInt32 chunkSize;
+    UInt64 chunkCount;
+    UInt64 dataSize;
+    UInt64 offsets[];
+} ARChunkIndex;
+
+#define kARChunkSize            (128 * 1024)
+
+// Encrypted archives have everything from the ToC through the end of the
+// stored data encrypted in counter mode (see car_crypto.h). Sections are
+// left in the clear. The key check is the encryption of a counter block no
+// archive offset maps to, so a wrong key is caught before anything is read.
+typedef struct {
+    UInt32 encryptionType;
+    UInt32 keySize;
+    UInt8 nonce[8];
+    UInt8 keyCheck[16];
+    UInt64 encryptedOffset;
+    UInt64 encryptedSize;
+} ARCipherInfo;
+
+// The stored data section (after compression and encryption) is split into
+// fixed-size blocks whose SHA-256 hashes are the leaves of a binary Merkle
+// tree. A node without a sibling is carried up unchanged. Every level is
+// stored, leaves first, so a range of blocks can be checked against the
+// root using only the sibling hashes along its path. The tree also records
+// the digests of the header and of the (stored) ToC and entry table.
+typedef struct {
+    UInt32 blockSize;
+    UInt32 levelCount;
+    UInt64 leafCount;
+    UInt64 dataOffset;
+    UInt64 dataSize;
+    UInt64 metadataOffset;
+    UInt64 metadataSize;
+    UInt8 headerDigest[32];
+    UInt8 metadataDigest[32];
+    UInt8 root[32];
+    UInt8 nodes[];
+} ARMerkleTree;
+
+#define kARMerkleBlockSize      (64 * 1024)
+
+// The signature is over the SHA-256 digest of the Merkle tree header and
+// every other extension section. The signer's public key (DER encoded
+// SubjectPublicKeyInfo) follows the signature itself.
+typedef struct {
+    UInt32 digestType;
+    UInt32 signatureSize;
+    UInt32 publicKeySize;
+    UInt32 reserved;
+    UInt8 digest[32];
+    UInt8 data[];
+} ARSignature;
+
+#define kARSignatureDigestSHA256    1
+
+// Checksums of each entry's raw data, indexed by ToC position. Entries
+// without data have a checksum of 0. Tools can compare entries between
+// archives through this table without reading (or decrypting) any data.
+typedef struct {
+    UInt32 checksumType;
+    UInt32 reserved;
+    UInt64 entryCount;
+    UInt32 checksums[];
+} ARChecksumTable;
+
+#define kARChecksumTypeCRC32C   1
+
+// Sparse files only store their data extents, back to back, and their
+// entry's data size is the size of what is stored. The sparse map lists
+// those entries (sorted by ToC position) and where each extent goes in the
+// file; everything else in the file is a hole. The extents of all entries
+// follow the entry records.
+typedef struct {
+    UInt64 entryIndex;
+    UInt64 fileSize;
+    UInt64 firstExtent;
+    UInt64 extentCount;
+} ARSparseEntry;
+
+typedef struct {
+    UInt64 offset;
+    UInt64 size;
+} ARSparseExtent;
+
+typedef struct {
+    UInt64 entryCount;
+    UInt64 extentCount;
+    ARSparseEntry entries[];
+} ARSparseMap;
+
+// The last byte of the header version holds revision flags. Every other
+// byte has to match one of the versions in OSCAR.h.
+//
+// Subtype 2 archives which have been appended to (trailing entries) keep
+// everything they had and add the new data, the extension sections and a
+// new ToC and entry table after it. The ToC then follows the data section
+// and the entry table runs to the end of the archive. Such archives are
+// never encrypted.
+#define kARHeaderFlagCompactEntries     (1 << 0)
+#define kARHeaderFlagNarrowOffsets      (1 << 1)
+#define kARHeaderFlagSparseEntries      (1 << 2)
+#define kARHeaderFlagTrailingEntries    (1 << 3)
+#define kARHeaderFlagMask               (kARHeaderFlagCompactEntries | kARHeaderFlagNarrowOffsets | kARHeaderFlagSparseEntries | kARHeaderFlagTrailingEntries)
+
+#define ARHeaderFlags(header)           (((const UInt8 *)(header))[7])
+
+// Narrow archives (chosen when the entry table and the data section both
+// fit in 4 GiB) have 32 bit ToC slots and 32 bit fields in their entries.
+// Subtype 2 and BootX directories omit the data fields as usual.
+typedef struct {
+    UInt8 type;
+    UInt8 flags;
+    UInt16 reserved;
+    UInt32 dataOffset;
+    UInt32 dataSize;
+    OSUTF8Char path[];
+} AREntryNarrow;
+
+typedef struct {
+    UInt8 type;
+    UInt8 specialFlags;
+    UInt16 reserved;
+    UInt32 entryCount;
+    UInt32 parentEntry;
+    UInt32 nextEntry;
+    UInt32 firstEntry;
+    OSUTF8Char path[];
+} ARSystemDirectoryEntryNarrow;
+
+typedef struct {
+    UInt8 type;
+    UInt8 specialFlags;
+    UInt16 reserved;
+    UInt32 parentEntry;
+    UInt32 nextEntry;
+    UInt32 dataOffset;
+    UInt32 dataSize;
+    OSUTF8Char path[];
+} ARSystemFileEntryNarrow;
+
+// Compact entry tables (Subtype 2 only) replace the ToC and entry table.
+// The ToC offset points at an ARCompactTable followed by one array per
+// field: types and flags (UInt8), parent entry indices (UInt32) and data
+// offsets and sizes (UInt64), each array 8 byte aligned. The entry table
+// offset points at the string pool, which holds each entry's name (not
+// its path) front coded against the previous entry's name: a LEB128 count
+// of shared bytes, a LEB128 count of new bytes, then the new bytes. Entry
+// 0 is the root; every other entry's parent comes before it.
+typedef struct {
+    UInt64 entryCount;
+    UInt64 poolSize;
+} ARCompactTable;
+
+#define ARCompactTypesOffset(n)         sizeof(ARCompactTable)
+#define ARCompactFlagsOffset(n)         (ARCompactTypesOffset(n) + (n))
+#define ARCompactParentsOffset(n)       OSAlignUpward(ARCompactFlagsOffset(n) + (n), 8)
+#define ARCompactDataOffsetsOffset(n)   OSAlignUpward(ARCompactParentsOffset(n) + ((n) * sizeof(UInt32)), 8)
+#define ARCompactDataSizesOffset(n)     (ARCompactDataOffsetsOffset(n) + ((n) * sizeof(UInt64)))
+#define ARCompactTableSize(n)           (ARCompactDataSizesOffset(n) + ((n) * sizeof(UInt64)))
+
+// Tar streams (read by --from-tar, written by --to-tar) are made of 512
+// byte blocks. This is the ustar header; old style and GNU headers share
+// its first 257 bytes.
+#define kARTarBlockSize         512
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char modificationTime[12];
+    char checksum[8];
+    char type;
+    char linkName[100];
+    char magic[6];
+    char version[2];
+    char userName[32];
+    char groupName[32];
+    char deviceMajor[8];
+    char deviceMinor[8];
+    char prefix[155];
+    char padding[12];
+} ARTarHeader;
+
+_Static_assert(sizeof(ARTarHeader) == kARTarBlockSize, "Tar headers are one block");
+
+typedef struct __ARChunkReader ARChunkReader;
+typedef struct __ARCipher ARCipher;
+
 typedef struct {
     ARSubtype subtype;
     void *address;
     OSSize size;
+
+    OSOffset tocOffset;
+    void *toc;
+    UInt8 *entryTable;
+    UInt8 *dataSection;
+    OSSize entryTableSize;
+    OSCount entryCount;
+
+    ARSectionDirectory *sections;
+    ARChunkReader *chunks;
+
+    // Set once an encrypted archive is unlocked; `metadata` holds the decrypted ToC and entry table
+    ARCipher *cipher;
+    UInt8 *metadata;
+
+    // Compact entry tables are decoded into full paths when they're loaded
+    bool compact;
+    bool narrow;
+    OSUTF8Char **paths;
 } ARArchive;
 
+// Subtype independent view of a single archive entry
+typedef struct {
+    UInt8 type;
+    UInt8 flags;
+    OSUTF8Char *path;
+    UInt64 dataOffset;
+    UInt64 dataSize;
+} ARArchiveEntry;
+
 ARArchive *ARArchiveOpen(const OSUTF8Char *path);
+ARArchive *ARArchiveOpenWithKey(const OSUTF8Char *path, const OSUTF8Char *keyFile);
+bool ARArchiveIsEncrypted(ARArchive *archive);
+bool ARArchiveUnlock(ARArchive *archive, const UInt8 *key, OSSize keySize);
 ARSubtype ARDetectSubtype(const UInt8 *header);
 bool ARArchiveClose(ARArchive *archive);
 
+OSSize ARArchiveHeaderSize(ARSubtype subtype);
+UInt32 ARArchiveHeaderChecksum(ARSubtype subtype, const void *header);
+void ARArchiveHeaderDigest(ARSubtype subtype, const void *header, UInt8 *digest);
+
+bool ARArchiveGetEntry(ARArchive *archive, OSIndex index, ARArchiveEntry *entry);
+OSIndex ARArchiveFindEntry(ARArchive *archive, const OSUTF8Char *path, ARArchiveEntry *entry);
+int ARArchiveComparePaths(const OSUTF8Char *a, const OSUTF8Char *b);
+bool ARArchiveGetEntryChecksum(ARArchive *archive, OSIndex index, UInt32 *checksum);
+bool ARArchiveGetSparseExtents(ARArchive *archive, OSIndex index, UInt64 *fileSize, const ARSparseExtent **extents, OSCount *extentCount);
+ARSection *ARArchiveFindSection(ARArchive *archive, ARSectionType type);
+bool ARArchiveReadData(ARArchive *archive, UInt64 offset, OSSize size, void *buffer);
+
 bool ARCreateDirectories(const OSUTF8Char *path);
 bool ARCreateDirectory(const OSUTF8Char *path);
 
 bool ARDirectoryExistsAtPath(const OSUTF8Char *path);
 bool ARFileHasDataAtPath(const OSUTF8Char *path);
+bool ARWriteAll(int fd, const void *buffer, OSSize size);
 
 // car_crc32.c
 
@@ -33,5 +316,34 @@ UInt32 ARCRC32Init(void);
 UInt32 ARCRC32Update(UInt32 checksum, void *buffer, OSSize size);
 UInt32 ARCRC32Finalize(UInt32 checksum);
 UInt32 ARCRC32Process(void *buffer, OSSize size);
+UInt32 ARCRC32Shift(UInt32 checksum, UInt64 size);
+UInt32 ARCRC32Combine(UInt32 first, UInt32 second, UInt64 secondSize);
+void ARCRC32FusedUpdate(UInt32 *checksum, UInt32 *checksumC, const void *buffer, OSSize size);
+
+// car_crc32c.c
+
+UInt32 ARCRC32CInit(void);
+UInt32 ARCRC32CUpdate(UInt32 checksum, const void *buffer, OSSize size);
+UInt32 ARCRC32CFinalize(UInt32 checksum);
+UInt32 ARCRC32CProcess(const void *buffer, OSSize size);
+
+// car_sign.c (SHA-256 is OpenSSL's)
+
+#define kARSHA256DigestSize     32
+
+typedef struct {
+    EVP_MD_CTX *context;
+} ARSHA256Context;
+
+void ARSHA256Init(ARSHA256Context *context);
+void ARSHA256Update(ARSHA256Context *context, const void *data, OSSize size);
+void ARSHA256Finalize(ARSHA256Context *context, UInt8 *digest);
+void ARSHA256Process(const void *data, OSSize size, UInt8 *digest);
+
+// For hashing many small messages with one context: Init it once, Reset
+// and Digest it for each message, then Free it
+void ARSHA256Reset(ARSHA256Context *context);
+void ARSHA256Digest(ARSHA256Context *context, UInt8 *digest);
+void ARSHA256Free(ARSHA256Context *context);
 
 #endif /* !defined(__car__) */
@@ -0,0 +1,302 @@
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "car_compress.h"
+#include "car_crypto.h"
+#include "car_chunk.h"
+
+// Number of decompressed chunks kept around for repeated reads
+#define kARChunkCacheSize 8
+
+typedef struct {
+    UInt64 chunk;
+    UInt64 lastUse;
+    UInt8 *buffer;
+    bool valid;
+} ARChunkCacheSlot;
+
+struct __ARChunkReader {
+    ARChunkIndex *index;
+    ARChunkSource source;
+    UInt8 *scratch;
+
+    pthread_mutex_t lock;
+    UInt64 clock;
+
+    ARChunkCacheSlot slots[kARChunkCacheSize];
+};
+
+#pragma mark - Chunk Helpers
+
+OSSize ARChunkIndexSize(UInt64 dataSize, UInt32 chunkSize)
+{
+    UInt64 chunkCount = (dataSize + (chunkSize - 1)) / chunkSize;
+
+    return sizeof(ARChunkIndex) + ((chunkCount + 1) * sizeof(UInt64));
+}
+
+OSSize ARChunkRawSize(ARChunkIndex *index, UInt64 chunk)
+{
+    if (chunk == index->chunkCount - 1)
+        return index->dataSize - (chunk * index->chunkSize);
+
+    return index->chunkSize;
+}
+
+// Compress `dataSize` bytes at `data` in place. Every chunk is stored at
+// or before its raw position, so a chunk never overwrites one which has
+// not been compressed yet. The stored size ends up in the final offset.
+bool ARChunkCompressData(UInt8 *data, ARChunkIndex *index, CACompressionType type, UInt64 dataSize, UInt32 chunkSize)
+{
+    UInt8 *scratch = malloc(chunkSize);
+    UInt64 storedSize = 0;
+
+    if (!scratch)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    index->compressionType = type;
+    index->chunkSize = chunkSize;
+    index->chunkCount = (dataSize + (chunkSize - 1)) / chunkSize;
+    index->dataSize = dataSize;
+
+    for (UInt64 chunk = 0; chunk < index->chunkCount; chunk++)
+    {
+        UInt8 *raw = data + (chunk * chunkSize);
+        OSSize rawSize = ARChunkRawSize(index, chunk);
+        OSSize packedSize = ARCompressBuffer(type, raw, rawSize, scratch, rawSize - 1);
+
+        index->offsets[chunk] = storedSize;
+
+        if (packedSize) {
+            memcpy(data + storedSize, scratch, packedSize);
+            storedSize += packedSize;
+        } else {
+            memmove(data + storedSize, raw, rawSize);
+            storedSize += rawSize;
+        }
+    }
+
+    index->offsets[index->chunkCount] = storedSize;
+    free(scratch);
+
+    return true;
+}
+
+// Decompress a full chunk into `buffer`, which must hold ARChunkRawSize()
+// bytes. `scratch` must hold a full chunk if the source is encrypted.
+bool ARChunkDecompress(const ARChunkSource *source, UInt64 chunk, void *buffer, void *scratch)
+{
+    ARChunkIndex *index = source->index;
+    OSSize storedSize = index->offsets[chunk + 1] - index->offsets[chunk];
+    OSSize rawSize = ARChunkRawSize(index, chunk);
+    UInt8 *stored = source->dataSection + index->offsets[chunk];
+
+    if (storedSize == rawSize)
+    {
+        memcpy(buffer, stored, rawSize);
+
+        if (source->cipher)
+            ARCipherApply(source->cipher, buffer, rawSize, source->dataSectionOffset + index->offsets[chunk]);
+
+        return true;
+    }
+
+    if (source->cipher)
+    {
+        memcpy(scratch, stored, storedSize);
+        ARCipherApply(source->cipher, scratch, storedSize, source->dataSectionOffset + index->offsets[chunk]);
+
+        stored = scratch;
+    }
+
+    if (!ARDecompressBuffer(index->compressionType, stored, storedSize, buffer, rawSize))
+    {
+        fprintf(stderr, "Error: Could not decompress chunk %lu!\n", chunk);
+        return false;
+    }
+
+    return true;
+}
+
+#pragma mark - Chunk Reader
+
+ARChunkReader *ARChunkReaderCreate(ARChunkIndex *index, OSSize indexSize, UInt8 *dataSection, OSSize storedSize)
+{
+    if (indexSize < sizeof(ARChunkIndex) || !index->chunkSize)
+        return kOSNullPointer;
+
+    if (index->chunkCount != (index->dataSize + (index->chunkSize - 1)) / index->chunkSize)
+        return kOSNullPointer;
+
+    if (indexSize < ARChunkIndexSize(index->dataSize, index->chunkSize))
+        return kOSNullPointer;
+
+    for (UInt64 chunk = 0; chunk < index->chunkCount; chunk++)
+    {
+        if (index->offsets[chunk] > index->offsets[chunk + 1])
+            return kOSNullPointer;
+
+        if (index->offsets[chunk + 1] - index->offsets[chunk] > ARChunkRawSize(index, chunk))
+            return kOSNullPointer;
+    }
+
+    if (index->offsets[index->chunkCount] > storedSize)
+        return kOSNullPointer;
+
+    if (!ARCompressionSupported(index->compressionType))
+    {
+        fprintf(stderr, "Error: Archive uses an unsupported compression type!\n");
+        return kOSNullPointer;
+    }
+
+    ARChunkReader *reader = malloc(sizeof(ARChunkReader));
+
+    if (!reader)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    memset(reader, 0, sizeof(ARChunkReader));
+    pthread_mutex_init(&reader->lock, kOSNullPointer);
+
+    reader->source.dataSection = dataSection;
+    reader->source.index = index;
+    reader->index = index;
+
+    return reader;
+}
+
+void ARChunkReaderSetCipher(ARChunkReader *reader, ARCipher *cipher, UInt64 dataSectionOffset)
+{
+    reader->source.cipher = cipher;
+    reader->source.dataSectionOffset = dataSectionOffset;
+}
+
+const ARChunkSource *ARChunkReaderSource(ARChunkReader *reader)
+{
+    return &reader->source;
+}
+
+// Scratch space for decrypting chunks (allocated on first use, under the lock)
+static UInt8 *ARChunkReaderScratch(ARChunkReader *reader)
+{
+    if (!reader->source.cipher || reader->scratch)
+        return reader->scratch;
+
+    reader->scratch = malloc(reader->index->chunkSize);
+
+    if (!reader->scratch)
+        fprintf(stderr, "Error: Out of memory!\n");
+
+    return reader->scratch;
+}
+
+ARChunkIndex *ARChunkReaderIndex(ARChunkReader *reader)
+{
+    return reader->index;
+}
+
+// Find `chunk` in the cache or decompress it into the least recently used slot
+static ARChunkCacheSlot *ARChunkReaderLookup(ARChunkReader *reader, UInt64 chunk)
+{
+    ARChunkCacheSlot *victim = &reader->slots[0];
+
+    for (OSIndex i = 0; i < kARChunkCacheSize; i++)
+    {
+        ARChunkCacheSlot *slot = &reader->slots[i];
+
+        if (slot->valid && slot->chunk == chunk)
+        {
+            slot->lastUse = ++reader->clock;
+            return slot;
+        }
+
+        if (!slot->valid || slot->lastUse < victim->lastUse)
+            victim = slot;
+    }
+
+    if (!victim->buffer)
+    {
+        victim->buffer = malloc(reader->index->chunkSize);
+
+        if (!victim->buffer)
+        {
+            fprintf(stderr, "Error: Out of memory!\n");
+            return kOSNullPointer;
+        }
+    }
+
+    victim->valid = ARChunkDecompress(&reader->source, chunk, victim->buffer, reader->scratch);
+    if (!victim->valid) return kOSNullPointer;
+
+    victim->lastUse = ++reader->clock;
+    victim->chunk = chunk;
+
+    return victim;
+}
+
+// Read `size` bytes at raw `offset`, decompressing only the chunks which overlap it
+bool ARChunkReaderRead(ARChunkReader *reader, UInt64 offset, OSSize size, void *b)
+{
+    ARChunkIndex *index = reader->index;
+    UInt8 *buffer = (UInt8 *)b;
+
+    if (offset > index->dataSize || size > index->dataSize - offset)
+    {
+        fprintf(stderr, "Error: Data range is outside of archive!\n");
+        return false;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+
+    if (reader->source.cipher && !ARChunkReaderScratch(reader))
+    {
+        pthread_mutex_unlock(&reader->lock);
+        return false;
+    }
+
+    while (size)
+    {
+        UInt64 chunk = offset / index->chunkSize;
+        OSOffset within = offset % index->chunkSize;
+        OSSize rawSize = ARChunkRawSize(index, chunk);
+        OSSize length = rawSize - within;
+
+        if (length > size)
+            length = size;
+
+        // Whole chunks skip the cache entirely
+        if (!within && length == rawSize) {
+            if (!ARChunkDecompress(&reader->source, chunk, buffer, reader->scratch))
+                break;
+        } else {
+            ARChunkCacheSlot *slot = ARChunkReaderLookup(reader, chunk);
+            if (!slot) break;
+
+            memcpy(buffer, slot->buffer + within, length);
+        }
+
+        buffer += length;
+        offset += length;
+        size -= length;
+    }
+
+    pthread_mutex_unlock(&reader->lock);
+    return !size;
+}
+
+void ARChunkReaderFree(ARChunkReader *reader)
+{
+    for (OSIndex i = 0; i < kARChunkCacheSize; i++)
+        free(reader->slots[i].buffer);
+
+    free(reader->scratch);
+    pthread_mutex_destroy(&reader->lock);
+    free(reader);
+}
@@ -0,0 +1,28 @@
+#ifndef __car_chunk__
+#define __car_chunk__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+// Where the stored chunks of an archive live. Chunks of encrypted archives
+// are decrypted into caller provided scratch space before decompression.
+typedef struct {
+    ARChunkIndex *index;
+    UInt8 *dataSection;
+    ARCipher *cipher;
+    UInt64 dataSectionOffset;
+} ARChunkSource;
+
+OSSize ARChunkIndexSize(UInt64 dataSize, UInt32 chunkSize);
+OSSize ARChunkRawSize(ARChunkIndex *index, UInt64 chunk);
+bool ARChunkCompressData(UInt8 *data, ARChunkIndex *index, CACompressionType type, UInt64 dataSize, UInt32 chunkSize);
+bool ARChunkDecompress(const ARChunkSource *source, UInt64 chunk, void *buffer, void *scratch);
+
+ARChunkReader *ARChunkReaderCreate(ARChunkIndex *index, OSSize indexSize, UInt8 *dataSection, OSSize storedSize);
+void ARChunkReaderSetCipher(ARChunkReader *reader, ARCipher *cipher, UInt64 dataSectionOffset);
+const ARChunkSource *ARChunkReaderSource(ARChunkReader *reader);
+ARChunkIndex *ARChunkReaderIndex(ARChunkReader *reader);
+bool ARChunkReaderRead(ARChunkReader *reader, UInt64 offset, OSSize size, void *buffer);
+void ARChunkReaderFree(ARChunkReader *reader);
+
+#endif /* !defined(__car_chunk__) */
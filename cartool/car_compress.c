@@ -0,0 +1,75 @@
+#include <stdio.h>
+
+#if defined(__APPLE__)
+    #include <compression.h>
+#else /* !defined(__APPLE__) */
+    #include <lzma.h>
+#endif /* defined(__APPLE__) */
+
+#include "car_compress.h"
+
+// Both backends produce and consume standard .xz streams,
+// so archives move freely between macOS and other hosts.
+// There is no LZO backend; archives asking for it are refused.
+
+bool ARCompressionSupported(CACompressionType type)
+{
+    return (type == kCACompressionTypeLZMA);
+}
+
+#if defined(__APPLE__)
+
+OSSize ARCompressBuffer(CACompressionType type, const void *source, OSSize sourceSize, void *destination, OSSize destinationSize)
+{
+    if (type != kCACompressionTypeLZMA)
+        return 0;
+
+    return compression_encode_buffer(destination, destinationSize, source, sourceSize, kOSNullPointer, COMPRESSION_LZMA);
+}
+
+bool ARDecompressBuffer(CACompressionType type, const void *source, OSSize sourceSize, void *destination, OSSize destinationSize)
+{
+    if (type != kCACompressionTypeLZMA)
+        return false;
+
+    return (compression_decode_buffer(destination, destinationSize, source, sourceSize, kOSNullPointer, COMPRESSION_LZMA) == destinationSize);
+}
+
+#else /* !defined(__APPLE__) */
+
+// Everything is encoded with this preset
+#define kARCompressionPreset LZMA_PRESET_DEFAULT
+
+OSSize ARCompressBuffer(CACompressionType type, const void *source, OSSize sourceSize, void *destination, OSSize destinationSize)
+{
+    if (type != kCACompressionTypeLZMA)
+        return 0;
+
+    size_t position = 0;
+
+    if (lzma_easy_buffer_encode(kARCompressionPreset, LZMA_CHECK_CRC32, kOSNullPointer, source, sourceSize, destination, &position, destinationSize) != LZMA_OK)
+        return 0;
+
+    return position;
+}
+
+bool ARDecompressBuffer(CACompressionType type, const void *source, OSSize sourceSize, void *destination, OSSize destinationSize)
+{
+    if (type != kCACompressionTypeLZMA)
+        return false;
+
+    // The decoder needs about as much memory as the dictionary it's told
+    // to use, whatever the size of the output. Ours never use a bigger one
+    // than the preset's (8 MiB), so a stream asking for more is refused
+    // rather than trusted with the allocation.
+    UInt64 memoryLimit = lzma_easy_decoder_memusage(kARCompressionPreset);
+    size_t inPosition = 0;
+    size_t outPosition = 0;
+
+    if (lzma_stream_buffer_decode(&memoryLimit, 0, kOSNullPointer, source, &inPosition, sourceSize, destination, &outPosition, destinationSize) != LZMA_OK)
+        return false;
+
+    return (outPosition == destinationSize);
+}
+
+#endif /* defined(__APPLE__) */
@@ -0,0 +1,13 @@
+#ifndef __car_compress__
+#define __car_compress__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+bool ARCompressionSupported(CACompressionType type);
+
+// Returns the compressed size, or 0 if `source` doesn't fit in `destinationSize` bytes
+OSSize ARCompressBuffer(CACompressionType type, const void *source, OSSize sourceSize, void *destination, OSSize destinationSize);
+bool ARDecompressBuffer(CACompressionType type, const void *source, OSSize sourceSize, void *destination, OSSize destinationSize);
+
+#endif /* !defined(__car_compress__) */
@@ -57,3 +57,70 @@ UInt32 ARCRC32Process(void *buffer, OSSize size)
     checksum = ARCRC32Update(checksum, buffer, size);
     return ARCRC32Finalize(checksum);
 }
+
+// Multiply two polynomials modulo the CRC-32 polynomial. Both are bit
+// reflected (x^0 is the top bit) and `a` must not be zero.
+static UInt32 ARCRC32MultiplyModP(UInt32 a, UInt32 b)
+{
+    UInt32 product = 0;
+
+    for (UInt32 mask = 1U << 31; ; mask >>= 1)
+    {
+        if (a & mask)
+        {
+            product ^= b;
+
+            if (!(a & (mask - 1)))
+                break;
+        }
+
+        b = (b & 1) ? ((b >> 1) ^ 0xEDB88320) : (b >> 1);
+    }
+
+    return product;
+}
+
+// Running `size` zero bytes through the CRC register multiplies it by
+// x^(8 * size), so that is what this does (in O(log size) steps).
+UInt32 ARCRC32Shift(UInt32 checksum, UInt64 size)
+{
+    UInt32 power = 1U << 31;
+    UInt32 square = 1U << 23;
+
+    for ( ; size; size >>= 1)
+    {
+        if (size & 1)
+            power = ARCRC32MultiplyModP(square, power);
+
+        square = ARCRC32MultiplyModP(square, square);
+    }
+
+    return ARCRC32MultiplyModP(power, checksum);
+}
+
+// Checksum of two buffers back to back, from the checksum of each
+UInt32 ARCRC32Combine(UInt32 first, UInt32 second, UInt64 secondSize)
+{
+    return ARCRC32Shift(first, secondSize) ^ second;
+}
+
+// Small enough that each block is still in L1 when the second checksum reads it
+#define kARCRC32FusedBlockSize (16 * 1024)
+
+// Update a CRC32 and a CRC32C (either may be null) over the same buffer in
+// a single pass through memory
+void ARCRC32FusedUpdate(UInt32 *checksum, UInt32 *checksumC, const void *buffer, OSSize size)
+{
+    const UInt8 *data = buffer;
+
+    while (size)
+    {
+        OSSize length = (size > kARCRC32FusedBlockSize) ? kARCRC32FusedBlockSize : size;
+
+        if (checksumC) *checksumC = ARCRC32CUpdate(*checksumC, data, length);
+        if (checksum) *checksum = ARCRC32Update(*checksum, (void *)data, length);
+
+        data += length;
+        size -= length;
+    }
+}
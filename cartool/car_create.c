@@ -1,6 +1,7 @@
 #include <sys/syslimits.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <stddef.h>
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
@@ -8,12 +9,30 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
 
+#if defined(__linux__)
+    #include <sys/sysmacros.h>
+#endif /* defined(__linux__) */
+
+#include "car_compress.h"
+#include "car_pipeline.h"
 #include "car_create.h"
+#include "car_manifest.h"
+#include "car_filter.h"
+#include "car_merkle.h"
+#include "car_crypto.h"
+#include "car_chunk.h"
+#include "car_sign.h"
+#include "car_log.h"
 
-#define OSAlignUpward(p, s) (((p) + ((s) - 1)) & (~((s) - 1)))
 #define ARAlignEntry(addr)  (((addr) - 5) & (~7)) + 12;
-#define kARBlockSize        512
+
+#if defined(__APPLE__)
+    #define ARStatModificationTime(s) (((s).st_mtimespec.tv_sec * 1000000000ULL) + (s).st_mtimespec.tv_nsec)
+#else /* !defined(__APPLE__) */
+    #define ARStatModificationTime(s) (((s).st_mtim.tv_sec * 1000000000ULL) + (s).st_mtim.tv_nsec)
+#endif /* defined(__APPLE__) */
 
 typedef struct {
     struct ARDirectoryEntry {
@@ -29,20 +48,71 @@ typedef struct {
         OSUTF8Char *path;
         UInt64 size;
         UInt8 type;
+
+        // Used to recognise unchanged files in incremental builds
+        UInt64 modificationTime;
+        UInt64 inode;
+        UInt64 device;
+
+        // Offset into the data section; entries with a `duplicate` share its data
+        struct ARDirectoryEntry *duplicate;
+        UInt64 dataOffset;
+        UInt64 layoutRank;
+
+        // CRC32 of the data, folded into the archive's data checksum
+        UInt32 dataCRC;
+
+        // Sparse files only store `extents`; `size` is their sum
+        ARSparseExtent *extents;
+        OSCount extentCount;
+        UInt64 fileSize;
+        bool sparse;
+
+        // Entries carried over when appending keep their data and checksum;
+        // repacked and imported entries copy theirs from `sourceOffset` in
+        // the source (or have their link target in memory)
+        bool existing;
+        UInt32 checksum;
+        UInt64 sourceOffset;
+        OSUTF8Char *linkTarget;
     } *head, *tail;
 
     OSCount entryCount;
     OSSize fullSize;
     OSSize nameSkip;
+
+    // Look for holes in files which use fewer blocks than their size
+    bool detectHoles;
+
+    // Record modification times and inodes (for manifests and hardlinks)
+    bool identifyFiles;
+
+    // getdents64 buffer for directory scans
+    UInt8 *scanBuffer;
+
+    // Include/exclude rules checked before anything in the tree is stat'd
+    ARFilter *filter;
+    OSCount sparseCount;
+    OSCount extentCount;
+
+    // Archive being repacked or tar stream being imported instead of a
+    // source tree. Data is at `sourceBase` in `sourceFd` when it can be
+    // copied straight out of the file; other archives are read through
+    // `source`.
+    ARArchive *source;
+    int sourceFd;
+    OSOffset sourceBase;
+    bool sourceChecksums;
 } ARDirectoryStructure;
 
 typedef struct ARDirectoryEntry ARDirectoryEntry;
 
 #pragma mark - Create Functions I
 
+// Repacking passes no root directory
 static bool ARCreatePretest(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive)
 {
-    if (!ARDirectoryExistsAtPath(rootDirectory))
+    if (rootDirectory && !ARDirectoryExistsAtPath(rootDirectory))
     {
         fprintf(stderr, "Error: Root directory for archive does not exist!\n");
         return false;
@@ -131,9 +201,12 @@ static bool ARCreateCloseArchive(int fd)
 
 #pragma mark - Write Helpers
 
-static bool ARCreateWriteToCEntry(int fd, OSOffset offset, OSOffset entry)
+static bool ARCreateWriteToCEntry(int fd, OSOffset offset, OSOffset entry, bool narrow)
 {
-    if (pwrite(fd, &entry, sizeof(UInt64), offset) != sizeof(UInt64))
+    UInt32 narrowEntry = (UInt32)entry;
+    OSSize size = narrow ? sizeof(UInt32) : sizeof(UInt64);
+
+    if (pwrite(fd, narrow ? (void *)&narrowEntry : (void *)&entry, size, offset) != size)
     {
         fprintf(stderr, "Error: Could not write ToC entry!\n");
         return false;
@@ -142,9 +215,9 @@ static bool ARCreateWriteToCEntry(int fd, OSOffset offset, OSOffset entry)
     return true;
 }
 
-static bool ARCreateWriteEntryStandard(int fd, void *entry)
+static bool ARCreateWriteEntryStandard(int fd, void *entry, OSSize size)
 {
-    if (write(fd, entry, sizeof(CAEntryS1)) != sizeof(CAEntryS1))
+    if (write(fd, entry, size) != size)
     {
         fprintf(stderr, "Error: Could not write entry!\n");
         return false;
@@ -178,7 +251,32 @@ static OSOffset ARCreateWriteAlignedPath(int fd, const OSUTF8Char *path, OSOffse
     return currentOffset;
 }
 
-static bool ARCreateWriteFile(void *destination, const OSUTF8Char *file, OSSize size)
+// Files are read this much at a time when they're checksummed, so each
+// block is checksummed while it's still in the cache
+#define kARCreateChecksumBlockSize (256 * 1024)
+
+// Read `size` bytes at `offset` in `fd` into `destination` and update the
+// CRC32 and CRC32C (either may be null) as it's read
+static bool ARCreateReadChecksummed(int fd, void *destination, OSSize size, off_t offset, UInt32 *checksum, UInt32 *checksumC)
+{
+    OSSize blockSize = (checksum || checksumC) ? kARCreateChecksumBlockSize : size;
+
+    while (size)
+    {
+        ssize_t length = pread(fd, destination, (size > blockSize) ? blockSize : size, offset);
+        if (length <= 0) return false;
+
+        ARCRC32FusedUpdate(checksum, checksumC, destination, length);
+
+        destination += length;
+        offset += length;
+        size -= length;
+    }
+
+    return true;
+}
+
+static bool ARCreateWriteFile(void *destination, const OSUTF8Char *file, OSSize size, UInt32 *checksum, UInt32 *checksumC)
 {
     int fd = open((char *)file, O_RDONLY);
 
@@ -188,12 +286,47 @@ static bool ARCreateWriteFile(void *destination, const OSUTF8Char *file, OSSize
         return false;
     }
 
-    if (read(fd, destination, size) != size)
+    if (!ARCreateReadChecksummed(fd, destination, size, 0, checksum, checksumC))
     {
         fprintf(stderr, "Error: Could not read proper number of bytes from '%s' (has it been modified?)\n", file);
+        close(fd);
+
+        return false;
+    }
+
+    if (close(fd))
+    {
+        fprintf(stderr, "Error: Could not close file '%s'!", file);
+        return false;
+    }
+
+    return true;
+}
+
+// Read the data extents of a sparse file back to back into `destination`
+static bool ARCreateWriteSparseFile(void *destination, const OSUTF8Char *file, const ARSparseExtent *extents, OSCount extentCount, UInt32 *checksum, UInt32 *checksumC)
+{
+    int fd = open((char *)file, O_RDONLY);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: Could not open file '%s'!\n", file);
         return false;
     }
 
+    for (OSIndex i = 0; i < extentCount; i++)
+    {
+        if (!ARCreateReadChecksummed(fd, destination, extents[i].size, extents[i].offset, checksum, checksumC))
+        {
+            fprintf(stderr, "Error: Could not read proper number of bytes from '%s' (has it been modified?)\n", file);
+            close(fd);
+
+            return false;
+        }
+
+        destination += extents[i].size;
+    }
+
     if (close(fd))
     {
         fprintf(stderr, "Error: Could not close file '%s'!", file);
@@ -203,7 +336,7 @@ static bool ARCreateWriteFile(void *destination, const OSUTF8Char *file, OSSize
     return true;
 }
 
-static bool ARCreateWriteSymlink(void *destination, const OSUTF8Char *link, OSSize size)
+static bool ARCreateWriteSymlink(void *destination, const OSUTF8Char *link, OSSize size, UInt32 *checksum, UInt32 *checksumC)
 {
     ssize_t linkSize = size;
 
@@ -213,6 +346,7 @@ static bool ARCreateWriteSymlink(void *destination, const OSUTF8Char *link, OSSi
         return false;
     }
 
+    ARCRC32FusedUpdate(checksum, checksumC, destination, size);
     return true;
 }
 
@@ -237,6 +371,7 @@ static ARDirectoryStructure *ARDirectoryStructureCreate(const OSUTF8Char *rootDi
     directory->head = directory->tail = rootEntry;
     directory->nameSkip = nameSkip;
     directory->entryCount = 1;
+    directory->sourceFd = -1;
 
     memset(rootEntry, 0, sizeof(ARDirectoryEntry));
     rootEntry->next = rootEntry->previous = 0;
@@ -266,6 +401,8 @@ static void ARDirectoryStructureFree(ARDirectoryStructure *directory)
 
     while (entry)
     {
+        free(entry->linkTarget);
+        free(entry->extents);
         free(entry->path);
 
         prev = entry;
@@ -274,6 +411,11 @@ static void ARDirectoryStructureFree(ARDirectoryStructure *directory)
         free(prev);
     }
 
+    if (directory->source) ARArchiveClose(directory->source);
+    if (directory->sourceFd != -1) close(directory->sourceFd);
+
+    ARFilterFree(directory->filter);
+    free(directory->scanBuffer);
     free(directory);
 }
 
@@ -307,15 +449,348 @@ static bool ARPromptContinue(void)
 
 #pragma mark - Directory Enumeration
 
-static bool AREnumerateDirectory(ARDirectoryStructure *directory, bool system, bool verbose)
+// Large enough for a few hundred names per getdents64 call
+#define kARScanBufferSize (64 * 1024)
+
+// A name in a directory along with what was found out about it. Only the
+// fields requested by the directory structure's scan flags are filled in.
+typedef struct {
+    char *name;
+    struct stat stats;
+
+    // Data extents of a file with holes, and the size of their data
+    ARSparseExtent *extents;
+    OSCount extentCount;
+    UInt64 storedSize;
+} ARScanEntry;
+
+static int ARCompareScanEntries(const void *a, const void *b)
+{
+    return strcmp(((const ARScanEntry *)a)->name, ((const ARScanEntry *)b)->name);
+}
+
+static void ARFreeScanEntries(ARScanEntry *entries, OSCount count)
+{
+    for (OSIndex i = 0; i < count; i++)
+    {
+        free(entries[i].name);
+        free(entries[i].extents);
+    }
+
+    free(entries);
+}
+
+// Append `name` to `entries`, growing it as needed
+static bool ARAddScanEntry(ARScanEntry **entries, OSCount *count, OSCount *capacity, const char *name)
+{
+    if (*count == *capacity)
+    {
+        ARScanEntry *grown = realloc(*entries, (*capacity * 2) * sizeof(ARScanEntry));
+
+        if (!grown)
+        {
+            fprintf(stderr, "Error: Out of memory!\n");
+            return false;
+        }
+
+        *entries = grown;
+        *capacity *= 2;
+    }
+
+    memset(&(*entries)[*count], 0, sizeof(ARScanEntry));
+
+    if (!((*entries)[*count].name = strdup(name)))
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    (*count)++;
+    return true;
+}
+
+// Whether the filter keeps `name` in the directory `fd` (at `path`). Only
+// the name and the type the directory reports are needed, so excluded
+// subtrees are dropped without being stat'd, let alone read.
+static bool ARScanIncludes(ARDirectoryStructure *directory, int fd, const OSUTF8Char *path, const char *name, unsigned char type)
+{
+    char archivePath[PATH_MAX + 1];
+    bool isDirectory = (type == DT_DIR);
+    struct stat stats;
+
+    if (type == DT_UNKNOWN && !fstatat(fd, name, &stats, AT_SYMLINK_NOFOLLOW))
+        isDirectory = S_ISDIR(stats.st_mode);
+
+    snprintf(archivePath, sizeof(archivePath), "%s/%s", path + directory->nameSkip, name);
+    return ARFilterIncludes(directory->filter, (const OSUTF8Char *)archivePath, isDirectory);
+}
+
+#if defined(__linux__)
+
+// Read the directory `fd` in large batches and stat its entries with the
+// smallest statx mask which covers what the build needs. Directories and
+// links are taken from the type getdents64 reports when nothing else about
+// them is needed.
+static bool ARScanEntries(ARDirectoryStructure *directory, int fd, const OSUTF8Char *path, ARScanEntry **entries, OSCount *count, OSCount *capacity)
+{
+    unsigned int mask = STATX_TYPE | STATX_SIZE;
+    ssize_t size;
+
+    if (directory->detectHoles) mask |= STATX_BLOCKS;
+    if (directory->identifyFiles) mask |= STATX_MTIME | STATX_INO;
+
+    if (!directory->scanBuffer && !(directory->scanBuffer = malloc(kARScanBufferSize)))
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    while ((size = getdents64(fd, directory->scanBuffer, kARScanBufferSize)) > 0)
+    {
+        for (ssize_t offset = 0; offset < size; )
+        {
+            struct dirent64 *dirent = (struct dirent64 *)(directory->scanBuffer + offset);
+            offset += dirent->d_reclen;
+
+            if (!strcmp(dirent->d_name, ".DS_Store")) continue;
+            if (!strcmp(dirent->d_name, "..")) continue;
+            if (!strcmp(dirent->d_name, ".")) continue;
+
+            if (directory->filter && !ARScanIncludes(directory, fd, path, dirent->d_name, dirent->d_type))
+                continue;
+
+            if (!ARAddScanEntry(entries, count, capacity, dirent->d_name))
+                return false;
+
+            struct stat *stats = &(*entries)[*count - 1].stats;
+            struct statx extended;
+
+            if (dirent->d_type == DT_DIR || (dirent->d_type == DT_LNK && !directory->identifyFiles))
+            {
+                stats->st_mode = (dirent->d_type == DT_DIR) ? S_IFDIR : S_IFLNK;
+                continue;
+            }
+
+            if (statx(fd, dirent->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &extended))
+            {
+                fprintf(stderr, "Error: Permission denied at path '%s/%s'!\n", path, dirent->d_name);
+                return false;
+            }
+
+            stats->st_mode = extended.stx_mode;
+            stats->st_size = extended.stx_size;
+            stats->st_blocks = extended.stx_blocks;
+            stats->st_ino = extended.stx_ino;
+            stats->st_dev = makedev(extended.stx_dev_major, extended.stx_dev_minor);
+            stats->st_mtim.tv_sec = extended.stx_mtime.tv_sec;
+            stats->st_mtim.tv_nsec = extended.stx_mtime.tv_nsec;
+        }
+    }
+
+    if (size == -1)
+    {
+        fprintf(stderr, "Error: Could not read directory '%s'!\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+#else /* !defined(__linux__) */
+
+static bool ARScanEntries(ARDirectoryStructure *directory, int fd, const OSUTF8Char *path, ARScanEntry **entries, OSCount *count, OSCount *capacity)
+{
+    DIR *dir = fdopendir(dup(fd));
+    struct dirent *dirent;
+
+    if (!dir)
+    {
+        fprintf(stderr, "Error: Could not read directory '%s'!\n", path);
+        return false;
+    }
+
+    while ((dirent = readdir(dir)))
+    {
+        if (!strncmp(dirent->d_name, ".DS_Store", dirent->d_namlen)) continue;
+        if (!strncmp(dirent->d_name, "..", dirent->d_namlen)) continue;
+        if (!strncmp(dirent->d_name, ".", dirent->d_namlen)) continue;
+
+        if (directory->filter && !ARScanIncludes(directory, fd, path, (const char *)dirent->d_name, dirent->d_type))
+            continue;
+
+        if (!ARAddScanEntry(entries, count, capacity, dirent->d_name))
+        {
+            closedir(dir);
+            return false;
+        }
+
+        if (fstatat(fd, dirent->d_name, &(*entries)[*count - 1].stats, AT_SYMLINK_NOFOLLOW))
+        {
+            fprintf(stderr, "Error: Permission denied at path '%s/%s'!\n", path, dirent->d_name);
+            closedir(dir);
+
+            return false;
+        }
+    }
+
+    closedir(dir);
+    return true;
+}
+
+#endif /* defined(__linux__) */
+
+// Find the data extents of the file `entry` in the directory `fd` (at
+// `path`) with SEEK_DATA and SEEK_HOLE. Files which turn out not to have
+// any holes are stored normally.
+static bool ARFindFileExtents(int fd, const OSUTF8Char *path, ARScanEntry *entry)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    int file = openat(fd, entry->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    UInt64 fileSize = entry->stats.st_size;
+    OSCount capacity = 0;
+    UInt64 storedSize = 0;
+    off_t offset = 0;
+
+    if (file == -1)
+    {
+        fprintf(stderr, "Error: Could not open file '%s/%s'!\n", path, entry->name);
+        return false;
+    }
+
+    while (offset < fileSize)
+    {
+        off_t start = lseek(file, offset, SEEK_DATA);
+        off_t end = (start == -1) ? -1 : lseek(file, start, SEEK_HOLE);
+
+        // Only holes are left
+        if (start == -1 && errno == ENXIO)
+            break;
+
+        if (end == -1)
+        {
+            fprintf(stderr, "Error: Could not find the data extents of file '%s/%s'!\n", path, entry->name);
+            close(file);
+
+            return false;
+        }
+
+        if (end > fileSize) end = fileSize;
+
+        if (entry->extentCount == capacity)
+        {
+            capacity = capacity ? (capacity * 2) : 8;
+            ARSparseExtent *extents = realloc(entry->extents, capacity * sizeof(ARSparseExtent));
+
+            if (!extents)
+            {
+                fprintf(stderr, "Error: Out of memory!\n");
+                close(file);
+
+                return false;
+            }
+
+            entry->extents = extents;
+        }
+
+        entry->extents[entry->extentCount].offset = start;
+        entry->extents[entry->extentCount].size = end - start;
+        entry->extentCount++;
+
+        storedSize += end - start;
+        offset = end;
+    }
+
+    close(file);
+
+    if (storedSize == fileSize)
+    {
+        free(entry->extents);
+        entry->extents = kOSNullPointer;
+        entry->extentCount = 0;
+
+        return true;
+    }
+
+    entry->storedSize = storedSize;
+#endif /* defined(SEEK_DATA) && defined(SEEK_HOLE) */
+
+    return true;
+}
+
+// Read the link lengths and file extents the build needs while the
+// directory `fd` is still open, so they are looked up by name rather
+// than by walking the full path again
+static bool ARScanDetails(ARDirectoryStructure *directory, int fd, const OSUTF8Char *path, ARScanEntry *entries, OSCount count)
+{
+    for (OSIndex i = 0; i < count; i++)
+    {
+        struct stat *stats = &entries[i].stats;
+
+        if (S_ISLNK(stats->st_mode)) {
+            char link[PATH_MAX + 1];
+            ssize_t length = readlinkat(fd, entries[i].name, link, PATH_MAX + 1);
+
+            if (length == -1)
+            {
+                fprintf(stderr, "Error: Couldn't read the contents of the symlink at '%s/%s'!\n", path, entries[i].name);
+                return false;
+            }
+
+            stats->st_size = length;
+        } else if (S_ISREG(stats->st_mode)) {
+            // Only files with fewer blocks than their size can have holes
+            if (directory->detectHoles && (stats->st_blocks * 512) < stats->st_size && !ARFindFileExtents(fd, path, &entries[i]))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Read and stat everything in the directory `fd` (at `path`), then close
+// it. With `sorted` the entries come back in byte order, otherwise in
+// whatever order the filesystem returns them.
+static ARScanEntry *ARScanDirectory(ARDirectoryStructure *directory, int fd, const OSUTF8Char *path, bool sorted, OSCount *count)
+{
+    OSCount capacity = 16;
+    ARScanEntry *entries = malloc(capacity * sizeof(ARScanEntry));
+
+    *count = 0;
+
+    if (!entries)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        close(fd);
+
+        return kOSNullPointer;
+    }
+
+    bool success = ARScanEntries(directory, fd, path, &entries, count, &capacity) && ARScanDetails(directory, fd, path, entries, *count);
+    close(fd);
+
+    if (!success)
+    {
+        ARFreeScanEntries(entries, *count);
+        return kOSNullPointer;
+    }
+
+    if (sorted)
+        qsort(entries, *count, sizeof(ARScanEntry), ARCompareScanEntries);
+
+    return entries;
+}
+
+static bool AREnumerateDirectory(ARDirectoryStructure *directory, bool system, bool sorted, bool verbose)
 {
-    DIR *dir = opendir((const char *)directory->tail->path);
+    int fd = open((const char *)directory->tail->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
     ARDirectoryEntry *iteration = directory->tail;
     ARDirectoryEntry *lastEntry = kOSNullPointer;
-    struct dirent *entry;
+    OSCount nameCount;
     char type;
 
-    if (!dir)
+    // Failing to open a directory (rather than a separate access check) is
+    // what finds unreadable ones; unreadable files fail when they're read
+    if (fd == -1)
     {
         fprintf(stderr, "Error: Unknown directory read or access error for directory '%s'!\n", directory->tail->path);
 
@@ -339,15 +814,17 @@ static bool AREnumerateDirectory(ARDirectoryStructure *directory, bool system, b
         }
     }
 
-    while ((entry = readdir(dir)))
-    {
-        if (!strncmp(entry->d_name, ".DS_Store", entry->d_namlen)) continue;
-        if (!strncmp(entry->d_name, "..", entry->d_namlen)) continue;
-        if (!strncmp(entry->d_name, ".", entry->d_namlen)) continue;
+    // Entries are read (and stat'd) up front so only one directory is open at a time
+    ARScanEntry *names = ARScanDirectory(directory, fd, iteration->path, sorted, &nameCount);
 
-        OSUTF8Char *entryPath; asprintf((char **)&entryPath, "%s/%s", iteration->path, entry->d_name);
+    if (!names)
+        return false;
+
+    for (OSIndex i = 0; i < nameCount; i++)
+    {
+        OSUTF8Char *entryPath; asprintf((char **)&entryPath, "%s/%s", iteration->path, names[i].name);
         ARDirectoryEntry *entryData = malloc(sizeof(ARDirectoryEntry));
-        struct stat stats;
+        struct stat stats = names[i].stats;
 
         if (!entryPath || !entryData)
         {
@@ -355,9 +832,13 @@ static bool AREnumerateDirectory(ARDirectoryStructure *directory, bool system, b
             if (entryData) free(entryData);
 
             fprintf(stderr, "Error: Out of memory!\n");
+            ARFreeScanEntries(names, nameCount);
+
             return false;
         }
 
+        memset(entryData, 0, sizeof(ARDirectoryEntry));
+
         entryData->previous = directory->tail;
         directory->tail->next = entryData;
         entryData->next = kOSNullPointer;
@@ -365,58 +846,50 @@ static bool AREnumerateDirectory(ARDirectoryStructure *directory, bool system, b
         entryData->path = entryPath;
         directory->entryCount++;
 
-        if (lstat((char *)entryData->path, &stats))
-        {
-            fprintf(stderr, "Error: Permission denied at path '%s'!\n", entryPath);
-            return false;
-        }
+        entryData->modificationTime = ARStatModificationTime(stats);
+        entryData->inode = stats.st_ino;
+        entryData->device = stats.st_dev;
 
         if (S_ISLNK(stats.st_mode)) {
-            OSUTF8Char link[PATH_MAX + 1];
-            ssize_t length;
-
-            if ((length = readlink((char *)entryPath, (char *)link, PATH_MAX + 1)) == -1)
-            {
-                fprintf(stderr, "Error: Couldn't read the contents of the symlink at '%s'!\n", entryPath);
-                return false;
-            }
-
             entryData->type = kCAEntryTypeLink;
-            entryData->size = length;
+            entryData->size = stats.st_size;
             type = 'L';
         } else if (S_ISDIR(stats.st_mode)) {
             entryData->type = kCAEntryTypeDirectory;
             entryData->size = 0;
 
-            if (access((char *)entryData->path, R_OK | X_OK))
-            {
-                fprintf(stderr, "Error: Can't access directory '%s'!\n", entryPath);
-                return false;
-            }
-
             type = 'D';
         } else if (S_ISREG(stats.st_mode)) {
             entryData->type = kCAEntryTypeFile;
             entryData->size = stats.st_size;
 
-            if (access((char *)entryData->path, R_OK))
+            if (names[i].extents)
             {
-                fprintf(stderr, "Error: Can't access file '%s'!\n", entryPath);
-                return false;
+                entryData->sparse = true;
+                entryData->fileSize = stats.st_size;
+                entryData->size = names[i].storedSize;
+                entryData->extents = names[i].extents;
+                entryData->extentCount = names[i].extentCount;
+                names[i].extents = kOSNullPointer;
+
+                directory->sparseCount++;
+                directory->extentCount += entryData->extentCount;
             }
 
-            type = 'F';
+            type = entryData->sparse ? 'H' : 'F';
         } else {
             directory->tail->next = kOSNullPointer;
             directory->entryCount--;
 
+            if (verbose) ARLog("S %s\n", entryPath);
+
             free(entryData);
             free(entryPath);
 
-            type = 'S';
+            continue;
         }
 
-        if (verbose) fprintf(stdout, "%c %s\n", type, entryPath);
+        if (verbose) ARLog("%c %s\n", type, entryPath);
 
         if (system)
         {
@@ -440,468 +913,3224 @@ static bool AREnumerateDirectory(ARDirectoryStructure *directory, bool system, b
             lastEntry = entryData;
         }
 
-        if (type != 'S')
+        directory->fullSize += entryData->size;
+        directory->tail = entryData;
+
+        if (type == 'D' && !AREnumerateDirectory(directory, system, sorted, verbose))
         {
-            directory->fullSize += entryData->size;
-            directory->tail = entryData;
+            ARFreeScanEntries(names, nameCount);
+            return false;
         }
-
-        if (type == 'D')
-            if (!AREnumerateDirectory(directory, system, verbose)) return false;
     }
 
-    closedir(dir);
+    ARFreeScanEntries(names, nameCount);
     return true;
 }
 
-#pragma mark - Create Functions II
+#pragma mark - Existing Archives
 
-static OSOffset ARCreateWriteToCAndEntries(ARSubtype subtype, ARDirectoryStructure *directory, int fd, OSOffset tocOffset, bool verbose)
+static void ARDirectoryEntryFree(ARDirectoryEntry *entry)
 {
-    const OSSize directoryEntrySize = sizeof(CAEntryS2) - (2 * sizeof(UInt64));
-    ARDirectoryEntry *entry = directory->head;
-    OSOffset entryOffset = 0;
-    OSOffset dataOffset = 0;
-    CAEntryS2 fileEntry;
+    free(entry->linkTarget);
+    free(entry->extents);
+    free(entry->path);
+    free(entry);
+}
 
-    memset(&fileEntry, 0, sizeof(CAEntryS2));
+// Canonical order (see ARArchiveComparePaths)
+static int ARCompareEntryPaths(const void *a, const void *b)
+{
+    return ARArchiveComparePaths((*(ARDirectoryEntry **)a)->path, (*(ARDirectoryEntry **)b)->path);
+}
 
-    while (entry)
+// Read `size` bytes at `offset` in the source of repacked or imported entries
+static bool ARSourceReadData(ARDirectoryStructure *directory, UInt64 offset, OSSize size, void *buffer)
+{
+    if (directory->source)
+        return ARArchiveReadData(directory->source, offset, size, buffer);
+
+    while (size)
     {
-        if (!ARCreateWriteToCEntry(fd, tocOffset, entryOffset))
-        {
-            ARDirectoryStructureFree(directory);
-            ARCreateCloseArchive(fd);
+        ssize_t length = pread(directory->sourceFd, buffer, size, directory->sourceBase + offset);
 
-            return -1;
+        if (length <= 0)
+        {
+            fprintf(stderr, "Error: Could not read from the source!\n");
+            return false;
         }
 
-        tocOffset += sizeof(UInt64);
-        fileEntry.type = entry->type;
-
-        switch (fileEntry.type)
-        {
-            case kCAEntryTypeDirectory: {
-                fileEntry.dataOffset = 0;
-                fileEntry.dataSize = 0;
-            } break;
-            case kCAEntryTypeLink:
-            case kCAEntryTypeFile: {
-                fileEntry.dataOffset = dataOffset;
-                fileEntry.dataSize = entry->size;
-
-                dataOffset += entry->size;
-            } break;
-        }
+        buffer += length;
+        offset += length;
+        size -= length;
+    }
 
-        if (subtype != kARSubtype1 && fileEntry.type == kCAEntryTypeDirectory) {
-            if (write(fd, &fileEntry, directoryEntrySize) != directoryEntrySize)
-            {
-                ARDirectoryStructureFree(directory);
-                ARCreateCloseArchive(fd);
+    return true;
+}
 
-                return -1;
-            }
+// Make a directory entry for the archive entry at ToC position `index`
+static ARDirectoryEntry *ARDirectoryEntryCreateFromArchive(ARArchive *archive, OSIndex index, const OSUTF8Char *rootDirectory)
+{
+    ARDirectoryEntry *entry = malloc(sizeof(ARDirectoryEntry));
+    const ARSparseExtent *extents;
+    ARArchiveEntry archiveEntry;
 
-            entryOffset += directoryEntrySize;
-        } else {
-            if (!ARCreateWriteEntryStandard(fd, &fileEntry))
-            {
-                ARDirectoryStructureFree(directory);
-                ARCreateCloseArchive(fd);
+    if (!entry)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
 
-                return -1;
-            }
+    memset(entry, 0, sizeof(ARDirectoryEntry));
 
-            entryOffset += sizeof(CAEntryS2);
-        }
+    if (!ARArchiveGetEntry(archive, index, &archiveEntry))
+    {
+        free(entry);
+        return kOSNullPointer;
+    }
 
-        OSUTF8Char *path = entry->path + directory->nameSkip;
-        entryOffset = ARCreateWriteAlignedPath(fd, path, entryOffset);
+    if (archiveEntry.type == kCAEntryTypeMeta)
+    {
+        fprintf(stderr, "Error: Can't carry over meta entry '%s'!\n", archiveEntry.path);
+        free(entry);
 
-        if (entryOffset == -1)
-        {
-            ARDirectoryStructureFree(directory);
-            ARCreateCloseArchive(fd);
+        return kOSNullPointer;
+    }
 
-            return -1;
-        }
+    if (asprintf((char **)&entry->path, "%s%s", rootDirectory, archiveEntry.path) == -1)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        free(entry);
 
-        if (verbose) fprintf(stdout, "E %s\n", path);
-        entry = entry->next;
+        return kOSNullPointer;
     }
 
-    return entryOffset;
-}
+    entry->type = archiveEntry.type;
+    entry->size = archiveEntry.dataSize;
+    entry->dataOffset = archiveEntry.dataOffset;
+    entry->sourceOffset = archiveEntry.dataOffset;
+    entry->existing = true;
 
-static OSOffset ARCreateWriteToCAndEntriesSystemImage(ARSubtype subtype, ARDirectoryStructure *directory, int fd, OSOffset tocOffset, bool verbose)
-{
-    ARDirectoryEntry *entry = directory->head;
-    OSOffset entryOffset = 0;
-    OSOffset dataOffset = 0;
+    ARArchiveGetEntryChecksum(archive, index, &entry->checksum);
 
-    while (entry)
+    if (ARArchiveGetSparseExtents(archive, index, &entry->fileSize, &extents, &entry->extentCount))
     {
-        if (!ARCreateWriteToCEntry(fd, tocOffset, entryOffset))
-        {
-            ARDirectoryStructureFree(directory);
-            ARCreateCloseArchive(fd);
-
-            return -1;
-        }
+        entry->extents = malloc((entry->extentCount ? entry->extentCount : 1) * sizeof(ARSparseExtent));
+        entry->sparse = true;
 
-        tocOffset += sizeof(UInt64);
-
-        switch (entry->type)
+        if (!entry->extents)
         {
-            case kCAEntryTypeDirectory: {
-                CASystemDirectoryEntry archiveEntry;
-
-                archiveEntry.type = kCAEntryTypeDirectory;
-                archiveEntry.specialFlags = 0xDD;
-
-                if (entry->parent) archiveEntry.parentEntry = entry->parent->entryID;
-                else               archiveEntry.parentEntry = 0;
-
-                if (entry->nextEntry) archiveEntry.nextEntry = entry->nextEntry->entryID;
-                else                  archiveEntry.nextEntry = 0;
-
-                if (archiveEntry.firstEntry) archiveEntry.firstEntry = entry->firstChild->entryID;
-                else                         archiveEntry.firstEntry = 0;
-
-                archiveEntry.entryCount = entry->children;
+            fprintf(stderr, "Error: Out of memory!\n");
+            ARDirectoryEntryFree(entry);
 
-                if (write(fd, &archiveEntry, sizeof(CASystemDirectoryEntry)) != sizeof(CASystemDirectoryEntry))
-                {
-                    fprintf(stderr, "Error: Could not write directory entry!\n");
+            return kOSNullPointer;
+        }
 
-                    ARDirectoryStructureFree(directory);
-                    ARCreateCloseArchive(fd);
+        memcpy(entry->extents, extents, entry->extentCount * sizeof(ARSparseExtent));
+    }
 
-                    return -1;
-                }
+    return entry;
+}
 
-                entryOffset += sizeof(CASystemDirectoryEntry);
-            } break;
-            case kCAEntryTypeLink:
-            case kCAEntryTypeFile: {
-                CASystemFileEntry archiveEntry;
+// Append `entry` to the directory structure
+static void ARDirectoryStructureAdd(ARDirectoryStructure *directory, ARDirectoryEntry *entry)
+{
+    entry->previous = directory->tail;
+    entry->entryID = directory->entryCount++;
+    directory->tail->next = entry;
+    directory->tail = entry;
 
-                archiveEntry.type = entry->type;
-                archiveEntry.specialFlags = 0xFF;
+    directory->fullSize += entry->size;
 
-                if (entry->parent) archiveEntry.parentEntry = entry->parent->entryID;
-                else               archiveEntry.parentEntry = 0;
+    if (entry->sparse)
+    {
+        directory->sparseCount++;
+        directory->extentCount += entry->extentCount;
+    }
+}
 
-                if (entry->nextEntry) archiveEntry.nextEntry = entry->nextEntry->entryID;
-                else                  archiveEntry.nextEntry = 0;
+static int ARRepackCompareData(const void *a, const void *b)
+{
+    const ARDirectoryEntry *x = *(ARDirectoryEntry **)a, *y = *(ARDirectoryEntry **)b;
 
-                archiveEntry.dataOffset = dataOffset;
-                archiveEntry.dataSize = entry->size;
+    if (x->sourceOffset != y->sourceOffset) return (x->sourceOffset < y->sourceOffset) ? -1 : 1;
+    if (x->size != y->size) return (x->size < y->size) ? -1 : 1;
 
-                if (write(fd, &archiveEntry, sizeof(CASystemFileEntry)) != sizeof(CASystemFileEntry))
-                {
-                    fprintf(stderr, "Error: Could not write file entry!\n");
+    return (x->entryID < y->entryID) ? -1 : (x->entryID > y->entryID);
+}
 
-                    ARDirectoryStructureFree(directory);
-                    ARCreateCloseArchive(fd);
+// Entries which already share data in the source keep sharing it (this
+// is also how hardlinks in tar streams are stored). They look like
+// hardlinks to deduplication as well.
+static bool ARRepackShareData(ARDirectoryStructure *directory, ARDirectoryEntry **entries, OSCount count)
+{
+    ARDirectoryEntry **order = malloc((count ? count : 1) * sizeof(ARDirectoryEntry *));
+    OSCount dataCount = 0;
 
-                    return -1;
-                }
+    if (!order)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
 
-                entryOffset += sizeof(CASystemFileEntry);
-                dataOffset += entry->size;
-            } break;
-        }
+    for (OSIndex i = 0; i < count; i++)
+    {
+        entries[i]->device = 1;
+        entries[i]->inode = entries[i]->sourceOffset + 1;
 
-        OSUTF8Char *path = entry->path + directory->nameSkip;
-        entryOffset = ARCreateWriteAlignedPath(fd, path, entryOffset);
+        if ((entries[i]->type == kCAEntryTypeFile || entries[i]->type == kCAEntryTypeLink) && entries[i]->size && !entries[i]->sparse && !entries[i]->linkTarget)
+            order[dataCount++] = entries[i];
+    }
 
-        if (entryOffset == -1)
-        {
-            ARDirectoryStructureFree(directory);
-            ARCreateCloseArchive(fd);
+    qsort(order, dataCount, sizeof(ARDirectoryEntry *), ARRepackCompareData);
 
-            return -1;
-        }
+    for (OSIndex i = 1; i < dataCount; i++)
+    {
+        if (order[i]->sourceOffset != order[i - 1]->sourceOffset || order[i]->size != order[i - 1]->size)
+            continue;
 
-        if (verbose) fprintf(stdout, "E %s\n", path);
-        entry = entry->next;
+        order[i]->duplicate = order[i - 1]->duplicate ? order[i - 1]->duplicate : order[i - 1];
     }
 
-    return entryOffset;
+    free(order);
+    return true;
 }
 
-static bool CACreateWriteDataSection(ARDirectoryStructure *directory, void *file, OSSize archiveSize, OSOffset dataOffset, bool verbose)
+// Link each entry to its parent directory, which has to come before it
+static bool ARRepackLinkParents(ARDirectoryStructure *directory, ARDirectoryEntry **entries, OSCount count)
 {
-    ARDirectoryEntry *entry = directory->head;
+    ARDirectoryEntry **byPath = malloc((count ? count : 1) * sizeof(ARDirectoryEntry *));
+    ARDirectoryEntry **lastChild = calloc(count + 1, sizeof(ARDirectoryEntry *));
+    bool success = (byPath && lastChild);
 
-    while (entry)
+    if (!success)
+        fprintf(stderr, "Error: Out of memory!\n");
+
+    if (success)
     {
-        bool failed = false;
+        memcpy(byPath, entries, count * sizeof(ARDirectoryEntry *));
+        qsort(byPath, count, sizeof(ARDirectoryEntry *), ARCompareEntryPaths);
+    }
 
-        switch (entry->type)
-        {
-            case kCAEntryTypeLink: {
-                failed = !ARCreateWriteSymlink(file + dataOffset, entry->path, entry->size);
-            } break;
-            case kCAEntryTypeFile: {
-                failed = !ARCreateWriteFile(file + dataOffset, entry->path, entry->size);
-            } break;
+    for (OSIndex i = 0; success && i < count; i++)
+    {
+        ARDirectoryEntry *entry = entries[i];
+        const char *slash = strrchr((char *)entry->path, '/');
+        ARDirectoryEntry *parent = directory->head;
+
+        if (slash - (char *)entry->path > PATH_MAX) {
+            parent = kOSNullPointer;
+        } else if (slash != (char *)entry->path) {
+            ARDirectoryEntry key, *keyEntry = &key, **found;
+            OSSize length = slash - (char *)entry->path;
+            OSUTF8Char parentPath[PATH_MAX + 1];
+
+            memcpy(parentPath, entry->path, length);
+            parentPath[length] = 0;
+            key.path = parentPath;
+
+            found = bsearch(&keyEntry, byPath, count, sizeof(ARDirectoryEntry *), ARCompareEntryPaths);
+            parent = found ? *found : kOSNullPointer;
         }
 
-        if (failed)
+        if (!parent || parent->type != kCAEntryTypeDirectory || parent->entryID > entry->entryID)
         {
-            ARCreateUnmapArchive(file, archiveSize);
-            ARDirectoryStructureFree(directory);
+            fprintf(stderr, "Error: Entry '%s' does not follow its parent directory (repack with --canonical-order)!\n", entry->path);
+            success = false;
 
-            return false;
+            break;
         }
 
-        if (verbose && (entry->type != kCAEntryTypeDirectory))
-            fprintf(stdout, "W %s\n", entry->path);
-
-        dataOffset += entry->size;
-        entry = entry->next;
-    }
+        entry->parent = parent;
+        parent->children++;
 
-    return true;
-}
+        if (lastChild[parent->entryID]) lastChild[parent->entryID]->nextEntry = entry;
+        else parent->firstChild = entry;
 
-#pragma mark - Creation Functions
+        lastChild[parent->entryID] = entry;
+    }
 
-typedef struct {
-    void *address;
-    OSSize archiveSize;
+    free(lastChild);
+    free(byPath);
 
-    OSOffset entryOffset;
-    OSOffset dataOffset;
-} ARCreateInfo;
+    return success;
+}
 
-ARCreateInfo *ARCreateArchive(ARSubtype subtype, const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, OSOffset tocOffset, bool verbose)
+// Fill `directory` with the entries of the archive at `path` in place of a
+// source tree. The root entry is already there. Entries keep the archive's
+// order unless they are to be sorted, and their data is copied out of the
+// archive when the data section is written.
+static bool ARRepackLoadEntries(ARDirectoryStructure *directory, const OSUTF8Char *path, const OSUTF8Char *keyFile, bool system, bool sorted)
 {
-    if (!ARCreatePretest(rootDirectory, archive))
-        return kOSNullPointer;
+    ARArchive *source = ARArchiveOpenWithKey(path, keyFile);
+    ARArchiveEntry rootEntry;
 
-    ARDirectoryStructure *directory = ARDirectoryStructureCreate(rootDirectory);
-    if (!directory) return kOSNullPointer;
+    if (!source)
+        return false;
 
-    if (verbose) fprintf(stdout, "D /\n");
-    bool haveStructure = AREnumerateDirectory(directory, (subtype == kARSubtypeSystemImage), verbose);
-    directory->head->path[directory->nameSkip] = '/';
+    directory->source = source;
 
-    if (!haveStructure)
+    if (!source->cipher && ARArchiveIsEncrypted(source))
     {
-        ARDirectoryStructureFree(directory);
-        return kOSNullPointer;
+        fprintf(stderr, "Error: Archive '%s' is encrypted and no key was given!\n", path);
+        return false;
     }
 
-    int fd = ARCreateOpenArchive(archive);
-
-    if (fd == -1)
+    if (!source->entryCount || !ARArchiveGetEntry(source, 0, &rootEntry) || rootEntry.type != kCAEntryTypeDirectory || strcmp((char *)rootEntry.path, "/"))
     {
-        ARDirectoryStructureFree(directory);
-        return kOSNullPointer;
+        fprintf(stderr, "Error: Archive '%s' has no root directory entry!\n", path);
+        return false;
     }
 
-    OSOffset entryTableOffset = tocOffset + (sizeof(UInt64) * directory->entryCount);
-    if (subtype == kARSubtypeSystemImage) entryTableOffset = OSAlignUpward(entryTableOffset, kARBlockSize);
-    entryTableOffset += sizeof(UInt32); // Entry Table is offset by 4 bytes
+    OSCount count = source->entryCount - 1;
+    ARDirectoryEntry **entries = malloc((count ? count : 1) * sizeof(ARDirectoryEntry *));
+    bool success = !!entries;
 
-    if (!ARCreateSeekInArchive(fd, entryTableOffset))
+    if (!entries)
+        fprintf(stderr, "Error: Out of memory!\n");
+
+    for (OSIndex i = 0; success && i < count; i++)
     {
-        ARDirectoryStructureFree(directory);
-        ARCreateCloseArchive(fd);
+        if (!(entries[i] = ARDirectoryEntryCreateFromArchive(source, i + 1, (const OSUTF8Char *)"")))
+        {
+            for (OSIndex j = 0; j < i; j++)
+                ARDirectoryEntryFree(entries[j]);
 
-        return kOSNullPointer;
+            success = false;
+        }
     }
 
-    OSOffset finalEntryOffset;
-
-    if (subtype == kARSubtypeSystemImage) finalEntryOffset = ARCreateWriteToCAndEntriesSystemImage(subtype, directory, fd, tocOffset, verbose);
-    else finalEntryOffset = ARCreateWriteToCAndEntries(subtype, directory, fd, tocOffset, verbose);
+    if (!success)
+    {
+        free(entries);
+        return false;
+    }
 
-    if (finalEntryOffset == -1)
-        return kOSNullPointer;
+    if (sorted)
+        qsort(entries, count, sizeof(ARDirectoryEntry *), ARCompareEntryPaths);
 
-    OSOffset dataOffset = entryTableOffset + finalEntryOffset;
+    for (OSIndex i = 0; i < count; i++)
+        ARDirectoryStructureAdd(directory, entries[i]);
 
-    if (subtype == kARSubtypeSystemImage) dataOffset = OSAlignUpward(dataOffset, kARBlockSize);
-    else dataOffset = OSAlignUpward(dataOffset, 8);
+    directory->sourceChecksums = !!ARArchiveFindSection(source, kARSectionTypeEntryChecksums);
 
-    if (!ARCreateSeekInArchive(fd, dataOffset))
+#if defined(__linux__)
+    // Plain data can be copied file to file without passing through memory
+    if (!source->chunks && !source->cipher)
     {
-        ARDirectoryStructureFree(directory);
-        ARCreateCloseArchive(fd);
-        
-        return kOSNullPointer;
+        directory->sourceFd = open((char *)path, O_RDONLY);
+        directory->sourceBase = source->dataSection - (UInt8 *)source->address;
     }
+#endif /* defined(__linux__) */
 
-    OSSize archiveSize = dataOffset + directory->fullSize;
-    OSUTF8Char *file = ARCreateMapArchive(fd, archiveSize);
-    OSOffset dataSectionOffset = dataOffset;
+    success = ARRepackShareData(directory, entries, count);
 
-    if (file == MAP_FAILED)
-    {
-        ARDirectoryStructureFree(directory);
-        ARCreateCloseArchive(fd);
+    if (success && system)
+        success = ARRepackLinkParents(directory, entries, count);
 
-        return kOSNullPointer;
-    }
+    free(entries);
+    return success;
+}
 
-    if (!ARCreateCloseArchive(fd))
+// An encrypted archive is repacked with the same cipher (and key) unless
+// the new archive is given a cipher of its own or is explicitly decrypted
+static bool ARRepackKeepCipher(const OSUTF8Char *path, ARSubtype subtype, ARCreateDataModifiers *modifiers)
+{
+    ARArchive *archive = ARArchiveOpen(path);
+    if (!archive) return false;
+
+    ARSection *section = ARArchiveFindSection(archive, kARSectionTypeCipher);
+    bool success = true;
+
+    if (section && section->size >= sizeof(ARCipherInfo))
     {
-        ARCreateUnmapArchive(file, archiveSize);
-        ARDirectoryStructureFree(directory);
+        ARCipherInfo *cipherInfo = archive->address + section->offset;
 
-        return kOSNullPointer;
+        if (subtype == kARSubtype1) {
+            fprintf(stderr, "Error: Archive '%s' is encrypted and Subtype 1 archives can't be (use --decrypt to repack it without encryption)!\n", path);
+            success = false;
+        } else {
+            modifiers->encryptArchive = true;
+            modifiers->encryptionType = cipherInfo->encryptionType;
+        }
     }
 
-    if (!CACreateWriteDataSection(directory, file, archiveSize, dataOffset, verbose))
-        return kOSNullPointer;
+    return (ARArchiveClose(archive) && success);
+}
 
-    ARDirectoryStructureFree(directory);
-    ARCreateInfo *stats = malloc(sizeof(ARCreateInfo));
+#pragma mark - Tar Import
 
-    if (!stats)
-    {
-        fprintf(stderr, "Error: Out of memory!\n");
-        ARCreateUnmapArchive(file, archiveSize);
+// Largest pax header or GNU long name which is read into memory
+#define kARTarMaxHeaderData (1 << 20)
 
-        return false;
-    }
+// Buffer used to skip and copy out payloads
+#define kARTarBufferSize (1 << 20)
 
-    stats->archiveSize = archiveSize;
-    stats->address = file;
+// The stream being read. Payloads stay where they are in a seekable file;
+// anything else has them written to `output` as they go by. That is the
+// data section of the archive itself when it can take them in stream
+// order (`direct`), and otherwise an unlinked spill file, since the data
+// of those archives can't be written until every header is known.
+typedef struct {
+    int fd;
+    bool seekable;
+    UInt64 position;
+
+    int output;
+    UInt64 outputSize;
+    UInt8 *buffer;
+
+    // Direct output keeps the CRC32 of everything written to it and (with
+    // `checksums`) the CRC32C of each member
+    bool direct;
+    bool checksums;
+    UInt32 dataChecksum;
+} ARTarStream;
+
+// A member as it was found in the stream
+typedef struct {
+    ARDirectoryEntry *entry;
+    OSUTF8Char *hardlink;
+    OSIndex index;
+} ARTarMember;
 
-    stats->entryOffset = entryTableOffset;
-    stats->dataOffset = dataSectionOffset;
+static bool ARTarRead(ARTarStream *stream, void *buffer, OSSize size)
+{
+    while (size)
+    {
+        ssize_t length = read(stream->fd, buffer, size);
 
-    return stats;
+        if (length <= 0)
+            return false;
+
+        stream->position += length;
+        buffer += length;
+        size -= length;
+    }
+
+    return true;
 }
 
-bool ARCreateSubtype1(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose)
+static bool ARTarSkip(ARTarStream *stream, UInt64 size)
 {
-    ARCreateInfo *stats = ARCreateArchive(kARSubtype1, rootDirectory, archive, sizeof(CAHeaderS1), verbose);
-    if (!stats) return false;
+    if (stream->seekable)
+    {
+        if (lseek(stream->fd, size, SEEK_CUR) == -1)
+            return false;
 
-    CAHeaderS1 *header = stats->address;
-    memcpy(&header->magic, kCAHeaderMagic, 4);
-    memcpy(&header->version, kCAHeaderVersionS1, 4);
+        stream->position += size;
+        return true;
+    }
 
-    header->dataSectionOffset = stats->dataOffset;
-    header->entryTableOffset = stats->entryOffset;
+    while (size)
+    {
+        OSSize length = (size > kARTarBufferSize) ? kARTarBufferSize : size;
 
-    if (verbose) fprintf(stdout, "Generating checksums...\n");
-    header->dataChecksum = ARCRC32Process(stats->address + sizeof(CAHeaderS1), stats->archiveSize - sizeof(CAHeaderS1));
-    header->headerChecksum = ARCRC32Process(header, sizeof(CAHeaderS1) - (2 * sizeof(UInt32)));
+        if (!ARTarRead(stream, stream->buffer, length))
+            return false;
 
-    if (verbose) printf("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
-    bool failed = ARCreateUnmapArchive(stats->address, stats->archiveSize);
-    free(stats);
+        size -= length;
+    }
 
-    return !failed;
+    return true;
 }
 
-bool ARCreateSubtype2(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers)
+// Write to the end of the output, updating `checksum` (a CRC32C) along
+// with the data checksum when the output is the archive
+static bool ARTarWriteOutput(ARTarStream *stream, const void *buffer, OSSize size, UInt32 *checksum)
 {
-    ARCreateInfo *stats = ARCreateArchive(kARSubtype2, rootDirectory, archive, sizeof(CAHeaderS2) + sizeof(CADataModification), verbose);
-    if (!stats) return false;
+    if (stream->direct)
+        ARCRC32FusedUpdate(&stream->dataChecksum, stream->checksums ? checksum : kOSNullPointer, buffer, size);
 
-    CAHeaderS2 *header = stats->address;
-    memcpy(&header->magic, kCAHeaderMagic, 4);
-    memcpy(&header->version, kCAHeaderVersionS2, 4);
+    if (!ARWriteAll(stream->output, buffer, size))
+        return false;
 
-    header->tocOffset = sizeof(CAHeaderS2) + sizeof(CADataModification);
-    header->dataModification = sizeof(CAHeaderS2);
-    header->dataSectionOffset = stats->dataOffset;
-    header->entryTableOffset = stats->entryOffset;
+    stream->outputSize += size;
+    return true;
+}
 
-    if (verbose) fprintf(stdout, "Generating checksums...\n");
-    header->dataChecksum = ARCRC32Process(stats->address + sizeof(CAHeaderS2), stats->archiveSize - sizeof(CAHeaderS2));
+// Find a payload of `size` bytes a place in the source (or the archive) and
+// return its offset there. `checksum` is set to its CRC32C if it was
+// written straight into the archive with checksums.
+static bool ARTarKeepPayload(ARTarStream *stream, UInt64 size, UInt64 *offset, UInt32 *checksum)
+{
+    UInt32 checksumC = ARCRC32CInit();
 
-    header->headerChecksum = ARCRC32Init();
-    header->headerChecksum = ARCRC32Update(header->headerChecksum, header, sizeof(CAHeaderS2) - (3 * sizeof(UInt64)));
-    header->headerChecksum = ARCRC32Update(header->headerChecksum, header + (sizeof(CAHeaderS2) - (3 * sizeof(UInt64))), 2 * sizeof(UInt64));
-    header->headerChecksum = ARCRC32Finalize(header->headerChecksum);
+    if (stream->seekable)
+    {
+        *offset = stream->position;
+        return ARTarSkip(stream, size);
+    }
 
-    if (verbose) printf("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
-    bool failed = ARCreateUnmapArchive(stats->address, stats->archiveSize);
-    free(stats);
+    *offset = stream->outputSize;
 
-    return !failed;
-}
+#if defined(__linux__)
+    // Pipes can be moved into the spill file without passing through memory
+    while (size && !stream->direct)
+    {
+        ssize_t length = splice(stream->fd, kOSNullPointer, stream->output, kOSNullPointer, size, SPLICE_F_MOVE);
 
-bool ARCreateBootX(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers, UInt16 architecture, UInt32 bootID, const OSUTF8Char *kernelLoaderPath, const OSUTF8Char *kernelPath, const OSUTF8Char *bootConfigPath)
-{
-    ARCreateInfo *stats = ARCreateArchive(kARSubtype2, rootDirectory, archive, sizeof(CAHeaderS2) + sizeof(CADataModification), verbose);
-    if (!stats) return false;
+        if (length <= 0)
+            break;
 
-    CAHeaderBootX *header = stats->address;
-    memcpy(&header->magic, kCAHeaderMagic, 4);
-    memcpy(&header->version, kCAHeaderVersionBootX, 4);
+        stream->position += length;
+        stream->outputSize += length;
+        size -= length;
+    }
+#endif /* defined(__linux__) */
 
-    header->dataSectionOffset = stats->dataOffset;
-    header->entryTableOffset = stats->entryOffset;
+    while (size)
+    {
+        OSSize length = (size > kARTarBufferSize) ? kARTarBufferSize : size;
 
-    header->processorType = architecture;
-    header->bootID = bootID;
+        if (!ARTarRead(stream, stream->buffer, length) || !ARTarWriteOutput(stream, stream->buffer, length, &checksumC))
+            return false;
 
-    OSOffset *toc = stats->address + sizeof(CAHeaderBootX) + sizeof(CADataModification);
-    OSOffset *final = stats->address + header->entryTableOffset - sizeof(UInt32);
-    OSSize skip = strlen((char *)rootDirectory);
-    OSOffset *base = toc;
+        size -= length;
+    }
 
-    while (toc < final)
-    {
-        CAEntryS2 *entry = stats->address + header->entryTableOffset + (*toc);
+    *checksum = ARCRC32CFinalize(checksumC);
+    return true;
+}
 
-        if (entry->type == kCAEntryTypeFile)
-        {
-            if (!header->kernelLoaderEntry && !strcmp((char *)entry->path, (char *)(kernelLoaderPath + skip))) {
-                header->kernelLoaderEntry = toc - base;
+// Numeric fields are octal, or big endian base 256 when the top bit is set
+static bool ARTarParseNumber(const char *field, OSSize length, UInt64 *value)
+{
+    OSIndex i = 0;
+    *value = 0;
 
-                if (verbose) fprintf(stdout, "Kernel Loader Entry: %hu\n", header->kernelLoaderEntry);
-            } else if (!header->kernelEntry && !strcmp((char *)entry->path, (char *)(kernelPath + skip))) {
-                header->kernelEntry = toc - base;
+    if (field[0] & 0x80)
+    {
+        if (field[0] & 0x40)
+            return false;
 
-                if (verbose) fprintf(stdout, "Kernel Entry: %hu\n", header->kernelEntry);
-            } else if (!header->bootConfigEntry && !strcmp((char *)entry->path, (char *)(bootConfigPath + skip))) {
-                header->bootConfigEntry = toc - base;
+        *value = field[0] & 0x3F;
 
-                if (verbose) fprintf(stdout, "Boot Config Entry: %hu\n", header->bootConfigEntry);
-            }
+        for (i = 1; i < length; i++)
+        {
+            if (*value >> 56) return false;
+            *value = (*value << 8) | (UInt8)field[i];
         }
 
-        toc++;
+        return true;
     }
 
-    header->lockA = kCAHeaderBootXLockAValue;
-    header->lockB = kCAHeaderBootXLockBValue;
-
-    if (verbose) fprintf(stdout, "Generating checksums...\n");
-    header->dataChecksum = ARCRC32Process(stats->address + sizeof(CAHeaderBootX), stats->archiveSize - sizeof(CAHeaderBootX));
+    while (i < length && field[i] == ' ') i++;
 
-    header->headerChecksum = ARCRC32Init();
-    header->headerChecksum = ARCRC32Update(header->headerChecksum, header, sizeof(CAHeaderBootX) - (3 * sizeof(UInt64)));
-    header->headerChecksum = ARCRC32Update(header->headerChecksum, header + (sizeof(CAHeaderBootX) - (3 * sizeof(UInt64))), 2 * sizeof(UInt64));
-    header->headerChecksum = ARCRC32Finalize(header->headerChecksum);
-
-    if (verbose) printf("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
-    bool failed = ARCreateUnmapArchive(stats->address, stats->archiveSize);
-    free(stats);
+    for ( ; i < length && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        if (*value >> 61) return false;
+        *value = (*value << 3) | (field[i] - '0');
+    }
 
-    return !failed;
+    return (i == length || field[i] == ' ' || !field[i]);
 }
 
-bool ARCreateSystemImage(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers, CASystemVersionInternal *systemVersion, const OSUTF8Char *partitionInfoPath, const OSUTF8Char *bootArchivePath)
+static bool ARTarCheckHeader(const ARTarHeader *header)
 {
-    ARCreateInfo *stats = ARCreateArchive(kARSubtypeSystemImage, rootDirectory, archive, kARBlockSize * 2, verbose);
+    const UInt8 *bytes = (const UInt8 *)header;
+    UInt64 expected;
+    UInt64 sum = 0;
+
+    if (!ARTarParseNumber(header->checksum, sizeof(header->checksum), &expected))
+        return false;
+
+    for (OSIndex i = 0; i < kARTarBlockSize; i++)
+    {
+        bool inChecksum = (i >= offsetof(ARTarHeader, checksum) && i < offsetof(ARTarHeader, checksum) + sizeof(header->checksum));
+        sum += inChecksum ? ' ' : bytes[i];
+    }
+
+    return (sum == expected);
+}
+
+// Archive path for a member name: leading '/' and './' go, as do trailing
+// and repeated slashes. Names with '..' components are refused.
+static OSUTF8Char *ARTarArchivePath(const char *name)
+{
+    OSSize length = strlen(name);
+    OSUTF8Char *path = malloc(length + 2);
+    OSSize used = 0;
+
+    if (!path)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    while (*name)
+    {
+        const char *end = strchr(name, '/');
+        if (!end) end = name + strlen(name);
+
+        OSSize size = end - name;
+
+        if (size == 2 && name[0] == '.' && name[1] == '.')
+        {
+            fprintf(stderr, "Error: Refusing tar member with '..' in its name!\n");
+            free(path);
+
+            return kOSNullPointer;
+        }
+
+        if (size && !(size == 1 && name[0] == '.'))
+        {
+            path[used++] = '/';
+            memcpy(path + used, name, size);
+            used += size;
+        }
+
+        name = *end ? end + 1 : end;
+    }
+
+    if (!used) path[used++] = '/';
+    path[used] = 0;
+
+    return path;
+}
+
+// Pull the records pax extended headers can override out of `data`
+static bool ARTarParsePax(char *data, OSSize size, char **path, char **linkPath, UInt64 *payloadSize, bool *hasSize)
+{
+    char *end = data + size;
+
+    while (data < end)
+    {
+        char *space = memchr(data, ' ', end - data);
+        UInt64 length = strtoull(data, kOSNullPointer, 10);
+
+        if (!space || length <= (space - data) + 1 || length > end - data || data[length - 1] != '\n')
+            return false;
+
+        char *key = space + 1;
+        char *value = memchr(key, '=', (data + length) - key);
+        data[length - 1] = 0;
+
+        if (!value)
+            return false;
+
+        *value++ = 0;
+
+        if (!strcmp(key, "path")) {
+            *path = value;
+        } else if (!strcmp(key, "linkpath")) {
+            *linkPath = value;
+        } else if (!strcmp(key, "size")) {
+            *payloadSize = strtoull(value, kOSNullPointer, 10);
+            *hasSize = true;
+        } else if (!strncmp(key, "GNU.sparse.", 11)) {
+            fprintf(stderr, "Error: Sparse tar members aren't supported!\n");
+            return false;
+        }
+
+        data += length;
+    }
+
+    return true;
+}
+
+static void ARTarFreeMembers(ARTarMember *members, OSCount count)
+{
+    for (OSIndex i = 0; i < count; i++)
+    {
+        if (members[i].entry) ARDirectoryEntryFree(members[i].entry);
+        free(members[i].hardlink);
+    }
+
+    free(members);
+}
+
+static bool ARTarAddMember(ARTarMember **members, OSCount *count, OSCount *capacity, ARTarMember *member)
+{
+    if (*count == *capacity)
+    {
+        OSCount newCapacity = *capacity ? (*capacity * 2) : 256;
+        ARTarMember *newMembers = realloc(*members, newCapacity * sizeof(ARTarMember));
+
+        if (!newMembers)
+        {
+            fprintf(stderr, "Error: Out of memory!\n");
+            return false;
+        }
+
+        *members = newMembers;
+        *capacity = newCapacity;
+    }
+
+    member->index = *count;
+    (*members)[(*count)++] = *member;
+
+    return true;
+}
+
+// Read headers up to the end of the stream, keeping the payload of each
+// regular file in the source
+static bool ARTarReadMembers(ARTarStream *stream, ARTarMember **members, OSCount *count, bool verbose)
+{
+    char *longName = kOSNullPointer, *longLink = kOSNullPointer, *pax = kOSNullPointer;
+    char *paxPath = kOSNullPointer, *paxLink = kOSNullPointer;
+    UInt64 paxSize = 0;
+    bool hasPaxSize = false;
+    OSCount capacity = 0;
+    bool success = true;
+    ARTarHeader header;
+
+    for ( ; ; )
+    {
+        UInt64 headerOffset = stream->position;
+
+        if (!ARTarRead(stream, &header, sizeof(ARTarHeader)))
+        {
+            // A stream may stop without its end of archive blocks
+            if (stream->position != headerOffset)
+            {
+                fprintf(stderr, "Error: Tar stream ends in the middle of a header!\n");
+                success = false;
+            }
+
+            break;
+        }
+
+        const UInt8 *bytes = (const UInt8 *)&header;
+        OSIndex zero = 0;
+
+        while (zero < kARTarBlockSize && !bytes[zero]) zero++;
+        if (zero == kARTarBlockSize) break;
+
+        UInt64 size;
+
+        if (!ARTarCheckHeader(&header) || !ARTarParseNumber(header.size, sizeof(header.size), &size))
+        {
+            fprintf(stderr, "Error: Invalid tar header at offset %lu!\n", headerOffset);
+            success = false;
+
+            break;
+        }
+
+        if (hasPaxSize) size = paxSize;
+        UInt64 padding = OSAlignUpward(size, kARTarBlockSize) - size;
+
+        // Headers which describe the next member
+        if (header.type == 'x' || header.type == 'L' || header.type == 'K')
+        {
+            char *data = (size < kARTarMaxHeaderData) ? malloc(size + 1) : kOSNullPointer;
+
+            if (!data || !ARTarRead(stream, data, size) || !ARTarSkip(stream, padding))
+            {
+                fprintf(stderr, "Error: Could not read tar header data at offset %lu!\n", headerOffset);
+                free(data);
+                success = false;
+
+                break;
+            }
+
+            data[size] = 0;
+
+            if (header.type == 'x') {
+                free(pax);
+                pax = data;
+
+                if (!ARTarParsePax(pax, size, &paxPath, &paxLink, &paxSize, &hasPaxSize))
+                {
+                    fprintf(stderr, "Error: Invalid pax header at offset %lu!\n", headerOffset);
+                    success = false;
+
+                    break;
+                }
+            } else if (header.type == 'L') {
+                free(longName);
+                longName = data;
+            } else {
+                free(longLink);
+                longLink = data;
+            }
+
+            continue;
+        }
+
+        char name[sizeof(header.prefix) + sizeof(header.name) + 2];
+        char link[sizeof(header.linkName) + 1];
+
+        if (!memcmp(header.magic, "ustar", 5) && header.prefix[0]) {
+            snprintf(name, sizeof(name), "%.*s/%.*s", (int)sizeof(header.prefix), header.prefix, (int)sizeof(header.name), header.name);
+        } else {
+            snprintf(name, sizeof(name), "%.*s", (int)sizeof(header.name), header.name);
+        }
+
+        snprintf(link, sizeof(link), "%.*s", (int)sizeof(header.linkName), header.linkName);
+
+        const char *memberName = paxPath ? paxPath : (longName ? longName : name);
+        const char *memberLink = paxLink ? paxLink : (longLink ? longLink : link);
+        ARDirectoryEntry *entry = kOSNullPointer;
+        ARTarMember member;
+
+        memset(&member, 0, sizeof(ARTarMember));
+
+        switch (header.type)
+        {
+            case 'g': {
+                success = ARTarSkip(stream, size + padding);
+            } break;
+            case 'S': {
+                fprintf(stderr, "Error: Sparse tar members aren't supported!\n");
+                success = false;
+            } break;
+            case '0': case '\0': case '7':
+            case '1': case '2': case '5': {
+                if (!(entry = malloc(sizeof(ARDirectoryEntry))))
+                {
+                    fprintf(stderr, "Error: Out of memory!\n");
+                    success = false;
+
+                    break;
+                }
+
+                memset(entry, 0, sizeof(ARDirectoryEntry));
+                member.entry = entry;
+
+                if (!(entry->path = ARTarArchivePath(memberName)))
+                {
+                    free(entry);
+                    success = false;
+
+                    break;
+                }
+
+                entry->existing = true;
+
+                if (header.type == '5') {
+                    entry->type = kCAEntryTypeDirectory;
+                    success = ARTarSkip(stream, size + padding);
+                } else if (header.type == '2') {
+                    UInt32 checksum = ARCRC32CInit();
+
+                    entry->type = kCAEntryTypeLink;
+                    entry->size = strlen(memberLink);
+
+                    // Link targets go in with the payloads when those are written into the archive
+                    if (stream->direct) {
+                        entry->sourceOffset = stream->outputSize;
+                        success = ARTarWriteOutput(stream, memberLink, entry->size, &checksum);
+                        entry->checksum = ARCRC32CFinalize(checksum);
+                    } else {
+                        success = !!(entry->linkTarget = (OSUTF8Char *)strdup(memberLink));
+                    }
+
+                    success = success && ARTarSkip(stream, size + padding);
+                } else if (header.type == '1') {
+                    entry->type = kCAEntryTypeFile;
+                    member.hardlink = ARTarArchivePath(memberLink);
+
+                    success = !!member.hardlink && ARTarSkip(stream, size + padding);
+                } else {
+                    entry->type = kCAEntryTypeFile;
+                    entry->size = size;
+
+                    success = ARTarKeepPayload(stream, size, &entry->sourceOffset, &entry->checksum) && ARTarSkip(stream, padding);
+                }
+
+                if (success)
+                    success = ARTarAddMember(members, count, &capacity, &member);
+
+                if (!success)
+                {
+                    fprintf(stderr, "Error: Could not read tar member '%s'!\n", memberName);
+                    ARDirectoryEntryFree(entry);
+                    free(member.hardlink);
+                }
+            } break;
+            default: {
+                if (verbose) ARLog("S %s\n", memberName);
+                success = ARTarSkip(stream, size + padding);
+            } break;
+        }
+
+        if (!success)
+            break;
+
+        free(longName);
+        free(longLink);
+        free(pax);
+
+        longName = longLink = pax = paxPath = paxLink = kOSNullPointer;
+        hasPaxSize = false;
+    }
+
+    free(longName);
+    free(longLink);
+    free(pax);
+
+    return success;
+}
+
+static int ARTarCompareMembers(const void *a, const void *b)
+{
+    const ARTarMember *x = a, *y = b;
+    int order = ARArchiveComparePaths(x->entry->path, y->entry->path);
+
+    if (order) return order;
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+static ARTarMember *ARTarFindMember(ARTarMember *members, OSCount count, const OSUTF8Char *path)
+{
+    OSIndex low = 0, high = count;
+
+    while (low < high)
+    {
+        OSIndex middle = low + ((high - low) / 2);
+        int order = ARArchiveComparePaths(members[middle].entry->path, path);
+
+        if (!order) return &members[middle];
+
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+
+    return kOSNullPointer;
+}
+
+// Whether `path` is somewhere below `directory`
+static bool ARTarIsInside(const OSUTF8Char *directory, const OSUTF8Char *path)
+{
+    OSSize length = strlen((char *)directory);
+
+    return (!strncmp((char *)directory, (char *)path, length) && path[length] == '/');
+}
+
+// Drop members replaced by later ones with the same path (as extracting
+// the tar would) and point hardlinks at the data of their targets
+static bool ARTarResolveMembers(ARTarMember *members, OSCount *count)
+{
+    OSCount unique = 0;
+    bool success = true;
+
+    qsort(members, *count, sizeof(ARTarMember), ARTarCompareMembers);
+
+    for (OSIndex i = 0; i < *count; i++)
+    {
+        ARDirectoryEntry *entry = members[i].entry;
+        bool replaced = (i + 1 < *count && !strcmp((char *)entry->path, (char *)members[i + 1].entry->path));
+        bool root = !strcmp((char *)entry->path, "/");
+
+        if (root && entry->type != kCAEntryTypeDirectory)
+        {
+            fprintf(stderr, "Error: Tar member for the root directory isn't a directory!\n");
+            success = false;
+        }
+
+        if (replaced || root) {
+            ARDirectoryEntryFree(entry);
+            free(members[i].hardlink);
+        } else {
+            members[unique++] = members[i];
+        }
+    }
+
+    *count = unique;
+
+    for (OSIndex i = 0; success && i < unique; i++)
+    {
+        ARTarMember *target = &members[i];
+
+        if (!target->hardlink)
+            continue;
+
+        for (OSIndex depth = 0; target && target->hardlink && depth < 16; depth++)
+            target = ARTarFindMember(members, unique, target->hardlink);
+
+        if (!target || target->hardlink || target->entry->type != kCAEntryTypeFile)
+        {
+            fprintf(stderr, "Error: Hardlink '%s' doesn't lead to a file in the tar stream!\n", members[i].entry->path);
+            return false;
+        }
+
+        members[i].entry->size = target->entry->size;
+        members[i].entry->sourceOffset = target->entry->sourceOffset;
+        members[i].entry->checksum = target->entry->checksum;
+    }
+
+    for (OSIndex i = 0; i < unique; i++)
+    {
+        free(members[i].hardlink);
+        members[i].hardlink = kOSNullPointer;
+    }
+
+    return success;
+}
+
+// Add the (sorted) members to `directory`, making up any directories the
+// stream leaves out. Canonical order puts everything inside a directory
+// right after it, so a stack of the directories around the current
+// member is all it takes to find which are missing.
+static bool ARTarBuildStructure(ARDirectoryStructure *directory, ARTarMember *members, OSCount count, bool verbose)
+{
+    ARDirectoryEntry *previous = directory->head;
+    OSCount maxDepth = 1;
+    OSCount depth = 1;
+
+    for (OSIndex i = 0; i < count; i++)
+    {
+        OSCount components = 0;
+
+        for (const OSUTF8Char *c = members[i].entry->path; *c; c++)
+            components += (*c == '/');
+
+        if (components + 1 > maxDepth) maxDepth = components + 1;
+    }
+
+    ARDirectoryEntry **stack = malloc(maxDepth * sizeof(ARDirectoryEntry *));
+
+    if (!stack)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    stack[0] = directory->head;
+
+    for (OSIndex i = 0; i < count; i++)
+    {
+        ARDirectoryEntry *entry = members[i].entry;
+
+        if (previous->type != kCAEntryTypeDirectory && ARTarIsInside(previous->path, entry->path))
+        {
+            fprintf(stderr, "Error: Tar member '%s' is inside '%s', which isn't a directory!\n", entry->path, previous->path);
+            free(stack);
+
+            return false;
+        }
+
+        while (!ARTarIsInside(stack[depth - 1]->path, entry->path))
+            depth--;
+
+        const OSUTF8Char *slash;
+        OSSize start = strlen((char *)stack[depth - 1]->path);
+
+        while ((slash = (const OSUTF8Char *)strchr((char *)entry->path + start + 1, '/')))
+        {
+            ARDirectoryEntry *parent = calloc(1, sizeof(ARDirectoryEntry));
+
+            if (!parent || !(parent->path = (OSUTF8Char *)strndup((char *)entry->path, slash - entry->path)))
+            {
+                fprintf(stderr, "Error: Out of memory!\n");
+                free(parent);
+                free(stack);
+
+                return false;
+            }
+
+            parent->type = kCAEntryTypeDirectory;
+            parent->existing = true;
+
+            ARDirectoryStructureAdd(directory, parent);
+            if (verbose) ARLog("D %s\n", parent->path);
+
+            stack[depth++] = parent;
+            start = slash - entry->path;
+        }
+
+        ARDirectoryStructureAdd(directory, entry);
+        members[i].entry = kOSNullPointer;
+
+        if (verbose) ARLog("%c %s\n", (entry->type == kCAEntryTypeDirectory) ? 'D' : ((entry->type == kCAEntryTypeLink) ? 'L' : 'F'), entry->path);
+
+        if (entry->type == kCAEntryTypeDirectory)
+            stack[depth++] = entry;
+
+        previous = entry;
+    }
+
+    free(stack);
+    return true;
+}
+
+static int ARTarCreateSpill(void)
+{
+    const char *temporary = getenv("TMPDIR");
+    char *path;
+
+    if (asprintf(&path, "%s/cartool.XXXXXX", temporary ? temporary : "/tmp") == -1)
+        return -1;
+
+    int fd = mkstemp(path);
+
+    if (fd != -1)
+        unlink(path);
+
+    free(path);
+    return fd;
+}
+
+// Open the tar stream at `path` ('-' for stdin)
+static bool ARTarOpenStream(ARTarStream *stream, const OSUTF8Char *path)
+{
+    struct stat stats;
+
+    memset(stream, 0, sizeof(ARTarStream));
+    stream->fd = strcmp((char *)path, "-") ? open((char *)path, O_RDONLY) : dup(STDIN_FILENO);
+    stream->output = -1;
+    stream->dataChecksum = ARCRC32Init();
+
+    if (stream->fd == -1 || fstat(stream->fd, &stats))
+    {
+        fprintf(stderr, "Error: Could not open tar stream '%s'!\n", path);
+        if (stream->fd != -1) close(stream->fd);
+
+        return false;
+    }
+
+    OSOffset start = S_ISREG(stats.st_mode) ? lseek(stream->fd, 0, SEEK_CUR) : -1;
+
+    stream->seekable = (start != -1);
+    stream->position = stream->seekable ? start : 0;
+
+    if (!(stream->buffer = malloc(kARTarBufferSize)))
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        close(stream->fd);
+
+        return false;
+    }
+
+    return true;
+}
+
+// Fill `directory` with the members of `stream` in place of a source tree.
+// Entries are always in canonical order, since a tar stream need not list
+// a directory before what's in it.
+static bool ARTarLoadMembers(ARDirectoryStructure *directory, ARTarStream *stream, bool system, bool verbose)
+{
+    ARTarMember *members = kOSNullPointer;
+    OSCount count = 0;
+
+    bool success = ARTarReadMembers(stream, &members, &count, verbose);
+
+    if (success)
+        success = ARTarResolveMembers(members, &count) && ARTarBuildStructure(directory, members, count, verbose);
+
+    ARTarFreeMembers(members, count);
+
+    OSCount entryCount = directory->entryCount - 1;
+    ARDirectoryEntry **entries = success ? malloc((entryCount ? entryCount : 1) * sizeof(ARDirectoryEntry *)) : kOSNullPointer;
+    OSIndex index = 0;
+
+    if (success && !entries)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        success = false;
+    }
+
+    for (ARDirectoryEntry *entry = directory->head->next; success && entry; entry = entry->next)
+        entries[index++] = entry;
+
+    if (success)
+        success = ARRepackShareData(directory, entries, entryCount);
+
+    if (success && system)
+        success = ARRepackLinkParents(directory, entries, entryCount);
+
+    free(entries);
+    return success;
+}
+
+// Fill `directory` with the members of the tar stream at `path`. Data is
+// copied out of the stream itself if it's a file, or else out of a spill
+// file it's copied into as it's read.
+static bool ARTarLoadEntries(ARDirectoryStructure *directory, const OSUTF8Char *path, bool system, bool verbose)
+{
+    ARTarStream stream;
+
+    if (!ARTarOpenStream(&stream, path))
+        return false;
+
+    if (!stream.seekable && (stream.output = ARTarCreateSpill()) == -1)
+        fprintf(stderr, "Error: Could not create a spill file for tar stream '%s'!\n", path);
+
+    bool success = (stream.seekable || stream.output != -1);
+
+    if (success)
+        success = ARTarLoadMembers(directory, &stream, system, verbose);
+
+    // Data is copied out of whichever file holds it
+    directory->sourceFd = stream.seekable ? stream.fd : stream.output;
+    if (!stream.seekable) close(stream.fd);
+
+    free(stream.buffer);
+    return success;
+}
+
+#pragma mark - Data Layout
+
+typedef struct {
+    ARDirectoryEntry *entry;
+    OSIndex index;
+    UInt32 hash;
+} ARDedupCandidate;
+
+typedef struct {
+    OSCount hardlinks;
+    OSCount duplicates;
+    UInt64 savedSize;
+} ARDedupStats;
+
+#define kARDedupBufferSize (1 << 20)
+
+static int ARDedupCompareCandidates(const void *a, const void *b)
+{
+    const ARDedupCandidate *x = a, *y = b;
+
+    if (x->entry->size != y->entry->size) return (x->entry->size < y->entry->size) ? -1 : 1;
+    if (x->entry->device != y->entry->device) return (x->entry->device < y->entry->device) ? -1 : 1;
+    if (x->entry->inode != y->entry->inode) return (x->entry->inode < y->entry->inode) ? -1 : 1;
+
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+static int ARDedupCompareIndex(const void *a, const void *b)
+{
+    const ARDedupCandidate *x = a, *y = b;
+
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+static bool ARDedupHashFile(const OSUTF8Char *path, UInt64 size, UInt8 *buffer, UInt32 *hash)
+{
+    int fd = open((char *)path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: Could not open file '%s'!\n", path);
+        return false;
+    }
+
+    UInt32 checksum = ARCRC32CInit();
+
+    while (size)
+    {
+        OSSize length = (size > kARDedupBufferSize) ? kARDedupBufferSize : size;
+
+        if (read(fd, buffer, length) != length)
+        {
+            fprintf(stderr, "Error: Could not read proper number of bytes from '%s' (has it been modified?)\n", path);
+            close(fd);
+
+            return false;
+        }
+
+        checksum = ARCRC32CUpdate(checksum, buffer, length);
+        size -= length;
+    }
+
+    *hash = ARCRC32CFinalize(checksum);
+    return !close(fd);
+}
+
+// Byte-for-byte comparison of two files of `size` bytes
+static bool ARDedupFilesEqual(const OSUTF8Char *a, const OSUTF8Char *b, UInt64 size, UInt8 *buffer)
+{
+    int fdA = open((char *)a, O_RDONLY);
+    int fdB = open((char *)b, O_RDONLY);
+    bool equal = (fdA != -1 && fdB != -1);
+
+    while (equal && size)
+    {
+        OSSize length = (size > (kARDedupBufferSize / 2)) ? (kARDedupBufferSize / 2) : size;
+
+        equal = (read(fdA, buffer, length) == length) && (read(fdB, buffer + length, length) == length) && !memcmp(buffer, buffer + length, length);
+        size -= length;
+    }
+
+    if (fdA != -1) close(fdA);
+    if (fdB != -1) close(fdB);
+
+    return equal;
+}
+
+// Hash the data of a repacked or imported entry. Checksums stored with a
+// repacked archive are CRC32Cs of the same data, so they are used when
+// there are any.
+static bool ARDedupHashSourceEntry(ARDirectoryStructure *directory, ARDirectoryEntry *entry, UInt8 *buffer, UInt32 *hash)
+{
+    UInt32 checksum = ARCRC32CInit();
+    UInt64 offset = 0;
+
+    if (directory->sourceChecksums)
+    {
+        *hash = entry->checksum;
+        return true;
+    }
+
+    while (offset < entry->size)
+    {
+        OSSize length = (entry->size - offset > kARDedupBufferSize) ? kARDedupBufferSize : (entry->size - offset);
+
+        if (!ARSourceReadData(directory, entry->sourceOffset + offset, length, buffer))
+            return false;
+
+        checksum = ARCRC32CUpdate(checksum, buffer, length);
+        offset += length;
+    }
+
+    *hash = ARCRC32CFinalize(checksum);
+    return true;
+}
+
+static bool ARDedupSourceEntriesEqual(ARDirectoryStructure *directory, ARDirectoryEntry *a, ARDirectoryEntry *b, UInt8 *buffer)
+{
+    bool equal = true;
+    UInt64 offset = 0;
+
+    while (equal && offset < a->size)
+    {
+        OSSize length = (a->size - offset > (kARDedupBufferSize / 2)) ? (kARDedupBufferSize / 2) : (a->size - offset);
+
+        equal = ARSourceReadData(directory, a->sourceOffset + offset, length, buffer) && ARSourceReadData(directory, b->sourceOffset + offset, length, buffer + length) && !memcmp(buffer, buffer + length, length);
+        offset += length;
+    }
+
+    return equal;
+}
+
+// Find content shared between the files in `group` (which all have the
+// same size and distinct inodes). Files are only read when at least two
+// of them have the same size; matching hashes are confirmed by comparing
+// the files themselves.
+static bool ARDedupGroup(ARDirectoryStructure *directory, ARDedupCandidate *group, OSCount count, UInt8 *buffer, ARDedupStats *stats)
+{
+    for (OSIndex i = 0; i < count; i++)
+    {
+        ARDirectoryEntry *entry = group[i].entry;
+
+        if (entry->existing && !ARDedupHashSourceEntry(directory, entry, buffer, &group[i].hash))
+            return false;
+
+        if (!entry->existing && !ARDedupHashFile(entry->path, entry->size, buffer, &group[i].hash))
+            return false;
+    }
+
+    // Keep the earliest entry of each set of duplicates as the one holding the data
+    qsort(group, count, sizeof(ARDedupCandidate), ARDedupCompareIndex);
+
+    for (OSIndex i = 0; i < count; i++)
+    {
+        if (group[i].entry->duplicate)
+            continue;
+
+        for (OSIndex j = i + 1; j < count; j++)
+        {
+            if (group[j].entry->duplicate || group[j].hash != group[i].hash)
+                continue;
+
+            if (group[i].entry->existing && !ARDedupSourceEntriesEqual(directory, group[i].entry, group[j].entry, buffer))
+                continue;
+
+            if (!group[i].entry->existing && !ARDedupFilesEqual(group[i].entry->path, group[j].entry->path, group[i].entry->size, buffer))
+                continue;
+
+            group[j].entry->duplicate = group[i].entry;
+            stats->savedSize += group[j].entry->size;
+            stats->duplicates++;
+        }
+    }
+
+    return true;
+}
+
+// Point hardlinks and files with identical content at a single copy of
+// their data. Hardlinks are found through their inode without reading
+// anything.
+static bool ARDeduplicateEntries(ARDirectoryStructure *directory, bool verbose)
+{
+    ARDedupCandidate *candidates = malloc(directory->entryCount * sizeof(ARDedupCandidate));
+    UInt8 *buffer = malloc(kARDedupBufferSize);
+    ARDedupStats stats = {0, 0, 0};
+    OSCount count = 0;
+    OSIndex index = 0;
+
+    if (!candidates || !buffer)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        free(candidates);
+        free(buffer);
+
+        return false;
+    }
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next, index++)
+    {
+        // Sparse files are laid out differently from their contents
+        if (entry->type != kCAEntryTypeFile || !entry->size || entry->sparse)
+            continue;
+
+        candidates[count].entry = entry;
+        candidates[count].index = index;
+        count++;
+    }
+
+    qsort(candidates, count, sizeof(ARDedupCandidate), ARDedupCompareCandidates);
+    bool success = true;
+
+    for (OSIndex first = 0; success && first < count; )
+    {
+        OSIndex end = first + 1;
+        OSCount unique = 1;
+
+        while (end < count && candidates[end].entry->size == candidates[first].entry->size)
+        {
+            ARDedupCandidate *previous = &candidates[end - 1];
+            ARDedupCandidate *current = &candidates[end];
+
+            // Hardlinks sort next to each other, earliest first
+            if (current->entry->device == previous->entry->device && current->entry->inode == previous->entry->inode) {
+                current->entry->duplicate = previous->entry->duplicate ? previous->entry->duplicate : previous->entry;
+                stats.savedSize += current->entry->size;
+                stats.hardlinks++;
+            } else {
+                candidates[first + unique++] = *current;
+            }
+
+            end++;
+        }
+
+        if (unique > 1)
+            success = ARDedupGroup(directory, candidates + first, unique, buffer, &stats);
+
+        first = end;
+    }
+
+    free(candidates);
+    free(buffer);
+
+    if (success && verbose)
+    {
+        UInt64 fullSize = directory->fullSize;
+        double ratio = (fullSize > stats.savedSize) ? ((double)fullSize / (double)(fullSize - stats.savedSize)) : 1.0;
+
+        ARLog("Deduplicated %lu hardlinks and %lu identical files, saving %lu of %lu bytes (%.2f:1)\n", stats.hardlinks, stats.duplicates, stats.savedSize, fullSize, ratio);
+    }
+
+    return success;
+}
+
+// Boot critical data starts on a page boundary (a multiple of kARBlockSize)
+#define kARBootAlignment 4096
+
+typedef struct {
+    const OSUTF8Char *path;
+    UInt64 rank;
+} ARLayoutRank;
+
+// Entries to place at the front of the data section: boot critical
+// entries first, each page aligned, then the entries of the boot profile
+// in the order they were accessed.
+typedef struct {
+    ARLayoutRank *ranks;
+    OSCount count;
+    OSCount bootCount;
+    OSUTF8Char *profile;
+} ARLayoutPlan;
+
+// Profiles may list paths with or without the leading '/'
+static const OSUTF8Char *ARLayoutKey(const OSUTF8Char *path)
+{
+    while (*path == '/') path++;
+    return path;
+}
+
+static int ARLayoutCompareRanks(const void *a, const void *b)
+{
+    const ARLayoutRank *x = a, *y = b;
+    int order = strcmp((const char *)x->path, (const char *)y->path);
+
+    if (order) return order;
+    return (x->rank < y->rank) ? -1 : (x->rank > y->rank);
+}
+
+static int ARLayoutCompareEntries(const void *a, const void *b)
+{
+    const ARDirectoryEntry *x = *(ARDirectoryEntry *const *)a;
+    const ARDirectoryEntry *y = *(ARDirectoryEntry *const *)b;
+
+    return (x->layoutRank < y->layoutRank) ? -1 : (x->layoutRank > y->layoutRank);
+}
+
+static OSUTF8Char *ARLayoutReadProfile(const OSUTF8Char *path)
+{
+    struct stat stats;
+    int fd = open((char *)path, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &stats))
+    {
+        fprintf(stderr, "Error: Could not open boot profile '%s'!\n", path);
+        if (fd != -1) close(fd);
+
+        return kOSNullPointer;
+    }
+
+    OSUTF8Char *profile = malloc(stats.st_size + 1);
+
+    if (!profile || read(fd, profile, stats.st_size) != stats.st_size)
+    {
+        fprintf(stderr, "Error: Could not read boot profile '%s'!\n", path);
+        close(fd);
+        free(profile);
+
+        return kOSNullPointer;
+    }
+
+    profile[stats.st_size] = 0;
+    close(fd);
+
+    return profile;
+}
+
+static void ARLayoutPlanFree(ARLayoutPlan *plan)
+{
+    if (!plan) return;
+
+    free(plan->ranks);
+    free(plan->profile);
+    free(plan);
+}
+
+// `bootPaths` is a null terminated list of source paths (beneath the root
+// directory). The profile holds one archive path per line; empty lines
+// and lines starting with '#' are skipped.
+static ARLayoutPlan *ARLayoutPlanCreate(const OSUTF8Char *const *bootPaths, OSSize nameSkip, const OSUTF8Char *profilePath)
+{
+    ARLayoutPlan *plan = malloc(sizeof(ARLayoutPlan));
+    OSCount capacity = 0;
+
+    if (!plan)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    memset(plan, 0, sizeof(ARLayoutPlan));
+
+    if (profilePath && !(plan->profile = ARLayoutReadProfile(profilePath)))
+    {
+        ARLayoutPlanFree(plan);
+        return kOSNullPointer;
+    }
+
+    for (const OSUTF8Char *const *path = bootPaths; path && *path; path++)
+        capacity++;
+
+    for (OSUTF8Char *c = plan->profile; c && *c; c++)
+        capacity += (*c == '\n');
+
+    plan->ranks = malloc((capacity + 1) * sizeof(ARLayoutRank));
+
+    if (!plan->ranks)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        ARLayoutPlanFree(plan);
+
+        return kOSNullPointer;
+    }
+
+    for (const OSUTF8Char *const *path = bootPaths; path && *path; path++)
+    {
+        if (strlen((char *)*path) <= nameSkip)
+            continue;
+
+        plan->ranks[plan->count].path = ARLayoutKey(*path + nameSkip);
+        plan->ranks[plan->count].rank = plan->count;
+        plan->count++;
+    }
+
+    plan->bootCount = plan->count;
+
+    for (OSUTF8Char *line = plan->profile; line && *line; )
+    {
+        OSUTF8Char *end = (OSUTF8Char *)strchr((char *)line, '\n');
+        OSUTF8Char *next = end ? end + 1 : line + strlen((char *)line);
+
+        if (end) *end = 0;
+        if (end && end > line && end[-1] == '\r') end[-1] = 0;
+
+        if (*line && *line != '#')
+        {
+            plan->ranks[plan->count].path = ARLayoutKey(line);
+            plan->ranks[plan->count].rank = plan->count;
+            plan->count++;
+        }
+
+        line = next;
+    }
+
+    // Sort for lookup, keeping only the earliest rank of each path
+    qsort(plan->ranks, plan->count, sizeof(ARLayoutRank), ARLayoutCompareRanks);
+    OSCount unique = 0;
+
+    for (OSIndex i = 0; i < plan->count; i++)
+    {
+        if (unique && !strcmp((char *)plan->ranks[unique - 1].path, (char *)plan->ranks[i].path))
+            continue;
+
+        plan->ranks[unique++] = plan->ranks[i];
+    }
+
+    plan->count = unique;
+    return plan;
+}
+
+static int ARLayoutComparePaths(const void *a, const void *b)
+{
+    return strcmp((const char *)((const ARLayoutRank *)a)->path, (const char *)((const ARLayoutRank *)b)->path);
+}
+
+static UInt64 ARLayoutPlanRank(ARLayoutPlan *plan, const OSUTF8Char *path, UInt64 fallback)
+{
+    ARLayoutRank key = {path, 0};
+    ARLayoutRank *found = bsearch(&key, plan->ranks, plan->count, sizeof(ARLayoutRank), ARLayoutComparePaths);
+
+    return found ? found->rank : fallback;
+}
+
+// Assign each entry its offset in the data section and work out the data
+// section's size. Without a plan, data follows the ToC order. With one,
+// planned entries come first (boot critical ones page aligned) and the
+// rest follow in ToC order. Entries sharing data take the offset of the
+// copy they point at, which always comes earlier in the ToC.
+static bool ARDirectoryLayoutData(ARDirectoryStructure *directory, ARLayoutPlan *plan, bool verbose)
+{
+    ARDirectoryEntry **order = malloc(directory->entryCount * sizeof(ARDirectoryEntry *));
+    OSCount count = 0;
+    OSIndex index = 0;
+
+    if (!order)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next, index++)
+    {
+        if (entry->type != kCAEntryTypeFile && entry->type != kCAEntryTypeLink)
+            continue;
+
+        UInt64 rank = plan ? ARLayoutPlanRank(plan, ARLayoutKey(entry->path + directory->nameSkip), plan->count + index) : index;
+
+        if (entry->duplicate) {
+            ARDirectoryEntry *original = entry->duplicate;
+            while (original->duplicate) original = original->duplicate;
+
+            // Shared data goes wherever its most urgent user needs it
+            entry->duplicate = original;
+            if (rank < original->layoutRank) original->layoutRank = rank;
+        } else {
+            entry->layoutRank = rank;
+            order[count++] = entry;
+        }
+    }
+
+    if (plan)
+        qsort(order, count, sizeof(ARDirectoryEntry *), ARLayoutCompareEntries);
+
+    UInt64 dataOffset = 0;
+    OSCount planned = 0;
+
+    for (OSIndex i = 0; i < count; i++)
+    {
+        if (plan && order[i]->layoutRank < plan->bootCount)
+            dataOffset = OSAlignUpward(dataOffset, kARBootAlignment);
+
+        if (plan && order[i]->layoutRank < plan->count)
+            planned++;
+
+        order[i]->dataOffset = dataOffset;
+        dataOffset += order[i]->size;
+    }
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next)
+    {
+        if (entry->duplicate)
+            entry->dataOffset = entry->duplicate->dataOffset;
+    }
+
+    if (plan && verbose)
+        ARLog("Placed %lu planned entries at the front of the data section\n", planned);
+
+    directory->fullSize = dataOffset;
+    free(order);
+
+    return true;
+}
+
+#pragma mark - Create Functions II
+
+// Fill in a Subtype 1, 2 or BootX entry of either width. Returns its size.
+static OSSize ARCreateEncodeEntry(ARSubtype subtype, ARDirectoryEntry *entry, bool narrow, void *buffer)
+{
+    bool hasData = (entry->type != kCAEntryTypeDirectory);
+
+    if (narrow) {
+        AREntryNarrow *narrowEntry = buffer;
+        memset(narrowEntry, 0, sizeof(AREntryNarrow));
+
+        narrowEntry->type = entry->type;
+        narrowEntry->dataOffset = hasData ? (UInt32)entry->dataOffset : 0;
+        narrowEntry->dataSize = hasData ? (UInt32)entry->size : 0;
+
+        if (subtype != kARSubtype1 && !hasData) return offsetof(AREntryNarrow, dataOffset);
+        return sizeof(AREntryNarrow);
+    } else {
+        CAEntryS2 *wideEntry = buffer;
+        memset(wideEntry, 0, sizeof(CAEntryS2));
+
+        wideEntry->type = entry->type;
+        wideEntry->dataOffset = hasData ? entry->dataOffset : 0;
+        wideEntry->dataSize = hasData ? entry->size : 0;
+
+        if (subtype != kARSubtype1 && !hasData) return offsetof(CAEntryS2, dataOffset);
+        return sizeof(CAEntryS2);
+    }
+}
+
+static OSOffset ARCreateWriteToCAndEntries(ARSubtype subtype, ARDirectoryStructure *directory, int fd, OSOffset tocOffset, bool narrow, bool verbose)
+{
+    ARDirectoryEntry *entry = directory->head;
+    OSOffset entryOffset = 0;
+    CAEntryS2 fileEntry;
+
+    while (entry)
+    {
+        if (!ARCreateWriteToCEntry(fd, tocOffset, entryOffset, narrow))
+        {
+            ARDirectoryStructureFree(directory);
+            ARCreateCloseArchive(fd);
+
+            return -1;
+        }
+
+        tocOffset += narrow ? sizeof(UInt32) : sizeof(UInt64);
+        OSSize entrySize = ARCreateEncodeEntry(subtype, entry, narrow, &fileEntry);
+
+        if (!ARCreateWriteEntryStandard(fd, &fileEntry, entrySize))
+        {
+            ARDirectoryStructureFree(directory);
+            ARCreateCloseArchive(fd);
+
+            return -1;
+        }
+
+        entryOffset += entrySize;
+
+        OSUTF8Char *path = entry->path + directory->nameSkip;
+        entryOffset = ARCreateWriteAlignedPath(fd, path, entryOffset);
+
+        if (entryOffset == -1)
+        {
+            ARDirectoryStructureFree(directory);
+            ARCreateCloseArchive(fd);
+
+            return -1;
+        }
+
+        if (verbose) ARLog("E %s\n", path);
+        entry = entry->next;
+    }
+
+    return entryOffset;
+}
+
+// Fill in a System Image entry of either width. Returns its size.
+static OSSize ARCreateEncodeEntrySystemImage(ARDirectoryEntry *entry, bool narrow, void *buffer)
+{
+    UInt64 parentEntry = entry->parent ? entry->parent->entryID : 0;
+    UInt64 nextEntry = entry->nextEntry ? entry->nextEntry->entryID : 0;
+    UInt64 firstEntry = entry->firstChild ? entry->firstChild->entryID : 0;
+
+    #define ARFillSystemDirectoryEntry(e)           \
+        memset(e, 0, sizeof(*e));                   \
+        e->type = kCAEntryTypeDirectory;            \
+        e->specialFlags = 0xDD;                     \
+        e->parentEntry = parentEntry;               \
+        e->nextEntry = nextEntry;                   \
+        e->firstEntry = firstEntry;                 \
+        e->entryCount = entry->children
+
+    #define ARFillSystemFileEntry(e)                \
+        memset(e, 0, sizeof(*e));                   \
+        e->type = entry->type;                      \
+        e->specialFlags = 0xFF;                     \
+        e->parentEntry = parentEntry;               \
+        e->nextEntry = nextEntry;                   \
+        e->dataOffset = entry->dataOffset;          \
+        e->dataSize = entry->size
+
+    if (entry->type == kCAEntryTypeDirectory) {
+        if (narrow) {
+            ARSystemDirectoryEntryNarrow *directoryEntry = buffer;
+            ARFillSystemDirectoryEntry(directoryEntry);
+
+            return sizeof(ARSystemDirectoryEntryNarrow);
+        } else {
+            CASystemDirectoryEntry *directoryEntry = buffer;
+            ARFillSystemDirectoryEntry(directoryEntry);
+
+            return sizeof(CASystemDirectoryEntry);
+        }
+    } else {
+        if (narrow) {
+            ARSystemFileEntryNarrow *fileEntry = buffer;
+            ARFillSystemFileEntry(fileEntry);
+
+            return sizeof(ARSystemFileEntryNarrow);
+        } else {
+            CASystemFileEntry *fileEntry = buffer;
+            ARFillSystemFileEntry(fileEntry);
+
+            return sizeof(CASystemFileEntry);
+        }
+    }
+
+    #undef ARFillSystemDirectoryEntry
+    #undef ARFillSystemFileEntry
+}
+
+static OSOffset ARCreateWriteToCAndEntriesSystemImage(ARSubtype subtype, ARDirectoryStructure *directory, int fd, OSOffset tocOffset, bool narrow, bool verbose)
+{
+    ARDirectoryEntry *entry = directory->head;
+    OSOffset entryOffset = 0;
+
+    union {
+        CASystemDirectoryEntry directory;
+        CASystemFileEntry file;
+    } archiveEntry;
+
+    while (entry)
+    {
+        if (!ARCreateWriteToCEntry(fd, tocOffset, entryOffset, narrow))
+        {
+            ARDirectoryStructureFree(directory);
+            ARCreateCloseArchive(fd);
+
+            return -1;
+        }
+
+        tocOffset += narrow ? sizeof(UInt32) : sizeof(UInt64);
+        OSSize entrySize = ARCreateEncodeEntrySystemImage(entry, narrow, &archiveEntry);
+
+        if (write(fd, &archiveEntry, entrySize) != entrySize)
+        {
+            fprintf(stderr, "Error: Could not write %s entry!\n", (entry->type == kCAEntryTypeDirectory) ? "directory" : "file");
+
+            ARDirectoryStructureFree(directory);
+            ARCreateCloseArchive(fd);
+
+            return -1;
+        }
+
+        entryOffset += entrySize;
+
+        OSUTF8Char *path = entry->path + directory->nameSkip;
+        entryOffset = ARCreateWriteAlignedPath(fd, path, entryOffset);
+
+        if (entryOffset == -1)
+        {
+            ARDirectoryStructureFree(directory);
+            ARCreateCloseArchive(fd);
+
+            return -1;
+        }
+
+        if (verbose) ARLog("E %s\n", path);
+        entry = entry->next;
+    }
+
+    return entryOffset;
+}
+
+static OSSize ARCreateWriteNumber(UInt8 *buffer, UInt64 value)
+{
+    OSSize size = 0;
+
+    do {
+        buffer[size++] = (value & 0x7F) | ((value > 0x7F) ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+
+    return size;
+}
+
+// Write a compact (Subtype 2 only) entry table: the field arrays go
+// where the ToC would be and the front coded names go in a string pool at
+// the entry table offset. Returns the size of the pool.
+static OSOffset ARCreateWriteCompactEntries(ARDirectoryStructure *directory, int fd, OSOffset tocOffset, OSOffset entryTableOffset, bool verbose)
+{
+    OSCount count = directory->entryCount;
+    OSSize tableSize = ARCompactTableSize(count);
+    UInt8 *table = calloc(1, tableSize);
+
+    // Worst case is every name stored in full with two maximal numbers
+    OSSize poolCapacity = 0;
+    OSSize poolSize = 0;
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next)
+        poolCapacity += strlen((char *)entry->path) + 20;
+
+    UInt8 *pool = malloc(poolCapacity);
+
+    if (!table || !pool)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        free(table);
+        free(pool);
+
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+
+        return -1;
+    }
+
+    UInt8 *types = table + ARCompactTypesOffset(count);
+    UInt32 *parents = (UInt32 *)(table + ARCompactParentsOffset(count));
+    UInt64 *dataOffsets = (UInt64 *)(table + ARCompactDataOffsetsOffset(count));
+    UInt64 *dataSizes = (UInt64 *)(table + ARCompactDataSizesOffset(count));
+    const char *previousName = "";
+    OSIndex index = 0;
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next, index++)
+    {
+        OSUTF8Char *path = entry->path + directory->nameSkip;
+        const char *name = index ? strrchr((char *)path, '/') + 1 : "";
+        OSSize shared = 0;
+
+        while (name[shared] && name[shared] == previousName[shared])
+            shared++;
+
+        OSSize added = strlen(name + shared);
+
+        poolSize += ARCreateWriteNumber(pool + poolSize, shared);
+        poolSize += ARCreateWriteNumber(pool + poolSize, added);
+        memcpy(pool + poolSize, name + shared, added);
+        poolSize += added;
+
+        types[index] = entry->type;
+        parents[index] = entry->parent ? entry->parent->entryID : 0;
+
+        if (entry->type != kCAEntryTypeDirectory)
+        {
+            dataOffsets[index] = entry->dataOffset;
+            dataSizes[index] = entry->size;
+        }
+
+        if (verbose) ARLog("E %s\n", path);
+        previousName = name;
+    }
+
+    ((ARCompactTable *)table)->entryCount = count;
+    ((ARCompactTable *)table)->poolSize = poolSize;
+
+    bool success = (pwrite(fd, table, tableSize, tocOffset) == tableSize) && (pwrite(fd, pool, poolSize, entryTableOffset) == poolSize);
+
+    free(table);
+    free(pool);
+
+    if (!success)
+    {
+        fprintf(stderr, "Error: Could not write entry table!\n");
+
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+
+        return -1;
+    }
+
+    if (verbose) ARLog("Compact entry table: %lu bytes of fields, %lu bytes of names\n", tableSize, poolSize);
+    return poolSize;
+}
+
+// Where entry data comes from (besides the source tree) and what is
+// recorded about it while the data section is written.
+typedef struct {
+    // CRC32C of each entry's data in ToC order (or null)
+    UInt32 *checksums;
+
+    // Previous build to copy unchanged entries from (or null)
+    ARArchive *previous;
+    ARManifest *previousManifest;
+
+    // Manifest for this build (or null)
+    ARManifest *manifest;
+
+    // Work out the CRC32 of the data section along with the entry checksums
+    // (unless it's going to be compressed or encrypted afterwards)
+    bool fuseChecksums;
+    UInt32 dataChecksum;
+
+    OSCount reusedCount;
+    UInt64 reusedSize;
+} ARCreateDataSource;
+
+// Set up the data source for an incremental build from `previousArchive`
+// and its manifest. If the previous build can't be used, everything is
+// read from the source tree instead.
+static bool ARCreateOpenPrevious(ARCreateDataSource *source, const OSUTF8Char *previousArchive, const OSUTF8Char *keyFile)
+{
+    OSUTF8Char *manifestPath;
+
+    if (asprintf((char **)&manifestPath, "%s.manifest", previousArchive) == -1)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    source->previousManifest = ARManifestLoad(manifestPath);
+    free(manifestPath);
+
+    if (source->previousManifest)
+        source->previous = ARArchiveOpenWithKey(previousArchive, keyFile);
+
+    if (source->previous && !source->previous->cipher && ARArchiveIsEncrypted(source->previous))
+    {
+        fprintf(stderr, "Warning: Previous archive is encrypted and no key was given!\n");
+        ARArchiveClose(source->previous);
+        source->previous = kOSNullPointer;
+    }
+
+    if (source->previous && source->previous->size != ARManifestArchiveSize(source->previousManifest))
+    {
+        fprintf(stderr, "Warning: Manifest does not match archive '%s'!\n", previousArchive);
+        ARArchiveClose(source->previous);
+        source->previous = kOSNullPointer;
+    }
+
+    if (!source->previous)
+        fprintf(stderr, "Warning: Not reusing any data from '%s'; doing a full build.\n", previousArchive);
+
+    return true;
+}
+
+static void ARCreateCloseDataSource(ARCreateDataSource *source)
+{
+    if (source->previous) ARArchiveClose(source->previous);
+    if (source->previousManifest) ARManifestFree(source->previousManifest);
+    if (source->manifest) ARManifestFree(source->manifest);
+
+    free(source->checksums);
+    memset(source, 0, sizeof(ARCreateDataSource));
+}
+
+// Copy the data of `entry` from the previous archive if the file is
+// unchanged since it was built. The copy is checked against the checksum
+// recorded for it, so a stale manifest only costs a re-read. `dataCRC`
+// (if not null) is set to the CRC32 of the data.
+static bool ARCreateReuseData(ARCreateDataSource *source, ARDirectoryEntry *entry, const OSUTF8Char *archivePath, void *destination, UInt32 *checksum, UInt32 *dataCRC)
+{
+    if (!source->previous || !entry->size || entry->sparse)
+        return false;
+
+    const ARManifestRecord *record = ARManifestFind(source->previousManifest, archivePath);
+
+    if (!record || record->type != entry->type || record->size != entry->size)
+        return false;
+
+    if (record->modificationTime != entry->modificationTime || record->inode != entry->inode || record->device != entry->device)
+        return false;
+
+    UInt32 checksumC = ARCRC32CInit();
+    UInt32 crc = ARCRC32Init();
+
+    for (UInt64 offset = 0; offset < entry->size; offset += kARCreateChecksumBlockSize)
+    {
+        OSSize length = (entry->size - offset > kARCreateChecksumBlockSize) ? kARCreateChecksumBlockSize : (entry->size - offset);
+
+        if (!ARArchiveReadData(source->previous, record->dataOffset + offset, length, destination + offset))
+            return false;
+
+        ARCRC32FusedUpdate(dataCRC ? &crc : kOSNullPointer, &checksumC, destination + offset, length);
+    }
+
+    if (ARCRC32CFinalize(checksumC) != record->checksum)
+        return false;
+
+    source->reusedCount++;
+    source->reusedSize += entry->size;
+
+    if (dataCRC) *dataCRC = ARCRC32Finalize(crc);
+    *checksum = record->checksum;
+
+    return true;
+}
+
+// Copy the data of a repacked or imported entry to `offset` in the new
+// archive (`destination` in its mapping). Data in a plain file is copied
+// file to file, which some file systems do without copying anything;
+// whatever that doesn't cover is read through the source. Data copied file
+// to file never passes through memory, so it's checksummed from the mapping.
+static bool ARCreateCopyData(ARDirectoryStructure *directory, ARDirectoryEntry *entry, int fd, void *destination, OSOffset offset, UInt32 *checksum, UInt32 *checksumC)
+{
+    UInt64 copied = 0;
+
+    if (entry->linkTarget)
+    {
+        memcpy(destination, entry->linkTarget, entry->size);
+        ARCRC32FusedUpdate(checksum, checksumC, destination, entry->size);
+
+        return true;
+    }
+
+#if defined(__linux__)
+    if (directory->sourceFd != -1)
+    {
+        loff_t sourceOffset = directory->sourceBase + entry->sourceOffset;
+        loff_t destinationOffset = offset;
+
+        while (copied < entry->size)
+        {
+            ssize_t length = copy_file_range(directory->sourceFd, &sourceOffset, fd, &destinationOffset, entry->size - copied, 0);
+
+            if (length <= 0) break;
+            copied += length;
+        }
+    }
+#endif /* defined(__linux__) */
+
+    ARCRC32FusedUpdate(checksum, checksumC, destination, copied);
+
+    while (copied < entry->size)
+    {
+        OSSize length = (entry->size - copied > kARCreateChecksumBlockSize) ? kARCreateChecksumBlockSize : (entry->size - copied);
+
+        if (!ARSourceReadData(directory, entry->sourceOffset + copied, length, destination + copied))
+        {
+            fprintf(stderr, "Error: Could not copy '%s' out of the source!\n", entry->path);
+            return false;
+        }
+
+        ARCRC32FusedUpdate(checksum, checksumC, destination + copied, length);
+        copied += length;
+    }
+
+    return true;
+}
+
+static int ARCreateCompareDataOffsets(const void *a, const void *b)
+{
+    const ARDirectoryEntry *x = *(ARDirectoryEntry **)a, *y = *(ARDirectoryEntry **)b;
+
+    return (x->dataOffset < y->dataOffset) ? -1 : (x->dataOffset > y->dataOffset);
+}
+
+// CRC32 of `size` zero bytes appended to data with CRC32 `checksum`
+static UInt32 ARCreateCombineZeros(UInt32 checksum, UInt64 size)
+{
+    static UInt8 zeros[kARBootAlignment];
+
+    while (size)
+    {
+        OSSize length = (size > kARBootAlignment) ? kARBootAlignment : size;
+
+        checksum = ARCRC32Combine(checksum, ARCRC32Process(zeros, length), length);
+        size -= length;
+    }
+
+    return checksum;
+}
+
+// Combine the CRC32 of each entry's data into that of the whole data
+// section. Anything between entries is alignment padding, which is zero.
+static bool ARCreateCombineDataChecksums(ARDirectoryStructure *directory, UInt32 *checksum)
+{
+    ARDirectoryEntry **order = malloc(directory->entryCount * sizeof(ARDirectoryEntry *));
+    UInt64 offset = 0;
+    OSCount count = 0;
+
+    if (!order)
+        return false;
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next)
+    {
+        if ((entry->type == kCAEntryTypeFile || entry->type == kCAEntryTypeLink) && entry->size && !entry->duplicate)
+            order[count++] = entry;
+    }
+
+    qsort(order, count, sizeof(ARDirectoryEntry *), ARCreateCompareDataOffsets);
+    *checksum = 0;
+
+    for (OSIndex i = 0; i < count; i++)
+    {
+        *checksum = ARCreateCombineZeros(*checksum, order[i]->dataOffset - offset);
+        *checksum = ARCRC32Combine(*checksum, order[i]->dataCRC, order[i]->size);
+
+        offset = order[i]->dataOffset + order[i]->size;
+    }
+
+    *checksum = ARCreateCombineZeros(*checksum, directory->fullSize - offset);
+    free(order);
+
+    return true;
+}
+
+static bool CACreateWriteDataSection(ARDirectoryStructure *directory, int fd, void *file, OSSize archiveSize, OSOffset dataStart, ARCreateDataSource *source, bool verbose)
+{
+    ARDirectoryEntry *entry = directory->head;
+    OSIndex index = 0;
+
+    ARLogProgressBegin("Writing data", directory->fullSize);
+
+    while (entry)
+    {
+        const OSUTF8Char *archivePath = entry->path + directory->nameSkip;
+        void *destination = file + dataStart + entry->dataOffset;
+        bool hasData = (entry->type == kCAEntryTypeLink || entry->type == kCAEntryTypeFile);
+        bool reused = false;
+        bool failed = false;
+        UInt32 checksum = 0;
+
+        // Both checksums are updated block by block as the data is copied in.
+        // Repacked data is checked against its old checksum.
+        bool dataChecksum = (source->fuseChecksums && hasData && !entry->duplicate && entry->size);
+        UInt32 checksumC = ARCRC32CInit();
+        UInt32 crc = ARCRC32Init();
+
+        // Shared data has already been written with the entry it belongs to
+        if (hasData && !entry->duplicate)
+            reused = ARCreateReuseData(source, entry, archivePath, destination, &checksum, dataChecksum ? &entry->dataCRC : kOSNullPointer);
+
+        bool entryChecksum = (!reused && entry->size && (source->checksums || source->manifest || (entry->existing && directory->sourceChecksums)));
+        UInt32 *crcUpdate = (dataChecksum && !reused) ? &crc : kOSNullPointer;
+        UInt32 *checksumCUpdate = entryChecksum ? &checksumC : kOSNullPointer;
+
+        if (hasData && !entry->duplicate && entry->existing) {
+            failed = !ARCreateCopyData(directory, entry, fd, destination, dataStart + entry->dataOffset, crcUpdate, checksumCUpdate);
+        } else if (hasData && !entry->duplicate && !reused) {
+            switch (entry->type)
+            {
+                case kCAEntryTypeLink: {
+                    failed = !ARCreateWriteSymlink(destination, entry->path, entry->size, crcUpdate, checksumCUpdate);
+                } break;
+                case kCAEntryTypeFile: {
+                    if (entry->sparse) failed = !ARCreateWriteSparseFile(destination, entry->path, entry->extents, entry->extentCount, crcUpdate, checksumCUpdate);
+                    else failed = !ARCreateWriteFile(destination, entry->path, entry->size, crcUpdate, checksumCUpdate);
+                } break;
+            }
+        } else if (hasData && entry->duplicate && entryChecksum) {
+            // Shared data isn't copied again, so it's checksummed in place
+            ARCRC32FusedUpdate(kOSNullPointer, &checksumC, destination, entry->size);
+        }
+
+        if (!failed && entryChecksum) checksum = ARCRC32CFinalize(checksumC);
+        if (!failed && crcUpdate) entry->dataCRC = ARCRC32Finalize(crc);
+
+        if (!failed && entry->existing && directory->sourceChecksums && entry->size && checksum != entry->checksum)
+        {
+            fprintf(stderr, "Error: Data of '%s' does not match its checksum in the archive being repacked!\n", entry->path);
+            failed = true;
+        }
+
+        if (!failed && source->manifest && hasData)
+        {
+            ARManifestRecord record;
+            memset(&record, 0, sizeof(ARManifestRecord));
+
+            record.size = entry->size;
+            record.modificationTime = entry->modificationTime;
+            record.inode = entry->inode;
+            record.device = entry->device;
+            record.dataOffset = entry->dataOffset;
+            record.checksum = checksum;
+            record.type = entry->type;
+
+            failed = !ARManifestAdd(source->manifest, archivePath, &record);
+        }
+
+        if (failed)
+        {
+            ARLogProgressEnd();
+            ARCreateUnmapArchive(file, archiveSize);
+            ARDirectoryStructureFree(directory);
+
+            return false;
+        }
+
+        if (source->checksums)
+            source->checksums[index] = checksum;
+
+        if (hasData && !entry->duplicate)
+            ARLogProgressAdvance(entry->size);
+
+        if (verbose && hasData)
+            ARLog("%c %s\n", entry->duplicate ? 'S' : (reused ? 'R' : (entry->existing ? 'C' : 'W')), entry->path);
+
+        entry = entry->next;
+        index++;
+    }
+
+    ARLogProgressEnd();
+
+    if (source->fuseChecksums && !ARCreateCombineDataChecksums(directory, &source->dataChecksum))
+        source->fuseChecksums = false;
+
+    return true;
+}
+
+#pragma mark - Creation Functions
+
+// Kernel loader, kernel and boot config
+#define kARCreateMaxBootPaths 3
+
+typedef struct {
+    ARSubtype subtype;
+    void *address;
+    OSSize archiveSize;
+    OSSize mappedSize;
+    int fd;
+
+    OSOffset entryOffset;
+    OSOffset dataOffset;
+    OSOffset dataEnd;
+
+    ARSectionDirectory sections;
+
+    UInt8 key[kARCipherMaxKeySize];
+    OSSize keySize;
+
+    ARSigningKey *signingKey;
+
+    // Written next to the archive once it's complete
+    ARManifest *manifest;
+    OSUTF8Char *manifestPath;
+
+    // Revision flags for the last byte of the header version
+    UInt8 headerFlags;
+
+    // Whether room was left for a section directory
+    bool sectionSpace;
+
+    // CRC32 of the data section as it was written (if it still holds)
+    bool haveDataChecksum;
+    UInt32 dataChecksum;
+
+    // ToC index of each boot path given to ARCreateArchive (0 if not found)
+    OSIndex bootEntries[kARCreateMaxBootPaths];
+} ARCreateInfo;
+
+// Whether every offset in the entry table and data section fits in 32 bits.
+// Directories and paths are counted at their widest.
+static bool ARCreateFitsNarrow(ARDirectoryStructure *directory)
+{
+    UInt64 entryTableSize = 0;
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next)
+        entryTableSize += sizeof(CASystemDirectoryEntry) + strlen((char *)entry->path) + 8;
+
+    return (directory->fullSize <= UINT32_MAX && entryTableSize <= UINT32_MAX);
+}
+
+// Find the ToC index of each of the (null terminated) `bootPaths`
+static void ARCreateFindBootEntries(ARDirectoryStructure *directory, const OSUTF8Char *const *bootPaths, OSIndex *bootEntries)
+{
+    OSIndex index = 0;
+
+    memset(bootEntries, 0, sizeof(OSIndex) * kARCreateMaxBootPaths);
+
+    for (ARDirectoryEntry *entry = directory->head; bootPaths && entry; entry = entry->next, index++)
+    {
+        if (entry->type != kCAEntryTypeFile)
+            continue;
+
+        for (OSIndex i = 0; i < kARCreateMaxBootPaths && bootPaths[i]; i++)
+        {
+            if (!bootEntries[i] && strlen((char *)bootPaths[i]) > directory->nameSkip && !strcmp((char *)entry->path + directory->nameSkip, (char *)bootPaths[i] + directory->nameSkip))
+                bootEntries[i] = index;
+        }
+    }
+}
+
+_Static_assert(sizeof(CADataModification) + sizeof(ARSectionDirectory) <= kARBlockSize, "Section directory must fit in the System Image data modification block");
+
+// Space to reserve after CADataModification for the section directory.
+// Repacked archives may have sparse files, which aren't known until later,
+// and imported tar streams are always sorted.
+static OSSize ARCreateSectionSpace(ARCreateDataModifiers *modifiers)
+{
+    if (modifiers && (modifiers->compressData || modifiers->encryptArchive || modifiers->signingCertificate || modifiers->checksumEntries || modifiers->canonicalOrder || modifiers->sparseFiles || modifiers->sourceArchive || modifiers->sourceTar))
+        return sizeof(ARSectionDirectory);
+
+    return 0;
+}
+
+static void ARCreateAddSection(ARCreateInfo *info, ARSectionType type, OSOffset offset, OSSize size)
+{
+    ARSection *section = &info->sections.sections[info->sections.sectionCount++];
+
+    section->type = type;
+    section->flags = 0;
+    section->offset = offset;
+    section->size = size;
+}
+
+// Copy the section directory into place after the CADataModification at
+// `dataModification`. Reserved space always gets one, even if it's empty,
+// since BootX archives find their ToC by whether there is one.
+//
+// Compression and encryption are described by their sections alone; the
+// compression and encryption counts stay 0 because no CACompressionInfo or
+// CAEncryptionInfo records follow the CADataModification (the section
+// directory does).
+static void ARCreateWriteSections(ARCreateInfo *info, OSOffset dataModification)
+{
+    if (!info->sections.sectionCount && !info->sections.flags && !info->sectionSpace)
+        return;
+
+    memcpy(info->sections.magic, kARSectionMagic, 4);
+
+    memcpy(info->address + dataModification + sizeof(CADataModification), &info->sections, sizeof(ARSectionDirectory));
+}
+
+// Compress the data section in place and store its chunk index directly after it
+static bool ARCreateCompressData(ARCreateInfo *info, UInt64 dataSize, CACompressionType type, bool verbose)
+{
+    OSSize indexSize = ARChunkIndexSize(dataSize, kARChunkSize);
+    ARChunkIndex *index = info->address + (info->mappedSize - indexSize);
+
+    if (verbose) ARLog("Compressing data section...\n");
+
+    if (!ARChunkCompressData(info->address + info->dataOffset, index, type, dataSize, kARChunkSize))
+        return false;
+
+    OSOffset storedEnd = info->dataOffset + index->offsets[index->chunkCount];
+    OSOffset indexOffset = OSAlignUpward(storedEnd, 8);
+
+    memset(info->address + storedEnd, 0, indexOffset - storedEnd);
+    memmove(info->address + indexOffset, index, indexSize);
+
+    ARCreateAddSection(info, kARSectionTypeChunkIndex, indexOffset, indexSize);
+    info->archiveSize = indexOffset + indexSize;
+    info->dataEnd = storedEnd;
+
+    if (verbose) ARLog("Compressed %lu bytes into %lu bytes in %lu chunks\n", dataSize, storedEnd - info->dataOffset, ((ARChunkIndex *)(info->address + indexOffset))->chunkCount);
+    return true;
+}
+
+// Append the per-entry checksum table. The table is left in the clear so
+// entries can be compared without a key.
+static void ARCreateWriteChecksums(ARCreateInfo *info, const UInt32 *checksums, OSCount entryCount)
+{
+    OSOffset tableOffset = OSAlignUpward(info->archiveSize, 8);
+    OSSize tableSize = sizeof(ARChecksumTable) + (entryCount * sizeof(UInt32));
+    ARChecksumTable *table = info->address + tableOffset;
+
+    memset(info->address + info->archiveSize, 0, tableOffset - info->archiveSize);
+
+    table->checksumType = kARChecksumTypeCRC32C;
+    table->reserved = 0;
+    table->entryCount = entryCount;
+    memcpy(table->checksums, checksums, entryCount * sizeof(UInt32));
+
+    ARCreateAddSection(info, kARSectionTypeEntryChecksums, tableOffset, tableSize);
+    info->archiveSize = tableOffset + tableSize;
+}
+
+#define ARCreateSparseMapSize(directory) (sizeof(ARSparseMap) + ((directory)->sparseCount * sizeof(ARSparseEntry)) + ((directory)->extentCount * sizeof(ARSparseExtent)))
+
+// Collect the extents of every sparse entry (in ToC order) into a sparse
+// map. The directory must have at least one sparse entry.
+static ARSparseMap *ARCreateBuildSparseMap(ARDirectoryStructure *directory)
+{
+    ARSparseMap *map = malloc(ARCreateSparseMapSize(directory));
+    OSCount entryCount = 0;
+    OSCount extentCount = 0;
+    OSIndex index = 0;
+
+    if (!map)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    ARSparseExtent *extents = (ARSparseExtent *)&map->entries[directory->sparseCount];
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next, index++)
+    {
+        if (!entry->sparse)
+            continue;
+
+        ARSparseEntry *sparseEntry = &map->entries[entryCount++];
+
+        sparseEntry->entryIndex = index;
+        sparseEntry->fileSize = entry->fileSize;
+        sparseEntry->firstExtent = extentCount;
+        sparseEntry->extentCount = entry->extentCount;
+
+        memcpy(&extents[extentCount], entry->extents, entry->extentCount * sizeof(ARSparseExtent));
+        extentCount += entry->extentCount;
+    }
+
+    map->entryCount = entryCount;
+    map->extentCount = extentCount;
+
+    return map;
+}
+
+// Append the sparse map. Like the checksum table, it is left in the clear.
+static void ARCreateWriteSparseMap(ARCreateInfo *info, const ARSparseMap *map, OSSize mapSize)
+{
+    OSOffset mapOffset = OSAlignUpward(info->archiveSize, 8);
+
+    memset(info->address + info->archiveSize, 0, mapOffset - info->archiveSize);
+    memcpy(info->address + mapOffset, map, mapSize);
+
+    ARCreateAddSection(info, kARSectionTypeSparseMap, mapOffset, mapSize);
+    info->archiveSize = mapOffset + mapSize;
+}
+
+// Encrypt everything from the ToC through the end of the stored data and
+// append the cipher parameters. This has to run after anything else which
+// reads the entries, and before the sections and checksums are written.
+static bool ARCreateEncryptArchive(ARCreateInfo *info, OSOffset tocOffset, ARCreateDataModifiers *modifiers, bool verbose)
+{
+    if (!modifiers || !modifiers->encryptArchive)
+        return true;
+
+    ARCipherInfo cipherInfo;
+    memset(&cipherInfo, 0, sizeof(ARCipherInfo));
+
+    if (!ARCipherGenerateNonce(cipherInfo.nonce))
+        return false;
+
+    ARCipher *cipher = ARCipherCreate(modifiers->encryptionType, info->key, info->keySize, cipherInfo.nonce);
+    memset(info->key, 0, sizeof(info->key));
+
+    if (!cipher)
+        return false;
+
+    cipherInfo.encryptionType = modifiers->encryptionType;
+    cipherInfo.keySize = info->keySize;
+    cipherInfo.encryptedOffset = tocOffset;
+    cipherInfo.encryptedSize = info->dataEnd - tocOffset;
+    ARCipherKeyCheck(cipher, cipherInfo.keyCheck);
+
+    if (verbose) ARLog("Encrypting %lu bytes with %s...\n", cipherInfo.encryptedSize, ARCipherImplementation(cipher));
+    ARCipherApplyParallel(cipher, info->address + tocOffset, cipherInfo.encryptedSize, tocOffset, ARPipelineDefaultWorkers());
+    ARCipherFree(cipher);
+
+    OSOffset cipherOffset = OSAlignUpward(info->archiveSize, 8);
+
+    memset(info->address + info->archiveSize, 0, cipherOffset - info->archiveSize);
+    memcpy(info->address + cipherOffset, &cipherInfo, sizeof(ARCipherInfo));
+
+    ARCreateAddSection(info, kARSectionTypeCipher, cipherOffset, sizeof(ARCipherInfo));
+    info->archiveSize = cipherOffset + sizeof(ARCipherInfo);
+
+    return true;
+}
+
+// Hash the stored data into a Merkle tree and sign it. This runs after
+// encryption (the tree covers the stored bytes, so no key is needed to
+// check it) and before the sections and checksums are written.
+static bool ARCreateSignArchive(ARCreateInfo *info, OSOffset metadataOffset, UInt64 *signatureOffset, bool verbose)
+{
+    if (!info->signingKey)
+        return true;
+
+    OSOffset treeOffset = OSAlignUpward(info->archiveSize, 8);
+    ARMerkleTree *tree = info->address + treeOffset;
+    UInt8 digest[kARSHA256DigestSize];
+
+    memset(info->address + info->archiveSize, 0, treeOffset - info->archiveSize);
+    memset(tree, 0, sizeof(ARMerkleTree));
+
+    tree->blockSize = kARMerkleBlockSize;
+    tree->dataOffset = info->dataOffset;
+    tree->dataSize = info->dataEnd - info->dataOffset;
+    tree->metadataOffset = metadataOffset;
+    tree->metadataSize = info->dataOffset - metadataOffset;
+
+    ARArchiveHeaderDigest(info->subtype, info->address, tree->headerDigest);
+    ARSHA256Process(info->address + metadataOffset, tree->metadataSize, tree->metadataDigest);
+
+    if (verbose) ARLog("Hashing %lu bytes of data...\n", tree->dataSize);
+    ARMerkleTreeBuild(tree, info->address + info->dataOffset, ARPipelineDefaultWorkers());
+
+    OSSize treeSize = ARMerkleTreeSize(tree->dataSize, tree->blockSize);
+    ARCreateAddSection(info, kARSectionTypeMerkleTree, treeOffset, treeSize);
+    ARSignatureDigest(tree, &info->sections, info->address, digest);
+
+    OSOffset offset = OSAlignUpward(treeOffset + treeSize, 8);
+    OSSize size;
+
+    memset(info->address + treeOffset + treeSize, 0, offset - (treeOffset + treeSize));
+
+    if (!ARSigningKeySign(info->signingKey, digest, info->address + offset, &size))
+        return false;
+
+    ARCreateAddSection(info, kARSectionTypeSignature, offset, size);
+    info->archiveSize = offset + size;
+    *signatureOffset = offset;
+
+    if (verbose) ARLog("Signed %lu data blocks\n", tree->leafCount);
+    return true;
+}
+
+// CRC32 of everything from `start` to the end of the archive. The data
+// section's was worked out while writing it, so only the metadata around
+// it is read again.
+static UInt32 ARCreateArchiveChecksum(ARCreateInfo *info, OSOffset start)
+{
+    if (!info->haveDataChecksum)
+        return ARCRC32Process(info->address + start, info->archiveSize - start);
+
+    UInt32 checksum = ARCRC32Process(info->address + start, info->dataOffset - start);
+    checksum = ARCRC32Combine(checksum, info->dataChecksum, info->dataEnd - info->dataOffset);
+
+    if (info->archiveSize > info->dataEnd)
+        checksum = ARCRC32Combine(checksum, ARCRC32Process(info->address + info->dataEnd, info->archiveSize - info->dataEnd), info->archiveSize - info->dataEnd);
+
+    return checksum;
+}
+
+// Unmap the archive, trim anything mapped but unused and close it
+static bool ARCreateFinish(ARCreateInfo *info)
+{
+    bool success = ARCreateUnmapArchive(info->address, info->mappedSize);
+    memset(info->key, 0, sizeof(info->key));
+
+    if (info->archiveSize != info->mappedSize && ftruncate(info->fd, info->archiveSize))
+    {
+        fprintf(stderr, "Error: Could not truncate archive to %lu bytes!\n", info->archiveSize);
+        success = false;
+    }
+
+    success = ARCreateCloseArchive(info->fd) && success;
+
+    if (info->manifest)
+    {
+        success = success && ARManifestWrite(info->manifest, info->manifestPath, info->archiveSize);
+
+        ARManifestFree(info->manifest);
+        free(info->manifestPath);
+    }
+
+    if (info->signingKey)
+        ARSigningKeyFree(info->signingKey);
+
+    free(info);
+
+    return success;
+}
+
+// Clean up after a failed build without writing its manifest
+static bool ARCreateAbort(ARCreateInfo *info)
+{
+    if (info->manifest)
+    {
+        ARManifestFree(info->manifest);
+        free(info->manifestPath);
+
+        info->manifest = kOSNullPointer;
+    }
+
+    ARCreateFinish(info);
+    return false;
+}
+
+// `bootPaths` optionally lists (null terminated) source paths of boot
+// critical files to lay out first in the data section.
+ARCreateInfo *ARCreateArchive(ARSubtype subtype, const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, OSOffset tocOffset, ARCreateDataModifiers *modifiers, const OSUTF8Char *const *bootPaths, bool verbose)
+{
+    const OSUTF8Char *sourceArchive = modifiers ? modifiers->sourceArchive : kOSNullPointer;
+    const OSUTF8Char *sourceTar = modifiers ? modifiers->sourceTar : kOSNullPointer;
+
+    if (!ARCreatePretest((sourceArchive || sourceTar) ? kOSNullPointer : rootDirectory, archive))
+        return kOSNullPointer;
+
+    // Decide on the encryption before anything else looks at it
+    if (sourceArchive && !modifiers->encryptArchive && !modifiers->decryptArchive && !ARRepackKeepCipher(sourceArchive, subtype, modifiers))
+        return kOSNullPointer;
+
+    bool compress = (modifiers && modifiers->compressData);
+    bool encrypt = (modifiers && modifiers->encryptArchive);
+    bool checksum = (modifiers && modifiers->checksumEntries);
+    bool manifest = (modifiers && (modifiers->writeManifest || modifiers->previousArchive));
+    UInt8 key[kARCipherMaxKeySize];
+    OSSize keySize = 0;
+
+    if (compress && !ARCompressionSupported(modifiers->compressionType))
+    {
+        fprintf(stderr, "Error: Requested compression type is not supported!\n");
+        return kOSNullPointer;
+    }
+
+    if (encrypt)
+    {
+        if (!modifiers->keyFile)
+        {
+            fprintf(stderr, "Error: Encrypting an archive requires a key file!\n");
+            return kOSNullPointer;
+        }
+
+        if (!ARCipherLoadKey(modifiers->keyFile, key, &keySize))
+            return kOSNullPointer;
+    }
+
+    ARSigningKey *signingKey = kOSNullPointer;
+
+    if (modifiers && modifiers->signingCertificate)
+    {
+        signingKey = ARSigningKeyLoad(modifiers->signingCertificate);
+        if (!signingKey) return kOSNullPointer;
+    }
+
+    // Repacked and imported entries have their archive paths
+    ARDirectoryStructure *directory = ARDirectoryStructureCreate((sourceArchive || sourceTar) ? (const OSUTF8Char *)"" : rootDirectory);
+
+    if (!directory)
+    {
+        ARSigningKeyFree(signingKey);
+        return kOSNullPointer;
+    }
+
+    directory->detectHoles = (modifiers && modifiers->sparseFiles);
+    directory->identifyFiles = (manifest || (modifiers && modifiers->deduplicate));
+
+    if (modifiers && modifiers->filterFile && !(directory->filter = ARFilterLoad(modifiers->filterFile)))
+    {
+        ARDirectoryStructureFree(directory);
+        ARSigningKeyFree(signingKey);
+        return kOSNullPointer;
+    }
+
+    if (verbose) ARLog("D /\n");
+    // Compact entry tables and System Images record each entry's parent
+    bool compact = (subtype == kARSubtype2 && modifiers && modifiers->compactEntries);
+    bool sorted = (modifiers && (modifiers->canonicalOrder || sourceTar));
+    bool haveStructure;
+
+    if (sourceArchive) haveStructure = ARRepackLoadEntries(directory, sourceArchive, modifiers->keyFile, (subtype == kARSubtypeSystemImage || compact), sorted);
+    else if (sourceTar) haveStructure = ARTarLoadEntries(directory, sourceTar, (subtype == kARSubtypeSystemImage || compact), verbose);
+    else haveStructure = AREnumerateDirectory(directory, (subtype == kARSubtypeSystemImage || compact), sorted, verbose);
+
+    directory->head->path[directory->nameSkip] = '/';
+
+    if (haveStructure && directory->sparseCount && subtype == kARSubtype1)
+    {
+        fprintf(stderr, "Error: Subtype 1 archives can't hold sparse files!\n");
+        haveStructure = false;
+    }
+
+    if (haveStructure && modifiers && modifiers->deduplicate)
+        haveStructure = ARDeduplicateEntries(directory, verbose);
+
+    const OSUTF8Char *bootProfile = modifiers ? modifiers->bootProfile : kOSNullPointer;
+    ARLayoutPlan *plan = kOSNullPointer;
+
+    if (haveStructure && (bootPaths || bootProfile))
+        haveStructure = !!(plan = ARLayoutPlanCreate(bootPaths, directory->nameSkip, bootProfile));
+
+    if (haveStructure)
+        haveStructure = ARDirectoryLayoutData(directory, plan, verbose);
+
+    ARLayoutPlanFree(plan);
+
+    if (!haveStructure)
+    {
+        ARDirectoryStructureFree(directory);
+        ARSigningKeyFree(signingKey);
+        return kOSNullPointer;
+    }
+
+    int fd = ARCreateOpenArchive(archive);
+
+    if (fd == -1)
+    {
+        ARDirectoryStructureFree(directory);
+        ARSigningKeyFree(signingKey);
+        return kOSNullPointer;
+    }
+
+    bool narrow = !compact && ARCreateFitsNarrow(directory);
+    UInt8 headerFlags = (compact ? kARHeaderFlagCompactEntries : 0) | (narrow ? kARHeaderFlagNarrowOffsets : 0) | (directory->sparseCount ? kARHeaderFlagSparseEntries : 0);
+    OSIndex bootEntries[kARCreateMaxBootPaths];
+
+    ARCreateFindBootEntries(directory, bootPaths, bootEntries);
+
+    OSOffset entryTableOffset = tocOffset + ((narrow ? sizeof(UInt32) : sizeof(UInt64)) * directory->entryCount);
+    if (compact) entryTableOffset = tocOffset + ARCompactTableSize(directory->entryCount);
+    if (subtype == kARSubtypeSystemImage) entryTableOffset = OSAlignUpward(entryTableOffset, kARBlockSize);
+    entryTableOffset += sizeof(UInt32); // Entry Table is offset by 4 bytes
+
+    if (!ARCreateSeekInArchive(fd, entryTableOffset))
+    {
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+        ARSigningKeyFree(signingKey);
+
+        return kOSNullPointer;
+    }
+
+    OSOffset finalEntryOffset;
+
+    if (compact) finalEntryOffset = ARCreateWriteCompactEntries(directory, fd, tocOffset, entryTableOffset, verbose);
+    else if (subtype == kARSubtypeSystemImage) finalEntryOffset = ARCreateWriteToCAndEntriesSystemImage(subtype, directory, fd, tocOffset, narrow, verbose);
+    else finalEntryOffset = ARCreateWriteToCAndEntries(subtype, directory, fd, tocOffset, narrow, verbose);
+
+    if (finalEntryOffset == -1)
+    {
+        ARSigningKeyFree(signingKey);
+        return kOSNullPointer;
+    }
+
+    OSOffset dataOffset = entryTableOffset + finalEntryOffset;
+
+    if (subtype == kARSubtypeSystemImage) dataOffset = OSAlignUpward(dataOffset, kARBlockSize);
+    else dataOffset = OSAlignUpward(dataOffset, 8);
+
+    // Page aligned boot data is only page aligned in the file if the data section is
+    if (bootPaths || bootProfile) dataOffset = OSAlignUpward(dataOffset, kARBootAlignment);
+
+    if (!ARCreateSeekInArchive(fd, dataOffset))
+    {
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+        ARSigningKeyFree(signingKey);
+        
+        return kOSNullPointer;
+    }
+
+    OSSize archiveSize = dataOffset + directory->fullSize;
+    OSSize mappedSize = archiveSize;
+    UInt64 dataSize = directory->fullSize;
+    OSSize sparseMapSize = directory->sparseCount ? ARCreateSparseMapSize(directory) : 0;
+
+    // The chunk index is built at the very end of the mapping while compressing
+    if (compress) mappedSize = OSAlignUpward(archiveSize, 8) + ARChunkIndexSize(dataSize, kARChunkSize);
+    if (checksum) mappedSize = OSAlignUpward(mappedSize, 8) + sizeof(ARChecksumTable) + (sizeof(UInt32) * directory->entryCount);
+    if (sparseMapSize) mappedSize = OSAlignUpward(mappedSize, 8) + sparseMapSize;
+    if (encrypt) mappedSize = OSAlignUpward(mappedSize, 8) + sizeof(ARCipherInfo);
+    if (signingKey) mappedSize = OSAlignUpward(mappedSize, 8) + ARMerkleTreeSize(dataSize, kARMerkleBlockSize) + 8 + ARSigningKeySignatureSize(signingKey);
+
+    OSUTF8Char *file = ARCreateMapArchive(fd, mappedSize);
+    OSOffset dataSectionOffset = dataOffset;
+    OSCount entryCount = directory->entryCount;
+    OSUTF8Char *manifestPath = kOSNullPointer;
+    ARCreateDataSource source;
+
+    memset(&source, 0, sizeof(ARCreateDataSource));
+    source.fuseChecksums = (!compress && !encrypt);
+
+    if (file == MAP_FAILED)
+    {
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+        ARSigningKeyFree(signingKey);
+
+        return kOSNullPointer;
+    }
+
+    bool haveSource = true;
+
+    if (checksum && !(source.checksums = malloc(sizeof(UInt32) * entryCount)))
+        haveSource = false;
+
+    if (manifest && (!(source.manifest = ARManifestCreate()) || asprintf((char **)&manifestPath, "%s.manifest", archive) == -1))
+        haveSource = false;
+
+    if (haveSource && modifiers && modifiers->previousArchive)
+        haveSource = ARCreateOpenPrevious(&source, modifiers->previousArchive, modifiers->keyFile);
+
+    if (!haveSource)
+    {
+        fprintf(stderr, "Error: Could not prepare data sources!\n");
+        ARCreateCloseDataSource(&source);
+        ARCreateUnmapArchive(file, mappedSize);
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+        ARSigningKeyFree(signingKey);
+
+        return kOSNullPointer;
+    }
+
+    if (!CACreateWriteDataSection(directory, fd, file, mappedSize, dataOffset, &source, verbose))
+    {
+        ARCreateCloseDataSource(&source);
+        ARCreateCloseArchive(fd);
+        free(manifestPath);
+        ARSigningKeyFree(signingKey);
+
+        return kOSNullPointer;
+    }
+
+    if (source.previous && verbose)
+        ARLog("Reused %lu entries (%lu bytes) from '%s'\n", source.reusedCount, source.reusedSize, modifiers->previousArchive);
+
+    ARSparseMap *sparseMap = sparseMapSize ? ARCreateBuildSparseMap(directory) : kOSNullPointer;
+    ARDirectoryStructureFree(directory);
+    ARCreateInfo *stats = malloc(sizeof(ARCreateInfo));
+
+    if (!stats || (sparseMapSize && !sparseMap))
+    {
+        if (!stats) fprintf(stderr, "Error: Out of memory!\n");
+
+        free(sparseMap);
+        free(stats);
+        ARCreateCloseDataSource(&source);
+        ARCreateUnmapArchive(file, mappedSize);
+        ARCreateCloseArchive(fd);
+        free(manifestPath);
+        ARSigningKeyFree(signingKey);
+
+        return false;
+    }
+
+    memset(stats, 0, sizeof(ARCreateInfo));
+    stats->archiveSize = archiveSize;
+    stats->mappedSize = mappedSize;
+    stats->address = file;
+    stats->fd = fd;
+
+    stats->entryOffset = entryTableOffset;
+    stats->dataOffset = dataSectionOffset;
+    stats->dataEnd = archiveSize;
+
+    memcpy(stats->key, key, keySize);
+    stats->keySize = keySize;
+    memset(key, 0, sizeof(key));
+
+    stats->signingKey = signingKey;
+    stats->subtype = subtype;
+
+    stats->headerFlags = headerFlags;
+    stats->sectionSpace = !!ARCreateSectionSpace(modifiers);
+    stats->haveDataChecksum = source.fuseChecksums;
+    stats->dataChecksum = source.dataChecksum;
+    memcpy(stats->bootEntries, bootEntries, sizeof(bootEntries));
+
+    if (sorted)
+        stats->sections.flags |= kARSectionFlagSortedEntries;
+
+    // The new manifest is only written out once the archive is complete
+    stats->manifest = source.manifest;
+    stats->manifestPath = manifestPath;
+    source.manifest = kOSNullPointer;
+
+    if (compress && !ARCreateCompressData(stats, dataSize, modifiers->compressionType, verbose))
+    {
+        ARCreateCloseDataSource(&source);
+        ARCreateAbort(stats);
+        free(sparseMap);
+
+        return kOSNullPointer;
+    }
+
+    if (checksum)
+        ARCreateWriteChecksums(stats, source.checksums, entryCount);
+
+    if (sparseMap)
+        ARCreateWriteSparseMap(stats, sparseMap, sparseMapSize);
+
+    free(sparseMap);
+
+    ARCreateCloseDataSource(&source);
+    return stats;
+}
+
+#pragma mark - Tar Streaming
+
+// Whether the tar import for a Subtype 2 archive can be written in stream
+// order: only pipes need it, since files are read in place, and only data
+// which is stored as it is can go in before the headers are all known.
+static bool ARTarCanStream(const OSUTF8Char *path, ARCreateDataModifiers *modifiers)
+{
+    struct stat stats;
+
+    if (modifiers->compressData || modifiers->encryptArchive || modifiers->signingCertificate || modifiers->compactEntries || modifiers->deduplicate || modifiers->bootProfile)
+        return false;
+
+    int result = strcmp((char *)path, "-") ? stat((char *)path, &stats) : fstat(STDIN_FILENO, &stats);
+    return (!result && !S_ISREG(stats.st_mode));
+}
+
+// Build a Subtype 2 archive from a tar stream which can only be read once.
+// Payloads are written into the data section in stream order as they go
+// by, hardlinks share the data of their target, and the ToC and entry
+// table (which can't be written before the stream ends) follow the data
+// as they do in appended archives. Data of members replaced later in the
+// stream stays behind unused, like superseded data of an appended archive.
+static bool ARCreateStreamTar(const OSUTF8Char *path, const OSUTF8Char *archive, ARCreateDataModifiers *modifiers, bool verbose)
+{
+    if (!ARCreatePretest(kOSNullPointer, archive))
+        return false;
+
+    OSOffset dataOffset = OSAlignUpward(sizeof(CAHeaderS2) + sizeof(CADataModification) + sizeof(ARSectionDirectory), 8);
+    ARDirectoryStructure *directory = ARDirectoryStructureCreate((const OSUTF8Char *)"");
+    ARTarStream stream;
+
+    if (!directory)
+        return false;
+
+    int fd = ARCreateOpenArchive(archive);
+
+    if (fd == -1 || !ARCreateSeekInArchive(fd, dataOffset) || !ARTarOpenStream(&stream, path))
+    {
+        ARDirectoryStructureFree(directory);
+        if (fd != -1) ARCreateCloseArchive(fd);
+
+        return false;
+    }
+
+    stream.output = fd;
+    stream.direct = true;
+    stream.checksums = modifiers->checksumEntries;
+
+    if (verbose) ARLog("D /\n");
+
+    bool success = ARTarLoadMembers(directory, &stream, false, verbose);
+    directory->head->path[directory->nameSkip] = '/';
+
+    close(stream.fd);
+    free(stream.buffer);
+
+    OSCount entryCount = directory->entryCount;
+    UInt32 *checksums = (success && stream.checksums) ? malloc(sizeof(UInt32) * entryCount) : kOSNullPointer;
+    ARCreateInfo *info = success ? malloc(sizeof(ARCreateInfo)) : kOSNullPointer;
+    OSIndex index = 0;
+
+    if (success && (!info || (stream.checksums && !checksums)))
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        success = false;
+    }
+
+    if (!success)
+    {
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+        free(checksums);
+        free(info);
+
+        return false;
+    }
+
+    // Everything is already where the stream put it
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next, index++)
+    {
+        bool hasData = (entry->type == kCAEntryTypeFile || entry->type == kCAEntryTypeLink);
+
+        entry->dataOffset = hasData ? entry->sourceOffset : 0;
+        if (checksums) checksums[index] = (hasData && entry->size) ? entry->checksum : 0;
+    }
+
+    directory->fullSize = stream.outputSize;
+
+    memset(info, 0, sizeof(ARCreateInfo));
+    info->subtype = kARSubtype2;
+    info->fd = fd;
+    info->dataOffset = dataOffset;
+    info->dataEnd = dataOffset + stream.outputSize;
+    info->archiveSize = info->dataEnd;
+    info->sectionSpace = true;
+    info->haveDataChecksum = true;
+    info->dataChecksum = ARCRC32Finalize(stream.dataChecksum);
+    info->sections.flags = kARSectionFlagSortedEntries;
+
+    if (verbose) ARLog("Streamed %lu bytes of data into the archive\n", stream.outputSize);
+
+    if (checksums)
+    {
+        OSSize mappedSize = OSAlignUpward(info->archiveSize, 8) + sizeof(ARChecksumTable) + (sizeof(UInt32) * entryCount);
+        success = ((info->address = ARCreateMapArchive(fd, mappedSize)) != MAP_FAILED);
+
+        if (success)
+        {
+            ARCreateWriteChecksums(info, checksums, entryCount);
+            success = ARCreateUnmapArchive(info->address, mappedSize);
+        }
+
+        free(checksums);
+    }
+
+    bool narrow = ARCreateFitsNarrow(directory);
+    OSOffset tocOffset = OSAlignUpward(info->archiveSize, 8);
+    OSOffset entryTableOffset = tocOffset + ((narrow ? sizeof(UInt32) : sizeof(UInt64)) * entryCount) + sizeof(UInt32);
+
+    if (!success || !ARCreateSeekInArchive(fd, entryTableOffset))
+    {
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+        free(info);
+
+        return false;
+    }
+
+    // Frees the directory and closes the archive if it fails
+    OSOffset finalEntryOffset = ARCreateWriteToCAndEntries(kARSubtype2, directory, fd, tocOffset, narrow, verbose);
+
+    if (finalEntryOffset == -1)
+    {
+        free(info);
+        return false;
+    }
+
+    ARDirectoryStructureFree(directory);
+
+    info->archiveSize = info->mappedSize = entryTableOffset + finalEntryOffset;
+
+    if ((info->address = ARCreateMapArchive(fd, info->mappedSize)) == MAP_FAILED)
+    {
+        ARCreateCloseArchive(fd);
+        free(info);
+
+        return false;
+    }
+
+    CAHeaderS2 *header = info->address;
+    memcpy(&header->magic, kCAHeaderMagic, 4);
+    memcpy(&header->version, kCAHeaderVersionS2, 4);
+    header->version[3] = kARHeaderFlagTrailingEntries | (narrow ? kARHeaderFlagNarrowOffsets : 0);
+
+    header->tocOffset = tocOffset;
+    header->dataModification = sizeof(CAHeaderS2);
+    header->dataSectionOffset = dataOffset;
+    header->entryTableOffset = entryTableOffset;
+
+    ARCreateWriteSections(info, header->dataModification);
+
+    if (verbose) ARLog("Generating checksums...\n");
+    header->dataChecksum = ARCreateArchiveChecksum(info, sizeof(CAHeaderS2));
+
+    header->headerChecksum = ARArchiveHeaderChecksum(kARSubtype2, header);
+
+    if (verbose) ARLog("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
+    return ARCreateFinish(info);
+}
+
+bool ARCreateSubtype1(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers)
+{
+    // Subtype 1 archives hold nothing but entries and data
+    ARCreateDataModifiers plain;
+    memset(&plain, 0, sizeof(ARCreateDataModifiers));
+
+    if (modifiers)
+    {
+        plain.sourceArchive = modifiers->sourceArchive;
+        plain.sourceTar = modifiers->sourceTar;
+        plain.keyFile = modifiers->keyFile;
+        plain.decryptArchive = modifiers->decryptArchive;
+        plain.filterFile = modifiers->filterFile;
+    }
+
+    ARCreateInfo *stats = ARCreateArchive(kARSubtype1, rootDirectory, archive, sizeof(CAHeaderS1), &plain, kOSNullPointer, verbose);
+    if (!stats) return false;
+
+    CAHeaderS1 *header = stats->address;
+    memcpy(&header->magic, kCAHeaderMagic, 4);
+    memcpy(&header->version, kCAHeaderVersionS1, 4);
+    header->version[3] = stats->headerFlags;
+
+    header->dataSectionOffset = stats->dataOffset;
+    header->entryTableOffset = stats->entryOffset;
+
+    if (verbose) ARLog("Generating checksums...\n");
+    header->dataChecksum = ARCreateArchiveChecksum(stats, sizeof(CAHeaderS1));
+    header->headerChecksum = ARArchiveHeaderChecksum(kARSubtype1, header);
+
+    if (verbose) ARLog("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
+    return ARCreateFinish(stats);
+}
+
+bool ARCreateSubtype2(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers)
+{
+    if (modifiers && modifiers->sourceTar && ARTarCanStream(modifiers->sourceTar, modifiers))
+        return ARCreateStreamTar(modifiers->sourceTar, archive, modifiers, verbose);
+
+    OSOffset tocOffset = sizeof(CAHeaderS2) + sizeof(CADataModification) + ARCreateSectionSpace(modifiers);
+    ARCreateInfo *stats = ARCreateArchive(kARSubtype2, rootDirectory, archive, tocOffset, modifiers, kOSNullPointer, verbose);
+    if (!stats) return false;
+
+    CAHeaderS2 *header = stats->address;
+    memcpy(&header->magic, kCAHeaderMagic, 4);
+    memcpy(&header->version, kCAHeaderVersionS2, 4);
+    header->version[3] = stats->headerFlags;
+
+    header->tocOffset = tocOffset;
+    header->dataModification = sizeof(CAHeaderS2);
+    header->dataSectionOffset = stats->dataOffset;
+    header->entryTableOffset = stats->entryOffset;
+
+    if (!ARCreateEncryptArchive(stats, tocOffset, modifiers, verbose) || !ARCreateSignArchive(stats, tocOffset, &header->archiveSignature, verbose))
+    {
+        return ARCreateAbort(stats);
+    }
+
+    ARCreateWriteSections(stats, header->dataModification);
+
+    if (verbose) ARLog("Generating checksums...\n");
+    header->dataChecksum = ARCreateArchiveChecksum(stats, sizeof(CAHeaderS2));
+
+    header->headerChecksum = ARArchiveHeaderChecksum(kARSubtype2, header);
+
+    if (verbose) ARLog("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
+    return ARCreateFinish(stats);
+}
+
+bool ARCreateBootX(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers, UInt16 architecture, UInt32 bootID, const OSUTF8Char *kernelLoaderPath, const OSUTF8Char *kernelPath, const OSUTF8Char *bootConfigPath)
+{
+    OSOffset tocOffset = sizeof(CAHeaderBootX) + sizeof(CADataModification) + ARCreateSectionSpace(modifiers);
+    const OSUTF8Char *bootPaths[] = {kernelLoaderPath, kernelPath, bootConfigPath, kOSNullPointer};
+    ARCreateInfo *stats = ARCreateArchive(kARSubtypeBootX, rootDirectory, archive, tocOffset, modifiers, bootPaths, verbose);
+    if (!stats) return false;
+
+    CAHeaderBootX *header = stats->address;
+    memcpy(&header->magic, kCAHeaderMagic, 4);
+    memcpy(&header->version, kCAHeaderVersionBootX, 4);
+    header->version[3] = stats->headerFlags;
+
+    header->dataSectionOffset = stats->dataOffset;
+    header->entryTableOffset = stats->entryOffset;
+
+    header->processorType = architecture;
+    header->bootID = bootID;
+
+    header->kernelLoaderEntry = stats->bootEntries[0];
+    header->kernelEntry = stats->bootEntries[1];
+    header->bootConfigEntry = stats->bootEntries[2];
+
+    if (verbose)
+    {
+        if (header->kernelLoaderEntry) ARLog("Kernel Loader Entry: %hu\n", header->kernelLoaderEntry);
+        if (header->kernelEntry) ARLog("Kernel Entry: %hu\n", header->kernelEntry);
+        if (header->bootConfigEntry) ARLog("Boot Config Entry: %hu\n", header->bootConfigEntry);
+    }
+
+    header->lockA = kCAHeaderBootXLockAValue;
+    header->lockB = kCAHeaderBootXLockBValue;
+
+    // BootX headers have no signature field; the signature is found through the section directory
+    UInt64 signatureOffset = 0;
+
+    if (!ARCreateEncryptArchive(stats, tocOffset, modifiers, verbose) || !ARCreateSignArchive(stats, tocOffset, &signatureOffset, verbose))
+    {
+        return ARCreateAbort(stats);
+    }
+
+    ARCreateWriteSections(stats, sizeof(CAHeaderBootX));
+
+    if (verbose) ARLog("Generating checksums...\n");
+    header->dataChecksum = ARCreateArchiveChecksum(stats, sizeof(CAHeaderBootX));
+
+    header->headerChecksum = ARArchiveHeaderChecksum(kARSubtypeBootX, header);
+
+    if (verbose) ARLog("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
+    return ARCreateFinish(stats);
+}
+
+bool ARCreateSystemImage(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers, CASystemVersionInternal *systemVersion, const OSUTF8Char *partitionInfoPath, const OSUTF8Char *bootArchivePath)
+{
+    const OSUTF8Char *bootPaths[] = {bootArchivePath, kOSNullPointer};
+    ARCreateInfo *stats = ARCreateArchive(kARSubtypeSystemImage, rootDirectory, archive, kARBlockSize * 2, modifiers, bootArchivePath ? bootPaths : kOSNullPointer, verbose);
     if (!stats) return false;
 
     CAHeaderSystemImage *header = stats->address;
     memcpy(&header->magic, kCAHeaderMagic, 4);
     memcpy(&header->version, kCAHeaderVersionSystem, 4);
+    header->version[3] = stats->headerFlags;
     memcpy(&header->systemVersion, systemVersion, sizeof(CASystemVersionInternal));
 
     header->tocOffset = 2 * kARBlockSize;
@@ -910,51 +4139,417 @@ bool ARCreateSystemImage(const OSUTF8Char *rootDirectory, const OSUTF8Char *arch
     header->dataModification = kARBlockSize;
 
     if (bootArchivePath) {
-        OSOffset *final = stats->address + header->entryTableOffset - sizeof(UInt32);
-        OSOffset *toc = stats->address + header->tocOffset;
-        OSSize skip = strlen((char *)rootDirectory);
-        OSOffset *base = toc;
+        header->bootEntry = stats->bootEntries[0];
+
+        if (verbose && header->bootEntry)
+            ARLog("Kernel Loader Entry: %lu\n", header->bootEntry);
+    } else {
+        // This means 'none'
+        header->bootEntry = ~((UInt64)0);
+    }
+
+    if (!ARCreateEncryptArchive(stats, header->tocOffset, modifiers, verbose) || !ARCreateSignArchive(stats, header->tocOffset, &header->archiveSignature, verbose))
+    {
+        return ARCreateAbort(stats);
+    }
+
+    ARCreateWriteSections(stats, header->dataModification);
+
+    if (verbose) ARLog("Generating checksums...\n");
+    header->dataChecksum = ARCreateArchiveChecksum(stats, sizeof(CAHeaderSystemImage));
+    header->headerChecksum = ARArchiveHeaderChecksum(kARSubtypeSystemImage, header);
+
+    if (verbose) ARLog("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
+    return ARCreateFinish(stats);
+}
+
+#pragma mark - Append
+
+// Only plain Subtype 2 archives can be appended to. Everything else has
+// data or metadata which would have to be rebuilt anyway.
+static bool ARAppendCheckArchive(ARArchive *archive, const OSUTF8Char *path)
+{
+    const char *reason = kOSNullPointer;
+
+    if (archive->subtype != kARSubtype2) {
+        reason = "only Subtype 2 archives can be appended to";
+    } else if (archive->compact) {
+        reason = "it has a compact entry table";
+    } else if (archive->chunks) {
+        reason = "it is compressed";
+    } else if (ARArchiveIsEncrypted(archive)) {
+        reason = "it is encrypted";
+    } else if (ARArchiveFindSection(archive, kARSectionTypeMerkleTree) || ARArchiveFindSection(archive, kARSectionTypeSignature)) {
+        reason = "it is signed";
+    }
+
+    if (reason)
+    {
+        fprintf(stderr, "Error: Can't append to archive '%s'; %s!\n", path, reason);
+        return false;
+    }
+
+    return true;
+}
+
+// Merge what was found under the root directory into the entries of the
+// archive. Entries the archive already has are replaced where they are
+// (directories are simply kept); new ones go at the end, or into place in
+// sorted archives. New data is laid out from `dataStart` on.
+static bool ARAppendMergeEntries(ARDirectoryStructure *directory, ARArchive *archive, const OSUTF8Char *rootDirectory, bool sorted, UInt64 dataStart, OSCount *replacedCount)
+{
+    OSCount existingCount = archive->entryCount;
+    ARDirectoryEntry **entries = malloc((existingCount + directory->entryCount) * sizeof(ARDirectoryEntry *));
+    ARDirectoryEntry *entry = directory->head;
+    ARArchiveEntry archiveEntry;
+    OSCount count = existingCount;
+    bool success = !!entries;
+
+    // The directory's entries are owned by `entries` from here on
+    directory->head = directory->tail = kOSNullPointer;
+    directory->entryCount = 0;
 
-        while (toc < final)
+    if (entries)
+        memset(entries, 0, existingCount * sizeof(ARDirectoryEntry *));
+    else
+        fprintf(stderr, "Error: Out of memory!\n");
+
+    *replacedCount = 0;
+
+    while (entry)
+    {
+        ARDirectoryEntry *next = entry->next;
+        OSIndex index = success ? ARArchiveFindEntry(archive, entry->path + directory->nameSkip, &archiveEntry) : -1;
+        bool keep = success;
+
+        entry->previous = entry->next = kOSNullPointer;
+
+        if (index != -1 && (archiveEntry.type == kCAEntryTypeDirectory) != (entry->type == kCAEntryTypeDirectory))
         {
-            CAEntryS2 *baseEntry = stats->address + header->entryTableOffset + (*toc);
+            fprintf(stderr, "Error: Can't replace entry '%s' with one of a different kind!\n", archiveEntry.path);
+            success = keep = false;
+        }
 
-            if (baseEntry->type == kCAEntryTypeFile)
-            {
-                CASystemFileEntry *entry = (CASystemFileEntry *)baseEntry;
+        if (keep && index == -1) {
+            entries[count++] = entry;
+        } else if (keep && entry->type != kCAEntryTypeDirectory) {
+            entries[index] = entry;
+            (*replacedCount)++;
+        } else {
+            ARDirectoryEntryFree(entry);
+        }
 
-                if (!strcmp((char *)entry->path, (char *)(bootArchivePath + skip)))
-                {
-                    header->bootEntry = toc - base;
+        entry = next;
+    }
 
-                    if (verbose)
-                        fprintf(stdout, "Kernel Loader Entry: %lu\n", header->bootEntry);
+    for (OSIndex i = 0; success && i < existingCount; i++)
+    {
+        if (!entries[i])
+            success = !!(entries[i] = ARDirectoryEntryCreateFromArchive(archive, i, rootDirectory));
+    }
 
-                    break;
-                }
-            }
+    if (!success)
+    {
+        for (OSIndex i = 0; entries && i < count; i++)
+        {
+            if (entries[i])
+                ARDirectoryEntryFree(entries[i]);
+        }
+
+        free(entries);
+        return false;
+    }
 
-            toc++;
+    if (sorted)
+        qsort(entries, count, sizeof(ARDirectoryEntry *), ARCompareEntryPaths);
+
+    UInt64 dataOffset = dataStart;
+
+    directory->sparseCount = 0;
+    directory->extentCount = 0;
+
+    for (OSIndex i = 0; i < count; i++)
+    {
+        entry = entries[i];
+
+        if (!entry->existing && (entry->type == kCAEntryTypeFile || entry->type == kCAEntryTypeLink))
+        {
+            entry->dataOffset = dataOffset;
+            dataOffset += entry->size;
         }
-    } else {
-        // This means 'none'
-        header->bootEntry = ~((UInt64)0);
+
+        if (entry->sparse)
+        {
+            directory->sparseCount++;
+            directory->extentCount += entry->extentCount;
+        }
+
+        entry->previous = i ? entries[i - 1] : kOSNullPointer;
+        entry->next = (i + 1 < count) ? entries[i + 1] : kOSNullPointer;
+    }
+
+    directory->head = entries[0];
+    directory->tail = entries[count - 1];
+    directory->entryCount = count;
+    directory->fullSize = dataOffset;
+
+    free(entries);
+    return true;
+}
+
+// Write the data of every entry which isn't carried over. `tail` maps the
+// archive from offset `tailOffset` into the data section on.
+static bool ARAppendWriteData(ARDirectoryStructure *directory, UInt8 *tail, UInt64 tailOffset, UInt32 *checksums, UInt64 *writtenSize, bool verbose)
+{
+    OSIndex index = 0;
+
+    for (ARDirectoryEntry *entry = directory->head; entry; entry = entry->next, index++)
+    {
+        bool hasData = (entry->type == kCAEntryTypeLink || entry->type == kCAEntryTypeFile);
+        UInt32 checksum = entry->checksum;
+
+        if (hasData && !entry->existing)
+        {
+            UInt8 *destination = tail + (entry->dataOffset - tailOffset);
+            bool written;
+
+            UInt32 checksumC = ARCRC32CInit();
+            UInt32 *checksumCUpdate = checksums ? &checksumC : kOSNullPointer;
+
+            if (entry->type == kCAEntryTypeLink) written = ARCreateWriteSymlink(destination, entry->path, entry->size, kOSNullPointer, checksumCUpdate);
+            else if (entry->sparse) written = ARCreateWriteSparseFile(destination, entry->path, entry->extents, entry->extentCount, kOSNullPointer, checksumCUpdate);
+            else written = ARCreateWriteFile(destination, entry->path, entry->size, kOSNullPointer, checksumCUpdate);
+
+            if (!written)
+                return false;
+
+            checksum = (checksums && entry->size) ? ARCRC32CFinalize(checksumC) : 0;
+            *writtenSize += entry->size;
+
+            if (verbose) ARLog("W %s\n", entry->path);
+        }
+
+        if (checksums)
+            checksums[index] = checksum;
+    }
+
+    return true;
+}
+
+// Cut off anything a failed append added. The header and section
+// directory are only rewritten once nothing else can fail, so this leaves
+// the archive as it was.
+static bool ARAppendRestore(ARArchive *archive, const OSUTF8Char *path)
+{
+    if (truncate((char *)path, archive->size))
+        fprintf(stderr, "Error: Could not truncate archive '%s' back to %lu bytes!\n", path, archive->size);
+
+    ARArchiveClose(archive);
+    return false;
+}
+
+// Add the files under `rootDirectory` to an existing archive, replacing
+// entries it already has. Nothing the archive holds is rewritten: the new
+// data, sections, ToC and entry table are all written after it and the
+// data checksum is extended rather than recomputed. Superseded data and
+// metadata stay behind until the archive is repacked.
+bool ARAppendArchive(const OSUTF8Char *rootDirectory, const OSUTF8Char *path, bool verbose)
+{
+    if (!ARDirectoryExistsAtPath(rootDirectory))
+    {
+        fprintf(stderr, "Error: Root directory for archive does not exist!\n");
+        return false;
+    }
+
+    ARArchive *archive = ARArchiveOpen(path);
+    if (!archive) return false;
+
+    if (!ARAppendCheckArchive(archive, path))
+    {
+        ARArchiveClose(archive);
+        return false;
+    }
+
+    CAHeaderS2 header = *(CAHeaderS2 *)archive->address;
+    OSOffset dataSectionOffset = archive->dataSection - (UInt8 *)archive->address;
+    OSOffset tailOffset = OSAlignUpward(archive->size, 8);
+    bool sorted = archive->sections && (archive->sections->flags & kARSectionFlagSortedEntries);
+    ARDirectoryStructure *directory = ARDirectoryStructureCreate(rootDirectory);
+    OSCount replacedCount;
+
+    if (!directory)
+    {
+        ARArchiveClose(archive);
+        return false;
+    }
+
+    // Archives with sparse entries get new ones the same way
+    directory->detectHoles = !!(ARHeaderFlags(&header) & kARHeaderFlagSparseEntries);
+
+    bool haveStructure = AREnumerateDirectory(directory, false, sorted, verbose);
+    directory->head->path[directory->nameSkip] = '/';
+
+    if (!haveStructure || !ARAppendMergeEntries(directory, archive, rootDirectory, sorted, tailOffset - dataSectionOffset, &replacedCount))
+    {
+        ARDirectoryStructureFree(directory);
+        ARArchiveClose(archive);
+
+        return false;
+    }
+
+    bool checksum = !!ARArchiveFindSection(archive, kARSectionTypeEntryChecksums);
+    bool narrow = ARCreateFitsNarrow(directory);
+    OSSize sparseMapSize = directory->sparseCount ? ARCreateSparseMapSize(directory) : 0;
+    OSCount entryCount = directory->entryCount;
+    OSSize dataEnd = dataSectionOffset + directory->fullSize;
+    OSSize mappedSize = dataEnd;
+
+    if (checksum) mappedSize = OSAlignUpward(mappedSize, 8) + sizeof(ARChecksumTable) + (sizeof(UInt32) * entryCount);
+    if (sparseMapSize) mappedSize = OSAlignUpward(mappedSize, 8) + sparseMapSize;
+
+    if ((sparseMapSize || checksum) && !archive->sections)
+    {
+        fprintf(stderr, "Error: Archive '%s' has no section directory!\n", path);
+        ARDirectoryStructureFree(directory);
+        ARArchiveClose(archive);
+
+        return false;
+    }
+
+    UInt32 *checksums = checksum ? malloc(sizeof(UInt32) * entryCount) : kOSNullPointer;
+    ARSparseMap *sparseMap = sparseMapSize ? ARCreateBuildSparseMap(directory) : kOSNullPointer;
+    int fd = open((char *)path, O_RDWR | O_CLOEXEC);
+    ARCreateInfo info;
+
+    memset(&info, 0, sizeof(ARCreateInfo));
+    info.subtype = kARSubtype2;
+    info.address = MAP_FAILED;
+    info.fd = fd;
+
+    if ((checksum && !checksums) || (sparseMapSize && !sparseMap) || fd == -1)
+    {
+        fprintf(stderr, "Error: Could not prepare to append to archive '%s'!\n", path);
+
+        free(checksums);
+        free(sparseMap);
+        ARDirectoryStructureFree(directory);
+        ARArchiveClose(archive);
+
+        if (fd != -1) close(fd);
+        return false;
+    }
+
+    // The new sections replace the old checksum table and sparse map
+    if (archive->sections)
+    {
+        for (OSIndex i = 0; i < archive->sections->sectionCount; i++)
+        {
+            ARSection *section = &archive->sections->sections[i];
+
+            if (section->type != kARSectionTypeEntryChecksums && section->type != kARSectionTypeSparseMap)
+                info.sections.sections[info.sections.sectionCount++] = *section;
+        }
+
+        info.sections.flags = archive->sections->flags;
+    }
+
+    UInt64 writtenSize = 0;
+    bool success = ((info.address = ARCreateMapArchive(fd, mappedSize)) != MAP_FAILED);
+
+    if (success)
+    {
+        info.archiveSize = dataEnd;
+        info.mappedSize = mappedSize;
+
+        success = ARAppendWriteData(directory, info.address + tailOffset, tailOffset - dataSectionOffset, checksums, &writtenSize, verbose);
     }
 
-    if (verbose) fprintf(stdout, "Generating checksums...\n");
-    header->dataChecksum = ARCRC32Process(stats->address + sizeof(CAHeaderSystemImage), stats->archiveSize - sizeof(CAHeaderSystemImage));
+    if (success && checksum)
+        ARCreateWriteChecksums(&info, checksums, entryCount);
+
+    if (success && sparseMap)
+        ARCreateWriteSparseMap(&info, sparseMap, sparseMapSize);
+
+    free(checksums);
+    free(sparseMap);
+
+    if (info.address != MAP_FAILED)
+        success = ARCreateUnmapArchive(info.address, mappedSize) && success;
+
+    // The entries go last, so the entry table runs to the end of the archive
+    OSOffset tocOffset = OSAlignUpward(info.archiveSize, 8);
+    OSOffset entryTableOffset = tocOffset + ((narrow ? sizeof(UInt32) : sizeof(UInt64)) * entryCount) + sizeof(UInt32);
+
+    if (!success || !ARCreateSeekInArchive(fd, entryTableOffset))
+    {
+        ARDirectoryStructureFree(directory);
+        ARCreateCloseArchive(fd);
+
+        return ARAppendRestore(archive, path);
+    }
+
+    // Frees the directory and closes the archive if it fails
+    OSOffset finalEntryOffset = ARCreateWriteToCAndEntries(kARSubtype2, directory, fd, tocOffset, narrow, verbose);
+
+    if (finalEntryOffset == -1)
+        return ARAppendRestore(archive, path);
+
+    ARDirectoryStructureFree(directory);
+
+    // Everything new has to be on disk before the header points at it
+    OSSize archiveSize = entryTableOffset + finalEntryOffset;
+    success = !fsync(fd) && ((info.address = ARCreateMapArchive(fd, archiveSize)) != MAP_FAILED);
+
+    if (!success)
+    {
+        fprintf(stderr, "Error: Could not finish appending to archive '%s'!\n", path);
+        ARCreateCloseArchive(fd);
+
+        return ARAppendRestore(archive, path);
+    }
+
+    // The data checksum covers everything after the header. Rewriting the
+    // section directory changes it by the checksum of the changed bits
+    // (moved to the end of the old archive), and the appended bytes are
+    // then combined in, so none of the existing data is read again.
+    UInt32 dataChecksum = header.dataChecksum;
+
+    if (archive->sections)
+    {
+        OSOffset sectionsOffset = (UInt8 *)archive->sections - (UInt8 *)archive->address;
+        UInt8 *oldSections = info.address + sectionsOffset;
+        UInt8 *newSections = (UInt8 *)&info.sections;
+        UInt8 difference[sizeof(ARSectionDirectory)];
+
+        memcpy(info.sections.magic, kARSectionMagic, 4);
+
+        for (OSIndex i = 0; i < sizeof(ARSectionDirectory); i++)
+            difference[i] = oldSections[i] ^ newSections[i];
+
+        UInt32 change = ARCRC32Update(0, difference, sizeof(ARSectionDirectory));
+        dataChecksum ^= ARCRC32Shift(change, archive->size - (sectionsOffset + sizeof(ARSectionDirectory)));
+
+        ARCreateWriteSections(&info, header.dataModification);
+    }
+
+    UInt32 tailChecksum = ARCRC32Process(info.address + archive->size, archiveSize - archive->size);
+
+    header.version[3] = (ARHeaderFlags(&header) & ~(kARHeaderFlagNarrowOffsets | kARHeaderFlagSparseEntries)) | kARHeaderFlagTrailingEntries;
+    if (narrow) header.version[3] |= kARHeaderFlagNarrowOffsets;
+    if (sparseMapSize) header.version[3] |= kARHeaderFlagSparseEntries;
+
+    header.tocOffset = tocOffset;
+    header.entryTableOffset = entryTableOffset;
+    header.dataChecksum = ARCRC32Combine(dataChecksum, tailChecksum, archiveSize - archive->size);
+    header.headerChecksum = ARArchiveHeaderChecksum(kARSubtype2, &header);
 
-    // Offset into the header for the checksum (ignored during calculation)
-    UInt32 headerChecksumOffset = sizeof(CAHeaderSystemImage) - (3 * sizeof(UInt64));
+    memcpy(info.address, &header, sizeof(CAHeaderS2));
 
-    header->headerChecksum = ARCRC32Init();
-    header->headerChecksum = ARCRC32Update(header->headerChecksum, header, headerChecksumOffset);
-    header->headerChecksum = ARCRC32Update(header->headerChecksum, header + headerChecksumOffset, kARBlockSize - (headerChecksumOffset + sizeof(UInt32)));
-    header->headerChecksum = ARCRC32Finalize(header->headerChecksum);
+    if (verbose)
+        ARLog("Appended %lu bytes (%lu entries replaced); archive is now %lu bytes\n", writtenSize, replacedCount, archiveSize);
 
-    if (verbose) printf("header: 0x%08X\ndata: 0x%08X\n", header->headerChecksum, header->dataChecksum);
-    bool failed = ARCreateUnmapArchive(stats->address, stats->archiveSize);
-    free(stats);
+    success = ARCreateUnmapArchive(info.address, archiveSize);
+    success = ARCreateCloseArchive(fd) && success;
 
-    return !failed;
+    return (ARArchiveClose(archive) && success);
 }
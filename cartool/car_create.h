@@ -11,12 +11,35 @@ typedef struct {
     bool compressEntries;
     bool compressData;
     bool encryptArchive;
+    bool checksumEntries;
+    bool deduplicate;
+    bool writeManifest;
+    bool canonicalOrder;
+    bool compactEntries;
+    bool sparseFiles;
+    const OSUTF8Char *previousArchive;
+    const OSUTF8Char *bootProfile;
+    const OSUTF8Char *keyFile;
     const OSUTF8Char *signingCertificate;
+
+    // Repack the entries and data of this archive instead of a root directory
+    const OSUTF8Char *sourceArchive;
+
+    // Repacked archives keep the source's encryption unless this is set
+    bool decryptArchive;
+
+    // Import this tar stream ('-' for stdin) instead of a root directory
+    const OSUTF8Char *sourceTar;
+
+    // Rules picking what under the root directory is archived (see car_filter.h)
+    const OSUTF8Char *filterFile;
 } ARCreateDataModifiers;
 
-bool ARCreateSubtype1(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose);
+bool ARCreateSubtype1(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers);
 bool ARCreateSubtype2(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers);
 bool ARCreateBootX(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers, UInt16 architecture, UInt32 bootID, const OSUTF8Char *kernelLoaderPath, const OSUTF8Char *kernelPath, const OSUTF8Char *bootConfigPath);
 bool ARCreateSystemImage(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose, ARCreateDataModifiers *modifiers, CASystemVersionInternal *systemVersion, const OSUTF8Char *partitionInfoPath, const OSUTF8Char *bootArchivePath);
 
+bool ARAppendArchive(const OSUTF8Char *rootDirectory, const OSUTF8Char *archive, bool verbose);
+
 #endif /* !defined(__car_create__) */
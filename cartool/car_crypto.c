@@ -0,0 +1,568 @@
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <wmmintrin.h>
+    #include <emmintrin.h>
+
+    #define kARCipherHaveAESNI 1
+#elif defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)
+    #include <arm_neon.h>
+
+    #define kARCipherHaveARMv8 1
+#endif /* defined(__x86_64__) || defined(__i386__) */
+
+#include "car_crypto.h"
+
+// Number of counter blocks encrypted per batch
+#define kARCipherBatchSize  64
+
+// Ranges are only split between threads in pieces at least this large
+#define kARCipherMinShare   (1024 * 1024)
+#define kARCipherMaxWorkers 16
+
+typedef void (*ARCipherEncryptBlocks)(ARCipher *cipher, const UInt8 *input, UInt8 *output, OSCount blocks);
+
+struct __ARCipher {
+    CAEncryptionType type;
+    UInt8 nonce[kARCipherNonceSize];
+
+    ARCipherEncryptBlocks encryptBlocks;
+    const char *implementation;
+
+    union {
+        struct {
+            UInt8 roundKeys[240];
+            UInt32 rounds;
+        } aes;
+
+        struct {
+            UInt32 subkeys[33][4];
+        } serpent;
+    } key;
+};
+
+#pragma mark - AES
+
+static const UInt8 gARAESSBox[0x100] = {
+    0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+    0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+    0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+    0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+    0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+    0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+    0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+    0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16,
+};
+
+static inline UInt8 ARAESDouble(UInt8 value)
+{
+    return (value << 1) ^ ((value & 0x80) ? 0x1B : 0x00);
+}
+
+static void ARAESExpandKey(ARCipher *cipher, const UInt8 *key, OSSize keySize)
+{
+    UInt8 *roundKeys = cipher->key.aes.roundKeys;
+    UInt32 words = keySize / 4;
+    UInt32 rounds = words + 6;
+    UInt8 rcon = 0x01;
+
+    memcpy(roundKeys, key, keySize);
+    cipher->key.aes.rounds = rounds;
+
+    for (UInt32 i = words; i < 4 * (rounds + 1); i++)
+    {
+        UInt8 temp[4];
+        memcpy(temp, roundKeys + 4 * (i - 1), 4);
+
+        if (!(i % words)) {
+            UInt8 first = temp[0];
+
+            temp[0] = gARAESSBox[temp[1]] ^ rcon;
+            temp[1] = gARAESSBox[temp[2]];
+            temp[2] = gARAESSBox[temp[3]];
+            temp[3] = gARAESSBox[first];
+
+            rcon = ARAESDouble(rcon);
+        } else if (words > 6 && (i % words) == 4) {
+            for (OSIndex j = 0; j < 4; j++)
+                temp[j] = gARAESSBox[temp[j]];
+        }
+
+        for (OSIndex j = 0; j < 4; j++)
+            roundKeys[4 * i + j] = roundKeys[4 * (i - words) + j] ^ temp[j];
+    }
+}
+
+// Portable fallback; one byte at a time
+static void ARAESEncryptBlock(const UInt8 *roundKeys, UInt32 rounds, const UInt8 *input, UInt8 *output)
+{
+    UInt8 state[16];
+    UInt8 temp[16];
+
+    for (OSIndex i = 0; i < 16; i++)
+        state[i] = input[i] ^ roundKeys[i];
+
+    for (UInt32 round = 1; round <= rounds; round++)
+    {
+        // SubBytes and ShiftRows
+        for (OSIndex column = 0; column < 4; column++)
+            for (OSIndex row = 0; row < 4; row++)
+                temp[4 * column + row] = gARAESSBox[state[4 * ((column + row) & 3) + row]];
+
+        // MixColumns
+        if (round != rounds)
+        {
+            for (OSIndex column = 0; column < 4; column++)
+            {
+                UInt8 *a = temp + (4 * column);
+                UInt8 all = a[0] ^ a[1] ^ a[2] ^ a[3];
+                UInt8 first = a[0];
+
+                a[0] ^= all ^ ARAESDouble(a[0] ^ a[1]);
+                a[1] ^= all ^ ARAESDouble(a[1] ^ a[2]);
+                a[2] ^= all ^ ARAESDouble(a[2] ^ a[3]);
+                a[3] ^= all ^ ARAESDouble(a[3] ^ first);
+            }
+        }
+
+        for (OSIndex i = 0; i < 16; i++)
+            state[i] = temp[i] ^ roundKeys[(16 * round) + i];
+    }
+
+    memcpy(output, state, 16);
+}
+
+static void ARAESEncryptBlocks(ARCipher *cipher, const UInt8 *input, UInt8 *output, OSCount blocks)
+{
+    for (OSIndex i = 0; i < blocks; i++)
+        ARAESEncryptBlock(cipher->key.aes.roundKeys, cipher->key.aes.rounds, input + (16 * i), output + (16 * i));
+}
+
+#if defined(kARCipherHaveAESNI)
+
+__attribute__((target("aes,sse2"))) static void ARAESEncryptBlocksAESNI(ARCipher *cipher, const UInt8 *input, UInt8 *output, OSCount blocks)
+{
+    UInt32 rounds = cipher->key.aes.rounds;
+    __m128i keys[15];
+    OSIndex i = 0;
+
+    for (UInt32 round = 0; round <= rounds; round++)
+        keys[round] = _mm_loadu_si128((const __m128i *)(cipher->key.aes.roundKeys + (16 * round)));
+
+    // Four blocks at a time keeps the AES unit busy
+    for ( ; i + 4 <= blocks; i += 4)
+    {
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + (16 * i) +  0)), keys[0]);
+        __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + (16 * i) + 16)), keys[0]);
+        __m128i b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + (16 * i) + 32)), keys[0]);
+        __m128i b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + (16 * i) + 48)), keys[0]);
+
+        for (UInt32 round = 1; round < rounds; round++)
+        {
+            b0 = _mm_aesenc_si128(b0, keys[round]);
+            b1 = _mm_aesenc_si128(b1, keys[round]);
+            b2 = _mm_aesenc_si128(b2, keys[round]);
+            b3 = _mm_aesenc_si128(b3, keys[round]);
+        }
+
+        _mm_storeu_si128((__m128i *)(output + (16 * i) +  0), _mm_aesenclast_si128(b0, keys[rounds]));
+        _mm_storeu_si128((__m128i *)(output + (16 * i) + 16), _mm_aesenclast_si128(b1, keys[rounds]));
+        _mm_storeu_si128((__m128i *)(output + (16 * i) + 32), _mm_aesenclast_si128(b2, keys[rounds]));
+        _mm_storeu_si128((__m128i *)(output + (16 * i) + 48), _mm_aesenclast_si128(b3, keys[rounds]));
+    }
+
+    for ( ; i < blocks; i++)
+    {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(input + (16 * i))), keys[0]);
+
+        for (UInt32 round = 1; round < rounds; round++)
+            block = _mm_aesenc_si128(block, keys[round]);
+
+        _mm_storeu_si128((__m128i *)(output + (16 * i)), _mm_aesenclast_si128(block, keys[rounds]));
+    }
+}
+
+#endif /* defined(kARCipherHaveAESNI) */
+
+#if defined(kARCipherHaveARMv8)
+
+static void ARAESEncryptBlocksARMv8(ARCipher *cipher, const UInt8 *input, UInt8 *output, OSCount blocks)
+{
+    UInt32 rounds = cipher->key.aes.rounds;
+    uint8x16_t keys[15];
+
+    for (UInt32 round = 0; round <= rounds; round++)
+        keys[round] = vld1q_u8(cipher->key.aes.roundKeys + (16 * round));
+
+    for (OSIndex i = 0; i < blocks; i++)
+    {
+        uint8x16_t block = vld1q_u8(input + (16 * i));
+
+        for (UInt32 round = 0; round < rounds - 1; round++)
+            block = vaesmcq_u8(vaeseq_u8(block, keys[round]));
+
+        block = veorq_u8(vaeseq_u8(block, keys[rounds - 1]), keys[rounds]);
+        vst1q_u8(output + (16 * i), block);
+    }
+}
+
+#endif /* defined(kARCipherHaveARMv8) */
+
+static void ARAESSetup(ARCipher *cipher, const UInt8 *key, OSSize keySize)
+{
+    ARAESExpandKey(cipher, key, keySize);
+
+    cipher->encryptBlocks = ARAESEncryptBlocks;
+    cipher->implementation = "AES (portable)";
+
+    #if defined(kARCipherHaveAESNI)
+        if (__builtin_cpu_supports("aes"))
+        {
+            cipher->encryptBlocks = ARAESEncryptBlocksAESNI;
+            cipher->implementation = "AES (AES-NI)";
+        }
+    #elif defined(kARCipherHaveARMv8)
+        cipher->encryptBlocks = ARAESEncryptBlocksARMv8;
+        cipher->implementation = "AES (ARMv8 Crypto)";
+    #endif /* defined(kARCipherHaveAESNI) */
+}
+
+#pragma mark - Serpent
+
+// Serpent is implemented straight from the specification in bitslice
+// form, with the S-boxes applied through their tables one bit column at
+// a time. It is slow, but has no platform dependencies.
+
+#define kARSerpentPhi 0x9E3779B9
+
+static const UInt8 gARSerpentSBox[8][16] = {
+    { 3,  8, 15,  1, 10,  6,  5, 11, 14, 13,  4,  2,  7,  0,  9, 12},
+    {15, 12,  2,  7,  9,  0,  5, 10,  1, 11, 14,  8,  6, 13,  3,  4},
+    { 8,  6,  7,  9,  3, 12, 10, 15, 13,  1, 14,  4,  0, 11,  5,  2},
+    { 0, 15, 11,  8, 12,  9,  6,  3, 13,  1,  2,  4, 10,  7,  5, 14},
+    { 1, 15,  8,  3, 12,  0, 11,  6,  2,  5,  4, 10,  9, 14,  7, 13},
+    {15,  5,  2, 11,  4, 10,  9, 12,  0,  3, 14,  8, 13,  6,  7,  1},
+    { 7,  2, 12,  5,  8,  4,  6, 11, 14,  9,  1, 15, 13,  3, 10,  0},
+    { 1, 13, 15,  0, 14,  8,  2, 11,  7,  4, 12, 10,  9,  3,  5,  6}
+};
+
+static inline UInt32 ARSerpentRotate(UInt32 value, UInt32 shift)
+{
+    return (value << shift) | (value >> (32 - shift));
+}
+
+static inline UInt32 ARSerpentLoad(const UInt8 *bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((UInt32)bytes[3] << 24);
+}
+
+static inline void ARSerpentStore(UInt8 *bytes, UInt32 value)
+{
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+}
+
+static void ARSerpentSubstitute(const UInt8 *box, UInt32 *x)
+{
+    UInt32 y[4] = {0, 0, 0, 0};
+
+    for (UInt32 bit = 0; bit < 32; bit++)
+    {
+        UInt32 input = ((x[0] >> bit) & 1) | (((x[1] >> bit) & 1) << 1) | (((x[2] >> bit) & 1) << 2) | (((x[3] >> bit) & 1) << 3);
+        UInt32 output = box[input];
+
+        y[0] |= ((output >> 0) & 1) << bit;
+        y[1] |= ((output >> 1) & 1) << bit;
+        y[2] |= ((output >> 2) & 1) << bit;
+        y[3] |= ((output >> 3) & 1) << bit;
+    }
+
+    memcpy(x, y, sizeof(y));
+}
+
+static void ARSerpentTransform(UInt32 *x)
+{
+    x[0] = ARSerpentRotate(x[0], 13);
+    x[2] = ARSerpentRotate(x[2], 3);
+    x[1] = x[1] ^ x[0] ^ x[2];
+    x[3] = x[3] ^ x[2] ^ (x[0] << 3);
+    x[1] = ARSerpentRotate(x[1], 1);
+    x[3] = ARSerpentRotate(x[3], 7);
+    x[0] = x[0] ^ x[1] ^ x[3];
+    x[2] = x[2] ^ x[3] ^ (x[1] << 7);
+    x[0] = ARSerpentRotate(x[0], 5);
+    x[2] = ARSerpentRotate(x[2], 22);
+}
+
+static void ARSerpentExpandKey(ARCipher *cipher, const UInt8 *key, OSSize keySize)
+{
+    UInt8 padded[kARCipherMaxKeySize];
+    UInt32 words[140];
+
+    // Short keys are padded with a single one bit followed by zeros
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, key, keySize);
+    if (keySize < kARCipherMaxKeySize) padded[keySize] = 0x01;
+
+    for (OSIndex i = 0; i < 8; i++)
+        words[i] = ARSerpentLoad(padded + (4 * i));
+
+    for (OSIndex i = 0; i < 132; i++)
+        words[i + 8] = ARSerpentRotate(words[i] ^ words[i + 3] ^ words[i + 5] ^ words[i + 7] ^ kARSerpentPhi ^ (UInt32)i, 11);
+
+    for (OSIndex i = 0; i < 33; i++)
+    {
+        UInt32 *subkey = cipher->key.serpent.subkeys[i];
+
+        memcpy(subkey, words + 8 + (4 * i), 4 * sizeof(UInt32));
+        ARSerpentSubstitute(gARSerpentSBox[(3 - i) & 7], subkey);
+    }
+}
+
+static void ARSerpentEncryptBlocks(ARCipher *cipher, const UInt8 *input, UInt8 *output, OSCount blocks)
+{
+    for (OSIndex block = 0; block < blocks; block++)
+    {
+        UInt32 x[4];
+
+        for (OSIndex i = 0; i < 4; i++)
+            x[i] = ARSerpentLoad(input + (16 * block) + (4 * i));
+
+        for (OSIndex round = 0; round < 32; round++)
+        {
+            for (OSIndex i = 0; i < 4; i++)
+                x[i] ^= cipher->key.serpent.subkeys[round][i];
+
+            ARSerpentSubstitute(gARSerpentSBox[round & 7], x);
+
+            if (round != 31) {
+                ARSerpentTransform(x);
+            } else {
+                for (OSIndex i = 0; i < 4; i++)
+                    x[i] ^= cipher->key.serpent.subkeys[32][i];
+            }
+        }
+
+        for (OSIndex i = 0; i < 4; i++)
+            ARSerpentStore(output + (16 * block) + (4 * i), x[i]);
+    }
+}
+
+#pragma mark - Counter Mode
+
+bool ARCipherLoadKey(const OSUTF8Char *path, UInt8 *key, OSSize *keySize)
+{
+    int fd = open((char *)path, O_RDONLY);
+    UInt8 buffer[kARCipherMaxKeySize + 1];
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: Could not open key file '%s'!\n", path);
+        return false;
+    }
+
+    ssize_t size = read(fd, buffer, sizeof(buffer));
+    close(fd);
+
+    if (size != 16 && size != 24 && size != 32)
+    {
+        fprintf(stderr, "Error: Key file '%s' must hold a raw 128, 192 or 256 bit key!\n", path);
+        return false;
+    }
+
+    memcpy(key, buffer, size);
+    memset(buffer, 0, sizeof(buffer));
+    *keySize = size;
+
+    return true;
+}
+
+bool ARCipherGenerateNonce(UInt8 *nonce)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd == -1 || read(fd, nonce, kARCipherNonceSize) != kARCipherNonceSize)
+    {
+        fprintf(stderr, "Error: Could not generate nonce!\n");
+
+        if (fd != -1) close(fd);
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+ARCipher *ARCipherCreate(CAEncryptionType type, const UInt8 *key, OSSize keySize, const UInt8 *nonce)
+{
+    if (keySize != 16 && keySize != 24 && keySize != 32)
+    {
+        fprintf(stderr, "Error: Invalid key size %lu!\n", keySize);
+        return kOSNullPointer;
+    }
+
+    ARCipher *cipher = malloc(sizeof(ARCipher));
+
+    if (!cipher)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    memset(cipher, 0, sizeof(ARCipher));
+    memcpy(cipher->nonce, nonce, kARCipherNonceSize);
+    cipher->type = type;
+
+    switch (type)
+    {
+        case kCAEncryptionTypeAES: {
+            ARAESSetup(cipher, key, keySize);
+        } break;
+        case kCAEncryptionTypeSerpent: {
+            ARSerpentExpandKey(cipher, key, keySize);
+
+            cipher->encryptBlocks = ARSerpentEncryptBlocks;
+            cipher->implementation = "Serpent (portable)";
+        } break;
+        default: {
+            fprintf(stderr, "Error: Unknown encryption type!\n");
+            free(cipher);
+
+            return kOSNullPointer;
+        }
+    }
+
+    return cipher;
+}
+
+const char *ARCipherImplementation(ARCipher *cipher)
+{
+    return cipher->implementation;
+}
+
+// The key check is the encryption of a counter block no archive offset can reach
+void ARCipherKeyCheck(ARCipher *cipher, UInt8 *check)
+{
+    UInt8 block[kARCipherBlockSize];
+
+    memcpy(block, cipher->nonce, kARCipherNonceSize);
+    memset(block + kARCipherNonceSize, 0xFF, kARCipherBlockSize - kARCipherNonceSize);
+
+    cipher->encryptBlocks(cipher, block, check, 1);
+}
+
+// XOR the keystream for archive bytes [offset, offset + size) into `buffer`
+void ARCipherApply(ARCipher *cipher, void *b, OSSize size, UInt64 offset)
+{
+    UInt8 counters[kARCipherBatchSize * kARCipherBlockSize];
+    UInt8 stream[kARCipherBatchSize * kARCipherBlockSize];
+    UInt64 block = offset / kARCipherBlockSize;
+    OSOffset skip = offset % kARCipherBlockSize;
+    UInt8 *buffer = (UInt8 *)b;
+
+    while (size)
+    {
+        OSCount blocks = (skip + size + (kARCipherBlockSize - 1)) / kARCipherBlockSize;
+        if (blocks > kARCipherBatchSize) blocks = kARCipherBatchSize;
+
+        for (OSIndex i = 0; i < blocks; i++)
+        {
+            UInt8 *counter = counters + (kARCipherBlockSize * i);
+            UInt64 value = block + i;
+
+            memcpy(counter, cipher->nonce, kARCipherNonceSize);
+
+            for (OSIndex j = 0; j < 8; j++)
+                counter[kARCipherNonceSize + j] = value >> (56 - (8 * j));
+        }
+
+        cipher->encryptBlocks(cipher, counters, stream, blocks);
+
+        OSSize length = (blocks * kARCipherBlockSize) - skip;
+        if (length > size) length = size;
+
+        for (OSIndex i = 0; i < length; i++)
+            buffer[i] ^= stream[skip + i];
+
+        buffer += length;
+        block += blocks;
+        size -= length;
+        skip = 0;
+    }
+}
+
+typedef struct {
+    ARCipher *cipher;
+    UInt8 *buffer;
+    OSSize size;
+    UInt64 offset;
+} ARCipherJob;
+
+static void *ARCipherWorker(void *context)
+{
+    ARCipherJob *job = context;
+
+    ARCipherApply(job->cipher, job->buffer, job->size, job->offset);
+    return kOSNullPointer;
+}
+
+// Split a large range between `workers` threads. Every block has its own
+// counter, so the pieces don't depend on each other at all.
+void ARCipherApplyParallel(ARCipher *cipher, void *b, OSSize size, UInt64 offset, OSCount workers)
+{
+    pthread_t threads[kARCipherMaxWorkers];
+    ARCipherJob jobs[kARCipherMaxWorkers];
+    bool started[kARCipherMaxWorkers];
+    UInt8 *buffer = (UInt8 *)b;
+
+    if (workers > kARCipherMaxWorkers) workers = kARCipherMaxWorkers;
+    if (workers > size / kARCipherMinShare) workers = size / kARCipherMinShare;
+
+    if (workers < 2)
+    {
+        ARCipherApply(cipher, buffer, size, offset);
+        return;
+    }
+
+    OSSize share = OSAlignUpward((size / workers) + 1, kARCipherBlockSize);
+
+    for (OSIndex i = 0; i < workers; i++)
+    {
+        jobs[i].cipher = cipher;
+        jobs[i].buffer = buffer;
+        jobs[i].offset = offset;
+        jobs[i].size = (size > share) ? share : size;
+
+        buffer += jobs[i].size;
+        offset += jobs[i].size;
+        size -= jobs[i].size;
+
+        // Do the work here if a thread can't be started
+        started[i] = !pthread_create(&threads[i], kOSNullPointer, ARCipherWorker, &jobs[i]);
+        if (!started[i]) ARCipherWorker(&jobs[i]);
+    }
+
+    for (OSIndex i = 0; i < workers; i++)
+        if (started[i]) pthread_join(threads[i], kOSNullPointer);
+}
+
+void ARCipherFree(ARCipher *cipher)
+{
+    memset(cipher, 0, sizeof(ARCipher));
+    free(cipher);
+}
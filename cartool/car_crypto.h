@@ -0,0 +1,26 @@
+#ifndef __car_crypto__
+#define __car_crypto__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+#define kARCipherBlockSize      16
+#define kARCipherMaxKeySize     32
+#define kARCipherNonceSize      8
+
+// Archives are encrypted in counter mode. The counter for each 16 byte
+// block is the nonce followed by the block's absolute offset in the
+// archive (divided by the block size), so any byte range can be
+// decrypted on its own and in parallel with any other range.
+
+bool ARCipherLoadKey(const OSUTF8Char *path, UInt8 *key, OSSize *keySize);
+bool ARCipherGenerateNonce(UInt8 *nonce);
+
+ARCipher *ARCipherCreate(CAEncryptionType type, const UInt8 *key, OSSize keySize, const UInt8 *nonce);
+const char *ARCipherImplementation(ARCipher *cipher);
+void ARCipherKeyCheck(ARCipher *cipher, UInt8 *check);
+void ARCipherApply(ARCipher *cipher, void *buffer, OSSize size, UInt64 offset);
+void ARCipherApplyParallel(ARCipher *cipher, void *buffer, OSSize size, UInt64 offset, OSCount workers);
+void ARCipherFree(ARCipher *cipher);
+
+#endif /* !defined(__car_crypto__) */
@@ -1,141 +1,1554 @@
 #include "car_extract.h"
+#include "car_pipeline.h"
+#include "car_chunk.h"
+#include "car_log.h"
+#include <sys/syslimits.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 
-// Read `size` bytes from `address` into `destination`
-static bool ARExtractFile(const OSUTF8Char *destination, void *address, OSSize size)
+#if defined(__linux__)
+    #include <sys/sendfile.h>
+#endif /* defined(__linux__) */
+
+typedef struct {
+    int fd;
+
+    // Archive path of the directory (not terminated at `length`)
+    const OSUTF8Char *path;
+    OSSize length;
+} ARExtractDirectory;
+
+typedef struct {
+    ARArchive *archive;
+    ARPipeline *pipeline;
+
+    // Open directories from the root down to the parent of the last entry
+    ARExtractDirectory *directories;
+    OSCount depth;
+    OSCount capacity;
+
+    // Only rewrite what differs from the existing tree (and remove what
+    // isn't in the archive when `deleteStale` is set)
+    bool update;
+    bool deleteStale;
+    bool unchanged;
+
+    // Create missing directories on the way to an entry (when entries are
+    // extracted on their own, without their parents)
+    bool createParents;
+
+    OSCount unchangedCount;
+    OSCount removedCount;
+} ARExtractState;
+
+typedef struct {
+    int fd;
+    UInt8 *buffer;
+    bool equal;
+} ARExtractCompare;
+
+typedef struct {
+    UInt8 *buffer;
+    OSSize offset;
+} ARExtractBuffer;
+
+typedef struct {
+    ARPipelineConsumer consumer;
+    void *context;
+    UInt32 checksum;
+} ARExtractChecksum;
+
+typedef struct {
+    int fd;
+    const ARSparseExtent *extents;
+    OSCount extentCount;
+    OSIndex extent;
+    UInt64 extentOffset;
+} ARExtractSparse;
+
+static bool ARExtractWriteConsumer(void *context, const UInt8 *data, OSSize size)
+{
+    return ARWriteAll(*((int *)context), data, size);
+}
+
+// Write stored data to the extents it came from, skipping over the holes
+static bool ARExtractSparseConsumer(void *context, const UInt8 *data, OSSize size)
+{
+    ARExtractSparse *sparse = context;
+
+    while (size)
+    {
+        if (sparse->extent >= sparse->extentCount)
+            return false;
+
+        const ARSparseExtent *extent = &sparse->extents[sparse->extent];
+        OSSize length = extent->size - sparse->extentOffset;
+        if (length > size) length = size;
+
+        ssize_t written = pwrite(sparse->fd, data, length, extent->offset + sparse->extentOffset);
+        if (written <= 0) return false;
+
+        data += written;
+        size -= written;
+
+        if ((sparse->extentOffset += written) == extent->size)
+        {
+            sparse->extentOffset = 0;
+            sparse->extent++;
+        }
+    }
+
+    return true;
+}
+
+static bool ARExtractBufferConsumer(void *context, const UInt8 *data, OSSize size)
+{
+    ARExtractBuffer *buffer = context;
+
+    memcpy(buffer->buffer + buffer->offset, data, size);
+    buffer->offset += size;
+
+    return true;
+}
+
+// Compare the data against the next bytes of an existing file. Always
+// succeeds so a mismatch doesn't disturb the decompression pipeline.
+static bool ARExtractCompareConsumer(void *context, const UInt8 *data, OSSize size)
+{
+    ARExtractCompare *compare = context;
+
+    while (compare->equal && size)
+    {
+        OSSize length = (size > kARChunkSize) ? kARChunkSize : size;
+
+        if (read(compare->fd, compare->buffer, length) != length || memcmp(compare->buffer, data, length))
+            compare->equal = false;
+
+        data += length;
+        size -= length;
+    }
+
+    return true;
+}
+
+static bool ARExtractChecksumConsumer(void *context, const UInt8 *data, OSSize size)
+{
+    ARExtractChecksum *checksum = context;
+    checksum->checksum = ARCRC32CUpdate(checksum->checksum, data, size);
+
+    return checksum->consumer(checksum->context, data, size);
+}
+
+// Feed the data of `entry` to `consumer`. Data is streamed from the
+// decompression pipeline when it lies ahead of the stream position,
+// and read (and decrypted) through the archive otherwise.
+static bool ARExtractReadStoredData(ARExtractState *state, ARArchiveEntry *entry, ARPipelineConsumer consumer, void *context)
+{
+    ARArchive *archive = state->archive;
+
+    if (!archive->chunks && !archive->cipher)
+    {
+        if (archive->dataSection + entry->dataOffset + entry->dataSize > (UInt8 *)archive->address + archive->size)
+        {
+            fprintf(stderr, "Error: Entry data is outside of archive!\n");
+            return false;
+        }
+
+        return consumer(context, archive->dataSection + entry->dataOffset, entry->dataSize);
+    }
+
+    if (state->pipeline && ARPipelineCanStream(state->pipeline, entry->dataOffset))
+        return ARPipelineStream(state->pipeline, entry->dataOffset, entry->dataSize, consumer, context);
+
+    UInt8 *buffer = malloc(kARChunkSize);
+    UInt64 offset = entry->dataOffset;
+    OSSize size = entry->dataSize;
+    bool success = !!buffer;
+
+    while (success && size)
+    {
+        OSSize length = (size > kARChunkSize) ? kARChunkSize : size;
+
+        success = ARArchiveReadData(archive, offset, length, buffer) && consumer(context, buffer, length);
+        offset += length;
+        size -= length;
+    }
+
+    free(buffer);
+    return success;
+}
+
+// Same as above, but check the data against the archive's checksum
+// table (if there is one) on the way through. `index` is the entry's
+// position in the ToC.
+static bool ARExtractReadData(ARExtractState *state, OSIndex index, ARArchiveEntry *entry, ARPipelineConsumer consumer, void *context)
+{
+    ARExtractChecksum checksum;
+    UInt32 expected;
+
+    if (!entry->dataSize || !ARArchiveGetEntryChecksum(state->archive, index, &expected))
+        return ARExtractReadStoredData(state, entry, consumer, context);
+
+    checksum.consumer = consumer;
+    checksum.context = context;
+    checksum.checksum = ARCRC32CInit();
+
+    if (!ARExtractReadStoredData(state, entry, ARExtractChecksumConsumer, &checksum))
+        return false;
+
+    if (ARCRC32CFinalize(checksum.checksum) != expected)
+    {
+        fprintf(stderr, "Error: Checksum mismatch for entry '%s'!\n", entry->path);
+        return false;
+    }
+
+    return true;
+}
+
+#pragma mark - Directories
+
+// Open the directory `name` in `directory` without following links
+static int ARExtractOpenDirectory(int directory, const OSUTF8Char *name)
+{
+    return openat(directory, (char *)name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+// Whether `path` is an absolute archive path whose names are all real
+// names. Empty, '.' and '..' names could point outside the root.
+static bool ARExtractPathIsValid(const OSUTF8Char *path)
+{
+    if (*path != '/')
+        return false;
+
+    while (*path)
+    {
+        const OSUTF8Char *component = path + 1;
+        OSSize length = strcspn((char *)component, "/");
+
+        if (!length || (component[0] == '.' && (length == 1 || (length == 2 && component[1] == '.'))))
+            return false;
+
+        path = component + length;
+    }
+
+    return true;
+}
+
+// Return a descriptor for the directory which holds the entry at `path`,
+// and point `name` at the entry's name within it. The open directories of
+// the last path are kept on a stack, so entries in ToC order (parents
+// before children) open each directory once and look up a single name
+// per entry.
+static int ARExtractParentDirectory(ARExtractState *state, const OSUTF8Char *path, const OSUTF8Char **name)
+{
+    if (!ARExtractPathIsValid(path))
+    {
+        fprintf(stderr, "Error: Invalid entry path '%s'!\n", path);
+        return -1;
+    }
+
+    const OSUTF8Char *separator = (const OSUTF8Char *)strrchr((char *)path, '/');
+    OSSize length = separator - path;
+
+    *name = separator + 1;
+
+    // Drop directories which aren't ancestors of this one (the root never is)
+    while (state->depth > 1)
+    {
+        ARExtractDirectory *top = &state->directories[state->depth - 1];
+
+        if (top->length <= length && !strncmp((char *)top->path, (char *)path, top->length) && (path[top->length] == '/'))
+            break;
+
+        close(top->fd);
+        state->depth--;
+    }
+
+    while (state->directories[state->depth - 1].length < length)
+    {
+        ARExtractDirectory *top = &state->directories[state->depth - 1];
+        const OSUTF8Char *component = path + top->length + 1;
+        OSUTF8Char directoryName[NAME_MAX + 1];
+
+        OSSize componentLength = strcspn((char *)component, "/");
+
+        if (componentLength > NAME_MAX)
+        {
+            fprintf(stderr, "Error: Name too long in path '%s'!\n", path);
+            return -1;
+        }
+
+        memcpy(directoryName, component, componentLength);
+        directoryName[componentLength] = 0;
+
+        if (state->depth == state->capacity)
+        {
+            OSCount capacity = state->capacity * 2;
+            ARExtractDirectory *directories = realloc(state->directories, capacity * sizeof(ARExtractDirectory));
+
+            if (!directories)
+            {
+                fprintf(stderr, "Error: Out of memory!\n");
+                return -1;
+            }
+
+            state->directories = directories;
+            state->capacity = capacity;
+            top = &state->directories[state->depth - 1];
+        }
+
+        int fd = ARExtractOpenDirectory(top->fd, directoryName);
+
+        if (fd == -1 && errno == ENOENT && state->createParents && !mkdirat(top->fd, (char *)directoryName, S_IRWXU))
+            fd = ARExtractOpenDirectory(top->fd, directoryName);
+
+        if (fd == -1)
+        {
+            fprintf(stderr, "Error: Could not open directory for '%s'!\n", path);
+            return -1;
+        }
+
+        state->directories[state->depth].fd = fd;
+        state->directories[state->depth].path = path;
+        state->directories[state->depth].length = (component + componentLength) - path;
+        state->depth++;
+    }
+
+    return state->directories[state->depth - 1].fd;
+}
+
+// Set up the directory stack with `rootDirectory` at the bottom
+static bool ARExtractOpenRoot(ARExtractState *state, const OSUTF8Char *rootDirectory)
+{
+    int fd = open((char *)rootDirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    state->capacity = 16;
+    state->directories = malloc(state->capacity * sizeof(ARExtractDirectory));
+
+    if (fd == -1 || !state->directories)
+    {
+        fprintf(stderr, "Error: Could not open root directory '%s'!\n", rootDirectory);
+        if (fd != -1) close(fd);
+
+        return false;
+    }
+
+    state->directories[0].fd = fd;
+    state->directories[0].path = (const OSUTF8Char *)"";
+    state->directories[0].length = 0;
+    state->depth = 1;
+
+    return true;
+}
+
+static void ARExtractCloseDirectories(ARExtractState *state)
+{
+    while (state->depth)
+        close(state->directories[--state->depth].fd);
+
+    free(state->directories);
+    state->directories = kOSNullPointer;
+}
+
+static bool ARExtractCreateDirectory(int directory, const OSUTF8Char *name, ARArchiveEntry *entry)
+{
+    if (mkdirat(directory, (char *)name, S_IRWXU))
+    {
+        fprintf(stderr, "Error: Could not create directory '%s'\n", entry->path);
+        return false;
+    }
+
+    return true;
+}
+
+#pragma mark - Updating
+
+// Remove `name` in `directory` and everything below it
+static bool ARExtractRemoveTree(int directory, const OSUTF8Char *name)
+{
+    int fd = ARExtractOpenDirectory(directory, name);
+    DIR *dir = (fd != -1) ? fdopendir(fd) : kOSNullPointer;
+    struct dirent *dirent;
+    bool success = !!dir;
+
+    if (!dir && fd != -1)
+        close(fd);
+
+    while (success && (dirent = readdir(dir)))
+    {
+        struct stat stats;
+
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+            continue;
+
+        if (!fstatat(dirfd(dir), dirent->d_name, &stats, AT_SYMLINK_NOFOLLOW) && S_ISDIR(stats.st_mode)) {
+            success = ARExtractRemoveTree(dirfd(dir), (const OSUTF8Char *)dirent->d_name);
+        } else {
+            success = !unlinkat(dirfd(dir), dirent->d_name, 0);
+        }
+    }
+
+    if (dir) closedir(dir);
+
+    if (!success || unlinkat(directory, (char *)name, AT_REMOVEDIR))
+    {
+        fprintf(stderr, "Error: Could not remove '%s'!\n", name);
+        return false;
+    }
+
+    return true;
+}
+
+// Whether the existing file `name` in `directory` holds the data of
+// `entry`. The file is checked against the stored checksum if there is
+// one, and compared with the stored data otherwise.
+static bool ARExtractFileUnchanged(ARExtractState *state, OSIndex index, ARArchiveEntry *entry, int directory, const OSUTF8Char *name, struct stat *stats)
+{
+    const ARSparseExtent *extents;
+    OSCount extentCount;
+    UInt64 fileSize;
+    UInt32 expected;
+
+    // The stored size of sparse files says nothing about the existing file
+    if (stats->st_size != entry->dataSize || ARArchiveGetSparseExtents(state->archive, index, &fileSize, &extents, &extentCount))
+        return false;
+
+    if (!entry->dataSize)
+        return true;
+
+    int fd = openat(directory, (char *)name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    UInt8 *buffer = malloc(kARChunkSize);
+    bool unchanged = (fd != -1 && buffer);
+
+    if (unchanged && ARArchiveGetEntryChecksum(state->archive, index, &expected)) {
+        UInt32 checksum = ARCRC32CInit();
+        UInt64 remaining = entry->dataSize;
+
+        while (unchanged && remaining)
+        {
+            OSSize length = (remaining > kARChunkSize) ? kARChunkSize : remaining;
+
+            unchanged = (read(fd, buffer, length) == length);
+            checksum = ARCRC32CUpdate(checksum, buffer, length);
+            remaining -= length;
+        }
+
+        unchanged = unchanged && (ARCRC32CFinalize(checksum) == expected);
+    } else if (unchanged) {
+        ARExtractCompare compare = {fd, buffer, true};
+
+        unchanged = ARExtractReadStoredData(state, entry, ARExtractCompareConsumer, &compare) && compare.equal;
+    }
+
+    if (fd != -1) close(fd);
+    free(buffer);
+
+    return unchanged;
+}
+
+// Whether the existing link `name` in `directory` points to the target of `entry`
+static bool ARExtractLinkUnchanged(ARExtractState *state, OSIndex index, ARArchiveEntry *entry, int directory, const OSUTF8Char *name, struct stat *stats)
+{
+    OSUTF8Char existing[PATH_MAX + 1];
+    ARExtractBuffer link;
+
+    if (stats->st_size != entry->dataSize || entry->dataSize > PATH_MAX)
+        return false;
+
+    if (readlinkat(directory, (char *)name, (char *)existing, PATH_MAX + 1) != entry->dataSize)
+        return false;
+
+    link.buffer = malloc(entry->dataSize + 1);
+    link.offset = 0;
+
+    bool unchanged = link.buffer && ARExtractReadData(state, index, entry, ARExtractBufferConsumer, &link) && !memcmp(link.buffer, existing, entry->dataSize);
+    free(link.buffer);
+
+    return unchanged;
+}
+
+// Check what is at `name` in `directory` before `entry` is written there.
+// It is left alone (and `state->unchanged` set) if it already matches the
+// entry, and removed otherwise. Directories in the way are only removed
+// when stale files are being deleted.
+static bool ARExtractPrepareDestination(ARExtractState *state, OSIndex index, ARArchiveEntry *entry, int directory, const OSUTF8Char *name)
+{
+    struct stat stats;
+
+    state->unchanged = false;
+
+    if (!state->update || fstatat(directory, (char *)name, &stats, AT_SYMLINK_NOFOLLOW))
+        return true;
+
+    switch (entry->type)
+    {
+        case kCAEntryTypeDirectory: state->unchanged = S_ISDIR(stats.st_mode); break;
+        case kCAEntryTypeFile: state->unchanged = S_ISREG(stats.st_mode) && ARExtractFileUnchanged(state, index, entry, directory, name, &stats); break;
+        case kCAEntryTypeLink: state->unchanged = S_ISLNK(stats.st_mode) && ARExtractLinkUnchanged(state, index, entry, directory, name, &stats); break;
+    }
+
+    if (state->unchanged)
+    {
+        state->unchangedCount++;
+        return true;
+    }
+
+    if (S_ISDIR(stats.st_mode))
+    {
+        if (!state->deleteStale)
+        {
+            fprintf(stderr, "Error: Directory '%s' is in the way of entry '%s'!\n", name, entry->path);
+            return false;
+        }
+
+        return ARExtractRemoveTree(directory, name);
+    }
+
+    if (unlinkat(directory, (char *)name, 0))
+    {
+        fprintf(stderr, "Error: Could not remove existing '%s'!\n", entry->path);
+        return false;
+    }
+
+    return true;
+}
+
+static int ARExtractComparePaths(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Remove everything in `directory` (at archive path `path`) which isn't
+// one of the sorted archive `paths`. Takes ownership of `directory`.
+static bool ARExtractDeleteStale(ARExtractState *state, const OSUTF8Char **paths, OSCount pathCount, int directory, const OSUTF8Char *path, bool verbose)
+{
+    DIR *dir = fdopendir(directory);
+    struct dirent *dirent;
+    bool success = true;
+
+    if (!dir)
+    {
+        fprintf(stderr, "Error: Could not read directory '%s'!\n", path);
+        close(directory);
+
+        return false;
+    }
+
+    while (success && (dirent = readdir(dir)))
+    {
+        OSUTF8Char childPath[PATH_MAX + 1];
+        const OSUTF8Char *key = childPath;
+        const OSUTF8Char *name = (const OSUTF8Char *)dirent->d_name;
+        struct stat stats;
+
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+            continue;
+
+        snprintf((char *)childPath, PATH_MAX + 1, "%s/%s", path, name);
+
+        if (fstatat(dirfd(dir), (char *)name, &stats, AT_SYMLINK_NOFOLLOW))
+            continue;
+
+        if (bsearch(&key, paths, pathCount, sizeof(OSUTF8Char *), ARExtractComparePaths))
+        {
+            if (S_ISDIR(stats.st_mode))
+            {
+                int fd = ARExtractOpenDirectory(dirfd(dir), name);
+                success = (fd != -1) && ARExtractDeleteStale(state, paths, pathCount, fd, childPath, verbose);
+            }
+
+            continue;
+        }
+
+        if (S_ISDIR(stats.st_mode)) {
+            success = ARExtractRemoveTree(dirfd(dir), name);
+        } else if (unlinkat(dirfd(dir), (char *)name, 0)) {
+            fprintf(stderr, "Error: Could not remove '%s'!\n", childPath);
+            success = false;
+        }
+
+        state->removedCount++;
+
+        if (success && verbose)
+            ARLog("- %s\n", childPath);
+    }
+
+    closedir(dir);
+    return success;
+}
+
+// Delete whatever the extracted tree has that the archive doesn't
+static bool ARExtractDeleteStaleEntries(ARExtractState *state, bool verbose)
+{
+    ARArchive *archive = state->archive;
+    const OSUTF8Char **paths = malloc((archive->entryCount + 1) * sizeof(OSUTF8Char *));
+    int root = dup(state->directories[0].fd);
+    ARArchiveEntry entry;
+
+    if (!paths || root == -1)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        if (root != -1) close(root);
+        free(paths);
+
+        return false;
+    }
+
+    for (OSIndex i = 0; i < archive->entryCount; i++)
+    {
+        if (!ARArchiveGetEntry(archive, i, &entry))
+        {
+            close(root);
+            free(paths);
+
+            return false;
+        }
+
+        paths[i] = entry.path;
+    }
+
+    qsort(paths, archive->entryCount, sizeof(OSUTF8Char *), ARExtractComparePaths);
+
+    bool success = ARExtractDeleteStale(state, paths, archive->entryCount, root, (const OSUTF8Char *)"", verbose);
+    free(paths);
+
+    return success;
+}
+
+#pragma mark - Extraction
+
+// Write the data of `entry` to a new file `name` in `directory`
+static bool ARExtractFile(ARExtractState *state, OSIndex index, ARArchiveEntry *entry, int directory, const OSUTF8Char *name)
+{
+    struct stat stats;
+
+    if (!ARExtractPrepareDestination(state, index, entry, directory, name))
+        return false;
+
+    if (state->unchanged)
+        return true;
+
+    // Nothing but an empty regular file is written into, so a link left in
+    // the tree can't send the data somewhere else
+    if (!fstatat(directory, (char *)name, &stats, AT_SYMLINK_NOFOLLOW))
+    {
+        if (S_ISREG(stats.st_mode) && stats.st_size)
+        {
+            fprintf(stderr, "Error: File exists and is not empty at '%s'!\n", entry->path);
+            return false;
+        }
+
+        if (!S_ISREG(stats.st_mode) && unlinkat(directory, (char *)name, 0))
+        {
+            fprintf(stderr, "Error: Could not remove existing '%s'!\n", entry->path);
+            return false;
+        }
+    }
+
+    int fd = openat(directory, (char *)name, O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: Could not open file '%s'!\n", entry->path);
+        return false;
+    }
+
+    ARExtractSparse sparse;
+    UInt64 fileSize;
+    bool success;
+
+    // The file is new, so leaving the holes unwritten and setting its size
+    // afterwards is enough to recreate them.
+    if (ARArchiveGetSparseExtents(state->archive, index, &fileSize, &sparse.extents, &sparse.extentCount)) {
+        sparse.fd = fd;
+        sparse.extent = 0;
+        sparse.extentOffset = 0;
+
+        success = ARExtractReadData(state, index, entry, ARExtractSparseConsumer, &sparse) && sparse.extent == sparse.extentCount && !ftruncate(fd, fileSize);
+    } else {
+        success = ARExtractReadData(state, index, entry, ARExtractWriteConsumer, &fd);
+    }
+
+    if (!success)
+    {
+        fprintf(stderr, "Error: Could not write file '%s'!\n", entry->path);
+        close(fd);
+
+        return false;
+    }
+
+    if (close(fd))
+    {
+        fprintf(stderr, "Error: Could not close file '%s'!\n", entry->path);
+        return false;
+    }
+
+    return true;
+}
+
+// Read the target of the link `entry` and create it as `name` in `directory`
+static bool ARExtractLinkEntry(ARExtractState *state, OSIndex index, ARArchiveEntry *entry, int directory, const OSUTF8Char *name)
+{
+    ARExtractBuffer link;
+
+    if (!ARExtractPrepareDestination(state, index, entry, directory, name))
+        return false;
+
+    if (state->unchanged)
+        return true;
+
+    link.buffer = malloc(entry->dataSize + 1);
+    link.offset = 0;
+
+    if (!link.buffer)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    bool success = ARExtractReadData(state, index, entry, ARExtractBufferConsumer, &link);
+    link.buffer[entry->dataSize] = 0;
+
+    if (success && symlinkat((char *)link.buffer, directory, (char *)name))
+    {
+        fprintf(stderr, "Could not create symlink '%s'\n", entry->path);
+        success = false;
+    }
+
+    free(link.buffer);
+    return success;
+}
+
+// Extract every entry below `rootDirectory`. Entries are created relative
+// to the descriptor of their parent directory, so nothing depends on (or
+// changes) the working directory.
+static bool ARExtractArchiveEntries(ARExtractState *state, const OSUTF8Char *rootDirectory, bool verbose)
+{
+    if (!(state->update && ARDirectoryExistsAtPath(rootDirectory)) && !ARCreateDirectory(rootDirectory))
+    {
+        fprintf(stderr, "Error: Could not create root directory!\n");
+        return false;
+    }
+
+    if (!ARExtractOpenRoot(state, rootDirectory))
+        return false;
+
+    ARArchive *archive = state->archive;
+    ARArchiveEntry entry;
+    bool success = true;
+    char type = '?';
+
+    if (ARLogProgressEnabled())
+    {
+        UInt64 total = 0;
+
+        for (OSIndex i = 0; i < archive->entryCount; i++)
+            if (ARArchiveGetEntry(archive, i, &entry)) total += entry.dataSize;
+
+        ARLogProgressBegin("Extracting", total);
+    }
+
+    for (OSIndex i = 0; success && i < archive->entryCount; i++)
+    {
+        const OSUTF8Char *name;
+        int directory;
+
+        if (!(success = ARArchiveGetEntry(archive, i, &entry)))
+            break;
+
+        state->unchanged = false;
+
+        // The root itself
+        if (!entry.path[1])
+        {
+            if (verbose) ARLog("D %s\n", entry.path);
+            continue;
+        }
+
+        if (!(success = ((directory = ARExtractParentDirectory(state, entry.path, &name)) != -1)))
+            break;
+
+        switch (entry.type)
+        {
+            case kCAEntryTypeDirectory: {
+                type = 'D';
+
+                success = ARExtractPrepareDestination(state, i, &entry, directory, name);
+
+                if (success && !state->unchanged)
+                    success = ARExtractCreateDirectory(directory, name, &entry);
+            } break;
+            case kCAEntryTypeFile: {
+                type = 'F';
+                success = ARExtractFile(state, i, &entry, directory, name);
+            } break;
+            case kCAEntryTypeLink: {
+                type = 'L';
+                success = ARExtractLinkEntry(state, i, &entry, directory, name);
+            } break;
+        }
+
+        // I'd be lying if I said I know why this helps...
+        // Both cases (verbose = true/false) actually go
+        // about 3x faster by using __builtin_except as
+        // opposed to a stanadrd if statement......
+        if (__builtin_expect(verbose, false) && success && !state->unchanged)
+            ARLog("%c %s\n", type, entry.path);
+
+        ARLogProgressAdvance(entry.dataSize);
+    }
+
+    ARLogProgressEnd();
+
+    if (success && state->deleteStale)
+        success = ARExtractDeleteStaleEntries(state, verbose);
+
+    if (success && state->update && verbose)
+        ARLog("%lu entries unchanged, %lu removed\n", state->unchangedCount, state->removedCount);
+
+    ARExtractCloseDirectories(state);
+    return success;
+}
+
+// Extract a single entry as `name` in `directory`. Directories are created
+// (if needed) but their contents are not extracted.
+static bool ARExtractEntryTo(ARExtractState *state, OSIndex index, ARArchiveEntry *entry, int directory, const OSUTF8Char *name)
+{
+    struct stat stats;
+
+    switch (entry->type)
+    {
+        case kCAEntryTypeDirectory: {
+            if (!ARExtractPrepareDestination(state, index, entry, directory, name))
+                return false;
+
+            if (state->unchanged || (!fstatat(directory, (char *)name, &stats, AT_SYMLINK_NOFOLLOW) && S_ISDIR(stats.st_mode)))
+                return true;
+
+            return ARExtractCreateDirectory(directory, name, entry);
+        }
+        case kCAEntryTypeFile: return ARExtractFile(state, index, entry, directory, name);
+        case kCAEntryTypeLink: return ARExtractLinkEntry(state, index, entry, directory, name);
+    }
+
+    return true;
+}
+
+// Open the directory holding `path` (a path given on the command line),
+// creating it if needed, and point `name` at the last name of `path`.
+// `path` is changed in place.
+static int ARExtractOpenDestination(OSUTF8Char *path, const OSUTF8Char **name)
+{
+    OSSize length = strlen((char *)path);
+
+    if (!length)
+    {
+        fprintf(stderr, "Error: Empty destination path!\n");
+        return -1;
+    }
+
+    while (length > 1 && path[length - 1] == '/')
+        path[--length] = 0;
+
+    OSUTF8Char *separator = (OSUTF8Char *)strrchr((char *)path, '/');
+    const char *parent = ".";
+
+    if (!ARCreateDirectories(path))
+        return -1;
+
+    if (separator)
+    {
+        *separator = 0;
+        parent = (separator == path) ? "/" : (char *)path;
+    }
+
+    *name = separator ? separator + 1 : path;
+
+    int fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1 || !**name)
+    {
+        fprintf(stderr, "Error: Could not open directory '%s'!\n", parent);
+        if (fd != -1) close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+// Extract only the entries named in `files`. Each entry is written to its
+// resulting path if one is given, or to its archive path under
+// `rootDirectory` otherwise. Entries under the root go through the same
+// directory stack as full extraction (missing parents are created on the
+// way). Only the data of these entries is read (and checked against the
+// archive's checksum table).
+bool ARExtractFiles(const OSUTF8Char *path, const OSUTF8Char *rootDirectory, ARExtractFileInfo *files, OSCount fileCount, const OSUTF8Char *keyFile, bool update, bool verbose)
 {
-    if (ARFileHasDataAtPath(destination))
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
+    if (!archive) return false;
+    ARExtractState state;
+
+    if (!archive->cipher && ARArchiveIsEncrypted(archive))
     {
-        fprintf(stderr, "Error: File exists and is not empty at '%s'!\n", destination);
+        fprintf(stderr, "Error: Archive '%s' is encrypted and no key was given!\n", path);
+        ARArchiveClose(archive);
+
         return false;
     }
 
-    int fd = open((char *)destination, O_CREAT | O_WRONLY);
+    memset(&state, 0, sizeof(ARExtractState));
+    state.archive = archive;
+    state.update = update;
+    state.createParents = true;
 
-    if (fd == -1)
+    OSUTF8Char destination[PATH_MAX + 1];
+    ARArchiveEntry entry;
+    bool success = true;
+
+    for (ARExtractFileInfo *file = files; file && success; file = file->next)
     {
-        fprintf(stderr, "Error: Could not open file '%s'!\n", destination);
-        return false;
+        OSIndex index = ARArchiveFindEntry(archive, file->archivePath, &entry);
+        const OSUTF8Char *name;
+        int directory;
+
+        if (index == -1)
+        {
+            fprintf(stderr, "Error: No entry '%s' in archive '%s'!\n", file->archivePath, path);
+            success = false;
+
+            break;
+        }
+
+        if (file->resultingPath) {
+            snprintf((char *)destination, PATH_MAX + 1, "%s", file->resultingPath);
+
+            if (!(success = ((directory = ARExtractOpenDestination(destination, &name)) != -1)))
+                break;
+
+            success = ARExtractEntryTo(&state, index, &entry, directory, name);
+            close(directory);
+        } else {
+            if (!state.depth)
+            {
+                if (!ARDirectoryExistsAtPath(rootDirectory) && !(ARCreateDirectories(rootDirectory) && ARCreateDirectory(rootDirectory)))
+                    success = false;
+
+                if (!(success = success && ARExtractOpenRoot(&state, rootDirectory)))
+                    break;
+            }
+
+            // The root itself already exists
+            if (entry.path[1] && (success = ((directory = ARExtractParentDirectory(&state, entry.path, &name)) != -1)))
+                success = ARExtractEntryTo(&state, index, &entry, directory, name);
+        }
+
+        if (success && verbose && file->resultingPath) {
+            ARLog("%s --> %s\n", entry.path, file->resultingPath);
+        } else if (success && verbose) {
+            ARLog("%s --> %s%s\n", entry.path, rootDirectory, entry.path);
+        }
     }
 
-    if (write(fd, address, size) != size)
+    ARExtractCloseDirectories(&state);
+    return (ARArchiveClose(archive) && success);
+}
+
+bool ARExtractArchive(const OSUTF8Char *path, const OSUTF8Char *rootDirectory, const OSUTF8Char *keyFile, bool update, bool deleteStale, bool verbose)
+{
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
+    if (!archive) return false;
+    ARExtractState state;
+
+    if (!archive->cipher && ARArchiveIsEncrypted(archive))
     {
-        fprintf(stderr, "Error: Could not write file '%s'!\n", destination);
+        fprintf(stderr, "Error: Archive '%s' is encrypted and no key was given!\n", path);
+        ARArchiveClose(archive);
+
         return false;
     }
 
-    if (close(fd))
+    memset(&state, 0, sizeof(ARExtractState));
+    state.archive = archive;
+    state.update = update;
+    state.deleteStale = deleteStale;
+
+    if (archive->chunks)
     {
-        fprintf(stderr, "Error: Could not close file '%s'!\n", destination);
-        return false;
+        ARChunkIndex *index = ARChunkReaderIndex(archive->chunks);
+        state.pipeline = ARPipelineCreate(ARChunkReaderSource(archive->chunks), 0, index->chunkCount, ARPipelineDefaultWorkers());
+
+        if (!state.pipeline)
+        {
+            ARArchiveClose(archive);
+            return false;
+        }
+    }
+
+    bool success = ARExtractArchiveEntries(&state, rootDirectory, verbose);
+
+    if (state.pipeline)
+        success = ARPipelineDestroy(state.pipeline) && success;
+
+    return (ARArchiveClose(archive) && success);
+}
+
+#pragma mark - Cat
+
+// Largest single sendfile call (Linux caps transfers just below 2 GiB)
+#define kARCatMaxSend (1UL << 30)
+
+// Write `size` bytes of zeros to `output`
+static bool ARCatZeros(int output, UInt64 size)
+{
+    static const UInt8 zeros[65536];
+
+    while (size)
+    {
+        OSSize length = (size > sizeof(zeros)) ? sizeof(zeros) : size;
+
+        if (!ARExtractWriteConsumer(&output, zeros, length))
+            return false;
+
+        size -= length;
     }
 
     return true;
 }
 
-// Create symlink with target `link` at `destination`
-static bool ARExtractLink(const OSUTF8Char *destination, const OSUTF8Char *link)
+// Write `size` bytes of stored data at `offset` in the data section to
+// `output`. Plain archives are sent from the archive file by the kernel
+// (sendfile falls back to splice internally for pipes); anything which
+// has to be decompressed or decrypted goes through ARArchiveReadData.
+static bool ARCatStoredRange(ARArchive *archive, int archiveFd, int output, UInt64 offset, UInt64 size)
 {
-    if (symlink((char *)link, (char *)destination))
+    if (archive->chunks || archive->cipher)
+    {
+        UInt8 *buffer = malloc(kARChunkSize);
+        bool success = !!buffer;
+
+        while (success && size)
+        {
+            OSSize length = (size > kARChunkSize) ? kARChunkSize : size;
+
+            success = ARArchiveReadData(archive, offset, length, buffer) && ARExtractWriteConsumer(&output, buffer, length);
+            offset += length;
+            size -= length;
+        }
+
+        free(buffer);
+        return success;
+    }
+
+    OSOffset dataStart = archive->dataSection - (UInt8 *)archive->address;
+
+    if (offset > archive->size - dataStart || size > archive->size - dataStart - offset)
     {
-        fprintf(stderr, "Could not create symlink '%s'\n", destination);
+        fprintf(stderr, "Error: Entry data is outside of archive!\n");
         return false;
     }
 
-    return true;
+    off_t position = dataStart + offset;
+
+#if defined(__linux__)
+    while (size)
+    {
+        ssize_t sent = sendfile(output, archiveFd, &position, (size > kARCatMaxSend) ? kARCatMaxSend : size);
+
+        if (sent > 0) {
+            size -= sent;
+        } else if (sent == -1 && errno == EINTR) {
+            continue;
+        } else if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            // Not supported for this output; write the rest from the mapping
+            break;
+        } else {
+            return false;
+        }
+    }
+#endif /* defined(__linux__) */
+
+    return ARExtractWriteConsumer(&output, archive->address + position, size);
 }
 
-static bool ARExtractArchiveSubtype1(ARArchive *archive, const OSUTF8Char *rootDirectory, bool verbose)
+// Write bytes `offset` through `offset + size` of a sparse file to `output`
+static bool ARCatSparseRange(ARArchive *archive, int archiveFd, int output, ARArchiveEntry *entry, const ARSparseExtent *extents, OSCount extentCount, UInt64 offset, UInt64 size)
 {
-    if (!ARCreateDirectory(rootDirectory))
+    UInt64 end = offset + size;
+    UInt64 stored = 0;
+
+    for (OSIndex i = 0; i < extentCount && offset < end; i++)
     {
-        fprintf(stderr, "Error: Could not create root directory!\n");
+        UInt64 extentEnd = extents[i].offset + extents[i].size;
+
+        if (stored + extents[i].size > entry->dataSize)
+        {
+            fprintf(stderr, "Error: Sparse map of entry '%s' is invalid!\n", entry->path);
+            return false;
+        }
+
+        if (extentEnd > offset)
+        {
+            UInt64 start = (extents[i].offset > offset) ? extents[i].offset : offset;
+            UInt64 stop = (extentEnd < end) ? extentEnd : end;
+
+            if (start > offset && !ARCatZeros(output, ((start < end) ? start : end) - offset))
+                return false;
+
+            if (start < stop && !ARCatStoredRange(archive, archiveFd, output, entry->dataOffset + stored + (start - extents[i].offset), stop - start))
+                return false;
+
+            offset = (start < stop) ? stop : end;
+        }
+
+        stored += extents[i].size;
+    }
+
+    return ARCatZeros(output, end - offset);
+}
+
+// Write the data of the entry at `entryPath` (or `size` bytes of it from
+// `offset`) to `output`
+bool ARCatEntry(const OSUTF8Char *path, const OSUTF8Char *entryPath, UInt64 offset, UInt64 size, const OSUTF8Char *keyFile, int output)
+{
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
+    if (!archive) return false;
+
+    if (!archive->cipher && ARArchiveIsEncrypted(archive))
+    {
+        fprintf(stderr, "Error: Archive '%s' is encrypted and no key was given!\n", path);
+        ARArchiveClose(archive);
+
+        return false;
+    }
+
+    const ARSparseExtent *extents = kOSNullPointer;
+    OSCount extentCount = 0;
+    ARArchiveEntry entry;
+    UInt64 fileSize;
+
+    OSIndex index = ARArchiveFindEntry(archive, entryPath, &entry);
+    bool success = false;
+
+    if (index == -1) {
+        fprintf(stderr, "Error: No entry '%s' in archive '%s'!\n", entryPath, path);
+    } else if (entry.type == kCAEntryTypeDirectory) {
+        fprintf(stderr, "Error: Entry '%s' is a directory!\n", entryPath);
+    } else {
+        if (!ARArchiveGetSparseExtents(archive, index, &fileSize, &extents, &extentCount))
+            fileSize = entry.dataSize;
+
+        success = (offset <= fileSize);
+
+        if (!success)
+            fprintf(stderr, "Error: Offset %lu is past the end of '%s' (%lu bytes)!\n", offset, entryPath, fileSize);
+    }
+
+    if (success && size > fileSize - offset)
+        size = fileSize - offset;
+
+    int archiveFd = success ? open((char *)path, O_RDONLY | O_CLOEXEC) : -1;
+
+    if (success && archiveFd == -1)
+    {
+        fprintf(stderr, "Error: Could not open archive '%s'!\n", path);
+        success = false;
+    }
+
+    if (success && extents) {
+        success = ARCatSparseRange(archive, archiveFd, output, &entry, extents, extentCount, offset, size);
+    } else if (success) {
+        success = ARCatStoredRange(archive, archiveFd, output, entry.dataOffset + offset, size);
+    }
+
+    if (archiveFd != -1)
+        close(archiveFd);
+
+    return (ARArchiveClose(archive) && success);
+}
+
+#pragma mark - Tar Export
+
+// Headers and small payloads are gathered here and written together.
+// Larger payloads of plain archives are sent from the archive file on
+// their own once the buffer has been flushed.
+#define kARTarExportBufferSize  (256 * 1024)
+#define kARTarExportSendSize    (64 * 1024)
+
+typedef struct {
+    int output;
+    UInt8 *buffer;
+    OSSize used;
+} ARTarWriter;
+
+typedef struct {
+    ARTarWriter *writer;
+    const ARSparseExtent *extents;
+    OSCount extentCount;
+    OSIndex extent;
+    UInt64 extentOffset;
+    UInt64 position;
+} ARTarSparse;
+
+static bool ARTarFlush(ARTarWriter *writer)
+{
+    bool success = ARExtractWriteConsumer(&writer->output, writer->buffer, writer->used);
+    writer->used = 0;
+
+    return success;
+}
+
+static bool ARTarPut(void *context, const UInt8 *data, OSSize size)
+{
+    ARTarWriter *writer = context;
+
+    if (size > kARTarExportBufferSize - writer->used && !ARTarFlush(writer))
         return false;
+
+    if (size >= kARTarExportBufferSize)
+        return ARExtractWriteConsumer(&writer->output, data, size);
+
+    memcpy(writer->buffer + writer->used, data, size);
+    writer->used += size;
+
+    return true;
+}
+
+static bool ARTarPutZeros(ARTarWriter *writer, UInt64 size)
+{
+    static const UInt8 zeros[kARTarBlockSize * 8];
+
+    while (size)
+    {
+        OSSize length = (size > sizeof(zeros)) ? sizeof(zeros) : size;
+
+        if (!ARTarPut(writer, zeros, length))
+            return false;
+
+        size -= length;
     }
 
-    if (chdir((char *)rootDirectory))
+    return true;
+}
+
+// Pad a payload of `size` bytes out to a whole block
+static bool ARTarPutPadding(ARTarWriter *writer, UInt64 size)
+{
+    return ARTarPutZeros(writer, (kARTarBlockSize - (size % kARTarBlockSize)) % kARTarBlockSize);
+}
+
+// Write `value` as `width - 1` octal digits and a NUL. Returns false when
+// it doesn't fit.
+static bool ARTarFormatNumber(char *field, OSSize width, UInt64 value)
+{
+    if (value >> ((width - 1) * 3))
+        return false;
+
+    snprintf(field, width, "%0*lo", (int)(width - 1), value);
+    return true;
+}
+
+// Append a pax record ("<length> <key>=<value>\n", where the length counts
+// its own digits)
+static bool ARTarAddPaxRecord(char *records, OSSize *used, OSSize capacity, const char *key, const char *value)
+{
+    OSSize payload = strlen(key) + strlen(value) + 3;
+    OSSize length = payload + 1;
+
+    while (length != payload + snprintf(kOSNullPointer, 0, "%lu", length))
+        length = payload + snprintf(kOSNullPointer, 0, "%lu", length);
+
+    if (length >= capacity - *used)
     {
-        fprintf(stderr, "Error: Could not change working directory!\n");
+        fprintf(stderr, "Error: pax header for '%s' is too large!\n", value);
         return false;
     }
 
-    CAHeaderS1 *header = archive->address;
-    OSOffset *finalEntryEnd = archive->address + (header->entryTableOffset - sizeof(UInt32));
-    OSOffset *toc = archive->address + sizeof(CAHeaderS1);
-    char type = '?';
+    snprintf(records + *used, capacity - *used, "%lu %s=%s\n", length, key, value);
+    *used += length;
+
+    return true;
+}
+
+static bool ARTarPutHeader(ARTarWriter *writer, ARTarHeader *header, char type, UInt64 size, UInt32 mode)
+{
+    const UInt8 *bytes = (const UInt8 *)header;
+    UInt32 checksum = 0;
+
+    header->type = type;
+
+    ARTarFormatNumber(header->mode, sizeof(header->mode), mode);
+    ARTarFormatNumber(header->uid, sizeof(header->uid), 0);
+    ARTarFormatNumber(header->gid, sizeof(header->gid), 0);
+    ARTarFormatNumber(header->modificationTime, sizeof(header->modificationTime), 0);
+
+    if (!ARTarFormatNumber(header->size, sizeof(header->size), size))
+        ARTarFormatNumber(header->size, sizeof(header->size), 0);
+
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+    memset(header->checksum, ' ', sizeof(header->checksum));
+
+    for (OSIndex i = 0; i < kARTarBlockSize; i++)
+        checksum += bytes[i];
 
-    while (toc < finalEntryEnd)
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", checksum);
+    return ARTarPut(writer, bytes, kARTarBlockSize);
+}
+
+// Write the header of one member. A pax header goes first when the name,
+// link or size doesn't fit a ustar header.
+static bool ARTarPutMember(ARTarWriter *writer, const char *name, char type, UInt64 size, const char *link, UInt32 mode)
+{
+    char records[(PATH_MAX * 2) + 128];
+    OSSize recordsSize = 0;
+    ARTarHeader header;
+
+    OSSize nameLength = strlen(name);
+    OSSize linkLength = strlen(link);
+
+    memset(&header, 0, sizeof(ARTarHeader));
+
+    if (nameLength <= sizeof(header.name)) {
+        memcpy(header.name, name, nameLength);
+    } else {
+        // Split at the first '/' which leaves a short enough name
+        const char *slash = strchr(name + nameLength - sizeof(header.name) - 1, '/');
+
+        if (slash && slash != name && slash - name <= sizeof(header.prefix)) {
+            memcpy(header.prefix, name, slash - name);
+            memcpy(header.name, slash + 1, nameLength - (slash - name) - 1);
+        } else {
+            memcpy(header.name, name, sizeof(header.name));
+
+            if (!ARTarAddPaxRecord(records, &recordsSize, sizeof(records), "path", name))
+                return false;
+        }
+    }
+
+    memcpy(header.linkName, link, (linkLength > sizeof(header.linkName)) ? sizeof(header.linkName) : linkLength);
+
+    if (linkLength > sizeof(header.linkName) && !ARTarAddPaxRecord(records, &recordsSize, sizeof(records), "linkpath", link))
+        return false;
+
+    if (size >> ((sizeof(header.size) - 1) * 3))
     {
-        CAEntryS1 *entry = archive->address + header->entryTableOffset + (*toc);
-        OSUTF8Char *destination = entry->path + 1;
+        char value[24];
+        snprintf(value, sizeof(value), "%lu", size);
 
-        switch (entry->type)
-        {
-            case kCAEntryTypeDirectory: {
-                type = 'D';
+        if (!ARTarAddPaxRecord(records, &recordsSize, sizeof(records), "size", value))
+            return false;
+    }
 
-                if (!(*destination))
-                    break;
+    if (recordsSize)
+    {
+        ARTarHeader pax;
 
-                if (!ARCreateDirectory(destination))
-                    return false;
-            } break;
-            case kCAEntryTypeFile: {
-                type = 'F';
+        memset(&pax, 0, sizeof(ARTarHeader));
+        memcpy(pax.name, "PaxHeader", 9);
 
-                if (!ARExtractFile(destination, archive->address + header->dataSectionOffset + entry->dataOffset, entry->dataSize))
-                    return false;
-            } break;
-            case kCAEntryTypeLink: {
-                OSUTF8Char *link = malloc(entry->dataSize + 1);
-                type = 'L';
+        if (!ARTarPutHeader(writer, &pax, 'x', recordsSize, 0644) || !ARTarPut(writer, (const UInt8 *)records, recordsSize) || !ARTarPutPadding(writer, recordsSize))
+            return false;
+    }
+
+    return ARTarPutHeader(writer, &header, type, size, mode);
+}
 
-                if (!link)
-                {
-                    fprintf(stderr, "Error: Out of memory!\n");
-                    return false;
-                }
+// Write stored data to the tar stream, filling in the holes between extents
+static bool ARTarSparseConsumer(void *context, const UInt8 *data, OSSize size)
+{
+    ARTarSparse *sparse = context;
 
-                memcpy(link, archive->address + header->dataSectionOffset + entry->dataOffset, entry->dataSize);
-                link[entry->dataSize] = 0;
+    while (size)
+    {
+        if (sparse->extent >= sparse->extentCount)
+            return false;
 
-                bool success = ARExtractLink(destination, link);
-                free(link);
+        const ARSparseExtent *extent = &sparse->extents[sparse->extent];
+        OSSize length = extent->size - sparse->extentOffset;
+        if (length > size) length = size;
 
-                if (!success) return false;
-            } break;
+        if (!sparse->extentOffset && extent->offset > sparse->position)
+        {
+            if (!ARTarPutZeros(sparse->writer, extent->offset - sparse->position))
+                return false;
+
+            sparse->position = extent->offset;
         }
 
-        toc++;
+        if (!ARTarPut(sparse->writer, data, length))
+            return false;
 
-        // I'd be lying if I said I know why this helps...
-        // Both cases (verbose = true/false) actually go
-        // about 3x faster by using __builtin_except as
-        // opposed to a stanadrd if statement......
-        if (__builtin_expect(verbose, false))
-            fprintf(stdout, "%c %s\n", type, entry->path);
+        data += length;
+        size -= length;
+        sparse->position += length;
+
+        if ((sparse->extentOffset += length) == extent->size)
+        {
+            sparse->extentOffset = 0;
+            sparse->extent++;
+        }
     }
 
     return true;
 }
 
-bool ARExtractFiles(const OSUTF8Char *archive, const OSUTF8Char *rootDirectory, ARExtractFileInfo *files, OSCount fileCount, bool verbose)
+// Write the contents of a file entry (`fileSize` bytes, holes included).
+// Plain archives send anything but small files straight from the archive
+// file; everything else is read through the extraction path, which checks
+// the data against the archive's checksum table on the way.
+static bool ARTarPutData(ARExtractState *state, ARTarWriter *writer, int archiveFd, OSIndex index, ARArchiveEntry *entry, const ARSparseExtent *extents, OSCount extentCount, UInt64 fileSize)
+{
+    ARTarSparse sparse;
+
+    if (archiveFd != -1 && (extents || entry->dataSize > kARTarExportSendSize))
+    {
+        if (!ARTarFlush(writer))
+            return false;
+
+        if (extents)
+            return ARCatSparseRange(state->archive, archiveFd, writer->output, entry, extents, extentCount, 0, fileSize);
+
+        return ARCatStoredRange(state->archive, archiveFd, writer->output, entry->dataOffset, entry->dataSize);
+    }
+
+    if (!extents)
+        return ARExtractReadData(state, index, entry, ARTarPut, writer);
+
+    memset(&sparse, 0, sizeof(ARTarSparse));
+    sparse.writer = writer;
+    sparse.extents = extents;
+    sparse.extentCount = extentCount;
+
+    if (!ARExtractReadData(state, index, entry, ARTarSparseConsumer, &sparse) || sparse.extent != extentCount || sparse.position > fileSize)
+    {
+        fprintf(stderr, "Error: Sparse map of entry '%s' is invalid!\n", entry->path);
+        return false;
+    }
+
+    return ARTarPutZeros(writer, fileSize - sparse.position);
+}
+
+static bool ARTarPutEntry(ARExtractState *state, ARTarWriter *writer, int archiveFd, OSIndex index, ARArchiveEntry *entry)
 {
-    return false;
+    const char *name = (const char *)entry->path + 1;
+
+    switch (entry->type)
+    {
+        case kCAEntryTypeDirectory: return ARTarPutMember(writer, name, '5', 0, "", 0755);
+        case kCAEntryTypeFile: {
+            const ARSparseExtent *extents = kOSNullPointer;
+            OSCount extentCount = 0;
+            UInt64 fileSize;
+
+            if (!ARArchiveGetSparseExtents(state->archive, index, &fileSize, &extents, &extentCount))
+                fileSize = entry->dataSize;
+
+            return ARTarPutMember(writer, name, '0', fileSize, "", 0644) && ARTarPutData(state, writer, archiveFd, index, entry, extents, extentCount, fileSize) && ARTarPutPadding(writer, fileSize);
+        }
+        case kCAEntryTypeLink: {
+            OSUTF8Char target[PATH_MAX + 1];
+            ARExtractBuffer link;
+
+            if (entry->dataSize > PATH_MAX)
+            {
+                fprintf(stderr, "Error: Link target of '%s' is too long!\n", entry->path);
+                return false;
+            }
+
+            link.buffer = target;
+            link.offset = 0;
+
+            if (!ARExtractReadData(state, index, entry, ARExtractBufferConsumer, &link))
+                return false;
+
+            target[entry->dataSize] = 0;
+            return ARTarPutMember(writer, name, '2', 0, (const char *)target, 0777);
+        }
+    }
+
+    return true;
 }
 
-bool ARExtractArchive(const OSUTF8Char *path, const OSUTF8Char *rootDirectory, bool verbose)
+// Write the archive to `output` as a POSIX (ustar, with pax headers where
+// needed) tar stream, entry by entry in ToC order. Memory use doesn't
+// depend on the size of the archive.
+bool ARExportTar(const OSUTF8Char *path, const OSUTF8Char *keyFile, int output)
 {
-    ARArchive *archive = ARArchiveOpen(path);
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
     if (!archive) return false;
-    bool success = false;
+    ARExtractState state;
+    ARTarWriter writer;
+
+    if (!archive->cipher && ARArchiveIsEncrypted(archive))
+    {
+        fprintf(stderr, "Error: Archive '%s' is encrypted and no key was given!\n", path);
+        ARArchiveClose(archive);
+
+        return false;
+    }
+
+    memset(&state, 0, sizeof(ARExtractState));
+    state.archive = archive;
+
+    if (archive->chunks)
+    {
+        ARChunkIndex *index = ARChunkReaderIndex(archive->chunks);
+        state.pipeline = ARPipelineCreate(ARChunkReaderSource(archive->chunks), 0, index->chunkCount, ARPipelineDefaultWorkers());
+
+        if (!state.pipeline)
+        {
+            ARArchiveClose(archive);
+            return false;
+        }
+    }
+
+    writer.output = output;
+    writer.buffer = malloc(kARTarExportBufferSize);
+    writer.used = 0;
+
+    int archiveFd = (archive->chunks || archive->cipher) ? -1 : open((char *)path, O_RDONLY | O_CLOEXEC);
+    bool success = !!writer.buffer;
+
+    if (!success)
+        fprintf(stderr, "Error: Out of memory!\n");
+
+    if (success && !archive->chunks && !archive->cipher && archiveFd == -1)
+    {
+        fprintf(stderr, "Error: Could not open archive '%s'!\n", path);
+        success = false;
+    }
+
+    for (OSIndex i = 0; success && i < archive->entryCount; i++)
+    {
+        ARArchiveEntry entry;
+
+        if (!(success = ARArchiveGetEntry(archive, i, &entry)))
+            break;
+
+        // The root itself
+        if (!entry.path[1])
+            continue;
+
+        success = ARTarPutEntry(&state, &writer, archiveFd, i, &entry);
+    }
+
+    // Two zero blocks end the stream
+    if (success)
+        success = ARTarPutZeros(&writer, kARTarBlockSize * 2) && ARTarFlush(&writer);
+
+    if (archiveFd != -1)
+        close(archiveFd);
 
-    if (archive->subtype == kARSubtype1)
-        success = ARExtractArchiveSubtype1(archive, rootDirectory, verbose);
+    if (state.pipeline)
+        success = ARPipelineDestroy(state.pipeline) && success;
 
+    free(writer.buffer);
     return (ARArchiveClose(archive) && success);
 }
@@ -7,5 +7,7 @@ typedef struct __ARExtractFileInfo {
     struct __ARExtractFileInfo *next;
 } ARExtractFileInfo;
 
-bool ARExtractFiles(const OSUTF8Char *archive, const OSUTF8Char *rootDirectory, ARExtractFileInfo *files, OSCount fileCount, bool verbose);
-bool ARExtractArchive(const OSUTF8Char *archive, const OSUTF8Char *rootDirectory, bool verbose);
+bool ARExtractFiles(const OSUTF8Char *archive, const OSUTF8Char *rootDirectory, ARExtractFileInfo *files, OSCount fileCount, const OSUTF8Char *keyFile, bool update, bool verbose);
+bool ARExtractArchive(const OSUTF8Char *archive, const OSUTF8Char *rootDirectory, const OSUTF8Char *keyFile, bool update, bool deleteStale, bool verbose);
+bool ARCatEntry(const OSUTF8Char *archive, const OSUTF8Char *entryPath, UInt64 offset, UInt64 size, const OSUTF8Char *keyFile, int output);
+bool ARExportTar(const OSUTF8Char *archive, const OSUTF8Char *keyFile, int output);
@@ -0,0 +1,392 @@
+#include <sys/syslimits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "car_filter.h"
+
+// Patterns are split into their '/' separated components when they're
+// loaded. Components without wildcards are compared as plain bytes.
+typedef struct {
+    const char *pattern;
+    OSSize length;
+    bool literal;
+    bool anyDepth;
+} ARFilterComponent;
+
+typedef struct {
+    bool include;
+    bool directoryOnly;
+
+    // Matched against the whole path rather than names
+    bool anchored;
+
+    ARFilterComponent *components;
+    OSCount componentCount;
+} ARFilterRule;
+
+typedef struct {
+    const char *name;
+    OSSize length;
+} ARFilterName;
+
+struct __ARFilter {
+    // The rules file; patterns point into it
+    char *text;
+
+    ARFilterRule *rules;
+    OSCount ruleCount;
+
+    // Names of the path being matched
+    ARFilterName *names;
+    OSCount nameCount;
+};
+
+#pragma mark - Matching
+
+// Match the class starting after a '[' against `c` and move `pattern` past
+// its ']'. Returns -1 if the class is never closed.
+static int ARFilterMatchClass(const char **pattern, const char *end, UInt8 c)
+{
+    const char *p = *pattern;
+    bool negate = false;
+    bool matched = false;
+
+    if (p < end && (*p == '!' || *p == '^'))
+    {
+        negate = true;
+        p++;
+    }
+
+    // A ']' straight after the '[' is part of the class
+    for (bool first = true; p < end && (first || *p != ']'); first = false)
+    {
+        UInt8 low = *p++;
+        UInt8 high;
+
+        if (low == '\\' && p < end) low = *p++;
+        high = low;
+
+        if (p + 1 < end && *p == '-' && p[1] != ']')
+        {
+            high = p[1];
+            p += 2;
+
+            if (high == '\\' && p < end) high = *p++;
+        }
+
+        if (c >= low && c <= high)
+            matched = true;
+    }
+
+    if (p == end)
+        return -1;
+
+    *pattern = p + 1;
+    return (matched != negate);
+}
+
+// Match a single name against a glob. A '*' is retried one byte further
+// on whenever what follows it fails, which is linear for one '*' and never
+// worse than quadratic.
+static bool ARFilterMatchName(const char *pattern, OSSize patternLength, const char *name, OSSize nameLength)
+{
+    const char *p = pattern, *patternEnd = pattern + patternLength;
+    const char *n = name, *nameEnd = name + nameLength;
+    const char *starPattern = kOSNullPointer;
+    const char *starName = kOSNullPointer;
+
+    while (n < nameEnd)
+    {
+        if (p < patternEnd && *p == '*')
+        {
+            while (p < patternEnd && *p == '*') p++;
+
+            starPattern = p;
+            starName = n;
+
+            continue;
+        }
+
+        if (p < patternEnd)
+        {
+            const char *next = p + 1;
+            bool matched;
+
+            if (*p == '?') {
+                matched = true;
+            } else if (*p == '[') {
+                int result = ARFilterMatchClass(&next, patternEnd, *n);
+
+                // An unclosed '[' is just a '['
+                if (result == -1) {
+                    matched = (*n == '[');
+                    next = p + 1;
+                } else {
+                    matched = result;
+                }
+            } else if (*p == '\\' && p + 1 < patternEnd) {
+                matched = (p[1] == *n);
+                next = p + 2;
+            } else {
+                matched = (*p == *n);
+            }
+
+            if (matched)
+            {
+                p = next;
+                n++;
+
+                continue;
+            }
+        }
+
+        if (!starPattern)
+            return false;
+
+        p = starPattern;
+        n = ++starName;
+    }
+
+    while (p < patternEnd && *p == '*') p++;
+    return (p == patternEnd);
+}
+
+static bool ARFilterMatchComponent(const ARFilterComponent *component, const ARFilterName *name)
+{
+    if (component->literal)
+        return (component->length == name->length && !memcmp(component->pattern, name->name, name->length));
+
+    return ARFilterMatchName(component->pattern, component->length, name->name, name->length);
+}
+
+// Whether the components of `rule` from `i` on match the names of the
+// path from `j` on, or the names of a directory above it. With `below`,
+// whether they could match something inside the path instead.
+static bool ARFilterMatchPath(ARFilter *filter, const ARFilterRule *rule, OSIndex i, OSIndex j, bool directory, bool below)
+{
+    if (i == rule->componentCount)
+        return (!below && (j < filter->nameCount || directory || !rule->directoryOnly));
+
+    if (j == filter->nameCount)
+        return below;
+
+    if (rule->components[i].anyDepth)
+        return (ARFilterMatchPath(filter, rule, i + 1, j, directory, below) || ARFilterMatchPath(filter, rule, i, j + 1, directory, below));
+
+    if (!ARFilterMatchComponent(&rule->components[i], &filter->names[j]))
+        return false;
+
+    return ARFilterMatchPath(filter, rule, i + 1, j + 1, directory, below);
+}
+
+// Name patterns only look at the last name of the path
+static bool ARFilterMatchLastName(ARFilter *filter, const ARFilterRule *rule, bool directory)
+{
+    if (!filter->nameCount || (rule->directoryOnly && !directory))
+        return false;
+
+    return ARFilterMatchComponent(&rule->components[0], &filter->names[filter->nameCount - 1]);
+}
+
+// `path` is an archive path ('/' first). `directory` says whether it is a
+// directory, which only matters to patterns ending in '/'.
+bool ARFilterIncludes(ARFilter *filter, const OSUTF8Char *path, bool directory)
+{
+    const char *c = (const char *)path;
+
+    filter->nameCount = 0;
+
+    while (*c)
+    {
+        while (*c == '/') c++;
+        if (!*c) break;
+
+        const char *end = strchr(c, '/');
+        if (!end) end = c + strlen(c);
+
+        filter->names[filter->nameCount].name = c;
+        filter->names[filter->nameCount].length = end - c;
+        filter->nameCount++;
+
+        c = end;
+    }
+
+    for (OSIndex i = 0; i < filter->ruleCount; i++)
+    {
+        const ARFilterRule *rule = &filter->rules[i];
+        bool matched = rule->anchored ? ARFilterMatchPath(filter, rule, 0, 0, directory, false) : ARFilterMatchLastName(filter, rule, directory);
+
+        if (matched)
+            return rule->include;
+
+        // Keep a directory no earlier rule decided on if this rule could
+        // include something inside it
+        if (directory && rule->include && rule->anchored && ARFilterMatchPath(filter, rule, 0, 0, true, true))
+            return true;
+    }
+
+    return true;
+}
+
+#pragma mark - Loading
+
+static char *ARFilterReadFile(const OSUTF8Char *path)
+{
+    struct stat stats;
+    int fd = open((char *)path, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &stats))
+    {
+        fprintf(stderr, "Error: Could not open filter '%s'!\n", path);
+        if (fd != -1) close(fd);
+
+        return kOSNullPointer;
+    }
+
+    char *text = malloc(stats.st_size + 1);
+
+    if (!text || read(fd, text, stats.st_size) != stats.st_size)
+    {
+        fprintf(stderr, "Error: Could not read filter '%s'!\n", path);
+        close(fd);
+        free(text);
+
+        return kOSNullPointer;
+    }
+
+    text[stats.st_size] = 0;
+    close(fd);
+
+    return text;
+}
+
+// Split `pattern` (terminated in place) into the components of `rule`
+static bool ARFilterCompileRule(ARFilterRule *rule, char *pattern)
+{
+    OSSize length = strlen(pattern);
+    OSCount capacity = 1;
+
+    while (length && pattern[length - 1] == '/')
+    {
+        pattern[--length] = 0;
+        rule->directoryOnly = true;
+    }
+
+    rule->anchored = !!strchr(pattern, '/');
+
+    for (OSIndex i = 0; i < length; i++)
+        capacity += (pattern[i] == '/');
+
+    if (!(rule->components = malloc(capacity * sizeof(ARFilterComponent))))
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    for (char *c = pattern; *c; )
+    {
+        if (*c == '/')
+        {
+            c++;
+            continue;
+        }
+
+        ARFilterComponent *component = &rule->components[rule->componentCount++];
+        char *end = strchr(c, '/');
+        if (!end) end = c + strlen(c);
+
+        char *wildcard = strpbrk(c, "*?[\\");
+
+        component->pattern = c;
+        component->length = end - c;
+        component->literal = (!wildcard || wildcard >= end);
+        component->anyDepth = (component->length == 2 && !memcmp(c, "**", 2));
+
+        c = end;
+    }
+
+    return (rule->componentCount != 0);
+}
+
+ARFilter *ARFilterLoad(const OSUTF8Char *path)
+{
+    ARFilter *filter = malloc(sizeof(ARFilter));
+    OSCount capacity = 1;
+    OSCount lineNumber = 0;
+
+    if (!filter)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    memset(filter, 0, sizeof(ARFilter));
+
+    if (!(filter->text = ARFilterReadFile(path)))
+    {
+        ARFilterFree(filter);
+        return kOSNullPointer;
+    }
+
+    for (char *c = filter->text; *c; c++)
+        capacity += (*c == '\n');
+
+    filter->rules = malloc(capacity * sizeof(ARFilterRule));
+    filter->names = malloc(((PATH_MAX / 2) + 1) * sizeof(ARFilterName));
+
+    if (!filter->rules || !filter->names)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        ARFilterFree(filter);
+
+        return kOSNullPointer;
+    }
+
+    for (char *line = filter->text; *line; )
+    {
+        char *end = strchr(line, '\n');
+        char *next = end ? end + 1 : line + strlen(line);
+
+        if (end) *end = 0;
+        if (end && end > line && end[-1] == '\r') end[-1] = 0;
+
+        lineNumber++;
+
+        if (*line && *line != '#')
+        {
+            ARFilterRule *rule = &filter->rules[filter->ruleCount++];
+            memset(rule, 0, sizeof(ARFilterRule));
+
+            rule->include = (*line == '+');
+
+            if ((*line != '+' && *line != '-') || line[1] != ' ' || !ARFilterCompileRule(rule, line + 2))
+            {
+                fprintf(stderr, "Error: Invalid rule on line %lu of filter '%s'!\n", lineNumber, path);
+                ARFilterFree(filter);
+
+                return kOSNullPointer;
+            }
+        }
+
+        line = next;
+    }
+
+    return filter;
+}
+
+void ARFilterFree(ARFilter *filter)
+{
+    if (!filter) return;
+
+    for (OSIndex i = 0; filter->rules && i < filter->ruleCount; i++)
+        free(filter->rules[i].components);
+
+    free(filter->rules);
+    free(filter->names);
+    free(filter->text);
+    free(filter);
+}
@@ -0,0 +1,31 @@
+#ifndef __car_filter__
+#define __car_filter__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+// A filter picks which paths under a root directory go into an archive.
+// Its rules come from a file with one rule per line: '+ <pattern>'
+// includes and '- <pattern>' excludes, and empty lines and lines starting
+// with '#' are skipped. The first rule matching a path decides; paths no
+// rule matches are included.
+//
+// Patterns containing a '/' are matched against the archive path (the
+// leading '/' is implied when left out) and also match everything inside
+// the directories they match. Other patterns are matched against the last
+// name of the path. A trailing '/' makes a pattern match only
+// directories. '*' and '?' match within a name, '[...]' matches a class of
+// bytes and a '**' component matches any number of directories.
+//
+// Excluded directories are never read, so nothing inside one can be
+// included. A directory is kept (rather than left to later rules) when an
+// include rule with a '/' could match something inside it and no earlier
+// rule matches the directory itself.
+
+typedef struct __ARFilter ARFilter;
+
+ARFilter *ARFilterLoad(const OSUTF8Char *path);
+bool ARFilterIncludes(ARFilter *filter, const OSUTF8Char *path, bool directory);
+void ARFilterFree(ARFilter *filter);
+
+#endif /* !defined(__car_filter__) */
@@ -0,0 +1,263 @@
+#include <sys/syslimits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "car_log.h"
+
+// The producer appends to the ring and publishes `head`; the writer thread
+// writes out everything up to `head` and publishes `tail`. Both only ever
+// grow, so `head - tail` is the number of bytes waiting.
+
+typedef enum {
+    kARLogProgressIdle      = 0,
+    kARLogProgressRunning   = 1,
+    kARLogProgressFinishing = 2
+} ARLogProgressState;
+
+typedef struct {
+    char *buffer;
+    _Atomic UInt64 head;
+    _Atomic UInt64 tail;
+    _Atomic bool running;
+
+    pthread_t thread;
+    bool started;
+    bool showProgress;
+
+    // Written by the producer before `progressState` is set to running
+    const char *progressAction;
+    UInt64 progressTotal;
+    UInt64 progressStart;
+
+    _Atomic UInt64 progressDone;
+    _Atomic int progressState;
+} ARLogState;
+
+static ARLogState gARLog;
+
+static UInt64 ARLogNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+static void ARLogBackoff(UInt32 *spins)
+{
+    struct timespec delay = {0, 50000};
+
+    if ((*spins)++ < 64)
+        return;
+
+    if ((*spins) < 128) {
+        sched_yield();
+    } else {
+        nanosleep(&delay, kOSNullPointer);
+    }
+}
+
+#pragma mark - Writer Thread
+
+static void ARLogPrintProgress(bool final)
+{
+    UInt64 done = atomic_load_explicit(&gARLog.progressDone, memory_order_relaxed);
+    UInt64 total = gARLog.progressTotal;
+    double elapsed = (ARLogNow() - gARLog.progressStart) / 1e9;
+    double rate = (elapsed > 0) ? (done / elapsed) : 0;
+    UInt64 eta = (rate > 0 && total > done) ? (UInt64)((total - done) / rate) : 0;
+
+    if (done > total) done = total;
+
+    fprintf(stderr, "\r%s: %.1f/%.1f MiB (%.1f MiB/s, ETA %lu:%02lu)   %s", gARLog.progressAction, done / 1048576.0, total / 1048576.0, rate / 1048576.0, eta / 60, eta % 60, final ? "\n" : "");
+}
+
+// Write out the bytes between `tail` and `head`. Returns whether there were any.
+static bool ARLogDrain(void)
+{
+    UInt64 head = atomic_load_explicit(&gARLog.head, memory_order_acquire);
+    UInt64 tail = atomic_load_explicit(&gARLog.tail, memory_order_relaxed);
+
+    if (head == tail)
+        return false;
+
+    while (tail < head)
+    {
+        OSSize offset = tail % kARLogBufferSize;
+        OSSize length = head - tail;
+
+        if (length > kARLogBufferSize - offset)
+            length = kARLogBufferSize - offset;
+
+        fwrite(gARLog.buffer + offset, 1, length, stdout);
+        tail += length;
+    }
+
+    atomic_store_explicit(&gARLog.tail, tail, memory_order_release);
+    return true;
+}
+
+static void *ARLogWriter(void *context)
+{
+    struct timespec delay = {0, 1000000};
+    UInt64 lastProgress = 0;
+
+    for ( ; ; )
+    {
+        bool wrote = ARLogDrain();
+        int state = atomic_load_explicit(&gARLog.progressState, memory_order_acquire);
+
+        if (state == kARLogProgressFinishing) {
+            ARLogPrintProgress(true);
+            atomic_store_explicit(&gARLog.progressState, kARLogProgressIdle, memory_order_release);
+        } else if (state == kARLogProgressRunning && ARLogNow() - lastProgress >= kARLogProgressInterval) {
+            ARLogPrintProgress(false);
+            lastProgress = ARLogNow();
+        }
+
+        if (wrote)
+            continue;
+
+        // Stopping waits for everything written before it to go out
+        if (!atomic_load_explicit(&gARLog.running, memory_order_acquire) && !ARLogDrain())
+            break;
+
+        fflush(stdout);
+        nanosleep(&delay, kOSNullPointer);
+    }
+
+    fflush(stdout);
+    return kOSNullPointer;
+}
+
+#pragma mark - Producer
+
+bool ARLogStart(bool progress)
+{
+    if (gARLog.started)
+        return true;
+
+    memset(&gARLog, 0, sizeof(ARLogState));
+    gARLog.buffer = malloc(kARLogBufferSize);
+    gARLog.showProgress = progress;
+
+    if (!gARLog.buffer)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    atomic_store(&gARLog.running, true);
+
+    if (pthread_create(&gARLog.thread, kOSNullPointer, ARLogWriter, kOSNullPointer))
+    {
+        fprintf(stderr, "Error: Could not start the log writer!\n");
+        free(gARLog.buffer);
+        gARLog.buffer = kOSNullPointer;
+
+        return false;
+    }
+
+    gARLog.started = true;
+    return true;
+}
+
+void ARLogStop(void)
+{
+    if (!gARLog.started)
+        return;
+
+    ARLogProgressEnd();
+
+    atomic_store_explicit(&gARLog.running, false, memory_order_release);
+    pthread_join(gARLog.thread, kOSNullPointer);
+
+    free(gARLog.buffer);
+    memset(&gARLog, 0, sizeof(ARLogState));
+}
+
+void ARLog(const char *format, ...)
+{
+    char line[(PATH_MAX * 2) + 64];
+    va_list arguments;
+
+    va_start(arguments, format);
+
+    if (!gARLog.started)
+    {
+        vfprintf(stdout, format, arguments);
+        va_end(arguments);
+
+        return;
+    }
+
+    int length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    if (length <= 0) return;
+    if (length >= sizeof(line)) length = sizeof(line) - 1;
+
+    UInt64 head = atomic_load_explicit(&gARLog.head, memory_order_relaxed);
+    UInt32 spins = 0;
+
+    while (head + length - atomic_load_explicit(&gARLog.tail, memory_order_acquire) > kARLogBufferSize)
+        ARLogBackoff(&spins);
+
+    OSSize offset = head % kARLogBufferSize;
+    OSSize first = (length > kARLogBufferSize - offset) ? (kARLogBufferSize - offset) : length;
+
+    memcpy(gARLog.buffer + offset, line, first);
+    memcpy(gARLog.buffer, line + first, length - first);
+
+    atomic_store_explicit(&gARLog.head, head + length, memory_order_release);
+}
+
+#pragma mark - Progress
+
+bool ARLogProgressEnabled(void)
+{
+    return (gARLog.started && gARLog.showProgress);
+}
+
+void ARLogProgressBegin(const char *action, UInt64 total)
+{
+    if (!gARLog.started || !gARLog.showProgress)
+        return;
+
+    // Let the writer finish with any previous progress line first
+    ARLogProgressEnd();
+
+    gARLog.progressAction = action;
+    gARLog.progressTotal = total;
+    gARLog.progressStart = ARLogNow();
+
+    atomic_store_explicit(&gARLog.progressDone, 0, memory_order_relaxed);
+    atomic_store_explicit(&gARLog.progressState, kARLogProgressRunning, memory_order_release);
+}
+
+void ARLogProgressAdvance(UInt64 size)
+{
+    if (gARLog.showProgress)
+        atomic_fetch_add_explicit(&gARLog.progressDone, size, memory_order_relaxed);
+}
+
+void ARLogProgressEnd(void)
+{
+    int expected = kARLogProgressRunning;
+    UInt32 spins = 0;
+
+    if (!gARLog.started || !gARLog.showProgress)
+        return;
+
+    if (!atomic_compare_exchange_strong(&gARLog.progressState, &expected, kARLogProgressFinishing))
+        return;
+
+    while (atomic_load_explicit(&gARLog.progressState, memory_order_acquire) != kARLogProgressIdle)
+        ARLogBackoff(&spins);
+}
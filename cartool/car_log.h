@@ -0,0 +1,28 @@
+#ifndef __car_log__
+#define __car_log__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+// Verbose output from the create and extract loops is formatted into a
+// ring buffer and written out by a background thread, so printing a line
+// per entry costs a copy rather than a trip through stdio. The buffer has
+// a single producer: only call ARLog from the thread which started it.
+// Without a running logger, ARLog prints directly.
+
+#define kARLogBufferSize        (1 << 20)
+#define kARLogProgressInterval  250000000ULL // ns
+
+bool ARLogStart(bool progress);
+void ARLogStop(void);
+bool ARLogProgressEnabled(void);
+
+void ARLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Progress is shown as a single line on stderr when the logger was started
+// with `progress`. `total` is the number of bytes the operation will process.
+void ARLogProgressBegin(const char *action, UInt64 total);
+void ARLogProgressAdvance(UInt64 size);
+void ARLogProgressEnd(void);
+
+#endif /* !defined(__car_log__) */
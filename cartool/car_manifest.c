@@ -0,0 +1,232 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "car_manifest.h"
+
+typedef struct {
+    const OSUTF8Char *path;
+    const ARManifestRecord *record;
+} ARManifestLookup;
+
+struct __ARManifest {
+    ARManifestRecord *records;
+    OSCount recordCount;
+    OSCount recordCapacity;
+
+    OSUTF8Char *paths;
+    OSSize pathsSize;
+    OSSize pathsCapacity;
+
+    // Only set for loaded manifests; sorted by path
+    ARManifestLookup *lookup;
+    UInt64 archiveSize;
+};
+
+#pragma mark - Building
+
+ARManifest *ARManifestCreate(void)
+{
+    ARManifest *manifest = malloc(sizeof(ARManifest));
+
+    if (!manifest)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    memset(manifest, 0, sizeof(ARManifest));
+    return manifest;
+}
+
+// Append `record` for the entry at (archive) `path`. The record's path
+// offset is filled in here.
+bool ARManifestAdd(ARManifest *manifest, const OSUTF8Char *path, ARManifestRecord *record)
+{
+    OSSize length = strlen((char *)path) + 1;
+
+    if (manifest->recordCount == manifest->recordCapacity)
+    {
+        OSCount capacity = manifest->recordCapacity ? (manifest->recordCapacity * 2) : 256;
+        ARManifestRecord *records = realloc(manifest->records, capacity * sizeof(ARManifestRecord));
+
+        if (!records)
+        {
+            fprintf(stderr, "Error: Out of memory!\n");
+            return false;
+        }
+
+        manifest->records = records;
+        manifest->recordCapacity = capacity;
+    }
+
+    if (manifest->pathsSize + length > manifest->pathsCapacity)
+    {
+        OSSize capacity = manifest->pathsCapacity ? manifest->pathsCapacity : 16384;
+        while (manifest->pathsSize + length > capacity) capacity *= 2;
+
+        OSUTF8Char *paths = realloc(manifest->paths, capacity);
+
+        if (!paths)
+        {
+            fprintf(stderr, "Error: Out of memory!\n");
+            return false;
+        }
+
+        manifest->paths = paths;
+        manifest->pathsCapacity = capacity;
+    }
+
+    memcpy(manifest->paths + manifest->pathsSize, path, length);
+    record->pathOffset = manifest->pathsSize;
+    manifest->pathsSize += length;
+
+    manifest->records[manifest->recordCount++] = *record;
+    return true;
+}
+
+bool ARManifestWrite(ARManifest *manifest, const OSUTF8Char *path, UInt64 archiveSize)
+{
+    ARManifestHeader header;
+    memcpy(header.magic, kARManifestMagic, 4);
+
+    header.version = kARManifestVersion;
+    header.archiveSize = archiveSize;
+    header.recordCount = manifest->recordCount;
+    header.pathsSize = manifest->pathsSize;
+
+    int fd = open((char *)path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: Could not open manifest '%s'!\n", path);
+        return false;
+    }
+
+    bool success = ARWriteAll(fd, &header, sizeof(ARManifestHeader))
+                && ARWriteAll(fd, manifest->records, manifest->recordCount * sizeof(ARManifestRecord))
+                && ARWriteAll(fd, manifest->paths, manifest->pathsSize);
+
+    if (!success)
+        fprintf(stderr, "Error: Could not write manifest '%s'!\n", path);
+
+    return !close(fd) && success;
+}
+
+#pragma mark - Loading
+
+static int ARManifestCompareLookup(const void *a, const void *b)
+{
+    return strcmp((const char *)((const ARManifestLookup *)a)->path, (const char *)((const ARManifestLookup *)b)->path);
+}
+
+ARManifest *ARManifestLoad(const OSUTF8Char *path)
+{
+    ARManifestHeader header;
+    struct stat stats;
+
+    int fd = open((char *)path, O_RDONLY);
+
+    // A missing manifest just means there's nothing to reuse
+    if (fd == -1)
+    {
+        if (errno != ENOENT) fprintf(stderr, "Error: Could not open manifest '%s'!\n", path);
+        return kOSNullPointer;
+    }
+
+    if (fstat(fd, &stats) || read(fd, &header, sizeof(ARManifestHeader)) != sizeof(ARManifestHeader))
+    {
+        fprintf(stderr, "Error: Could not read manifest '%s'!\n", path);
+        close(fd);
+
+        return kOSNullPointer;
+    }
+
+    OSSize recordsSize = header.recordCount * sizeof(ARManifestRecord);
+
+    if (memcmp(header.magic, kARManifestMagic, 4) || header.version != kARManifestVersion || header.recordCount > (stats.st_size / sizeof(ARManifestRecord)) || sizeof(ARManifestHeader) + recordsSize + header.pathsSize != stats.st_size)
+    {
+        fprintf(stderr, "Error: Manifest '%s' is invalid!\n", path);
+        close(fd);
+
+        return kOSNullPointer;
+    }
+
+    ARManifest *manifest = ARManifestCreate();
+
+    if (!manifest)
+    {
+        close(fd);
+        return kOSNullPointer;
+    }
+
+    manifest->records = malloc(recordsSize ? recordsSize : 1);
+    manifest->paths = malloc(header.pathsSize + 1);
+    manifest->lookup = malloc(header.recordCount ? (header.recordCount * sizeof(ARManifestLookup)) : 1);
+    manifest->recordCount = manifest->recordCapacity = header.recordCount;
+    manifest->pathsSize = manifest->pathsCapacity = header.pathsSize;
+    manifest->archiveSize = header.archiveSize;
+
+    if (!manifest->records || !manifest->paths || !manifest->lookup)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        ARManifestFree(manifest);
+        close(fd);
+
+        return kOSNullPointer;
+    }
+
+    bool success = (read(fd, manifest->records, recordsSize) == recordsSize) && (read(fd, manifest->paths, header.pathsSize) == header.pathsSize);
+    close(fd);
+
+    // Terminate the path blob so a bad offset can never run past it
+    manifest->paths[header.pathsSize] = 0;
+
+    for (OSIndex i = 0; success && i < manifest->recordCount; i++)
+    {
+        if (manifest->records[i].pathOffset >= header.pathsSize)
+            success = false;
+
+        manifest->lookup[i].path = manifest->paths + manifest->records[i].pathOffset;
+        manifest->lookup[i].record = &manifest->records[i];
+    }
+
+    if (!success)
+    {
+        fprintf(stderr, "Error: Manifest '%s' is invalid!\n", path);
+        ARManifestFree(manifest);
+
+        return kOSNullPointer;
+    }
+
+    qsort(manifest->lookup, manifest->recordCount, sizeof(ARManifestLookup), ARManifestCompareLookup);
+    return manifest;
+}
+
+UInt64 ARManifestArchiveSize(ARManifest *manifest)
+{
+    return manifest->archiveSize;
+}
+
+const ARManifestRecord *ARManifestFind(ARManifest *manifest, const OSUTF8Char *path)
+{
+    ARManifestLookup key = {path, kOSNullPointer};
+
+    if (!manifest->lookup)
+        return kOSNullPointer;
+
+    ARManifestLookup *found = bsearch(&key, manifest->lookup, manifest->recordCount, sizeof(ARManifestLookup), ARManifestCompareLookup);
+    return found ? found->record : kOSNullPointer;
+}
+
+void ARManifestFree(ARManifest *manifest)
+{
+    free(manifest->records);
+    free(manifest->paths);
+    free(manifest->lookup);
+    free(manifest);
+}
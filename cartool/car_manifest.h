@@ -0,0 +1,46 @@
+#ifndef __car_manifest__
+#define __car_manifest__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+// A manifest is a sidecar file ('<archive>.manifest') recording the source
+// file behind each entry with data. Incremental builds use it to tell which
+// files are unchanged and can be copied from the previous archive.
+
+#define kARManifestMagic    "CARM"
+#define kARManifestVersion  1
+
+typedef struct {
+    UInt8 magic[4];
+    UInt32 version;
+    UInt64 archiveSize;
+    UInt64 recordCount;
+    UInt64 pathsSize;
+} ARManifestHeader;
+
+typedef struct {
+    UInt64 size;
+    UInt64 modificationTime;
+    UInt64 inode;
+    UInt64 device;
+    UInt64 dataOffset;
+    UInt64 pathOffset;
+    UInt32 checksum;
+    UInt8 type;
+    UInt8 reserved[3];
+} ARManifestRecord;
+
+typedef struct __ARManifest ARManifest;
+
+ARManifest *ARManifestCreate(void);
+bool ARManifestAdd(ARManifest *manifest, const OSUTF8Char *path, ARManifestRecord *record);
+bool ARManifestWrite(ARManifest *manifest, const OSUTF8Char *path, UInt64 archiveSize);
+
+ARManifest *ARManifestLoad(const OSUTF8Char *path);
+UInt64 ARManifestArchiveSize(ARManifest *manifest);
+const ARManifestRecord *ARManifestFind(ARManifest *manifest, const OSUTF8Char *path);
+
+void ARManifestFree(ARManifest *manifest);
+
+#endif /* !defined(__car_manifest__) */
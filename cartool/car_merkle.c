@@ -0,0 +1,273 @@
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "car_merkle.h"
+
+#define kARMerkleMaxWorkers 16
+
+// Leaves and interior nodes are hashed with different prefixes so a leaf can never pass for a node
+#define kARMerkleLeafPrefix 0x00
+#define kARMerkleNodePrefix 0x01
+
+typedef struct {
+    ARMerkleTree *tree;
+    const UInt8 *data;
+    UInt8 *leaves;
+    UInt64 first;
+    UInt64 end;
+} ARMerkleJob;
+
+#pragma mark - Tree Helpers
+
+OSCount ARMerkleLeafCount(UInt64 dataSize, UInt32 blockSize)
+{
+    OSCount count = (dataSize + (blockSize - 1)) / blockSize;
+
+    // Empty data still has a single (empty) leaf
+    return count ? count : 1;
+}
+
+static OSCount ARMerkleNodeCount(OSCount leafCount, UInt32 *levelCount)
+{
+    OSCount nodes = leafCount;
+    UInt32 levels = 1;
+
+    while (leafCount > 1)
+    {
+        leafCount = (leafCount + 1) / 2;
+        nodes += leafCount;
+        levels++;
+    }
+
+    if (levelCount) (*levelCount) = levels;
+    return nodes;
+}
+
+OSSize ARMerkleTreeSize(UInt64 dataSize, UInt32 blockSize)
+{
+    return sizeof(ARMerkleTree) + (ARMerkleNodeCount(ARMerkleLeafCount(dataSize, blockSize), kOSNullPointer) * kARSHA256DigestSize);
+}
+
+bool ARMerkleTreeValid(ARMerkleTree *tree, OSSize size)
+{
+    UInt32 levels;
+
+    if (size < sizeof(ARMerkleTree) || !tree->blockSize)
+        return false;
+
+    if (tree->leafCount != ARMerkleLeafCount(tree->dataSize, tree->blockSize))
+        return false;
+
+    OSCount nodes = ARMerkleNodeCount(tree->leafCount, &levels);
+    return (levels == tree->levelCount && size >= sizeof(ARMerkleTree) + (nodes * kARSHA256DigestSize));
+}
+
+// Leaves and nodes are hashed with a `context` which is reset for each
+// one, so hashing a tree doesn't allocate per node
+static void ARMerkleHashLeaf(ARSHA256Context *context, ARMerkleTree *tree, const UInt8 *data, UInt64 leaf, UInt8 *digest)
+{
+    const UInt8 prefix = kARMerkleLeafPrefix;
+    UInt64 offset = leaf * tree->blockSize;
+    OSSize size = tree->blockSize;
+
+    if (offset + size > tree->dataSize)
+        size = tree->dataSize - offset;
+
+    ARSHA256Reset(context);
+    ARSHA256Update(context, &prefix, 1);
+    ARSHA256Update(context, data + offset, size);
+    ARSHA256Digest(context, digest);
+}
+
+static void ARMerkleHashNode(ARSHA256Context *context, const UInt8 *left, const UInt8 *right, UInt8 *digest)
+{
+    const UInt8 prefix = kARMerkleNodePrefix;
+
+    ARSHA256Reset(context);
+    ARSHA256Update(context, &prefix, 1);
+    ARSHA256Update(context, left, kARSHA256DigestSize);
+    ARSHA256Update(context, right, kARSHA256DigestSize);
+    ARSHA256Digest(context, digest);
+}
+
+static void *ARMerkleLeafWorker(void *context)
+{
+    ARMerkleJob *job = context;
+    ARSHA256Context hash;
+
+    ARSHA256Init(&hash);
+
+    for (UInt64 leaf = job->first; leaf < job->end; leaf++)
+        ARMerkleHashLeaf(&hash, job->tree, job->data, leaf, job->leaves + (leaf * kARSHA256DigestSize));
+
+    ARSHA256Free(&hash);
+    return kOSNullPointer;
+}
+
+// Hash every leaf of `tree` into `leaves`, split evenly between `workers` threads
+static void ARMerkleHashLeaves(ARMerkleTree *tree, const UInt8 *data, UInt8 *leaves, OSCount workers)
+{
+    pthread_t threads[kARMerkleMaxWorkers];
+    ARMerkleJob jobs[kARMerkleMaxWorkers];
+    bool started[kARMerkleMaxWorkers];
+    UInt64 leafCount = tree->leafCount;
+
+    if (workers > kARMerkleMaxWorkers) workers = kARMerkleMaxWorkers;
+    if (workers > leafCount) workers = leafCount;
+    if (!workers) workers = 1;
+
+    for (OSIndex i = 0; i < workers; i++)
+    {
+        jobs[i].tree = tree;
+        jobs[i].data = data;
+        jobs[i].leaves = leaves;
+        jobs[i].first = (leafCount * i) / workers;
+        jobs[i].end = (leafCount * (i + 1)) / workers;
+
+        // The calling thread takes the first share itself
+        started[i] = (i && !pthread_create(&threads[i], kOSNullPointer, ARMerkleLeafWorker, &jobs[i]));
+        if (i && !started[i]) ARMerkleLeafWorker(&jobs[i]);
+    }
+
+    ARMerkleLeafWorker(&jobs[0]);
+
+    for (OSIndex i = 1; i < workers; i++)
+        if (started[i]) pthread_join(threads[i], kOSNullPointer);
+}
+
+// Build every level above the leaves at the start of `nodes`. Returns the root.
+static UInt8 *ARMerkleBuildLevels(UInt8 *nodes, UInt64 leafCount)
+{
+    UInt8 *level = nodes;
+    UInt64 width = leafCount;
+    ARSHA256Context hash;
+
+    ARSHA256Init(&hash);
+
+    while (width > 1)
+    {
+        UInt8 *parent = level + (width * kARSHA256DigestSize);
+
+        for (UInt64 i = 0; i < width; i += 2)
+        {
+            UInt8 *left = level + (i * kARSHA256DigestSize);
+            UInt8 *output = parent + ((i / 2) * kARSHA256DigestSize);
+
+            if (i + 1 < width) {
+                ARMerkleHashNode(&hash, left, left + kARSHA256DigestSize, output);
+            } else {
+                memcpy(output, left, kARSHA256DigestSize);
+            }
+        }
+
+        level = parent;
+        width = (width + 1) / 2;
+    }
+
+    ARSHA256Free(&hash);
+    return level;
+}
+
+#pragma mark - Building & Verification
+
+void ARMerkleTreeBuild(ARMerkleTree *tree, const UInt8 *data, OSCount workers)
+{
+    tree->leafCount = ARMerkleLeafCount(tree->dataSize, tree->blockSize);
+    ARMerkleNodeCount(tree->leafCount, &tree->levelCount);
+
+    ARMerkleHashLeaves(tree, data, tree->nodes, workers);
+    memcpy(tree->root, ARMerkleBuildLevels(tree->nodes, tree->leafCount), kARSHA256DigestSize);
+}
+
+// Rehash all of the data and check the result against the root
+bool ARMerkleTreeVerify(ARMerkleTree *tree, const UInt8 *data, OSCount workers, bool verbose)
+{
+    UInt8 *nodes = malloc(ARMerkleNodeCount(tree->leafCount, kOSNullPointer) * kARSHA256DigestSize);
+
+    if (!nodes)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    ARMerkleHashLeaves(tree, data, nodes, workers);
+    bool success = !memcmp(ARMerkleBuildLevels(nodes, tree->leafCount), tree->root, kARSHA256DigestSize);
+
+    // The stored leaves say which blocks changed (if the tree itself wasn't altered)
+    if (!success && verbose)
+    {
+        for (UInt64 leaf = 0; leaf < tree->leafCount; leaf++)
+        {
+            if (memcmp(nodes + (leaf * kARSHA256DigestSize), tree->nodes + (leaf * kARSHA256DigestSize), kARSHA256DigestSize))
+                fprintf(stdout, "Block %lu (offset %lu) does not match\n", leaf, tree->dataOffset + (leaf * tree->blockSize));
+        }
+    }
+
+    free(nodes);
+    return success;
+}
+
+// Check the blocks overlapping [offset, offset + size) against the root.
+// Only those blocks are hashed; the stored tree supplies the siblings at
+// the edges of the range on each level, which the root authenticates.
+bool ARMerkleTreeVerifyRange(ARMerkleTree *tree, const UInt8 *data, UInt64 offset, UInt64 size)
+{
+    if (!size)
+        return true;
+
+    if (offset > tree->dataSize || size > tree->dataSize - offset)
+        return false;
+
+    UInt64 first = offset / tree->blockSize;
+    UInt64 last = (offset + size - 1) / tree->blockSize;
+    UInt8 *hashes = malloc(((last - first) + 1) * kARSHA256DigestSize);
+    UInt8 *stored = tree->nodes;
+    UInt64 width = tree->leafCount;
+    ARSHA256Context hash;
+
+    if (!hashes)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    ARSHA256Init(&hash);
+
+    for (UInt64 leaf = first; leaf <= last; leaf++)
+        ARMerkleHashLeaf(&hash, tree, data, leaf, hashes + ((leaf - first) * kARSHA256DigestSize));
+
+    while (width > 1)
+    {
+        #define ARMerkleNode(n) (((n) >= first && (n) <= last) ? hashes + (((n) - first) * kARSHA256DigestSize) : stored + ((n) * kARSHA256DigestSize))
+
+        // Parents are written over the range in order, behind the children they are built from
+        for (UInt64 parent = first / 2; parent <= last / 2; parent++)
+        {
+            UInt64 left = parent * 2;
+            UInt8 digest[kARSHA256DigestSize];
+
+            if (left + 1 < width) {
+                ARMerkleHashNode(&hash, ARMerkleNode(left), ARMerkleNode(left + 1), digest);
+            } else {
+                memcpy(digest, ARMerkleNode(left), kARSHA256DigestSize);
+            }
+
+            memcpy(hashes + ((parent - (first / 2)) * kARSHA256DigestSize), digest, kARSHA256DigestSize);
+        }
+
+        #undef ARMerkleNode
+
+        stored += width * kARSHA256DigestSize;
+        width = (width + 1) / 2;
+        first /= 2;
+        last /= 2;
+    }
+
+    bool success = !memcmp(hashes, tree->root, kARSHA256DigestSize);
+    ARSHA256Free(&hash);
+    free(hashes);
+
+    return success;
+}
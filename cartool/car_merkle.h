@@ -0,0 +1,16 @@
+#ifndef __car_merkle__
+#define __car_merkle__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+OSCount ARMerkleLeafCount(UInt64 dataSize, UInt32 blockSize);
+OSSize ARMerkleTreeSize(UInt64 dataSize, UInt32 blockSize);
+bool ARMerkleTreeValid(ARMerkleTree *tree, OSSize size);
+
+// `data` points at the first byte covered by the tree (tree->dataOffset in the archive)
+void ARMerkleTreeBuild(ARMerkleTree *tree, const UInt8 *data, OSCount workers);
+bool ARMerkleTreeVerify(ARMerkleTree *tree, const UInt8 *data, OSCount workers, bool verbose);
+bool ARMerkleTreeVerifyRange(ARMerkleTree *tree, const UInt8 *data, UInt64 offset, UInt64 size);
+
+#endif /* !defined(__car_merkle__) */
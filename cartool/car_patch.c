@@ -0,0 +1,803 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "car_compress.h"
+#include "car_patch.h"
+
+#define kARPatchStreamBufferSize    (256 * 1024)
+
+// Changed files at least this large get approximate matches (bsdiff style)
+#define kARDiffLargeFile            (1 << 20)
+
+#define kARDiffMinBlockSize         64
+#define kARDiffMaxTableEntries      (1 << 22)
+#define kARDiffMaxProbes            8
+#define kARDiffApproximateWindow    64
+
+#define kARDiffHashBase             0x01000193u
+
+typedef struct {
+    int fd;
+    UInt8 *buffer;
+    OSSize used;
+    bool failed;
+
+    // Hash of everything written so far (or null)
+    ARSHA256Context *hash;
+} ARPatchWriter;
+
+typedef struct {
+    int fd;
+    UInt8 *buffer;
+    OSSize used;
+    OSSize size;
+} ARPatchReader;
+
+typedef struct {
+    UInt32 hash;
+    UInt32 reserved;
+    UInt64 offset;
+} ARDiffBlock;
+
+typedef struct {
+    const OSUTF8Char *path;
+    OSIndex index;
+    UInt64 dataOffset;
+    UInt64 dataSize;
+} ARDiffEntry;
+
+typedef struct {
+    ARPatchWriter writer;
+    ARArchive *oldArchive;
+    ARArchive *newArchive;
+
+    const UInt8 *old;
+    OSSize oldSize;
+    const UInt8 *new;
+
+    UInt64 copyOffset;
+    UInt64 copySize;
+
+    UInt8 *literal;
+    OSSize literalSize;
+
+    UInt8 *scratch;
+    UInt8 *compressed;
+    bool compress;
+
+    UInt64 copied;
+    UInt64 inserted;
+    UInt64 added;
+    UInt64 stored;
+} ARDiffContext;
+
+#pragma mark - Streams
+
+static void ARPatchWrite(ARPatchWriter *writer, const void *data, OSSize size)
+{
+    if (writer->hash)
+        ARSHA256Update(writer->hash, data, size);
+
+    while (size && !writer->failed)
+    {
+        OSSize length = kARPatchStreamBufferSize - writer->used;
+        if (length > size) length = size;
+
+        memcpy(writer->buffer + writer->used, data, length);
+        writer->used += length;
+        data += length;
+        size -= length;
+
+        if (writer->used == kARPatchStreamBufferSize)
+        {
+            writer->failed = (write(writer->fd, writer->buffer, writer->used) != writer->used);
+            writer->used = 0;
+        }
+    }
+}
+
+static bool ARPatchWriterFlush(ARPatchWriter *writer)
+{
+    if (!writer->failed && writer->used)
+        writer->failed = (write(writer->fd, writer->buffer, writer->used) != writer->used);
+
+    writer->used = 0;
+    return !writer->failed;
+}
+
+static bool ARPatchRead(ARPatchReader *reader, void *data, OSSize size)
+{
+    while (size)
+    {
+        if (reader->used == reader->size)
+        {
+            ssize_t length = read(reader->fd, reader->buffer, kARPatchStreamBufferSize);
+            if (length <= 0) return false;
+
+            reader->size = length;
+            reader->used = 0;
+        }
+
+        OSSize length = reader->size - reader->used;
+        if (length > size) length = size;
+
+        memcpy(data, reader->buffer + reader->used, length);
+        reader->used += length;
+        data += length;
+        size -= length;
+    }
+
+    return true;
+}
+
+#pragma mark - Diff Operations
+
+static void ARDiffWritePayload(ARDiffContext *context, ARPatchOpType type, UInt64 offset, const UInt8 *data, OSSize size)
+{
+    OSSize storedSize = 0;
+    ARPatchOp op;
+
+    if (context->compress)
+        storedSize = ARCompressBuffer(kCACompressionTypeLZMA, data, size, context->compressed, size - 1);
+
+    memset(&op, 0, sizeof(ARPatchOp));
+    op.type = type;
+    op.offset = offset;
+    op.size = size;
+    op.storedSize = (UInt32)(storedSize ? storedSize : size);
+
+    ARPatchWrite(&context->writer, &op, sizeof(ARPatchOp));
+    ARPatchWrite(&context->writer, storedSize ? context->compressed : data, op.storedSize);
+
+    context->stored += sizeof(ARPatchOp) + op.storedSize;
+}
+
+static void ARDiffFlushCopy(ARDiffContext *context)
+{
+    ARPatchOp op;
+
+    if (!context->copySize)
+        return;
+
+    memset(&op, 0, sizeof(ARPatchOp));
+    op.type = kARPatchOpCopy;
+    op.offset = context->copyOffset;
+    op.size = context->copySize;
+
+    ARPatchWrite(&context->writer, &op, sizeof(ARPatchOp));
+
+    context->copied += context->copySize;
+    context->stored += sizeof(ARPatchOp);
+    context->copySize = 0;
+}
+
+static void ARDiffFlushLiteral(ARDiffContext *context)
+{
+    if (!context->literalSize)
+        return;
+
+    ARDiffWritePayload(context, kARPatchOpInsert, 0, context->literal, context->literalSize);
+
+    context->inserted += context->literalSize;
+    context->literalSize = 0;
+}
+
+static void ARDiffCopy(ARDiffContext *context, UInt64 offset, UInt64 size)
+{
+    if (!size)
+        return;
+
+    ARDiffFlushLiteral(context);
+
+    if (context->copySize && context->copyOffset + context->copySize == offset) {
+        context->copySize += size;
+    } else {
+        ARDiffFlushCopy(context);
+
+        context->copyOffset = offset;
+        context->copySize = size;
+    }
+}
+
+static void ARDiffLiteral(ARDiffContext *context, const UInt8 *data, UInt64 size)
+{
+    ARDiffFlushCopy(context);
+
+    while (size)
+    {
+        OSSize length = kARPatchBlockSize - context->literalSize;
+        if (length > size) length = size;
+
+        memcpy(context->literal + context->literalSize, data, length);
+        context->literalSize += length;
+        data += length;
+        size -= length;
+
+        if (context->literalSize == kARPatchBlockSize)
+            ARDiffFlushLiteral(context);
+    }
+}
+
+// Store `data` as its bytewise difference from the old archive at `offset`
+static void ARDiffAdd(ARDiffContext *context, UInt64 offset, const UInt8 *data, UInt64 size)
+{
+    ARDiffFlushCopy(context);
+    ARDiffFlushLiteral(context);
+
+    while (size)
+    {
+        OSSize length = (size > kARPatchBlockSize) ? kARPatchBlockSize : size;
+
+        for (OSIndex i = 0; i < length; i++)
+            context->scratch[i] = data[i] - context->old[offset + i];
+
+        ARDiffWritePayload(context, kARPatchOpAdd, offset, context->scratch, length);
+
+        context->added += length;
+        offset += length;
+        data += length;
+        size -= length;
+    }
+}
+
+#pragma mark - Block Matching
+
+static UInt32 ARDiffHash(const UInt8 *data, OSSize size)
+{
+    UInt32 hash = 0;
+
+    for (OSIndex i = 0; i < size; i++)
+        hash = (hash * kARDiffHashBase) + data[i];
+
+    return hash;
+}
+
+// Encode the new range as copies from the old range plus literals, using
+// a rolling hash over fixed size blocks of the old range. Matches are
+// grown byte by byte in both directions. With `approximate` set, a match
+// is continued as an add operation for as long as most bytes still agree,
+// which suits recompiled binaries where code moved but changed little.
+static bool ARDiffRange(ARDiffContext *context, UInt64 oldStart, UInt64 oldSize, UInt64 newStart, UInt64 newSize, bool approximate)
+{
+    const UInt8 *old = context->old + oldStart;
+    const UInt8 *new = context->new + newStart;
+    OSSize blockSize = kARDiffMinBlockSize;
+
+    while ((oldSize / blockSize) > kARDiffMaxTableEntries)
+        blockSize *= 2;
+
+    if (oldSize < blockSize || newSize < blockSize)
+    {
+        if (oldSize == newSize && !memcmp(old, new, newSize)) {
+            ARDiffCopy(context, oldStart, newSize);
+        } else {
+            ARDiffLiteral(context, new, newSize);
+        }
+
+        return true;
+    }
+
+    OSCount tableSize = 1;
+    while (tableSize < (oldSize / blockSize) * 2) tableSize *= 2;
+
+    ARDiffBlock *table = calloc(tableSize, sizeof(ARDiffBlock));
+
+    if (!table)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    for (UInt64 offset = 0; offset + blockSize <= oldSize; offset += blockSize)
+    {
+        UInt32 hash = ARDiffHash(old + offset, blockSize);
+        OSIndex slot = hash & (tableSize - 1);
+
+        for (OSIndex probe = 0; probe < kARDiffMaxProbes && table[slot].offset; probe++)
+            slot = (slot + 1) & (tableSize - 1);
+
+        if (!table[slot].offset)
+        {
+            table[slot].hash = hash;
+            table[slot].offset = offset + 1;
+        }
+    }
+
+    UInt32 outgoing = 1;
+
+    for (OSIndex i = 1; i < blockSize; i++)
+        outgoing *= kARDiffHashBase;
+
+    UInt64 literalStart = 0;
+    UInt64 position = 0;
+    UInt32 hash = ARDiffHash(new, blockSize);
+
+    while (position + blockSize <= newSize)
+    {
+        OSIndex slot = hash & (tableSize - 1);
+        SInt64 match = -1;
+
+        for (OSIndex probe = 0; probe < kARDiffMaxProbes && table[slot].offset; probe++)
+        {
+            UInt64 offset = table[slot].offset - 1;
+
+            if (table[slot].hash == hash && !memcmp(old + offset, new + position, blockSize))
+            {
+                match = offset;
+                break;
+            }
+
+            slot = (slot + 1) & (tableSize - 1);
+        }
+
+        if (match == -1)
+        {
+            if (position + blockSize < newSize)
+                hash = ((hash - (new[position] * outgoing)) * kARDiffHashBase) + new[position + blockSize];
+
+            position++;
+            continue;
+        }
+
+        UInt64 back = 0;
+        UInt64 length = blockSize;
+
+        while (back < position - literalStart && back < match && old[match - back - 1] == new[position - back - 1])
+            back++;
+
+        while (position + length < newSize && match + length < oldSize && old[match + length] == new[position + length])
+            length++;
+
+        ARDiffLiteral(context, new + literalStart, (position - back) - literalStart);
+        ARDiffCopy(context, oldStart + match - back, length + back);
+        position += length;
+
+        if (approximate)
+        {
+            UInt64 oldOffset = match + length;
+            UInt64 addSize = 0;
+
+            while (position + addSize < newSize && oldOffset + addSize < oldSize)
+            {
+                UInt64 window = kARDiffApproximateWindow;
+                UInt64 equal = 0;
+
+                if (window > newSize - (position + addSize)) window = newSize - (position + addSize);
+                if (window > oldSize - (oldOffset + addSize)) window = oldSize - (oldOffset + addSize);
+
+                for (OSIndex i = 0; i < window; i++)
+                    equal += (old[oldOffset + addSize + i] == new[position + addSize + i]);
+
+                if (equal * 2 < window)
+                    break;
+
+                addSize += window;
+            }
+
+            ARDiffAdd(context, oldStart + oldOffset, new + position, addSize);
+            position += addSize;
+        }
+
+        literalStart = position;
+
+        if (position + blockSize <= newSize)
+            hash = ARDiffHash(new + position, blockSize);
+    }
+
+    ARDiffLiteral(context, new + literalStart, newSize - literalStart);
+    free(table);
+
+    return true;
+}
+
+#pragma mark - Entry Matching
+
+static int ARDiffComparePaths(const void *a, const void *b)
+{
+    return strcmp((const char *)((const ARDiffEntry *)a)->path, (const char *)((const ARDiffEntry *)b)->path);
+}
+
+static int ARDiffCompareOffsets(const void *a, const void *b)
+{
+    const ARDiffEntry *x = a, *y = b;
+
+    if (x->dataOffset != y->dataOffset) return (x->dataOffset < y->dataOffset) ? -1 : 1;
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+// Collect the entries of `archive` with data. Returns the number of
+// entries, or -1 on failure (including data outside of the archive).
+static OSIndex ARDiffCollectEntries(ARArchive *archive, ARDiffEntry **entries)
+{
+    OSSize dataSize = archive->size - (archive->dataSection - (UInt8 *)archive->address);
+    ARArchiveEntry entry;
+    OSCount count = 0;
+    OSIndex i;
+
+    *entries = malloc((archive->entryCount ? archive->entryCount : 1) * sizeof(ARDiffEntry));
+
+    if (!(*entries))
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return -1;
+    }
+
+    for (i = 0; i < archive->entryCount; i++)
+    {
+        if (!ARArchiveGetEntry(archive, i, &entry))
+            break;
+
+        if (!entry.dataSize || entry.type == kCAEntryTypeDirectory)
+            continue;
+
+        if (entry.dataOffset > dataSize || entry.dataSize > dataSize - entry.dataOffset)
+        {
+            fprintf(stderr, "Error: Entry data is outside of archive!\n");
+            break;
+        }
+
+        (*entries)[count].path = entry.path;
+        (*entries)[count].index = i;
+        (*entries)[count].dataOffset = entry.dataOffset;
+        (*entries)[count].dataSize = entry.dataSize;
+        count++;
+    }
+
+    if (i < archive->entryCount)
+    {
+        free(*entries);
+        *entries = kOSNullPointer;
+
+        return -1;
+    }
+
+    return count;
+}
+
+// Diff two plain (uncompressed, unencrypted) archives entry by entry.
+// Entries are matched by path; unchanged data is copied by reference and
+// changed data is delta encoded against the old version of the file.
+static bool ARDiffEntries(ARDiffContext *context)
+{
+    ARArchive *oldArchive = context->oldArchive;
+    ARArchive *newArchive = context->newArchive;
+    UInt64 oldDataStart = oldArchive->dataSection - (UInt8 *)oldArchive->address;
+    UInt64 newDataStart = newArchive->dataSection - (UInt8 *)newArchive->address;
+    ARDiffEntry *oldEntries = kOSNullPointer;
+    ARDiffEntry *newEntries = kOSNullPointer;
+
+    OSIndex oldCount = ARDiffCollectEntries(oldArchive, &oldEntries);
+    OSIndex newCount = (oldCount == -1) ? -1 : ARDiffCollectEntries(newArchive, &newEntries);
+    bool success = (newCount != -1);
+
+    if (success)
+    {
+        qsort(oldEntries, oldCount, sizeof(ARDiffEntry), ARDiffComparePaths);
+        qsort(newEntries, newCount, sizeof(ARDiffEntry), ARDiffCompareOffsets);
+
+        // Header, ToC and entry table
+        success = ARDiffRange(context, 0, oldDataStart, 0, newDataStart, false);
+    }
+
+    UInt64 oldDataEnd = 0;
+    UInt64 cursor = 0;
+
+    for (OSIndex i = 0; i < oldCount; i++)
+    {
+        if (oldEntries[i].dataOffset + oldEntries[i].dataSize > oldDataEnd)
+            oldDataEnd = oldEntries[i].dataOffset + oldEntries[i].dataSize;
+    }
+
+    for (OSIndex i = 0; success && i < newCount; i++)
+    {
+        ARDiffEntry *entry = &newEntries[i];
+        UInt64 end = entry->dataOffset + entry->dataSize;
+
+        // Data shared with an earlier entry has already been encoded
+        if (end <= cursor)
+            continue;
+
+        if (entry->dataOffset < cursor)
+        {
+            ARDiffLiteral(context, context->new + newDataStart + cursor, end - cursor);
+            cursor = end;
+
+            continue;
+        }
+
+        if (entry->dataOffset > cursor)
+            ARDiffLiteral(context, context->new + newDataStart + cursor, entry->dataOffset - cursor);
+
+        ARDiffEntry *previous = bsearch(entry, oldEntries, oldCount, sizeof(ARDiffEntry), ARDiffComparePaths);
+        const UInt8 *data = context->new + newDataStart + entry->dataOffset;
+
+        if (!previous) {
+            ARDiffLiteral(context, data, entry->dataSize);
+        } else {
+            UInt64 oldOffset = oldDataStart + previous->dataOffset;
+            UInt32 oldChecksum, newChecksum;
+
+            // Checksum tables rule out a match without reading the data
+            bool differs = ARArchiveGetEntryChecksum(oldArchive, previous->index, &oldChecksum) && ARArchiveGetEntryChecksum(newArchive, entry->index, &newChecksum) && oldChecksum != newChecksum;
+
+            if (!differs && previous->dataSize == entry->dataSize && !memcmp(context->old + oldOffset, data, entry->dataSize)) {
+                ARDiffCopy(context, oldOffset, entry->dataSize);
+            } else {
+                success = ARDiffRange(context, oldOffset, previous->dataSize, newDataStart + entry->dataOffset, entry->dataSize, entry->dataSize >= kARDiffLargeFile);
+            }
+        }
+
+        cursor = end;
+    }
+
+    // Anything after the data (section tables and the like)
+    if (success)
+    {
+        UInt64 oldTail = oldDataStart + oldDataEnd;
+        UInt64 newTail = newDataStart + cursor;
+
+        success = ARDiffRange(context, oldTail, context->oldSize - oldTail, newTail, newArchive->size - newTail, false);
+    }
+
+    free(oldEntries);
+    free(newEntries);
+
+    return success;
+}
+
+static bool ARDiffIsPlain(ARArchive *archive)
+{
+    return !archive->chunks && !ARArchiveIsEncrypted(archive);
+}
+
+#pragma mark - Diff and Patch
+
+bool ARDiffArchives(const OSUTF8Char *oldPath, const OSUTF8Char *newPath, const OSUTF8Char *patch, bool verbose)
+{
+    if (ARFileHasDataAtPath(patch))
+    {
+        fprintf(stderr, "Error: Patch exists at path '%s' and is not empty!\n", patch);
+        return false;
+    }
+
+    ARArchive *oldArchive = ARArchiveOpen(oldPath);
+    ARArchive *newArchive = oldArchive ? ARArchiveOpen(newPath) : kOSNullPointer;
+
+    if (!newArchive)
+    {
+        if (oldArchive) ARArchiveClose(oldArchive);
+        return false;
+    }
+
+    if (oldArchive->subtype != newArchive->subtype)
+    {
+        fprintf(stderr, "Error: Archives '%s' and '%s' are of different subtypes!\n", oldPath, newPath);
+        ARArchiveClose(oldArchive);
+        ARArchiveClose(newArchive);
+
+        return false;
+    }
+
+    ARDiffContext context;
+    ARPatchHeader header;
+
+    memset(&context, 0, sizeof(ARDiffContext));
+    context.oldArchive = oldArchive;
+    context.newArchive = newArchive;
+    context.old = oldArchive->address;
+    context.oldSize = oldArchive->size;
+    context.new = newArchive->address;
+    context.compress = ARCompressionSupported(kCACompressionTypeLZMA);
+
+    context.writer.buffer = malloc(kARPatchStreamBufferSize);
+    context.literal = malloc(kARPatchBlockSize);
+    context.scratch = malloc(kARPatchBlockSize);
+    context.compressed = malloc(kARPatchBlockSize);
+    context.writer.fd = open((char *)patch, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    bool success = (context.writer.buffer && context.literal && context.scratch && context.compressed);
+
+    if (!success) fprintf(stderr, "Error: Out of memory!\n");
+    else if (context.writer.fd == -1) fprintf(stderr, "Error: Could not open patch '%s'!\n", patch);
+
+    success = success && (context.writer.fd != -1);
+
+    if (success)
+    {
+        memset(&header, 0, sizeof(ARPatchHeader));
+        memcpy(header.magic, kARPatchMagic, 4);
+
+        header.version = kARPatchVersion;
+        header.oldSize = oldArchive->size;
+        header.newSize = newArchive->size;
+
+        ARSHA256Process(oldArchive->address, ARArchiveHeaderSize(oldArchive->subtype), header.oldHeaderDigest);
+        ARSHA256Process(newArchive->address, newArchive->size, header.newDigest);
+        ARPatchWrite(&context.writer, &header, sizeof(ARPatchHeader));
+
+        // Compressed or encrypted data can't be matched up by entry, so such archives are diffed as a whole
+        if (ARDiffIsPlain(oldArchive) && ARDiffIsPlain(newArchive)) {
+            success = ARDiffEntries(&context);
+        } else {
+            success = ARDiffRange(&context, 0, oldArchive->size, 0, newArchive->size, false);
+        }
+    }
+
+    if (success)
+    {
+        ARPatchOp end;
+        memset(&end, 0, sizeof(ARPatchOp));
+
+        ARDiffFlushCopy(&context);
+        ARDiffFlushLiteral(&context);
+        ARPatchWrite(&context.writer, &end, sizeof(ARPatchOp));
+
+        success = ARPatchWriterFlush(&context.writer);
+        if (!success) fprintf(stderr, "Error: Could not write patch '%s'!\n", patch);
+    }
+
+    if (success && verbose)
+        fprintf(stdout, "Copied %lu bytes, inserted %lu bytes, added %lu bytes; patch is %lu bytes\n", context.copied, context.inserted, context.added, context.stored + sizeof(ARPatchHeader) + sizeof(ARPatchOp));
+
+    if (context.writer.fd != -1)
+        success = !close(context.writer.fd) && success;
+
+    free(context.writer.buffer);
+    free(context.literal);
+    free(context.scratch);
+    free(context.compressed);
+
+    success = ARArchiveClose(newArchive) && success;
+    return (ARArchiveClose(oldArchive) && success);
+}
+
+// Apply a single operation. The new archive is written strictly in order.
+static bool ARPatchApplyOp(ARPatchOp *op, ARArchive *old, ARPatchReader *reader, ARPatchWriter *writer, UInt8 *stored, UInt8 *raw)
+{
+    switch (op->type)
+    {
+        case kARPatchOpCopy: {
+            if (op->offset > old->size || op->size > old->size - op->offset)
+                return false;
+
+            ARPatchWrite(writer, old->address + op->offset, op->size);
+        } break;
+        case kARPatchOpInsert:
+        case kARPatchOpAdd: {
+            if (op->size > kARPatchBlockSize || op->storedSize > op->size || !op->storedSize)
+                return false;
+
+            if (!ARPatchRead(reader, stored, op->storedSize))
+                return false;
+
+            if (op->storedSize < op->size) {
+                if (!ARDecompressBuffer(kCACompressionTypeLZMA, stored, op->storedSize, raw, op->size))
+                    return false;
+            } else {
+                memcpy(raw, stored, op->size);
+            }
+
+            if (op->type == kARPatchOpAdd)
+            {
+                if (op->offset > old->size || op->size > old->size - op->offset)
+                    return false;
+
+                const UInt8 *base = old->address + op->offset;
+
+                for (OSIndex i = 0; i < op->size; i++)
+                    raw[i] += base[i];
+            }
+
+            ARPatchWrite(writer, raw, op->size);
+        } break;
+        default: return false;
+    }
+
+    return !writer->failed;
+}
+
+bool ARPatchArchive(const OSUTF8Char *oldPath, const OSUTF8Char *patch, const OSUTF8Char *newPath, bool verbose)
+{
+    UInt8 digest[kARSHA256DigestSize];
+    ARSHA256Context hash;
+    ARPatchHeader header;
+
+    if (ARFileHasDataAtPath(newPath))
+    {
+        fprintf(stderr, "Error: Archive exists at path '%s' and is not empty!\n", newPath);
+        return false;
+    }
+
+    ARArchive *old = ARArchiveOpen(oldPath);
+    if (!old) return false;
+
+    ARPatchReader reader = {open((char *)patch, O_RDONLY), malloc(kARPatchStreamBufferSize), 0, 0};
+    ARPatchWriter writer = {-1, malloc(kARPatchStreamBufferSize), 0, false, &hash};
+    UInt8 *stored = malloc(kARPatchBlockSize);
+    UInt8 *raw = malloc(kARPatchBlockSize);
+    bool success = false;
+
+    if (!reader.buffer || !writer.buffer || !stored || !raw) {
+        fprintf(stderr, "Error: Out of memory!\n");
+    } else if (reader.fd == -1 || !ARPatchRead(&reader, &header, sizeof(ARPatchHeader))) {
+        fprintf(stderr, "Error: Could not read patch '%s'!\n", patch);
+    } else if (memcmp(header.magic, kARPatchMagic, 4) || header.version != kARPatchVersion) {
+        fprintf(stderr, "Error: Patch '%s' is invalid!\n", patch);
+    } else {
+        ARSHA256Process(old->address, ARArchiveHeaderSize(old->subtype), digest);
+
+        if (header.oldSize != old->size || memcmp(digest, header.oldHeaderDigest, kARSHA256DigestSize)) {
+            fprintf(stderr, "Error: Patch '%s' does not apply to archive '%s'!\n", patch, oldPath);
+        } else if ((writer.fd = open((char *)newPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            fprintf(stderr, "Error: Could not open archive '%s'!\n", newPath);
+        } else {
+            success = true;
+        }
+    }
+
+    ARSHA256Init(&hash);
+    UInt64 size = 0;
+    OSCount count = 0;
+
+    while (success)
+    {
+        ARPatchOp op;
+
+        if (!ARPatchRead(&reader, &op, sizeof(ARPatchOp)))
+        {
+            fprintf(stderr, "Error: Patch '%s' is truncated!\n", patch);
+            success = false;
+
+            break;
+        }
+
+        if (op.type == kARPatchOpEnd)
+            break;
+
+        if (!ARPatchApplyOp(&op, old, &reader, &writer, stored, raw))
+        {
+            fprintf(stderr, "Error: Patch '%s' is invalid or could not be written!\n", patch);
+            success = false;
+
+            break;
+        }
+
+        size += op.size;
+        count++;
+    }
+
+    ARSHA256Finalize(&hash, digest);
+
+    if (success)
+    {
+        success = ARPatchWriterFlush(&writer);
+
+        if (success && (size != header.newSize || memcmp(digest, header.newDigest, kARSHA256DigestSize)))
+        {
+            fprintf(stderr, "Error: Patched archive does not match the expected result!\n");
+            success = false;
+        }
+    }
+
+    if (writer.fd != -1)
+    {
+        success = !close(writer.fd) && success;
+        if (!success) unlink((char *)newPath);
+    }
+
+    if (success && verbose)
+        fprintf(stdout, "Applied %lu operations, wrote %lu bytes\n", count, size);
+
+    if (reader.fd != -1)
+        close(reader.fd);
+
+    free(reader.buffer);
+    free(writer.buffer);
+    free(stored);
+    free(raw);
+
+    return (ARArchiveClose(old) && success);
+}
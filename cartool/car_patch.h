@@ -0,0 +1,47 @@
+#ifndef __car_patch__
+#define __car_patch__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+// A patch turns one archive into another of the same subtype. It is a
+// stream of operations which build the new archive front to back: copy a
+// range of the old archive, insert new bytes, or add a difference to a
+// range of the old archive (for files which changed only slightly).
+
+#define kARPatchMagic       "CARP"
+#define kARPatchVersion     1
+
+// Largest payload of a single insert or add operation
+#define kARPatchBlockSize   (1 << 20)
+
+typedef enum {
+    kARPatchOpEnd       = 0,
+    kARPatchOpCopy      = 1,
+    kARPatchOpInsert    = 2,
+    kARPatchOpAdd       = 3
+} ARPatchOpType;
+
+typedef struct {
+    UInt8 magic[4];
+    UInt32 version;
+    UInt64 oldSize;
+    UInt64 newSize;
+    UInt8 oldHeaderDigest[kARSHA256DigestSize];
+    UInt8 newDigest[kARSHA256DigestSize];
+} ARPatchHeader;
+
+// Followed by `storedSize` bytes of payload for inserts and adds. The
+// payload is LZMA compressed when `storedSize` is less than `size`.
+typedef struct {
+    UInt8 type;
+    UInt8 reserved[3];
+    UInt32 storedSize;
+    UInt64 offset;
+    UInt64 size;
+} ARPatchOp;
+
+bool ARDiffArchives(const OSUTF8Char *oldArchive, const OSUTF8Char *newArchive, const OSUTF8Char *patch, bool verbose);
+bool ARPatchArchive(const OSUTF8Char *oldArchive, const OSUTF8Char *patch, const OSUTF8Char *newArchive, bool verbose);
+
+#endif /* !defined(__car_patch__) */
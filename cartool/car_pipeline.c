@@ -0,0 +1,283 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "car_pipeline.h"
+#include "car_chunk.h"
+
+// Chunks are decompressed by a pool of workers into a ring of slots. Each
+// worker claims the next chunk number with an atomic increment, and may
+// only fill the slot for chunk c once the consumer has released chunk
+// c - slotCount, which bounds read-ahead. The consumer takes chunks back
+// strictly in order, so files are still written sequentially. No locks are
+// taken; waiting is done by spinning with backoff.
+
+#define kARPipelineMaxWorkers   16
+#define kARPipelineSlotsPerWorker 2
+
+typedef struct {
+    _Atomic UInt64 ready;
+    bool failed;
+    UInt8 *buffer;
+    UInt8 *scratch;
+} ARPipelineSlot;
+
+struct __ARPipeline {
+    ARChunkSource source;
+    ARChunkIndex *index;
+
+    UInt64 firstChunk;
+    UInt64 endChunk;
+
+    _Atomic UInt64 nextChunk;
+    _Atomic UInt64 releasedChunk;
+    _Atomic bool stop;
+
+    ARPipelineSlot *slots;
+    OSCount slotCount;
+
+    pthread_t workers[kARPipelineMaxWorkers];
+    OSCount workerCount;
+
+    // Consumer state (only touched by the consuming thread)
+    UInt64 currentChunk;
+    bool failed;
+};
+
+static void ARPipelineBackoff(UInt32 *spins)
+{
+    struct timespec delay = {0, 50000};
+
+    if ((*spins)++ < 64)
+        return;
+
+    if ((*spins) < 128) {
+        sched_yield();
+    } else {
+        nanosleep(&delay, kOSNullPointer);
+    }
+}
+
+static void *ARPipelineWorker(void *context)
+{
+    ARPipeline *pipeline = context;
+
+    for ( ; ; )
+    {
+        UInt64 chunk = atomic_fetch_add(&pipeline->nextChunk, 1);
+        UInt32 spins = 0;
+
+        if (chunk >= pipeline->endChunk)
+            break;
+
+        while (chunk >= atomic_load_explicit(&pipeline->releasedChunk, memory_order_acquire) + pipeline->slotCount)
+        {
+            if (atomic_load_explicit(&pipeline->stop, memory_order_relaxed))
+                return kOSNullPointer;
+
+            ARPipelineBackoff(&spins);
+        }
+
+        ARPipelineSlot *slot = &pipeline->slots[chunk % pipeline->slotCount];
+
+        slot->failed = !ARChunkDecompress(&pipeline->source, chunk, slot->buffer, slot->scratch);
+        atomic_store_explicit(&slot->ready, chunk + 1, memory_order_release);
+    }
+
+    return kOSNullPointer;
+}
+
+OSCount ARPipelineDefaultWorkers(void)
+{
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (processors < 1)
+        return 1;
+
+    if (processors > kARPipelineMaxWorkers)
+        return kARPipelineMaxWorkers;
+
+    return processors;
+}
+
+ARPipeline *ARPipelineCreate(const ARChunkSource *source, UInt64 firstChunk, UInt64 endChunk, OSCount workers)
+{
+    ARChunkIndex *index = source->index;
+    ARPipeline *pipeline = malloc(sizeof(ARPipeline));
+
+    if (!pipeline)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return kOSNullPointer;
+    }
+
+    if (workers > kARPipelineMaxWorkers) workers = kARPipelineMaxWorkers;
+    if (!workers) workers = 1;
+
+    memset(pipeline, 0, sizeof(ARPipeline));
+    pipeline->source = *source;
+    pipeline->index = index;
+    pipeline->firstChunk = firstChunk;
+    pipeline->endChunk = endChunk;
+    pipeline->currentChunk = firstChunk;
+    pipeline->slotCount = workers * kARPipelineSlotsPerWorker;
+    pipeline->slots = calloc(pipeline->slotCount, sizeof(ARPipelineSlot));
+
+    atomic_init(&pipeline->nextChunk, firstChunk);
+    atomic_init(&pipeline->releasedChunk, firstChunk);
+    atomic_init(&pipeline->stop, false);
+
+    if (!pipeline->slots)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        free(pipeline);
+
+        return kOSNullPointer;
+    }
+
+    for (OSIndex i = 0; i < pipeline->slotCount; i++)
+    {
+        atomic_init(&pipeline->slots[i].ready, 0);
+        pipeline->slots[i].buffer = malloc(index->chunkSize);
+
+        // Encrypted chunks are decrypted next to the slot they decompress into
+        if (source->cipher)
+            pipeline->slots[i].scratch = malloc(index->chunkSize);
+
+        if (!pipeline->slots[i].buffer || (source->cipher && !pipeline->slots[i].scratch))
+        {
+            fprintf(stderr, "Error: Out of memory!\n");
+            ARPipelineDestroy(pipeline);
+
+            return kOSNullPointer;
+        }
+    }
+
+    for (OSIndex i = 0; i < workers; i++)
+    {
+        if (pthread_create(&pipeline->workers[i], kOSNullPointer, ARPipelineWorker, pipeline))
+        {
+            fprintf(stderr, "Error: Could not start decompression thread!\n");
+            break;
+        }
+
+        pipeline->workerCount++;
+    }
+
+    if (!pipeline->workerCount)
+    {
+        ARPipelineDestroy(pipeline);
+        return kOSNullPointer;
+    }
+
+    return pipeline;
+}
+
+// Wait for `chunk` to be decompressed
+static const UInt8 *ARPipelineAcquire(ARPipeline *pipeline, UInt64 chunk)
+{
+    ARPipelineSlot *slot = &pipeline->slots[chunk % pipeline->slotCount];
+    UInt32 spins = 0;
+
+    while (atomic_load_explicit(&slot->ready, memory_order_acquire) != chunk + 1)
+        ARPipelineBackoff(&spins);
+
+    if (slot->failed)
+    {
+        pipeline->failed = true;
+        return kOSNullPointer;
+    }
+
+    return slot->buffer;
+}
+
+// Hand the slot holding `chunk` back to the workers
+static void ARPipelineRelease(ARPipeline *pipeline, UInt64 chunk)
+{
+    atomic_store_explicit(&pipeline->releasedChunk, chunk + 1, memory_order_release);
+    pipeline->currentChunk = chunk + 1;
+}
+
+bool ARPipelineCanStream(ARPipeline *pipeline, UInt64 offset)
+{
+    UInt64 chunk = offset / pipeline->index->chunkSize;
+
+    return (!pipeline->failed && chunk >= pipeline->currentChunk && chunk < pipeline->endChunk);
+}
+
+// Stream `size` bytes at raw `offset` to `consumer`. Streams must move forward.
+bool ARPipelineStream(ARPipeline *pipeline, UInt64 offset, OSSize size, ARPipelineConsumer consumer, void *context)
+{
+    UInt32 chunkSize = pipeline->index->chunkSize;
+
+    if (!size)
+        return true;
+
+    if (!ARPipelineCanStream(pipeline, offset))
+        return false;
+
+    while (size)
+    {
+        UInt64 chunk = offset / chunkSize;
+
+        // Skip over anything nobody asked for
+        while (pipeline->currentChunk < chunk)
+        {
+            if (!ARPipelineAcquire(pipeline, pipeline->currentChunk))
+                return false;
+
+            ARPipelineRelease(pipeline, pipeline->currentChunk);
+        }
+
+        if (chunk >= pipeline->endChunk)
+            return false;
+
+        const UInt8 *data = ARPipelineAcquire(pipeline, chunk);
+        if (!data) return false;
+
+        OSSize rawSize = ARChunkRawSize(pipeline->index, chunk);
+        OSOffset within = offset - (chunk * chunkSize);
+        OSSize length = rawSize - within;
+
+        if (length > size)
+            length = size;
+
+        if (!consumer(context, data + within, length))
+            return false;
+
+        if (within + length == rawSize)
+            ARPipelineRelease(pipeline, chunk);
+
+        offset += length;
+        size -= length;
+    }
+
+    return true;
+}
+
+// Stop and join the workers. Returns false if any consumed chunk failed to decompress.
+bool ARPipelineDestroy(ARPipeline *pipeline)
+{
+    atomic_store(&pipeline->stop, true);
+
+    for (OSIndex i = 0; i < pipeline->workerCount; i++)
+        pthread_join(pipeline->workers[i], kOSNullPointer);
+
+    for (OSIndex i = 0; i < pipeline->slotCount; i++)
+    {
+        free(pipeline->slots[i].buffer);
+        free(pipeline->slots[i].scratch);
+    }
+
+    bool success = !pipeline->failed;
+
+    free(pipeline->slots);
+    free(pipeline);
+
+    return success;
+}
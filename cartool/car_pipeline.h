@@ -0,0 +1,20 @@
+#ifndef __car_pipeline__
+#define __car_pipeline__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car_chunk.h"
+#include "car.h"
+
+typedef struct __ARPipeline ARPipeline;
+
+// Called with consecutive pieces of a streamed data range
+typedef bool (*ARPipelineConsumer)(void *context, const UInt8 *data, OSSize size);
+
+OSCount ARPipelineDefaultWorkers(void);
+
+ARPipeline *ARPipelineCreate(const ARChunkSource *source, UInt64 firstChunk, UInt64 endChunk, OSCount workers);
+bool ARPipelineCanStream(ARPipeline *pipeline, UInt64 offset);
+bool ARPipelineStream(ARPipeline *pipeline, UInt64 offset, OSSize size, ARPipelineConsumer consumer, void *context);
+bool ARPipelineDestroy(ARPipeline *pipeline);
+
+#endif /* !defined(__car_pipeline__) */
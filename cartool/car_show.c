@@ -3,28 +3,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-static bool ARShowContentsInternal(ARSubtype subtype, OSOffset *toc, UInt8 *entryTable, UInt8 *dataOffset, bool showSize, bool showLinks)
+static bool ARShowContentsInternal(ARArchive *archive, bool showSize, bool showLinks, bool showChecksums)
 {
-    OSCount entryCount = (((OSPointerValue)entryTable) - ((OSPointerValue)toc)) / sizeof(OSPointerValue);
-
-    for (OSIndex i = 0; i < entryCount; i++)
+    for (OSIndex i = 0; i < archive->entryCount; i++)
     {
-        if (i & !(*toc))
-        {
-            // We're done
-            break;
-        }
-
-        UInt8 *entry = entryTable + (*toc);
-        UInt8 entryType = *((UInt8 *)entry);
-        toc++;
-
-        CAEntryS1 linkData;
-        OSUTF8Char *path;
+        ARArchiveEntry entry;
         OSUTF8Char type;
-        UInt64 size = 0;
 
-        switch (entryType)
+        if (!ARArchiveGetEntry(archive, i, &entry))
+            return false;
+
+        switch (entry.type)
         {
             case kCAEntryTypeDirectory: type = 'D'; break;
             case kCAEntryTypeFile:      type = 'F'; break;
@@ -33,74 +22,37 @@ static bool ARShowContentsInternal(ARSubtype subtype, OSOffset *toc, UInt8 *entr
             default:                    type = '?'; break;
         }
 
-        switch (subtype)
-        {
-            case kARSubtype1: {
-                CAEntryS1 *realEntry = (CAEntryS1 *)entry;
-                path = realEntry->path;
-
-                if (showLinks && entryType == kCAEntryTypeLink)
-                    memcpy(&linkData, entry, sizeof(CAEntryS1));
-
-                if (showSize)
-                    size = realEntry->dataSize;
-            } break;
-            case kARSubtype2:
-            case kARSubtypeBootX: {
-                path = (OSUTF8Char *)(entry + sizeof(CAEntryS2));
-
-                if (entryType == kCAEntryTypeDirectory) {
-                    path -= (2 * sizeof(UInt64));
-                    size = 0;
-                } else if (entryType == kCAEntryTypeMeta) {
-                    CAEntryS2 *realEntry = (CAEntryS2 *)entry;
-
-                    if (!(realEntry->flags & kCAEntryFlagMetaHasData)) {
-                        path -= (2 * sizeof(UInt64));
-                        size = 0;
-                    } else {
-                        size = realEntry->dataSize;
-                    }
-                } else {
-                    size = ((CAEntryS2 *)entry)->dataSize;
-                }
-
-                if (showLinks && entryType == kCAEntryTypeLink)
-                    memcpy(&linkData, entry, sizeof(CAEntryS1));
-            } break;
-            case kARSubtypeSystemImage: {
-                if (entryType == kCAEntryTypeDirectory) {
-                    path = (OSUTF8Char *)(entry + sizeof(CASystemDirectoryEntry));
-                    size = 0;
-                } else {
-                    size = ((CASystemFileEntry *)entry)->dataSize;
-                    path = (OSUTF8Char *)(entry + sizeof(CASystemFileEntry));
-                }
-
-                if (showLinks && entryType == kCAEntryTypeLink)
-                {
-                    CASystemFileEntry *realEntry = (CASystemFileEntry *)entry;
-
-                    linkData.dataOffset = realEntry->dataOffset;
-                    linkData.dataSize = realEntry->dataSize;
-                }
-            } break;
-            default: {
-                path = (OSUTF8Char *)"";
-                size = 0;
-            } break;
+        fprintf(stdout, "%c %s", type, entry.path);
+
+        const ARSparseExtent *extents;
+        OSCount extentCount;
+        UInt64 fileSize;
+
+        // Sparse files show their full size and the size actually stored
+        if (showSize && ARArchiveGetSparseExtents(archive, i, &fileSize, &extents, &extentCount)) {
+            fprintf(stdout, " (%lu, %lu stored)", fileSize, entry.dataSize);
+        } else if (showSize) {
+            fprintf(stdout, " (%lu)", entry.dataSize);
         }
 
-        fprintf(stdout, "%c %s", type, path);
+        UInt32 checksum;
+
+        if (showChecksums && ARArchiveGetEntryChecksum(archive, i, &checksum))
+            fprintf(stdout, " [0x%08X]", checksum);
+
+        if (showLinks && entry.type == kCAEntryTypeLink) {
+            OSUTF8Char *link = malloc(entry.dataSize + 1);
+
+            if (!link || !ARArchiveReadData(archive, entry.dataOffset, entry.dataSize, link))
+            {
+                fprintf(stdout, "\n");
+                free(link);
 
-        if (showSize)
-            fprintf(stdout, " (%lu)", size);
+                return false;
+            }
+
+            link[entry.dataSize] = 0;
 
-        if (showLinks && entryType == kCAEntryTypeLink) {
-            OSUTF8Char *link = malloc(linkData.dataSize + 1);
-            memcpy(link, dataOffset + linkData.dataOffset, linkData.dataSize);
-            link[linkData.dataSize] = 0;
-            
             fprintf(stdout, " --> %s\n", link);
             free(link);
         } else {
@@ -111,68 +63,35 @@ static bool ARShowContentsInternal(ARSubtype subtype, OSOffset *toc, UInt8 *entr
     return true;
 }
 
-static bool ARListContentsInternal(ARArchive *archive, bool showSize, bool showLinks)
+static bool ARListContentsInternal(ARArchive *archive, bool showSize, bool showLinks, bool showChecksums)
 {
-    UInt8 *dataOffset = kOSNullPointer;
-    UInt8 *entryTable = kOSNullPointer;
-    OSOffset *toc = kOSNullPointer;
+    CADataModification *dataModification = kOSNullPointer;
 
-    bool success = true;
+    if (!archive->cipher && ARArchiveIsEncrypted(archive))
+    {
+        fprintf(stderr, "Error: Archive is encrypted and no key was given!\n");
+        return false;
+    }
 
-    #define ARCopyShared(h)                                     \
-        dataOffset = archive->address + h->dataSectionOffset;   \
-        entryTable = archive->address + h->entryTableOffset
+    // Data modifications described by the section directory are handled transparently
+    #define ARWarnDataModification(m)                                                                   \
+        if (((m)->compressionCount && !archive->chunks) || ((m)->encryptionCount && !archive->cipher))  \
+            fprintf(stderr, "Warning: Archive may contain data modification!\n")
 
     switch (archive->subtype)
     {
-        case kARSubtype1: {
-            CAHeaderS1 *header = archive->address;
-
-            toc = archive->address + sizeof(CAHeaderS1);
-            ARCopyShared(header);
-        } break;
-        case kARSubtype2: {
-            CAHeaderS2 *header = archive->address;
-            CADataModification *dataModification = archive->address + header->dataModification;
-
-            toc = archive->address + header->tocOffset;
-            ARCopyShared(header);
-
-            if (dataModification->compressionCount || dataModification->encryptionCount)
-                fprintf(stderr, "Warning: Archive may contain data modification!\n");
-        } break;
-        case kARSubtypeBootX: {
-            CAHeaderBootX *header = archive->address;
-            CADataModification *dataModification = archive->address + sizeof(CAHeaderBootX);
-            toc = archive->address;
-
-            if (dataModification->compressionCount || dataModification->encryptionCount) {
-                fprintf(stderr, "Warning: Archive may contain data modification!\n");
-
-                toc += (dataModification->compressionCount * sizeof(CACompressionInfo));
-                toc += (dataModification->encryptionCount * sizeof(CAEncryptionInfo));
-                toc += sizeof(CADataModification);
-            } else {
-                toc += sizeof(CADataModification);
-            }
-
-            ARCopyShared(header);
-        } break;
-        case kARSubtypeSystemImage: {
-            CAHeaderSystemImage *header = archive->address;
-            CADataModification *dataModification = archive->address + header->dataModification;
-
-            toc = archive->address + header->tocOffset;
-            ARCopyShared(header);
-
-            if (dataModification->compressionCount || dataModification->encryptionCount)
-                fprintf(stderr, "Warning: Archive may contain data modification!\n");
-        } break;
-        default: success = false; break;
+        case kARSubtype1: break;
+        case kARSubtype2:           dataModification = archive->address + ((CAHeaderS2 *)archive->address)->dataModification;          break;
+        case kARSubtypeBootX:       dataModification = archive->address + sizeof(CAHeaderBootX);                                      break;
+        case kARSubtypeSystemImage: dataModification = archive->address + ((CAHeaderSystemImage *)archive->address)->dataModification; break;
+        default: return false;
     }
 
-    if (success) success = ARShowContentsInternal(archive->subtype, toc, entryTable, dataOffset, showSize, showLinks);
-    return success;
+    if (dataModification)
+        ARWarnDataModification(dataModification);
+
+    // The archive's ToC and entry table are already decrypted if needed
+    return ARShowContentsInternal(archive, showSize, showLinks, showChecksums);
 }
 
 // Print SystemImage version string
@@ -211,6 +130,9 @@ static void ARShowHeader(ARArchive *archive)
     fprintf(stdout, "Archive Signature:     '%.4s'\n", archive->address);
     fprintf(stdout, "CAR Version:           '%.4s'\n", archive->address + 4);
 
+    if (archive->narrow)
+        fprintf(stdout, "Entry Offsets:         32 bit\n");
+
     #define ARSubtype1Shared(h)                                                                     \
         fprintf(stdout, "Entry Table Offset:    %lu\n",     h->entryTableOffset);                   \
         fprintf(stdout, "Data Section Offset:   %lu\n",     h->dataSectionOffset);                  \
@@ -239,6 +161,9 @@ static void ARShowHeader(ARArchive *archive)
             CAHeaderS2 *header = archive->address;
             ARSubtype2Shared(header);
 
+            if (archive->compact)
+                fprintf(stdout, "Entry Table:           Compact\n");
+
             CADataModification *dataModification = archive->address + header->dataModification;
             ARDataModificationShared(dataModification);
         } break;
@@ -278,30 +203,61 @@ static void ARShowHeader(ARArchive *archive)
         } break;
         default: return;
     }
+
+    ARSection *cipherSection = ARArchiveFindSection(archive, kARSectionTypeCipher);
+
+    if (cipherSection && cipherSection->size >= sizeof(ARCipherInfo))
+    {
+        ARCipherInfo *info = archive->address + cipherSection->offset;
+        const char *cipher = (info->encryptionType == kCAEncryptionTypeAES) ? "AES" : (info->encryptionType == kCAEncryptionTypeSerpent) ? "Serpent" : "Unknown";
+
+        fprintf(stdout, "Encryption:            %s-%u CTR\n", cipher, info->keySize * 8);
+        fprintf(stdout, "Encrypted Range:       %lu-%lu\n", info->encryptedOffset, info->encryptedOffset + info->encryptedSize);
+    }
+
+    ARSection *checksumSection = ARArchiveFindSection(archive, kARSectionTypeEntryChecksums);
+
+    if (checksumSection && checksumSection->size >= sizeof(ARChecksumTable))
+    {
+        ARChecksumTable *table = archive->address + checksumSection->offset;
+        const char *type = (table->checksumType == kARChecksumTypeCRC32C) ? "CRC32C" : "Unknown";
+
+        fprintf(stdout, "Entry Checksums:       %s (%lu entries)\n", type, table->entryCount);
+    }
+
+    ARSection *sparseSection = ARArchiveFindSection(archive, kARSectionTypeSparseMap);
+
+    if (sparseSection && sparseSection->size >= sizeof(ARSparseMap))
+    {
+        ARSparseMap *map = archive->address + sparseSection->offset;
+        fprintf(stdout, "Sparse Files:          %lu (%lu extents)\n", map->entryCount, map->extentCount);
+    }
 }
 
-bool ARShowInformation(const OSUTF8Char *path, bool showHeader, bool showContents, bool showSize, bool showLinks)
+bool ARShowInformation(const OSUTF8Char *path, const OSUTF8Char *keyFile, bool showHeader, bool showContents, bool showSize, bool showLinks, bool showChecksums)
 {
-    ARArchive *archive = ARArchiveOpen(path);
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
     if (!archive) return false;
 
+    bool success = true;
+
     if (showHeader) ARShowHeader(archive);
 
     if (showContents)
     {
         fprintf(stdout, "Contents:\n");
 
-        return ARListContentsInternal(archive, showSize, showLinks);
+        success = ARListContentsInternal(archive, showSize, showLinks, showChecksums);
     }
 
-    return ARArchiveClose(archive);
+    return (ARArchiveClose(archive) && success);
 }
 
-bool ARListContents(const OSUTF8Char *path, bool showLinks)
+bool ARListContents(const OSUTF8Char *path, const OSUTF8Char *keyFile, bool showLinks)
 {
-    ARArchive *archive = ARArchiveOpen(path);
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
     if (!archive) return false;
 
-    bool success = ARListContentsInternal(archive, false, showLinks);
+    bool success = ARListContentsInternal(archive, false, showLinks, false);
     return (ARArchiveClose(archive) && success);
 }
@@ -1,5 +1,5 @@
 #include <System/Archives/OSCAR.h>
 #include "car.h"
 
-bool ARShowInformation(const OSUTF8Char *archive, bool showHeader, bool showContents, bool showSize, bool showLinks);
-bool ARListContents(const OSUTF8Char *archive, bool showLinks);
+bool ARShowInformation(const OSUTF8Char *archive, const OSUTF8Char *keyFile, bool showHeader, bool showContents, bool showSize, bool showLinks, bool showChecksums);
+bool ARListContents(const OSUTF8Char *archive, const OSUTF8Char *keyFile, bool showLinks);
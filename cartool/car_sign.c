@@ -0,0 +1,319 @@
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "car_sign.h"
+
+// Signing goes through OpenSSL so any key type it supports (RSA, ECDSA,
+// Ed25519) works. Keys and certificates are read from PEM files.
+
+struct __ARSigningKey {
+    EVP_PKEY *key;
+    UInt8 *publicKey;
+    OSSize publicKeySize;
+};
+
+#pragma mark - SHA-256
+
+// If the context can't be allocated, the digest comes out as zeros, which
+// never matches anything it's compared to
+void ARSHA256Init(ARSHA256Context *context)
+{
+    if (!(context->context = EVP_MD_CTX_new()) || EVP_DigestInit_ex(context->context, EVP_sha256(), kOSNullPointer) != 1)
+    {
+        fprintf(stderr, "Error: Could not set up SHA-256!\n");
+
+        EVP_MD_CTX_free(context->context);
+        context->context = kOSNullPointer;
+    }
+}
+
+void ARSHA256Update(ARSHA256Context *context, const void *data, OSSize size)
+{
+    if (context->context)
+        EVP_DigestUpdate(context->context, data, size);
+}
+
+void ARSHA256Finalize(ARSHA256Context *context, UInt8 *digest)
+{
+    ARSHA256Digest(context, digest);
+    ARSHA256Free(context);
+}
+
+// Start a new message, keeping the context's allocation
+void ARSHA256Reset(ARSHA256Context *context)
+{
+    if (context->context && EVP_DigestInit_ex(context->context, EVP_sha256(), kOSNullPointer) != 1)
+    {
+        fprintf(stderr, "Error: Could not set up SHA-256!\n");
+
+        EVP_MD_CTX_free(context->context);
+        context->context = kOSNullPointer;
+    }
+}
+
+// Finish the message without giving up the context
+void ARSHA256Digest(ARSHA256Context *context, UInt8 *digest)
+{
+    if (!context->context || EVP_DigestFinal_ex(context->context, digest, kOSNullPointer) != 1)
+        memset(digest, 0, kARSHA256DigestSize);
+}
+
+void ARSHA256Free(ARSHA256Context *context)
+{
+    EVP_MD_CTX_free(context->context);
+    context->context = kOSNullPointer;
+}
+
+void ARSHA256Process(const void *data, OSSize size, UInt8 *digest)
+{
+    if (EVP_Digest(data, size, digest, kOSNullPointer, EVP_sha256(), kOSNullPointer) != 1)
+    {
+        fprintf(stderr, "Error: Could not compute SHA-256!\n");
+        memset(digest, 0, kARSHA256DigestSize);
+    }
+}
+
+#pragma mark - Key Helpers
+
+// Ed25519 and Ed448 sign the message directly; everything else hashes it with SHA-256 first
+static const EVP_MD *ARSignatureMessageDigest(EVP_PKEY *key)
+{
+    int type = EVP_PKEY_base_id(key);
+
+    if (type == EVP_PKEY_ED25519 || type == EVP_PKEY_ED448)
+        return kOSNullPointer;
+
+    return EVP_sha256();
+}
+
+static OSSize ARSignatureEncodePublicKey(EVP_PKEY *key, UInt8 **encoded)
+{
+    *encoded = kOSNullPointer;
+    int size = i2d_PUBKEY(key, encoded);
+
+    return (size > 0) ? size : 0;
+}
+
+// Read a public key, or the public key of a certificate, from a PEM file
+static EVP_PKEY *ARSignatureLoadPublicKey(const OSUTF8Char *path)
+{
+    FILE *file = fopen((char *)path, "r");
+    EVP_PKEY *key;
+
+    if (!file)
+    {
+        fprintf(stderr, "Error: Could not open key file '%s'!\n", path);
+        return kOSNullPointer;
+    }
+
+    key = PEM_read_PUBKEY(file, kOSNullPointer, kOSNullPointer, kOSNullPointer);
+
+    if (!key)
+    {
+        rewind(file);
+        X509 *certificate = PEM_read_X509(file, kOSNullPointer, kOSNullPointer, kOSNullPointer);
+
+        if (certificate)
+        {
+            key = X509_get_pubkey(certificate);
+            X509_free(certificate);
+        }
+    }
+
+    fclose(file);
+
+    if (!key)
+        fprintf(stderr, "Error: '%s' does not hold a PEM public key or certificate!\n", path);
+
+    return key;
+}
+
+#pragma mark - Signing
+
+ARSigningKey *ARSigningKeyLoad(const OSUTF8Char *path)
+{
+    FILE *file = fopen((char *)path, "r");
+
+    if (!file)
+    {
+        fprintf(stderr, "Error: Could not open signing key '%s'!\n", path);
+        return kOSNullPointer;
+    }
+
+    EVP_PKEY *privateKey = PEM_read_PrivateKey(file, kOSNullPointer, kOSNullPointer, kOSNullPointer);
+    fclose(file);
+
+    if (!privateKey)
+    {
+        fprintf(stderr, "Error: '%s' does not hold a PEM private key!\n", path);
+        return kOSNullPointer;
+    }
+
+    ARSigningKey *key = malloc(sizeof(ARSigningKey));
+
+    if (!key)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        EVP_PKEY_free(privateKey);
+
+        return kOSNullPointer;
+    }
+
+    key->key = privateKey;
+    key->publicKeySize = ARSignatureEncodePublicKey(privateKey, &key->publicKey);
+
+    if (!key->publicKeySize)
+    {
+        fprintf(stderr, "Error: Could not encode public key of '%s'!\n", path);
+        ARSigningKeyFree(key);
+
+        return kOSNullPointer;
+    }
+
+    return key;
+}
+
+// Upper bound on the size of the signature section this key produces
+OSSize ARSigningKeySignatureSize(ARSigningKey *key)
+{
+    return sizeof(ARSignature) + EVP_PKEY_size(key->key) + key->publicKeySize;
+}
+
+// Sign `digest` into `signature`, which must hold ARSigningKeySignatureSize() bytes
+bool ARSigningKeySign(ARSigningKey *key, const UInt8 *digest, ARSignature *signature, OSSize *size)
+{
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    size_t signatureSize = EVP_PKEY_size(key->key);
+    bool success = false;
+
+    if (!context)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        return false;
+    }
+
+    memset(signature, 0, sizeof(ARSignature));
+    signature->digestType = kARSignatureDigestSHA256;
+    memcpy(signature->digest, digest, kARSHA256DigestSize);
+
+    if (EVP_DigestSignInit(context, kOSNullPointer, ARSignatureMessageDigest(key->key), kOSNullPointer, key->key) == 1 &&
+        EVP_DigestSign(context, signature->data, &signatureSize, digest, kARSHA256DigestSize) == 1)
+    {
+        signature->signatureSize = signatureSize;
+        signature->publicKeySize = key->publicKeySize;
+        memcpy(signature->data + signatureSize, key->publicKey, key->publicKeySize);
+
+        *size = sizeof(ARSignature) + signatureSize + key->publicKeySize;
+        success = true;
+    } else {
+        fprintf(stderr, "Error: Could not sign archive!\n");
+    }
+
+    EVP_MD_CTX_free(context);
+    return success;
+}
+
+void ARSigningKeyFree(ARSigningKey *key)
+{
+    if (!key) return;
+
+    OPENSSL_free(key->publicKey);
+    EVP_PKEY_free(key->key);
+    free(key);
+}
+
+#pragma mark - Verification
+
+// The signed digest covers the Merkle tree header (which holds the root and
+// the metadata digest), the section directory's flags and the contents of
+// every other section except the signature. Sections are taken in
+// directory order.
+void ARSignatureDigest(const ARMerkleTree *tree, const ARSectionDirectory *directory, const void *address, UInt8 *digest)
+{
+    ARSHA256Context context;
+
+    ARSHA256Init(&context);
+    ARSHA256Update(&context, tree, sizeof(ARMerkleTree));
+    ARSHA256Update(&context, &directory->flags, sizeof(directory->flags));
+
+    for (OSIndex i = 0; i < directory->sectionCount; i++)
+    {
+        const ARSection *section = &directory->sections[i];
+
+        if (section->type == kARSectionTypeMerkleTree || section->type == kARSectionTypeSignature)
+            continue;
+
+        ARSHA256Update(&context, section, sizeof(ARSection));
+        ARSHA256Update(&context, address + section->offset, section->size);
+    }
+
+    ARSHA256Finalize(&context, digest);
+}
+
+// Check `signature` over `digest` with the embedded public key, and that the
+// key matches the one in `trustedKeyPath`. The embedded key only shows the
+// archive is intact, not who signed it, so without a trusted key the
+// signature is unauthenticated and this fails.
+bool ARSignatureVerify(ARSignature *signature, OSSize size, const UInt8 *digest, const OSUTF8Char *trustedKeyPath, bool verbose)
+{
+    if (size < sizeof(ARSignature) || signature->digestType != kARSignatureDigestSHA256 || (OSSize)signature->signatureSize + signature->publicKeySize > size - sizeof(ARSignature))
+    {
+        fprintf(stderr, "Error: Archive signature is malformed!\n");
+        return false;
+    }
+
+    if (memcmp(signature->digest, digest, kARSHA256DigestSize))
+    {
+        fprintf(stderr, "Error: Archive contents do not match signed digest!\n");
+        return false;
+    }
+
+    const UInt8 *publicKeyData = signature->data + signature->signatureSize;
+    EVP_PKEY *key = d2i_PUBKEY(kOSNullPointer, &publicKeyData, signature->publicKeySize);
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    bool success = false;
+
+    if (!key || !context)
+    {
+        fprintf(stderr, "Error: Could not read signer's public key!\n");
+
+        if (context) EVP_MD_CTX_free(context);
+        if (key) EVP_PKEY_free(key);
+
+        return false;
+    }
+
+    if (EVP_DigestVerifyInit(context, kOSNullPointer, ARSignatureMessageDigest(key), kOSNullPointer, key) == 1 &&
+        EVP_DigestVerify(context, signature->data, signature->signatureSize, digest, kARSHA256DigestSize) == 1) {
+        success = true;
+    } else {
+        fprintf(stderr, "Error: Archive signature is invalid!\n");
+    }
+
+    if (success && trustedKeyPath)
+    {
+        EVP_PKEY *trusted = ARSignatureLoadPublicKey(trustedKeyPath);
+
+        if (!trusted || EVP_PKEY_eq(trusted, key) != 1)
+        {
+            if (trusted) fprintf(stderr, "Error: Archive was not signed by the trusted key!\n");
+            success = false;
+        }
+
+        if (trusted) EVP_PKEY_free(trusted);
+    } else if (success) {
+        if (verbose) fprintf(stdout, "signature: unauthenticated\n");
+
+        fprintf(stderr, "Error: Archive is signed but no trusted key was given to check the signer against!\n");
+        success = false;
+    }
+
+    EVP_MD_CTX_free(context);
+    EVP_PKEY_free(key);
+
+    return success;
+}
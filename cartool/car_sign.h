@@ -0,0 +1,17 @@
+#ifndef __car_sign__
+#define __car_sign__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+typedef struct __ARSigningKey ARSigningKey;
+
+ARSigningKey *ARSigningKeyLoad(const OSUTF8Char *path);
+OSSize ARSigningKeySignatureSize(ARSigningKey *key);
+bool ARSigningKeySign(ARSigningKey *key, const UInt8 *digest, ARSignature *signature, OSSize *size);
+void ARSigningKeyFree(ARSigningKey *key);
+
+void ARSignatureDigest(const ARMerkleTree *tree, const ARSectionDirectory *directory, const void *address, UInt8 *digest);
+bool ARSignatureVerify(ARSignature *signature, OSSize size, const UInt8 *digest, const OSUTF8Char *trustedKeyPath, bool verbose);
+
+#endif /* !defined(__car_sign__) */
@@ -0,0 +1,333 @@
+#include <sys/syslimits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "car_store.h"
+
+// Normalized chunking: cut points are harder to hit before the average
+// size and easier after it, which keeps chunk sizes close to the average.
+#define kARStoreMaskSmall   (((1ULL << 18) - 1) << (64 - 18))
+#define kARStoreMaskLarge   (((1ULL << 14) - 1) << (64 - 14))
+
+static UInt64 gARStoreGear[256];
+static bool gARStoreGearReady = false;
+
+#pragma mark - Chunking
+
+// The gear table has to be identical for every build, so it is generated
+// from a fixed seed rather than at random.
+static void ARStoreInitGear(void)
+{
+    UInt64 state = 0x43415252u;
+
+    if (gARStoreGearReady)
+        return;
+
+    for (OSIndex i = 0; i < 256; i++)
+    {
+        UInt64 value = (state += 0x9E3779B97F4A7C15ULL);
+
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        gARStoreGear[i] = value ^ (value >> 31);
+    }
+
+    gARStoreGearReady = true;
+}
+
+// Length of the next chunk of `data` (at most `size` bytes)
+static OSSize ARStoreNextChunk(const UInt8 *data, OSSize size)
+{
+    OSSize normal = kARStoreAverageChunkSize;
+    UInt64 hash = 0;
+    OSIndex i = kARStoreMinChunkSize;
+
+    if (size <= kARStoreMinChunkSize)
+        return size;
+
+    if (size > kARStoreMaxChunkSize) size = kARStoreMaxChunkSize;
+    if (normal > size) normal = size;
+
+    for ( ; i < normal; i++)
+    {
+        hash = (hash << 1) + gARStoreGear[data[i]];
+        if (!(hash & kARStoreMaskSmall)) return i;
+    }
+
+    for ( ; i < size; i++)
+    {
+        hash = (hash << 1) + gARStoreGear[data[i]];
+        if (!(hash & kARStoreMaskLarge)) return i;
+    }
+
+    return size;
+}
+
+#pragma mark - Blobs
+
+// Fails if the path doesn't fit in PATH_MAX
+static bool ARStoreBlobPath(const OSUTF8Char *storeDirectory, const UInt8 *digest, OSUTF8Char *path, OSUTF8Char *directory)
+{
+    char hex[(kARSHA256DigestSize * 2) + 1];
+
+    for (OSIndex i = 0; i < kARSHA256DigestSize; i++)
+        snprintf(hex + (i * 2), 3, "%02x", digest[i]);
+
+    int length = snprintf((char *)directory, PATH_MAX + 1, "%s/%.2s", storeDirectory, hex);
+
+    if (length < 0 || length > PATH_MAX || (length = snprintf((char *)path, PATH_MAX + 1, "%s/%s", directory, hex + 2)) < 0 || length > PATH_MAX)
+    {
+        fprintf(stderr, "Error: Store path '%s' is too long!\n", storeDirectory);
+        return false;
+    }
+
+    return true;
+}
+
+// Write a blob unless the store already has it. Blobs are written under a
+// temporary name and renamed so a store never holds a partial blob.
+static bool ARStorePutBlob(const OSUTF8Char *storeDirectory, const UInt8 *digest, const UInt8 *data, OSSize size, bool *added)
+{
+    OSUTF8Char directory[PATH_MAX + 1];
+    OSUTF8Char path[PATH_MAX + 1];
+    OSUTF8Char temporary[PATH_MAX + 1];
+
+    *added = false;
+
+    if (!ARStoreBlobPath(storeDirectory, digest, path, directory))
+        return false;
+
+    if (!access((char *)path, F_OK))
+        return true;
+
+    if (!ARDirectoryExistsAtPath(directory) && !ARCreateDirectory(directory))
+        return false;
+
+    int length = snprintf((char *)temporary, PATH_MAX + 1, "%s.%d", path, getpid());
+
+    if (length < 0 || length > PATH_MAX)
+    {
+        fprintf(stderr, "Error: Store path '%s' is too long!\n", storeDirectory);
+        return false;
+    }
+
+    int fd = open((char *)temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: Could not create blob '%s'!\n", temporary);
+        return false;
+    }
+
+    bool success = ARWriteAll(fd, data, size);
+    success = !close(fd) && success;
+
+    if (!success || rename((char *)temporary, (char *)path))
+    {
+        fprintf(stderr, "Error: Could not write blob '%s'!\n", path);
+        unlink((char *)temporary);
+
+        return false;
+    }
+
+    *added = true;
+    return true;
+}
+
+// Read the blob `chunk` into `buffer` and check it against its digest
+static bool ARStoreGetBlob(const OSUTF8Char *storeDirectory, const ARRecipeChunk *chunk, UInt8 *buffer)
+{
+    OSUTF8Char directory[PATH_MAX + 1];
+    OSUTF8Char path[PATH_MAX + 1];
+    UInt8 digest[kARSHA256DigestSize];
+
+    if (!ARStoreBlobPath(storeDirectory, chunk->digest, path, directory))
+        return false;
+
+    int fd = open((char *)path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: Missing blob '%s'!\n", path);
+        return false;
+    }
+
+    bool success = (read(fd, buffer, chunk->size) == chunk->size);
+    close(fd);
+
+    if (success)
+    {
+        ARSHA256Process(buffer, chunk->size, digest);
+        success = !memcmp(digest, chunk->digest, kARSHA256DigestSize);
+    }
+
+    if (!success)
+        fprintf(stderr, "Error: Blob '%s' is corrupt!\n", path);
+
+    return success;
+}
+
+#pragma mark - Store and Materialize
+
+// Split `archive` into content-defined chunks, add the new ones to the
+// store and write the recipe. A cut is forced at the start of the data
+// section so metadata changes never shift the data chunks.
+bool ARStoreArchive(const OSUTF8Char *path, const OSUTF8Char *storeDirectory, const OSUTF8Char *recipePath, bool verbose)
+{
+    if (!ARDirectoryExistsAtPath(storeDirectory) && !ARCreateDirectory(storeDirectory))
+        return false;
+
+    ARArchive *archive = ARArchiveOpen(path);
+    if (!archive) return false;
+
+    OSSize dataStart = archive->dataSection - (UInt8 *)archive->address;
+    OSCount capacity = (archive->size / kARStoreMinChunkSize) + 2;
+    ARRecipeChunk *chunks = malloc(capacity * sizeof(ARRecipeChunk));
+    const UInt8 *data = archive->address;
+    UInt64 addedSize = 0;
+    OSCount addedCount = 0;
+    OSCount chunkCount = 0;
+    OSOffset offset = 0;
+    bool success = true;
+
+    if (!chunks)
+    {
+        fprintf(stderr, "Error: Out of memory!\n");
+        ARArchiveClose(archive);
+
+        return false;
+    }
+
+    ARStoreInitGear();
+
+    while (success && offset < archive->size)
+    {
+        OSSize limit = archive->size - offset;
+        if (offset < dataStart) limit = dataStart - offset;
+
+        OSSize size = ARStoreNextChunk(data + offset, limit);
+        ARRecipeChunk *chunk = &chunks[chunkCount++];
+        bool added;
+
+        memset(chunk, 0, sizeof(ARRecipeChunk));
+        ARSHA256Process(data + offset, size, chunk->digest);
+        chunk->size = (UInt32)size;
+
+        success = ARStorePutBlob(storeDirectory, chunk->digest, data + offset, size, &added);
+
+        if (added)
+        {
+            addedSize += size;
+            addedCount++;
+        }
+
+        offset += size;
+    }
+
+    ARRecipeHeader header;
+    memcpy(header.magic, kARRecipeMagic, 4);
+
+    header.version = kARRecipeVersion;
+    header.archiveSize = archive->size;
+    header.chunkCount = chunkCount;
+
+    if (success)
+    {
+        int fd = open((char *)recipePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        success = (fd != -1) && ARWriteAll(fd, &header, sizeof(ARRecipeHeader)) && ARWriteAll(fd, chunks, chunkCount * sizeof(ARRecipeChunk));
+        if (fd != -1) success = !close(fd) && success;
+
+        if (!success)
+            fprintf(stderr, "Error: Could not write recipe '%s'!\n", recipePath);
+    }
+
+    if (success && verbose)
+        fprintf(stdout, "Stored %lu chunks (%lu new, %lu of %lu bytes added to the store)\n", chunkCount, addedCount, addedSize, archive->size);
+
+    free(chunks);
+    return (ARArchiveClose(archive) && success);
+}
+
+// Reassemble the archive described by `recipePath` from the store. The
+// archive is written sequentially and every chunk is checked on the way.
+bool ARMaterializeArchive(const OSUTF8Char *recipePath, const OSUTF8Char *storeDirectory, const OSUTF8Char *archive, bool verbose)
+{
+    ARRecipeHeader header;
+    struct stat stats;
+
+    if (ARFileHasDataAtPath(archive))
+    {
+        fprintf(stderr, "Error: Archive exists at path '%s' and is not empty!\n", archive);
+        return false;
+    }
+
+    int recipe = open((char *)recipePath, O_RDONLY);
+
+    if (recipe == -1 || fstat(recipe, &stats) || read(recipe, &header, sizeof(ARRecipeHeader)) != sizeof(ARRecipeHeader))
+    {
+        fprintf(stderr, "Error: Could not read recipe '%s'!\n", recipePath);
+        if (recipe != -1) close(recipe);
+
+        return false;
+    }
+
+    if (memcmp(header.magic, kARRecipeMagic, 4) || header.version != kARRecipeVersion || sizeof(ARRecipeHeader) + (header.chunkCount * sizeof(ARRecipeChunk)) != stats.st_size)
+    {
+        fprintf(stderr, "Error: Recipe '%s' is invalid!\n", recipePath);
+        close(recipe);
+
+        return false;
+    }
+
+    OSSize chunksSize = header.chunkCount * sizeof(ARRecipeChunk);
+    ARRecipeChunk *chunks = malloc(chunksSize ? chunksSize : 1);
+    UInt8 *buffer = malloc(kARStoreMaxChunkSize);
+
+    bool success = chunks && buffer && (read(recipe, chunks, chunksSize) == chunksSize);
+    close(recipe);
+
+    int fd = success ? open((char *)archive, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    UInt64 size = 0;
+
+    if (!success || fd == -1)
+    {
+        fprintf(stderr, "Error: Could not materialize archive '%s'!\n", archive);
+        success = false;
+    }
+
+    for (OSIndex i = 0; success && i < header.chunkCount; i++)
+    {
+        if (chunks[i].size > kARStoreMaxChunkSize)
+        {
+            fprintf(stderr, "Error: Recipe '%s' is invalid!\n", recipePath);
+            success = false;
+
+            break;
+        }
+
+        success = ARStoreGetBlob(storeDirectory, &chunks[i], buffer) && ARWriteAll(fd, buffer, chunks[i].size);
+        size += chunks[i].size;
+    }
+
+    if (success && size != header.archiveSize)
+    {
+        fprintf(stderr, "Error: Recipe '%s' does not add up to its archive size!\n", recipePath);
+        success = false;
+    }
+
+    if (fd != -1)
+        success = !close(fd) && success;
+
+    if (success && verbose)
+        fprintf(stdout, "Materialized %lu bytes from %lu chunks\n", size, header.chunkCount);
+
+    free(chunks);
+    free(buffer);
+
+    return success;
+}
@@ -0,0 +1,34 @@
+#ifndef __car_store__
+#define __car_store__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+// A chunk store holds content-defined chunks of archives as blobs named by
+// their SHA-256 ('<store>/ab/cdef...'). A recipe lists the chunks making up
+// one archive, so successive builds only add the chunks that changed.
+
+#define kARRecipeMagic      "CARR"
+#define kARRecipeVersion    1
+
+#define kARStoreMinChunkSize        (16 * 1024)
+#define kARStoreAverageChunkSize    (64 * 1024)
+#define kARStoreMaxChunkSize        (256 * 1024)
+
+typedef struct {
+    UInt8 magic[4];
+    UInt32 version;
+    UInt64 archiveSize;
+    UInt64 chunkCount;
+} ARRecipeHeader;
+
+typedef struct {
+    UInt8 digest[kARSHA256DigestSize];
+    UInt32 size;
+    UInt32 reserved;
+} ARRecipeChunk;
+
+bool ARStoreArchive(const OSUTF8Char *archive, const OSUTF8Char *storeDirectory, const OSUTF8Char *recipe, bool verbose);
+bool ARMaterializeArchive(const OSUTF8Char *recipe, const OSUTF8Char *storeDirectory, const OSUTF8Char *archive, bool verbose);
+
+#endif /* !defined(__car_store__) */
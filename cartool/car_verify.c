@@ -0,0 +1,265 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "car_pipeline.h"
+#include "car_verify.h"
+#include "car_merkle.h"
+#include "car_chunk.h"
+#include "car_sign.h"
+
+static void ARVerifyStoredChecksums(ARArchive *archive, UInt32 *headerChecksum, UInt32 *dataChecksum)
+{
+    #define ARCopyChecksums(t)                                              \
+        *headerChecksum = ((t *)archive->address)->headerChecksum;          \
+        *dataChecksum = ((t *)archive->address)->dataChecksum
+
+    switch (archive->subtype)
+    {
+        case kARSubtype1:           ARCopyChecksums(CAHeaderS1);          break;
+        case kARSubtype2:           ARCopyChecksums(CAHeaderS2);          break;
+        case kARSubtypeBootX:       ARCopyChecksums(CAHeaderBootX);       break;
+        case kARSubtypeSystemImage: ARCopyChecksums(CAHeaderSystemImage); break;
+        default: *headerChecksum = *dataChecksum = 0; break;
+    }
+}
+
+static bool ARVerifyDiscardConsumer(void *context, const UInt8 *data, OSSize size)
+{
+    *((UInt64 *)context) += size;
+    return true;
+}
+
+// Compute the data checksum while the pipeline decompresses every chunk.
+// The checksum is advanced chunk by chunk behind the decompressed stream
+// so both make progress together; decompression validates each chunk's
+// own integrity check.
+static bool ARVerifyData(ARArchive *archive, UInt32 *checksum, bool verbose)
+{
+    UInt8 *start = archive->address + ARArchiveHeaderSize(archive->subtype);
+    UInt8 *end = archive->address + archive->size;
+    UInt8 *position = start;
+    bool success = true;
+
+    *checksum = ARCRC32Init();
+
+    // Encrypted chunks can't be decompressed without the key, but the checksum covers the stored bytes either way
+    if (archive->chunks && !archive->cipher && ARArchiveIsEncrypted(archive))
+    {
+        fprintf(stderr, "Warning: Archive is encrypted and no key was given; not checking compressed data!\n");
+    }
+    else if (archive->chunks)
+    {
+        ARChunkIndex *index = ARChunkReaderIndex(archive->chunks);
+        ARPipeline *pipeline = ARPipelineCreate(ARChunkReaderSource(archive->chunks), 0, index->chunkCount, ARPipelineDefaultWorkers());
+        UInt64 rawSize = 0;
+
+        if (!pipeline)
+            return false;
+
+        for (UInt64 chunk = 0; success && chunk < index->chunkCount; chunk++)
+        {
+            UInt8 *storedEnd = archive->dataSection + index->offsets[chunk + 1];
+
+            success = ARPipelineStream(pipeline, chunk * index->chunkSize, ARChunkRawSize(index, chunk), ARVerifyDiscardConsumer, &rawSize);
+
+            if (storedEnd > position)
+            {
+                *checksum = ARCRC32Update(*checksum, position, storedEnd - position);
+                position = storedEnd;
+            }
+        }
+
+        success = ARPipelineDestroy(pipeline) && success;
+
+        if (!success)
+            fprintf(stderr, "Error: Compressed data is corrupt!\n");
+        else if (verbose)
+            fprintf(stdout, "Decompressed %lu bytes in %lu chunks\n", rawSize, index->chunkCount);
+    }
+
+    if (end > position)
+        *checksum = ARCRC32Update(*checksum, position, end - position);
+
+    *checksum = ARCRC32Finalize(*checksum);
+    return success;
+}
+
+// Check that the Merkle tree describes this archive's layout, that the
+// header and metadata match it, and that its signature is valid. The data
+// blocks themselves are checked separately. Returns the tree, or null if
+// the archive isn't signed (`*success` is false on any failure).
+static ARMerkleTree *ARVerifySignature(ARArchive *archive, const OSUTF8Char *trustedKey, bool verbose, bool *success)
+{
+    ARSection *treeSection = ARArchiveFindSection(archive, kARSectionTypeMerkleTree);
+    ARSection *signatureSection = ARArchiveFindSection(archive, kARSectionTypeSignature);
+    UInt8 digest[kARSHA256DigestSize];
+    OSOffset dataOffset = archive->dataSection - (UInt8 *)archive->address;
+    UInt64 signatureOffset = signatureSection ? signatureSection->offset : 0;
+
+    *success = false;
+
+    if (!treeSection && !signatureSection)
+    {
+        if (trustedKey) {
+            fprintf(stderr, "Error: Archive is not signed!\n");
+        } else {
+            *success = true;
+        }
+
+        return kOSNullPointer;
+    }
+
+    ARMerkleTree *tree = archive->address + (treeSection ? treeSection->offset : 0);
+
+    if (!treeSection || !signatureSection || !ARMerkleTreeValid(tree, treeSection->size))
+    {
+        fprintf(stderr, "Error: Archive signature sections are malformed!\n");
+        return kOSNullPointer;
+    }
+
+    if (tree->dataOffset != dataOffset || tree->metadataOffset != archive->tocOffset || tree->metadataOffset + tree->metadataSize != dataOffset || tree->dataSize > archive->size - dataOffset)
+    {
+        fprintf(stderr, "Error: Archive layout does not match its signature!\n");
+        return kOSNullPointer;
+    }
+
+    if (archive->subtype == kARSubtype2)           signatureOffset = ((CAHeaderS2 *)archive->address)->archiveSignature;
+    if (archive->subtype == kARSubtypeSystemImage) signatureOffset = ((CAHeaderSystemImage *)archive->address)->archiveSignature;
+
+    if (signatureOffset != signatureSection->offset)
+    {
+        fprintf(stderr, "Error: Header does not point at archive signature!\n");
+        return kOSNullPointer;
+    }
+
+    ARArchiveHeaderDigest(archive->subtype, archive->address, digest);
+
+    if (memcmp(digest, tree->headerDigest, kARSHA256DigestSize))
+    {
+        fprintf(stderr, "Error: Header does not match its signature!\n");
+        return kOSNullPointer;
+    }
+
+    ARSHA256Process(archive->address + tree->metadataOffset, tree->metadataSize, digest);
+
+    if (memcmp(digest, tree->metadataDigest, kARSHA256DigestSize))
+    {
+        fprintf(stderr, "Error: ToC or entry table does not match its signature!\n");
+        return kOSNullPointer;
+    }
+
+    ARSignatureDigest(tree, archive->sections, archive->address, digest);
+
+    if (!ARSignatureVerify(archive->address + signatureSection->offset, signatureSection->size, digest, trustedKey, verbose))
+        return kOSNullPointer;
+
+    *success = true;
+    return tree;
+}
+
+bool ARVerifyArchive(const OSUTF8Char *path, const OSUTF8Char *keyFile, const OSUTF8Char *trustedKey, bool verbose)
+{
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
+    if (!archive) return false;
+
+    UInt32 headerChecksum, dataChecksum, checksum;
+    bool success = true;
+
+    ARVerifyStoredChecksums(archive, &headerChecksum, &dataChecksum);
+    checksum = ARArchiveHeaderChecksum(archive->subtype, archive->address);
+
+    if (verbose) fprintf(stdout, "header: 0x%08X (expected 0x%08X)\n", checksum, headerChecksum);
+
+    if (checksum != headerChecksum)
+    {
+        fprintf(stderr, "Error: Header checksum mismatch in archive '%s'!\n", path);
+        success = false;
+    }
+
+    if (!ARVerifyData(archive, &checksum, verbose))
+        success = false;
+
+    if (verbose) fprintf(stdout, "data: 0x%08X (expected 0x%08X)\n", checksum, dataChecksum);
+
+    if (checksum != dataChecksum)
+    {
+        fprintf(stderr, "Error: Data checksum mismatch in archive '%s'!\n", path);
+        success = false;
+    }
+
+    bool signatureValid;
+    ARMerkleTree *tree = ARVerifySignature(archive, trustedKey, verbose, &signatureValid);
+
+    if (tree && !ARMerkleTreeVerify(tree, archive->address + tree->dataOffset, ARPipelineDefaultWorkers(), verbose))
+    {
+        fprintf(stderr, "Error: Data does not match signature in archive '%s'!\n", path);
+        signatureValid = false;
+    }
+
+    if (tree && signatureValid && verbose)
+        fprintf(stdout, "signature: valid (%lu blocks)\n", tree->leafCount);
+
+    success = signatureValid && success;
+    return (ARArchiveClose(archive) && success);
+}
+
+// Check a single entry against the archive signature. Only the blocks
+// holding the entry's stored data are hashed.
+bool ARVerifyEntry(const OSUTF8Char *path, const OSUTF8Char *entryPath, const OSUTF8Char *keyFile, const OSUTF8Char *trustedKey, bool verbose)
+{
+    ARArchive *archive = ARArchiveOpenWithKey(path, keyFile);
+    if (!archive) return false;
+
+    ARArchiveEntry entry;
+    bool success;
+
+    if (ARArchiveFindEntry(archive, entryPath, &entry) == -1)
+    {
+        fprintf(stderr, "Error: No entry '%s' in archive '%s'!\n", entryPath, path);
+        ARArchiveClose(archive);
+
+        return false;
+    }
+
+    ARMerkleTree *tree = ARVerifySignature(archive, trustedKey, verbose, &success);
+
+    if (!tree)
+    {
+        if (success) fprintf(stderr, "Error: Archive '%s' is not signed!\n", path);
+        ARArchiveClose(archive);
+
+        return false;
+    }
+
+    // Compressed entries are checked through the chunks which hold them
+    UInt64 storedOffset = entry.dataOffset;
+    UInt64 storedSize = entry.dataSize;
+
+    if (archive->chunks && entry.dataSize)
+    {
+        ARChunkIndex *index = ARChunkReaderIndex(archive->chunks);
+        UInt64 firstChunk = entry.dataOffset / index->chunkSize;
+        UInt64 lastChunk = (entry.dataOffset + entry.dataSize - 1) / index->chunkSize;
+
+        if (lastChunk >= index->chunkCount)
+        {
+            fprintf(stderr, "Error: Entry data is outside of archive!\n");
+            ARArchiveClose(archive);
+
+            return false;
+        }
+
+        storedOffset = index->offsets[firstChunk];
+        storedSize = index->offsets[lastChunk + 1] - storedOffset;
+    }
+
+    success = ARMerkleTreeVerifyRange(tree, archive->address + tree->dataOffset, storedOffset, storedSize);
+
+    if (!success) {
+        fprintf(stderr, "Error: Entry '%s' does not match signature!\n", entryPath);
+    } else if (verbose) {
+        fprintf(stdout, "%s: valid (%lu bytes checked)\n", entryPath, storedSize);
+    }
+
+    return (ARArchiveClose(archive) && success);
+}
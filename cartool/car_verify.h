@@ -0,0 +1,10 @@
+#ifndef __car_verify__
+#define __car_verify__ 1
+
+#include <System/Archives/OSCAR.h>
+#include "car.h"
+
+bool ARVerifyArchive(const OSUTF8Char *archive, const OSUTF8Char *keyFile, const OSUTF8Char *trustedKey, bool verbose);
+bool ARVerifyEntry(const OSUTF8Char *archive, const OSUTF8Char *entryPath, const OSUTF8Char *keyFile, const OSUTF8Char *trustedKey, bool verbose);
+
+#endif /* !defined(__car_verify__) */
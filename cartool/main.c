@@ -1,3 +1,4 @@
+#include <unistd.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <stdarg.h>
@@ -7,19 +8,34 @@
 
 #include "car_create.h"
 #include "car_extract.h"
+#include "car_verify.h"
+#include "car_store.h"
+#include "car_patch.h"
 #include "car_show.h"
+#include "car_log.h"
 #include "car.h"
 
 #include <System/Archives/OSCAR.h>
 
 // cartool:
-//   -c: create archive [root directory, archive name]
+//   -c: create archive [root directory, archive name] (or [archive name] with --from-tar)
 //         -v: verbose
 //         --subtype <1, 2, BootX, SystemImage>: select archive subtype
 //         --apply-compression <LZMA, LZO>: equivament to --compress-section ToC <type> --compress-section Entries <type> --compress-section Data <type>
 //         --compress-section {ToC|EntryTable|DataSection, LZMA|LZO}: compress a given section with the given compression type
 //         --apply-encryption <AES, Serpent>: encrypt the archive. Encrypts all data except the header.
-//         --sign <certificate>
+//         --key-file <path>: raw 128, 192 or 256 bit key to encrypt with
+//         --sign <private key>: sign the archive with a PEM private key
+//         --checksum-entries: store a CRC32C of each entry's data
+//         --dedup: store hardlinked and identical files only once
+//         --manifest: write '<archive>.manifest' for later incremental builds
+//         --incremental <previous archive>: copy unchanged files from a previous build (implies --manifest)
+//         --canonical-order: sort entries by name so identical trees give identical archives
+//         --compact-entries: store a compact entry table with a separate name pool (Subtype 2)
+//         --sparse: store only the data extents of sparse files and recreate their holes on extraction
+//         --progress: show a progress line with throughput and ETA
+//         --from-tar <path|->: read the tree from a tar stream (or stdin) instead of a root directory; boot paths are then paths in the archive
+//         --filter <path>: include and exclude paths under the root directory with the rules in the given file ('+ pattern' or '- pattern' per line)
 //
 //         --arch <x86_64|ARMv8>: architecture for Boot-X file
 //         --bootID <id>: boot ID hex value
@@ -34,18 +50,52 @@
 //         --build-id <id>: specify system build id
 //         --partition-info <path>: read partition flag information from the given file
 //         --boot-archive <path>: specify boot archive path
+//         --boot-profile <path>: lay out data in the order of the paths listed in the given file (BootX and SystemImage)
 //   -x: extract archive [archive path]
 //         -v: verbose
 //         -d: output directory
 //         -o: output path(s)
 //         -f: file(s)
+//         -k: key file for encrypted archives
+//         -u: update an existing tree, only writing entries which differ from it
+//         -D: with -u, delete anything the archive doesn't have
+//         -p: show a progress line with throughput and ETA
 //   -s: show archive contents [archive path(s)]
 //         --show-header: show information about the archive header
 //         --show-entries: show in-depth information about archive entries
 //         --show-size: show the size of each entry
 //         --show-links: show link location
+//         --show-checksums: show the stored checksum of each entry
+//         --key-file <path>: key file for encrypted archives
 //   -l: list paths in archive [archive path(s)]
 //         --show-links: show link location
+//         --key-file <path>: key file for encrypted archives
+//   -t: verify archive checksums and data [archive path(s)]
+//         -v: verbose
+//         -k: key file for encrypted archives
+//         -p: trusted signer's PEM public key or certificate (signed archives fail without one)
+//         -f: check only this entry against the archive signature
+//   --store: add an archive to a chunk store [archive, store directory, recipe]
+//         -v: verbose
+//   --materialize: rebuild an archive from a chunk store [recipe, store directory, archive]
+//         -v: verbose
+//   --diff: create a patch between two archives of the same subtype [old archive, new archive, patch]
+//         -v: verbose
+//   --patch: apply a patch [old archive, patch, new archive]
+//         -v: verbose
+//   --cat: write an entry's data (or a byte range of it) to stdout [archive, path, offset, length]
+//         -k: key file for encrypted archives
+//   --to-tar: write the archive to stdout as a tar stream [archive]
+//         -k: key file for encrypted archives
+//   --append: add the files under a directory to an existing Subtype 2 archive, replacing entries it has [root directory, archive]
+//         -v: verbose
+//   --repack: rewrite an archive with a fresh layout, copying data out of the old one [old archive, new archive]
+//         takes the options of -c (except --manifest, --incremental and --filter); --key-file also unlocks the old archive
+//         and boot paths are paths inside the old archive
+//         encrypted archives keep their cipher unless --apply-encryption picks another
+//         --decrypt: write the new archive without encryption
+//   --convert: convert an archive to another subtype or encoding, keeping its entries in order [old archive, new archive]
+//         takes the options of --repack (except --canonical-order)
 //   -u: show this menu
 
 const char *program_name;
@@ -93,13 +143,16 @@ __attribute__((noreturn)) static void do_usage(bool print_usage, const char *err
         fprintf(stderr, "  -x: Extract archive                  \n");
         fprintf(stderr, "  -s: Show archive contents            \n");
         fprintf(stderr, "  -l: List entries in archive          \n");
+        fprintf(stderr, "  -t: Verify archive                   \n");
         fprintf(stderr, "  -u: Show extended usage menu         \n");
     }
 
     exit(EXIT_FAILURE);
 }
 
-__attribute__((noreturn)) static void do_create(int argc, const char *const *argv)
+// Repacking takes an archive in place of the root directory; converting
+// is repacking without reordering the entries
+__attribute__((noreturn)) static void do_create(int argc, const char *const *argv, bool repack, bool convert)
 {
     if (argc < 2)
         do_usage(true, "Not enough arguments!\n");
@@ -132,11 +185,56 @@ __attribute__((noreturn)) static void do_create(int argc, const char *const *arg
             .has_arg = required_argument,
             .flag = NULL,
             .val = 'e'
+        }, {
+            .name = "key-file",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'K'
         }, {
             .name = "sign",
             .has_arg = required_argument,
             .flag = NULL,
             .val = 'q'
+        }, {
+            .name = "checksum-entries",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'C'
+        }, {
+            .name = "dedup",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'D'
+        }, {
+            .name = "manifest",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'M'
+        }, {
+            .name = "incremental",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'I'
+        }, {
+            .name = "canonical-order",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'R'
+        }, {
+            .name = "compact-entries",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'E'
+        }, {
+            .name = "sparse",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'H'
+        }, {
+            .name = "progress",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'g'
         }, {
             .name = "arch",
             .has_arg = required_argument,
@@ -197,6 +295,26 @@ __attribute__((noreturn)) static void do_create(int argc, const char *const *arg
             .has_arg = required_argument,
             .flag = NULL,
             .val = 'B'
+        }, {
+            .name = "boot-profile",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'P'
+        }, {
+            .name = "from-tar",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'T'
+        }, {
+            .name = "filter",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'F'
+        }, {
+            .name = "decrypt",
+            .has_arg = no_argument,
+            .flag = NULL,
+            .val = 'd'
         },{NULL, 0, NULL, 0}
     };
 
@@ -212,10 +330,14 @@ __attribute__((noreturn)) static void do_create(int argc, const char *const *arg
     const OSUTF8Char *boot_config = NULL;
     const OSUTF8Char *kernel = NULL;
     bool has_error = false;
+    bool progress = false;
     bool verbose = false;
     char c;
 
-    while ((c = getopt_long(argc, (char *const *)argv, "vs:a:c:e:q:h:b:l:k:f:y:m:r:t:i:p:", options, NULL)) != -1)
+    memset(&data_modifiers, 0, sizeof(ARCreateDataModifiers));
+    memset(&system_version, 0, sizeof(CASystemVersionInternal));
+
+    while ((c = getopt_long(argc, (char *const *)argv, "vs:a:c:e:K:q:CDMI:REHgh:b:l:k:f:y:m:r:t:i:p:P:T:F:d", options, NULL)) != -1)
     {
         switch (c)
         {
@@ -271,7 +393,7 @@ __attribute__((noreturn)) static void do_create(int argc, const char *const *arg
 
                 if (!strcmp("LZMA", compressionType)) {
                     data_modifiers.compressionType = kCACompressionTypeLZMA;
-                } else if (!strcmp("lZO", compressionType)) {
+                } else if (!strcmp("LZO", compressionType)) {
                     data_modifiers.compressionType = kCACompressionTypeLZO;
                 } else {
                     do_usage(true, "Invalid compression type '%s'!\n", compressionType);
@@ -291,12 +413,64 @@ __attribute__((noreturn)) static void do_create(int argc, const char *const *arg
                     do_usage(true, "Invalid encryption type '%s'!\n", optarg);
                 }
             } break;
+            case 'K': {
+                if (subtype == kARSubtype1 && !repack)
+                    do_usage(true, "Subtype 1 archives cannot be encrypted!\n");
+
+                data_modifiers.keyFile = (const OSUTF8Char *)optarg;
+            } break;
             case 'q': {
                 if (subtype == kARSubtype1)
                     do_usage(true, "Subtype 1 archives cannot be signed!\n");
 
                 data_modifiers.signingCertificate = (const OSUTF8Char *)optarg;
             } break;
+            case 'C': {
+                if (subtype == kARSubtype1)
+                    do_usage(true, "Subtype 1 archives cannot hold entry checksums!\n");
+
+                data_modifiers.checksumEntries = true;
+            } break;
+            case 'D': {
+                if (subtype == kARSubtype1)
+                    do_usage(true, "Subtype 1 archives cannot be deduplicated!\n");
+
+                data_modifiers.deduplicate = true;
+            } break;
+            case 'M': {
+                if (subtype == kARSubtype1 || repack)
+                    do_usage(true, "%s cannot be built incrementally!\n", repack ? "Repacked archives" : "Subtype 1 archives");
+
+                data_modifiers.writeManifest = true;
+            } break;
+            case 'I': {
+                if (subtype == kARSubtype1 || repack)
+                    do_usage(true, "%s cannot be built incrementally!\n", repack ? "Repacked archives" : "Subtype 1 archives");
+
+                data_modifiers.previousArchive = (const OSUTF8Char *)optarg;
+            } break;
+            case 'R': {
+                if (subtype == kARSubtype1)
+                    do_usage(true, "Subtype 1 archives cannot be sorted!\n");
+
+                if (convert)
+                    do_usage(true, "Converting keeps the entry order (use --repack to sort)!\n");
+
+                data_modifiers.canonicalOrder = true;
+            } break;
+            case 'E': {
+                if (subtype != kARSubtype2)
+                    do_usage(true, "Only Subtype 2 archives can have a compact entry table!\n");
+
+                data_modifiers.compactEntries = true;
+            } break;
+            case 'H': {
+                if (subtype == kARSubtype1)
+                    do_usage(true, "Subtype 1 archives cannot hold sparse files!\n");
+
+                data_modifiers.sparseFiles = true;
+            } break;
+            case 'g': progress = true; break;
             case 'h': {
                 if (subtype != kARSubtypeBootX)
                     do_usage(true, "Non-BootX archives cannot have an architecture!\n");
@@ -412,6 +586,30 @@ __attribute__((noreturn)) static void do_create(int argc, const char *const *arg
 
                 boot_archive = (const OSUTF8Char *)optarg;
             } break;
+            case 'P': {
+                if (subtype != kARSubtypeBootX && subtype != kARSubtypeSystemImage)
+                    do_usage(true, "Only BootX archives and System Images take a boot profile!\n");
+
+                data_modifiers.bootProfile = (const OSUTF8Char *)optarg;
+            } break;
+            case 'T': {
+                if (repack)
+                    do_usage(true, "Only new archives can be imported from tar!\n");
+
+                data_modifiers.sourceTar = (const OSUTF8Char *)optarg;
+            } break;
+            case 'F': {
+                if (repack)
+                    do_usage(true, "Only root directories can be filtered!\n");
+
+                data_modifiers.filterFile = (const OSUTF8Char *)optarg;
+            } break;
+            case 'd': {
+                if (!repack)
+                    do_usage(true, "Only repacked archives can be decrypted!\n");
+
+                data_modifiers.decryptArchive = true;
+            } break;
             case '?': {
                 fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
                 fprintf(stderr, "Will ignore.\n");
@@ -422,30 +620,52 @@ __attribute__((noreturn)) static void do_create(int argc, const char *const *arg
     argv += optind;
     argc -= optind;
 
-    if (argc < 2)
+    // Tar imports take no root directory
+    bool from_tar = !!data_modifiers.sourceTar;
+
+    if (argc < (from_tar ? 1 : 2))
         do_usage(true, "Not enough arguments!\n");
 
-    const OSUTF8Char *root_directory = (const OSUTF8Char *)argv[0];
-    const OSUTF8Char *archive = (const OSUTF8Char *)argv[1];
+    if (from_tar && (data_modifiers.writeManifest || data_modifiers.previousArchive))
+        do_usage(true, "Archives imported from tar cannot be built incrementally!\n");
+
+    if (from_tar && data_modifiers.filterFile)
+        do_usage(true, "Only root directories can be filtered!\n");
+
+    const OSUTF8Char *root_directory = (repack || from_tar) ? NULL : (const OSUTF8Char *)argv[0];
+    const OSUTF8Char *archive = (const OSUTF8Char *)argv[from_tar ? 0 : 1];
+
+    if (repack)
+        data_modifiers.sourceArchive = (const OSUTF8Char *)argv[0];
+
+    if (data_modifiers.encryptArchive && data_modifiers.decryptArchive)
+        do_usage(true, "--decrypt and --apply-encryption are mutually exclusive!\n");
+
+    if (data_modifiers.encryptArchive && !data_modifiers.keyFile)
+        do_usage(true, "Encryption requires a key file (--key-file)!\n");
+
+    if ((verbose || progress) && !ARLogStart(progress))
+        exit(1);
 
     switch (subtype)
     {
         case kARSubtype1: {
-            has_error = ARCreateSubtype1(root_directory, archive, verbose);
+            has_error = !ARCreateSubtype1(root_directory, archive, verbose, &data_modifiers);
         } break;
         case kARSubtype2: {
-            has_error = ARCreateSubtype2(root_directory, archive, verbose, &data_modifiers);
+            has_error = !ARCreateSubtype2(root_directory, archive, verbose, &data_modifiers);
         } break;
         case kARSubtypeBootX: {
-            has_error = ARCreateBootX(root_directory, archive, verbose, &data_modifiers, architecture, boot_id, kernel_loader, kernel, boot_config);
+            has_error = !ARCreateBootX(root_directory, archive, verbose, &data_modifiers, architecture, boot_id, kernel_loader, kernel, boot_config);
         } break;
         case kARSubtypeSystemImage: {
-            has_error = ARCreateSystemImage(root_directory, archive, verbose, &data_modifiers, &system_version, partition_info, boot_archive);
+            has_error = !ARCreateSystemImage(root_directory, archive, verbose, &data_modifiers, &system_version, partition_info, boot_archive);
         } break;
         default:
             do_usage(true, "Cannot create an archive with no subtype!\n");
     }
 
+    ARLogStop();
     exit(has_error);
 }
 
@@ -457,17 +677,21 @@ __attribute__((noreturn)) static void do_extract(int argc, const char *const *ar
     OSUTF8Char *output_directory = (OSUTF8Char *)string_without_extension(argv[1]);
     const OSUTF8Char *archive = (const OSUTF8Char *)argv[1];
     ARExtractFileInfo *filelist = NULL;
+    const OSUTF8Char *key_file = NULL;
     bool custom_output = false;
+    bool delete_stale = false;
     OSCount file_count = 0;
     bool has_error = false;
+    bool progress = false;
     bool verbose = false;
+    bool update = false;
     argv++, argc--;
     char c;
 
     if (!output_directory)
         do_usage(false, "Out of memory!\n");
 
-    while ((c = getopt(argc, (char *const *)argv, "vd:of")) != -1)
+    while ((c = getopt(argc, (char *const *)argv, "vd:ofk:uDp")) != -1)
     {
         switch (c)
         {
@@ -478,29 +702,32 @@ __attribute__((noreturn)) static void do_extract(int argc, const char *const *ar
                 output_directory = (OSUTF8Char *)optarg;
                 custom_output = true;
             } break;
+            case 'k': key_file = (const OSUTF8Char *)optarg; break;
+            case 'u': update = true; break;
+            case 'D': delete_stale = true; break;
+            case 'p': progress = true; break;
             case 'f': {
-                const char *const *argument = argv + optind;
+                OSIndex first = optind;
 
-                while ((*argument)[0] != '-' && optind < argc)
-                {
-                    file_count++;
-                    argument++;
+                while (optind < argc && argv[optind][0] != '-')
                     optind++;
-                }
 
+                file_count = optind - first;
+
+                if (!file_count)
+                    do_usage(true, "No files given!\n");
+
+                free(filelist);
                 filelist = malloc(file_count * sizeof(ARExtractFileInfo));
-                argument -= file_count;
 
                 if (!filelist)
                     do_usage(false, "Out of memory!\n");
 
                 for (OSIndex i = 0; i < file_count; i++)
                 {
-                    filelist[i].archivePath = (const OSUTF8Char *)argument;
+                    filelist[i].archivePath = (const OSUTF8Char *)argv[first + i];
                     filelist[i].next = filelist + i + 1;
                     filelist[i].resultingPath = NULL;
-
-                    argument++;
                 }
 
                 filelist[file_count - 1].next = NULL;
@@ -508,23 +735,15 @@ __attribute__((noreturn)) static void do_extract(int argc, const char *const *ar
             case 'o': {
                 if (!filelist) do_usage(true, "A file list must come before an output list!");
 
-                const char *const *argument = argv + optind;
-                ARExtractFileInfo *file = filelist;
-
-                while (file->next)
+                for (ARExtractFileInfo *file = filelist; file; file = file->next)
                 {
-                    file->resultingPath = (const OSUTF8Char *)argument;
-
-                    if ((++optind) >= argc)
-                        do_usage(true, "Have files without output files!\n");
-
-                    if ((*(++argument))[0] == '-')
+                    if (optind >= argc || argv[optind][0] == '-')
                         do_usage(true, "Have files without output files!\n");
 
-                    file = file->next;
+                    file->resultingPath = (const OSUTF8Char *)argv[optind++];
                 }
 
-                if (!(optind >= argc) && (*argument)[0] != '-')
+                if (optind < argc && argv[optind][0] != '-')
                     do_usage(true, "Have excess output files!\n");
             } break;
             case '?': {
@@ -534,26 +753,34 @@ __attribute__((noreturn)) static void do_extract(int argc, const char *const *ar
         }
     }
 
+    if (delete_stale && (!update || filelist))
+        do_usage(true, "Stale files can only be deleted when updating a whole tree!\n");
+
+    if ((verbose || progress) && !ARLogStart(progress))
+        exit(1);
+
     if (filelist) {
-        has_error = ARExtractFiles(archive, output_directory, filelist, file_count, verbose);
+        has_error = !ARExtractFiles(archive, output_directory, filelist, file_count, key_file, update, verbose);
 
         free(filelist);
     } else {
-        has_error = ARExtractArchive(archive, output_directory, verbose);
+        has_error = !ARExtractArchive(archive, output_directory, key_file, update, delete_stale, verbose);
     }
 
     if (!custom_output)
         free(output_directory);
 
+    ARLogStop();
     exit(has_error);
 }
 
 __attribute__((noreturn)) static void do_show(int argc, const char *const *argv)
 {
-    int show_header = true, show_entries = false, show_size = false, show_links = false;
+    int show_header = true, show_entries = false, show_size = false, show_links = false, show_checksums = false;
+    const OSUTF8Char *key_file = NULL;
     bool has_error = false;
 
-    const struct option options[5] = {
+    const struct option options[7] = {
         {
             .name = "show-header",
             .has_arg = no_argument,
@@ -574,6 +801,16 @@ __attribute__((noreturn)) static void do_show(int argc, const char *const *argv)
             .has_arg = no_argument,
             .flag = &show_links,
             .val = true
+        }, {
+            .name = "show-checksums",
+            .has_arg = no_argument,
+            .flag = &show_checksums,
+            .val = true
+        }, {
+            .name = "key-file",
+            .has_arg = required_argument,
+            .flag = NULL,
+            .val = 'k'
         }, {NULL, 0, NULL, 0}
     };
 
@@ -584,6 +821,9 @@ __attribute__((noreturn)) static void do_show(int argc, const char *const *argv)
         // Everything should be handled for us automatically!
         // Unless it's not...
 
+        if (c == 'k')
+            key_file = (const OSUTF8Char *)optarg;
+
         if (c == '?')
         {
             fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
@@ -601,7 +841,7 @@ __attribute__((noreturn)) static void do_show(int argc, const char *const *argv)
     {
         fprintf(stderr, "Showing archive %s:\n", argv[i]);
 
-        if (!ARShowInformation((const OSUTF8Char *)argv[i], show_header, show_entries, show_size, show_links))
+        if (!ARShowInformation((const OSUTF8Char *)argv[i], key_file, show_header, show_entries, show_size, show_links, show_checksums))
         {
             fprintf(stderr, "Encountered an error!\n");
             has_error = true;
@@ -613,23 +853,87 @@ __attribute__((noreturn)) static void do_show(int argc, const char *const *argv)
 
 __attribute__((noreturn)) static void do_list(int argc, const char *const *argv)
 {
-    bool show_links = !strcmp(argv[0], "--show-links");
+    const OSUTF8Char *key_file = NULL;
+    bool show_links = false;
     bool has_error = false;
 
-    if (show_links)
+    while (argc > 0 && !strncmp(argv[0], "--", 2))
     {
-        if (argc < 2)
-            do_usage(true, "Not enough arguments!\n");
+        if (!strcmp(argv[0], "--show-links")) {
+            show_links = true;
+        } else if (!strcmp(argv[0], "--key-file") && argc > 1) {
+            key_file = (const OSUTF8Char *)argv[1];
+
+            argv++;
+            argc--;
+        } else {
+            do_usage(true, "Invalid option '%s'!\n", argv[0]);
+        }
 
         argv++;
         argc--;
     }
 
+    if (argc < 1)
+        do_usage(true, "Not enough arguments!\n");
+
     for (uint32_t i = 0; i < argc; i++)
     {
         fprintf(stderr, "Entries in archive %s:\n", argv[i]);
 
-        if (!ARListContents((const OSUTF8Char *)argv[i], show_links))
+        if (!ARListContents((const OSUTF8Char *)argv[i], key_file, show_links))
+        {
+            fprintf(stderr, "Encountered an error!\n");
+            has_error = true;
+        }
+    }
+
+    exit(has_error);
+}
+
+__attribute__((noreturn)) static void do_verify(int argc, const char *const *argv)
+{
+    const OSUTF8Char *trusted_key = NULL;
+    const OSUTF8Char *entry_path = NULL;
+    const OSUTF8Char *key_file = NULL;
+    bool has_error = false;
+    bool verbose = false;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "vk:p:f:")) != -1)
+    {
+        switch (c)
+        {
+            case 'v': verbose = true; break;
+            case 'k': key_file = (const OSUTF8Char *)optarg; break;
+            case 'p': trusted_key = (const OSUTF8Char *)optarg; break;
+            case 'f': entry_path = (const OSUTF8Char *)optarg; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1)
+        do_usage(true, "Not enough arguments!\n");
+
+    for (uint32_t i = 0; i < argc; i++)
+    {
+        fprintf(stderr, "Verifying archive %s:\n", argv[i]);
+
+        bool valid;
+
+        if (entry_path) {
+            valid = ARVerifyEntry((const OSUTF8Char *)argv[i], entry_path, key_file, trusted_key, verbose);
+        } else {
+            valid = ARVerifyArchive((const OSUTF8Char *)argv[i], key_file, trusted_key, verbose);
+        }
+
+        if (!valid)
         {
             fprintf(stderr, "Encountered an error!\n");
             has_error = true;
@@ -639,18 +943,234 @@ __attribute__((noreturn)) static void do_list(int argc, const char *const *argv)
     exit(has_error);
 }
 
+__attribute__((noreturn)) static void do_store(int argc, const char *const *argv)
+{
+    bool verbose = false;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "v")) != -1)
+    {
+        switch (c)
+        {
+            case 'v': verbose = true; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 3)
+        do_usage(true, "Not enough arguments!\n");
+
+    exit(!ARStoreArchive((const OSUTF8Char *)argv[0], (const OSUTF8Char *)argv[1], (const OSUTF8Char *)argv[2], verbose));
+}
+
+__attribute__((noreturn)) static void do_materialize(int argc, const char *const *argv)
+{
+    bool verbose = false;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "v")) != -1)
+    {
+        switch (c)
+        {
+            case 'v': verbose = true; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 3)
+        do_usage(true, "Not enough arguments!\n");
+
+    exit(!ARMaterializeArchive((const OSUTF8Char *)argv[0], (const OSUTF8Char *)argv[1], (const OSUTF8Char *)argv[2], verbose));
+}
+
+__attribute__((noreturn)) static void do_diff(int argc, const char *const *argv)
+{
+    bool verbose = false;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "v")) != -1)
+    {
+        switch (c)
+        {
+            case 'v': verbose = true; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 3)
+        do_usage(true, "Not enough arguments!\n");
+
+    exit(!ARDiffArchives((const OSUTF8Char *)argv[0], (const OSUTF8Char *)argv[1], (const OSUTF8Char *)argv[2], verbose));
+}
+
+__attribute__((noreturn)) static void do_patch(int argc, const char *const *argv)
+{
+    bool verbose = false;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "v")) != -1)
+    {
+        switch (c)
+        {
+            case 'v': verbose = true; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 3)
+        do_usage(true, "Not enough arguments!\n");
+
+    exit(!ARPatchArchive((const OSUTF8Char *)argv[0], (const OSUTF8Char *)argv[1], (const OSUTF8Char *)argv[2], verbose));
+}
+
+__attribute__((noreturn)) static void do_cat(int argc, const char *const *argv)
+{
+    const char *key_file = NULL;
+    UInt64 offset = 0;
+    UInt64 length = (UInt64)-1;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "k:")) != -1)
+    {
+        switch (c)
+        {
+            case 'k': key_file = optarg; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2)
+        do_usage(true, "Not enough arguments!\n");
+
+    if (argc > 2)
+    {
+        char *endptr = NULL;
+        offset = strtoull(argv[2], &endptr, 0);
+
+        if (!*argv[2] || *endptr)
+            do_usage(true, "Invalid offset '%s'!\n", argv[2]);
+    }
+
+    if (argc > 3)
+    {
+        char *endptr = NULL;
+        length = strtoull(argv[3], &endptr, 0);
+
+        if (!*argv[3] || *endptr)
+            do_usage(true, "Invalid length '%s'!\n", argv[3]);
+    }
+
+    exit(!ARCatEntry((const OSUTF8Char *)argv[0], (const OSUTF8Char *)argv[1], offset, length, (const OSUTF8Char *)key_file, STDOUT_FILENO));
+}
+
+__attribute__((noreturn)) static void do_to_tar(int argc, const char *const *argv)
+{
+    const char *key_file = NULL;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "k:")) != -1)
+    {
+        switch (c)
+        {
+            case 'k': key_file = optarg; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1)
+        do_usage(true, "Not enough arguments!\n");
+
+    if (isatty(STDOUT_FILENO))
+        do_usage(true, "Refusing to write a tar stream to a terminal!\n");
+
+    exit(!ARExportTar((const OSUTF8Char *)argv[0], (const OSUTF8Char *)key_file, STDOUT_FILENO));
+}
+
+__attribute__((noreturn)) static void do_append(int argc, const char *const *argv)
+{
+    bool verbose = false;
+    char c;
+
+    while ((c = getopt(argc, (char *const *)argv, "v")) != -1)
+    {
+        switch (c)
+        {
+            case 'v': verbose = true; break;
+            case '?': {
+                fprintf(stderr, "Warning: Encountered unknown option '%c'\n", optopt);
+                fprintf(stderr, "Will ignore.\n");
+            } break;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2)
+        do_usage(true, "Not enough arguments!\n");
+
+    exit(!ARAppendArchive((const OSUTF8Char *)argv[0], (const OSUTF8Char *)argv[1], verbose));
+}
+
 __attribute__((noreturn)) static void do_extended_usage(void)
 {
     fprintf(stderr, "Usage: %s <action> <arguments>         \n\n", program_name);
     fprintf(stderr, "Where action is one of the following:  \n");
 
-    fprintf(stderr, "-c: create archive [root directory, archive name]\n");
+    fprintf(stderr, "-c: create archive [root directory, archive name] (or [archive name] with --from-tar)\n");
     fprintf(stderr, "      -v: verbose\n");
     fprintf(stderr, "      --subtype <1, 2, BootX, SystemImage>: select archive subtype\n");
     fprintf(stderr, "      --apply-compression <LZMA, LZO>: equivament to --compress-section ToC <type> --compress-section Entries <type> --compress-section Data <type>\n");
     fprintf(stderr, "      --compress-section {ToC|EntryTable|DataSection, LZMA|LZO}: compress a given section with the given compression type\n");
     fprintf(stderr, "      --apply-encryption <AES, Serpent>: encrypt the archive. Encrypts all data except the header.\n");
-    fprintf(stderr, "      --sign <certificate>\n");
+    fprintf(stderr, "      --key-file <path>: raw 128, 192 or 256 bit key to encrypt with\n");
+    fprintf(stderr, "      --sign <private key>: sign the archive with a PEM private key\n");
+    fprintf(stderr, "      --checksum-entries: store a CRC32C of each entry's data\n");
+    fprintf(stderr, "      --dedup: store hardlinked and identical files only once\n");
+    fprintf(stderr, "      --manifest: write '<archive>.manifest' for later incremental builds\n");
+    fprintf(stderr, "      --incremental <previous archive>: copy unchanged files from a previous build (implies --manifest)\n");
+    fprintf(stderr, "      --canonical-order: sort entries by name so identical trees give identical archives\n");
+    fprintf(stderr, "      --compact-entries: store a compact entry table with a separate name pool (Subtype 2)\n");
+    fprintf(stderr, "      --sparse: store only the data extents of sparse files and recreate their holes on extraction\n");
+    fprintf(stderr, "      --progress: show a progress line with throughput and ETA\n");
+    fprintf(stderr, "      --from-tar <path|->: read the tree from a tar stream (or stdin) instead of a root directory; boot paths are then paths in the archive\n");
+    fprintf(stderr, "      --filter <path>: include and exclude paths under the root directory with the rules in the given file ('+ pattern' or '- pattern' per line)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "      --arch <x86_64|ARMv8>: architecture for Boot-X file\n");
     fprintf(stderr, "      --bootID <id>: boot ID hex value\n");
@@ -665,18 +1185,52 @@ __attribute__((noreturn)) static void do_extended_usage(void)
     fprintf(stderr, "      --build-id <id>: specify system build id\n");
     fprintf(stderr, "      --partition-info <path>: read partition flag information from the given file\n");
     fprintf(stderr, "      --boot-archive <path>: specify boot archive path\n");
+    fprintf(stderr, "      --boot-profile <path>: lay out data in the order of the paths listed in the given file (BootX and SystemImage)\n");
     fprintf(stderr, "-x: extract archive [archive path]\n");
     fprintf(stderr, "      -v: verbose\n");
     fprintf(stderr, "      -d: output directory\n");
     fprintf(stderr, "      -o: output path(s)\n");
     fprintf(stderr, "      -f: file(s)\n");
+    fprintf(stderr, "      -k: key file for encrypted archives\n");
+    fprintf(stderr, "      -u: update an existing tree, only writing entries which differ from it\n");
+    fprintf(stderr, "      -D: with -u, delete anything the archive doesn't have\n");
+    fprintf(stderr, "      -p: show a progress line with throughput and ETA\n");
     fprintf(stderr, "-s: show archive contents [archive path(s)]\n");
     fprintf(stderr, "      --show-header: show information about the archive header\n");
     fprintf(stderr, "      --show-entries: show in-depth information about archive entries\n");
     fprintf(stderr, "      --show-size: show the size of each entry\n");
     fprintf(stderr, "      --show-links: show link location\n");
+    fprintf(stderr, "      --show-checksums: show the stored checksum of each entry\n");
+    fprintf(stderr, "      --key-file <path>: key file for encrypted archives\n");
     fprintf(stderr, "-l: list paths in archive [archive path(s)]\n");
     fprintf(stderr, "      --show-links: show link location\n");
+    fprintf(stderr, "      --key-file <path>: key file for encrypted archives\n");
+    fprintf(stderr, "-t: verify archive checksums and data [archive path(s)]\n");
+    fprintf(stderr, "      -v: verbose\n");
+    fprintf(stderr, "      -k: key file for encrypted archives\n");
+    fprintf(stderr, "      -p: trusted signer's PEM public key or certificate (signed archives fail without one)\n");
+    fprintf(stderr, "      -f: check only this entry against the archive signature\n");
+    fprintf(stderr, "--store: add an archive to a chunk store [archive, store directory, recipe]\n");
+    fprintf(stderr, "      -v: verbose\n");
+    fprintf(stderr, "--materialize: rebuild an archive from a chunk store [recipe, store directory, archive]\n");
+    fprintf(stderr, "      -v: verbose\n");
+    fprintf(stderr, "--diff: create a patch between two archives of the same subtype [old archive, new archive, patch]\n");
+    fprintf(stderr, "      -v: verbose\n");
+    fprintf(stderr, "--patch: apply a patch [old archive, patch, new archive]\n");
+    fprintf(stderr, "      -v: verbose\n");
+    fprintf(stderr, "--cat: write an entry's data (or a byte range of it) to stdout [archive, path, offset, length]\n");
+    fprintf(stderr, "      -k: key file for encrypted archives\n");
+    fprintf(stderr, "--to-tar: write the archive to stdout as a tar stream [archive]\n");
+    fprintf(stderr, "      -k: key file for encrypted archives\n");
+    fprintf(stderr, "--append: add the files under a directory to an existing Subtype 2 archive, replacing entries it has [root directory, archive]\n");
+    fprintf(stderr, "      -v: verbose\n");
+    fprintf(stderr, "--repack: rewrite an archive with a fresh layout, copying data out of the old one [old archive, new archive]\n");
+    fprintf(stderr, "      takes the options of -c (except --manifest, --incremental and --filter); --key-file also unlocks the old archive\n");
+    fprintf(stderr, "      and boot paths are paths inside the old archive\n");
+    fprintf(stderr, "      encrypted archives keep their cipher unless --apply-encryption picks another\n");
+    fprintf(stderr, "      --decrypt: write the new archive without encryption\n");
+    fprintf(stderr, "--convert: convert an archive to another subtype or encoding, keeping its entries in order [old archive, new archive]\n");
+    fprintf(stderr, "      takes the options of --repack (except --canonical-order)\n");
     fprintf(stderr, "-u: show this menu\n");
 
     exit(EXIT_SUCCESS);
@@ -692,6 +1246,22 @@ int main(int argc, const char *const *argv)
     if (argc < 2)
         do_usage(true, "Not enough arguments!\n");
 
+    // Actions without a single letter form
+    if (!strncmp(argv[1], "--", 2))
+    {
+        if (!strcmp(argv[1], "--store"))       do_store(argc - 1, argv + 1);
+        if (!strcmp(argv[1], "--materialize")) do_materialize(argc - 1, argv + 1);
+        if (!strcmp(argv[1], "--diff"))        do_diff(argc - 1, argv + 1);
+        if (!strcmp(argv[1], "--patch"))       do_patch(argc - 1, argv + 1);
+        if (!strcmp(argv[1], "--cat"))         do_cat(argc - 1, argv + 1);
+        if (!strcmp(argv[1], "--to-tar"))      do_to_tar(argc - 1, argv + 1);
+        if (!strcmp(argv[1], "--append"))      do_append(argc - 1, argv + 1);
+        if (!strcmp(argv[1], "--repack"))      do_create(argc - 1, argv + 1, true, false);
+        if (!strcmp(argv[1], "--convert"))     do_create(argc - 1, argv + 1, true, true);
+
+        do_usage(true, "Invalid first argument!\n");
+    }
+
     size_t first_arg_length = strlen(argv[1]);
 
     if (first_arg_length != 2)
@@ -702,10 +1272,11 @@ int main(int argc, const char *const *argv)
 
     switch (argv[1][1])
     {
-        case 'c':  do_create(argc - 1, argv + 1);
+        case 'c':  do_create(argc - 1, argv + 1, false, false);
         case 'x': do_extract(argc - 1, argv + 1);
         case 's':    do_show(argc - 1, argv + 1);
         case 'l':    do_list(argc - 2, argv + 2);
+        case 't':  do_verify(argc - 1, argv + 1);
         case 'u': do_extended_usage();
         default: do_usage(true, "Invalid first argument!\n");
     }